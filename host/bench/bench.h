@@ -0,0 +1,26 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Shared by the host benchmarks: a monotonic clock, and the iteration count
+// from the first argument, so ctest can run each one briefly
+static inline uint64_t bench_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static inline uint32_t bench_iterations(int argc, char **argv, uint32_t fallback) {
+    return argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 0) : fallback;
+}
+
+// Keeps a result alive so the compiler cannot drop the work that made it
+static inline void bench_consume(uint64_t value) {
+    static volatile uint64_t sink;
+    sink += value;
+}
+
+#endif // BENCH_H
@@ -0,0 +1,226 @@
+/*
+ * TX Coalescing Benchmark
+ *
+ * Goodput and latency of a stream of small sends from the application to one
+ * SPP peer, with coalescing off and at several threshold/deadline settings.
+ * The link carries 50 KB/s and every write costs it 1.25 ms more (a slot
+ * pair), so a 20-byte write spends most of its air time on overhead.
+ *
+ * Two loads of 20-byte records, each carrying its sequence number and send
+ * time:
+ *
+ * - light: 100 records/s, well inside the link without coalescing. The cost
+ *   of each setting shows as latency added to the uncoalesced figure.
+ * - heavy: 2000 records/s, more than uncoalesced writes can carry. Sends the
+ *   full TX ring refuses are counted as refused.
+ *
+ * Goodput counts record bytes that reached the peer while the load ran.
+ * Exits non-zero if an accepted record never arrives, arrives twice, out of
+ * order or damaged.
+ *
+ *     bench_coalesce [milliseconds per run]
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bluetooth_spp.h"
+#include "bt_stats.h"
+#include "sim.h"
+#include "bench.h"
+
+#define RECORD_SIZE 20 // Sequence, send time and a check word derived from the sequence
+#define DRAIN_TIMEOUT_MS 2000
+
+typedef struct {
+    const char *name;
+    uint32_t records_per_s;
+} load_t;
+
+static uint32_t handle;
+static uint32_t run_ms;
+static const load_t *load;
+
+// Sender thread
+static uint32_t accepted;
+static uint32_t refused;
+
+// Event thread
+static uint8_t carry[RECORD_SIZE];
+static uint16_t carry_length;
+static uint32_t next_seq;
+static uint64_t window_end_us;
+static uint64_t goodput_bytes;
+static uint64_t latency_sum_us;
+static uint32_t latency_hist[LATENCY_HIST_BUCKETS];
+static _Atomic uint32_t arrived;
+static _Atomic uint32_t damaged;
+
+static uint64_t now_us(void) {
+    return bench_now_ns() / 1000;
+}
+
+static uint32_t check_word(uint32_t seq) {
+    return seq * 2654435761u ^ 0x5A5A5A5A;
+}
+
+static void take_record(const uint8_t *record) {
+    uint32_t seq;
+    uint64_t sent_us;
+    uint32_t check;
+    uint64_t now = now_us();
+    memcpy(&seq, record, 4);
+    memcpy(&sent_us, &record[4], 8);
+    memcpy(&check, &record[12], 4);
+    if (seq != next_seq || check != check_word(seq)) {
+        atomic_fetch_add(&damaged, 1);
+    }
+    next_seq = seq + 1;
+    latency_sum_us += now - sent_us;
+    bt_latency_record(latency_hist, now - sent_us);
+    if (now <= window_end_us) {
+        goodput_bytes += RECORD_SIZE;
+    }
+    atomic_fetch_add(&arrived, 1);
+}
+
+// Writes arrive as the SPP stream they were sent on, so a record could span two
+static void on_peer_receive(uint32_t conn_handle, const uint8_t *data, uint16_t length, void *context) {
+    while (length > 0) {
+        uint16_t take = RECORD_SIZE - carry_length < length ? RECORD_SIZE - carry_length : length;
+        memcpy(&carry[carry_length], data, take);
+        carry_length += take;
+        data += take;
+        length -= take;
+        if (carry_length == RECORD_SIZE) {
+            take_record(carry);
+            carry_length = 0;
+        }
+    }
+}
+
+static void *sender_thread(void *parameter) {
+    uint8_t record[RECORD_SIZE] = {0};
+    uint64_t interval_ns = 1000000000ull / load->records_per_s;
+    uint64_t total = (uint64_t)load->records_per_s * run_ms / 1000;
+    struct timespec next;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (uint32_t i = 0; i < total; i++) {
+        uint64_t sent_us = now_us();
+        uint32_t check = check_word(accepted);
+        memcpy(record, &accepted, 4);
+        memcpy(&record[4], &sent_us, 8);
+        memcpy(&record[12], &check, 4);
+        if (bluetooth_spp_send_data(handle, record, RECORD_SIZE) == ESP_OK) {
+            accepted++;
+        } else {
+            refused++;
+        }
+        uint64_t ns = next.tv_nsec + interval_ns;
+        next.tv_sec += ns / 1000000000;
+        next.tv_nsec = ns % 1000000000;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    return NULL;
+}
+
+// Returns false if accepted records went missing or came back wrong
+static bool run(const tx_coalesce_config_t *config, uint32_t *baseline_us) {
+    pthread_t sender;
+    sim_stats_t before;
+    sim_stats_t after;
+
+    bluetooth_spp_set_tx_coalescing(handle, config);
+    sim_sync();
+    accepted = refused = 0;
+    next_seq = 0;
+    goodput_bytes = latency_sum_us = 0;
+    memset(latency_hist, 0, sizeof(latency_hist));
+    atomic_store(&arrived, 0);
+    sim_get_stats(&before);
+
+    uint64_t start_us = now_us();
+    window_end_us = start_us + (uint64_t)run_ms * 1000;
+    pthread_create(&sender, NULL, sender_thread, NULL);
+    pthread_join(sender, NULL);
+    for (int waited = 0; waited < DRAIN_TIMEOUT_MS && atomic_load(&arrived) < accepted; waited += 10) {
+        usleep(10000);
+    }
+    sim_sync();
+    sim_get_stats(&after);
+
+    uint32_t got = atomic_load(&arrived);
+    uint32_t mean_us = got ? (uint32_t)(latency_sum_us / got) : 0;
+    if (config->flush_threshold == 0) {
+        *baseline_us = mean_us;
+    }
+    char setting[32] = "off";
+    if (config->flush_threshold > 0) {
+        snprintf(setting, sizeof(setting), "%u B / %lu ms", config->flush_threshold,
+                 (unsigned long)(config->flush_deadline_us / 1000));
+    }
+    uint32_t writes = after.writes - before.writes;
+    printf("  %-14s %8.0f %9lu %7.1f %10lu %+10ld %9lu\n", setting, goodput_bytes * 1000.0 / run_ms,
+           (unsigned long)writes, writes ? (double)got / writes : 0, (unsigned long)mean_us,
+           (long)mean_us - (long)*baseline_us, (unsigned long)bt_latency_percentile(latency_hist, 99));
+    if (refused > 0) {
+        printf("  %-14s %lu of %lu sends refused\n", "", (unsigned long)refused, (unsigned long)(accepted + refused));
+    }
+
+    if (got != accepted || atomic_load(&damaged) != 0) {
+        fprintf(stderr, "FAIL: %lu of %lu records arrived, %lu damaged or out of order\n", (unsigned long)got,
+                (unsigned long)accepted, (unsigned long)atomic_load(&damaged));
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    static const load_t loads[] = {
+        {"Light", 100},
+        {"Heavy", 2000},
+    };
+    static const tx_coalesce_config_t settings[] = {
+        {.flush_threshold = 0},
+        {.flush_threshold = 64, .flush_deadline_us = 2000},
+        {.flush_threshold = 128, .flush_deadline_us = 5000},
+        {.flush_threshold = 244, .flush_deadline_us = 10000},
+        {.flush_threshold = 512, .flush_deadline_us = 20000},
+    };
+    sim_link_config_t link = SIM_LINK_DEFAULT;
+    link.rate_bytes_per_s = 50000;
+    link.write_cost_us = 1250;
+    run_ms = bench_iterations(argc, argv, 2000);
+
+    sim_set_link_config(&link);
+    sim_set_peer_sink(on_peer_receive, NULL);
+    bluetooth_spp_init();
+    esp_bd_addr_t address = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+    for (int attempt = 0; attempt < 100 && handle == 0; attempt++) {
+        sim_sync();
+        handle = sim_spp_connect(address);
+    }
+    if (handle == 0) {
+        fprintf(stderr, "peer could not connect\n");
+        return 1;
+    }
+    sim_sync();
+
+    bool ok = true;
+    for (size_t l = 0; l < sizeof(loads) / sizeof(loads[0]); l++) {
+        uint32_t baseline_us = 0;
+        load = &loads[l];
+        printf("%s load, %lu records/s of %d bytes, %lu ms per setting:\n", load->name,
+               (unsigned long)load->records_per_s, RECORD_SIZE, (unsigned long)run_ms);
+        printf("  %-14s %8s %9s %7s %10s %10s %9s\n", "coalescing", "B/s", "writes", "rec/wr", "mean us",
+               "added us", "p99 us");
+        for (size_t s = 0; s < sizeof(settings) / sizeof(settings[0]) && ok; s++) {
+            ok = run(&settings[s], &baseline_us);
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,242 @@
+/*
+ * Fair Scheduling Benchmark
+ *
+ * A discrete-event simulation of eight connections sharing one link, served
+ * two ways:
+ *
+ * - FIFO: one 20-deep queue for everyone, the newest packet dropped when it
+ *   is full (the original shared message queue)
+ * - DRR: a bt_ring_t per connection, dropping its newest packet when full,
+ *   served by deficit round robin through bt_sched (as the message task does)
+ *
+ * Two loads, with Poisson arrivals from a fixed seed:
+ *
+ * - skewed: connection 0 offers 80 KB/s of 512-byte packets, the other seven
+ *   5 KB/s each of 64-byte packets, on a 100 KB/s link. Fair service gives the
+ *   light connections all they offer.
+ * - weighted: every connection offers the whole link in 256-byte packets,
+ *   with weights 4, 2, 1, 1, 1, 1, 1, 1. DRR should share the link by weight.
+ *
+ * For each connection it reports the share of the link received, drops and
+ * the p99 queueing delay (arrival to start of transmission). Exits non-zero
+ * if DRR misses either fairness target by more than 5%.
+ *
+ *     bench_drr [simulated seconds]
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "bt_ring.h"
+#include "bt_sched.h"
+#include "bt_stats.h"
+#include "bench.h"
+
+#define FLOWS 8
+#define LINK_BYTES_PER_S 100000.0
+#define FIFO_DEPTH 20
+
+typedef struct {
+    const char *name;
+    double offered[FLOWS]; // Bytes per second
+    uint16_t length[FLOWS];
+    uint16_t weight[FLOWS];
+} load_t;
+
+typedef struct {
+    uint64_t offered_bytes;
+    uint64_t served_bytes;
+    uint32_t drops;
+    uint32_t delay_hist[LATENCY_HIST_BUCKETS];
+} flow_result_t;
+
+// Schedulers
+
+static bt_message_t fifo[FIFO_DEPTH];
+static uint32_t fifo_head;
+static uint32_t fifo_count;
+
+static bt_ring_t rings[FLOWS];
+static bt_drr_t drr;
+static uint32_t drr_current;
+static bool drr_replenished; // The current flow has had this visit's credit
+
+static bool use_drr;
+
+static bool enqueue(const bt_message_t *message) {
+    if (use_drr) {
+        return bt_ring_push(&rings[message->slot], message);
+    }
+    if (fifo_count == FIFO_DEPTH) {
+        return false;
+    }
+    fifo[(fifo_head + fifo_count++) % FIFO_DEPTH] = *message;
+    return true;
+}
+
+static void next_flow(void) {
+    drr_current = (drr_current + 1) % FLOWS;
+    drr_replenished = false;
+}
+
+// Each backlogged flow, in turn, is credited its quantum and sends while the
+// credit covers its head packet; an empty flow forfeits what is left
+static bool dequeue(bt_message_t *message) {
+    if (!use_drr) {
+        if (fifo_count == 0) {
+            return false;
+        }
+        *message = fifo[fifo_head];
+        fifo_head = (fifo_head + 1) % FIFO_DEPTH;
+        fifo_count--;
+        return true;
+    }
+    for (int visits = 0; visits <= 2 * FLOWS; visits++) {
+        if (!bt_ring_peek(&rings[drr_current], message)) {
+            bt_drr_reset(&drr, drr_current);
+            next_flow();
+            continue;
+        }
+        if (!drr_replenished) {
+            bt_drr_replenish(&drr, drr_current);
+            drr_replenished = true;
+        }
+        if (bt_drr_consume(&drr, drr_current, message->length)) {
+            bt_ring_pop(&rings[drr_current], message);
+            return true;
+        }
+        next_flow();
+    }
+    return false;
+}
+
+// Simulation
+
+static uint64_t random_state;
+
+static double exponential(double mean) {
+    random_state = random_state * 6364136223846793005ull + 1442695040888963407ull;
+    double uniform = ((random_state >> 11) + 0.5) / 9007199254740992.0;
+    return -log(uniform) * mean;
+}
+
+static void simulate(const load_t *load, bool drr_mode, double seconds, flow_result_t *results) {
+    double next_arrival[FLOWS];
+    double mean_gap[FLOWS];
+    double link_free_at = 0;
+    bool link_busy = false;
+    double end = seconds * 1e6;
+
+    use_drr = drr_mode;
+    fifo_head = fifo_count = 0;
+    bt_drr_init(&drr);
+    drr_current = 0;
+    drr_replenished = false;
+    random_state = 1;
+    memset(results, 0, sizeof(flow_result_t) * FLOWS);
+    for (int f = 0; f < FLOWS; f++) {
+        bt_ring_init(&rings[f]);
+        bt_drr_set_weight(&drr, f, load->weight[f]);
+        mean_gap[f] = load->length[f] * 1e6 / load->offered[f];
+        next_arrival[f] = exponential(mean_gap[f]);
+    }
+
+    while (true) {
+        int flow = 0;
+        for (int f = 1; f < FLOWS; f++) {
+            if (next_arrival[f] < next_arrival[flow]) {
+                flow = f;
+            }
+        }
+        double now = link_busy && link_free_at <= next_arrival[flow] ? link_free_at : next_arrival[flow];
+        if (now >= end) {
+            break;
+        }
+
+        if (now == next_arrival[flow]) {
+            bt_message_t message = {.timestamp_us = (uint32_t)now, .length = load->length[flow], .slot = flow};
+            results[flow].offered_bytes += message.length;
+            if (!enqueue(&message)) {
+                results[flow].drops++;
+            }
+            next_arrival[flow] += exponential(mean_gap[flow]);
+        } else {
+            link_busy = false;
+        }
+
+        bt_message_t message;
+        if (!link_busy && dequeue(&message)) {
+            bt_latency_record(results[message.slot].delay_hist, (uint32_t)now - message.timestamp_us);
+            results[message.slot].served_bytes += message.length;
+            link_free_at = now + message.length * 1e6 / LINK_BYTES_PER_S;
+            link_busy = true;
+        }
+    }
+}
+
+// Served share of the link per flow, as a fraction of all bytes served
+static void shares(const flow_result_t *results, double *share) {
+    uint64_t total = 0;
+    for (int f = 0; f < FLOWS; f++) {
+        total += results[f].served_bytes;
+    }
+    for (int f = 0; f < FLOWS; f++) {
+        share[f] = total ? (double)results[f].served_bytes / total : 0;
+    }
+}
+
+static void report(const load_t *load, const char *scheduler, const flow_result_t *results, double seconds) {
+    double share[FLOWS];
+    shares(results, share);
+    printf("%s load, %s:\n", load->name, scheduler);
+    printf("  %4s %6s %12s %12s %7s %8s %10s\n", "conn", "weight", "offered B/s", "served B/s", "share", "drops",
+           "p99 delay");
+    for (int f = 0; f < FLOWS; f++) {
+        printf("  %4d %6u %12.0f %12.0f %6.1f%% %8lu %7lu us\n", f, load->weight[f],
+               results[f].offered_bytes / seconds, results[f].served_bytes / seconds, share[f] * 100,
+               (unsigned long)results[f].drops, (unsigned long)bt_latency_percentile(results[f].delay_hist, 99));
+    }
+}
+
+int main(int argc, char **argv) {
+    double seconds = bench_iterations(argc, argv, 60);
+    static const load_t skewed = {
+        .name = "Skewed",
+        .offered = {80000, 5000, 5000, 5000, 5000, 5000, 5000, 5000},
+        .length = {512, 64, 64, 64, 64, 64, 64, 64},
+        .weight = {1, 1, 1, 1, 1, 1, 1, 1},
+    };
+    static const load_t weighted = {
+        .name = "Weighted",
+        .offered = {100000, 100000, 100000, 100000, 100000, 100000, 100000, 100000},
+        .length = {256, 256, 256, 256, 256, 256, 256, 256},
+        .weight = {4, 2, 1, 1, 1, 1, 1, 1},
+    };
+    flow_result_t results[FLOWS];
+    double share[FLOWS];
+    bool fair = true;
+
+    simulate(&skewed, false, seconds, results);
+    report(&skewed, "FIFO", results, seconds);
+    simulate(&skewed, true, seconds, results);
+    report(&skewed, "DRR", results, seconds);
+    for (int f = 1; f < FLOWS; f++) {
+        fair &= results[f].served_bytes >= results[f].offered_bytes * 0.95;
+    }
+
+    simulate(&weighted, false, seconds, results);
+    report(&weighted, "FIFO", results, seconds);
+    simulate(&weighted, true, seconds, results);
+    report(&weighted, "DRR", results, seconds);
+    shares(results, share);
+    for (int f = 0; f < FLOWS; f++) {
+        double target = weighted.weight[f] / 12.0;
+        fair &= fabs(share[f] - target) <= target * 0.05;
+    }
+
+    if (!fair) {
+        fprintf(stderr, "FAIL: DRR missed its fairness targets\n");
+        return 1;
+    }
+    return 0;
+}
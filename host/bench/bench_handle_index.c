@@ -0,0 +1,107 @@
+/*
+ * Handle Lookup Benchmark
+ *
+ * The cost of finding a connection's slot from its handle, which the data
+ * path does once per packet, with every slot connected:
+ *
+ * - before: a scan of the slots' handles, as find_connection_by_handle was
+ * - after: bt_handle_index, the open-addressed table it uses now
+ *
+ * Built once per table size (bench_handle_index_8, _16 and _32, with
+ * MAX_CONNECTIONS set to match). Half the peers are SPP and half BLE, and
+ * every peer has reconnected a few times first, so the index carries the
+ * tombstones it would in service. Lookups follow a fixed pseudo-random order,
+ * one in sixteen for a handle that is not connected. Exits non-zero if the
+ * two disagree on any lookup.
+ *
+ *     bench_handle_index_N [lookups]
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include "bt_handle_index.h"
+#include "bench.h"
+
+#define ORDER_LENGTH 4096
+#define RECONNECTS 4
+
+static _Atomic uint32_t slot_handles[MAX_CONNECTIONS];
+static uint32_t order[ORDER_LENGTH];
+
+static uint32_t scan_lookup(uint32_t handle) {
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (atomic_load_explicit(&slot_handles[i], memory_order_acquire) == handle) {
+            return i;
+        }
+    }
+    return MAX_CONNECTIONS;
+}
+
+// SPP handles count up from 0x81 and BLE conn_ids from 0, as the stack
+// hands them out
+static uint32_t next_handle(uint32_t slot, uint32_t *spp, uint32_t *ble) {
+    return slot % 2 ? CONN_HANDLE_FROM_BLE((*ble)++) : (*spp)++;
+}
+
+static void connect_all(void) {
+    uint32_t spp = 0x81;
+    uint32_t ble = 0;
+    bt_index_init();
+    for (int round = 0; round <= RECONNECTS; round++) {
+        for (uint32_t slot = 0; slot < MAX_CONNECTIONS; slot++) {
+            if (round > 0) {
+                bt_index_remove(slot_handles[slot]);
+            }
+            uint32_t handle = next_handle(slot, &spp, &ble);
+            atomic_store(&slot_handles[slot], handle);
+            bt_index_insert(handle, slot);
+        }
+    }
+}
+
+static void make_order(void) {
+    uint64_t state = 1;
+    for (int i = 0; i < ORDER_LENGTH; i++) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        uint32_t pick = (uint32_t)(state >> 33);
+        // Misses use a handle from before the reconnects
+        order[i] = pick % 16 == 0 ? 0x81 + pick % MAX_CONNECTIONS : slot_handles[pick % MAX_CONNECTIONS];
+    }
+}
+
+static double time_lookups(uint32_t (*lookup)(uint32_t), uint32_t lookups, uint64_t *check) {
+    uint64_t sum = 0;
+    uint64_t start = bench_now_ns();
+    for (uint32_t i = 0; i < lookups; i++) {
+        sum += lookup(order[i % ORDER_LENGTH]);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    *check = sum;
+    bench_consume(sum);
+    return (double)elapsed / lookups;
+}
+
+int main(int argc, char **argv) {
+    uint32_t lookups = bench_iterations(argc, argv, 20000000);
+
+    connect_all();
+    make_order();
+    for (int i = 0; i < ORDER_LENGTH; i++) {
+        if (scan_lookup(order[i]) != bt_index_lookup(order[i])) {
+            fprintf(stderr, "FAIL: lookup of handle 0x%lx disagrees\n", (unsigned long)order[i]);
+            return 1;
+        }
+    }
+
+    uint64_t scan_check;
+    uint64_t index_check;
+    double scan_ns = time_lookups(scan_lookup, lookups, &scan_check);
+    double index_ns = time_lookups(bt_index_lookup, lookups, &index_check);
+    if (scan_check != index_check) {
+        fprintf(stderr, "FAIL: lookups disagree\n");
+        return 1;
+    }
+    printf("%3d slots, %3d-entry index: scan %6.2f ns, index %6.2f ns per lookup (%lu lookups)\n",
+           MAX_CONNECTIONS, BT_HANDLE_INDEX_SIZE, scan_ns, index_ns, (unsigned long)lookups);
+    return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * RX Hand-off Copy Benchmark
+ *
+ * The cost of handing a received packet from the Bluetooth callback to the
+ * message task and on to the data callback, before and after the packet pool:
+ *
+ * - before: the callback filled a whole message (payload array included) on
+ *   its stack, xQueueSend copied the message into a 20-deep queue and the
+ *   message task copied it out again
+ * - after: the callback copies the payload once into a pool buffer, only the
+ *   descriptor goes through the connection's ring, and the data callback
+ *   borrows the buffer
+ *
+ * Packets go through in bursts of one ring's worth on a single thread, so the
+ * figures are the copies and queue operations, not thread hand-off (see
+ * test_ring_stress for that).
+ *
+ *     bench_rx_copy [packets per size]
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "bt_packet_pool.h"
+#include "bt_ring.h"
+#include "bench.h"
+
+#define LEGACY_QUEUE_DEPTH 20
+#define BURST BT_RING_SIZE
+
+// The message that used to be queued by value
+typedef struct {
+    uint32_t conn_handle;
+    uint8_t data[MAX_PACKET_SIZE];
+    uint16_t length;
+    uint8_t type;
+} legacy_message_t;
+
+static uint8_t payload[MAX_PACKET_SIZE];
+
+// What the data callback does with a packet: enough to need its bytes
+static uint64_t deliver(const uint8_t *data, uint16_t length) {
+    return data[0] + data[length - 1] + length;
+}
+
+static uint64_t run_before(QueueHandle_t queue, uint16_t length, uint32_t packets) {
+    uint64_t check = 0;
+    for (uint32_t sent = 0; sent < packets; sent += BURST) {
+        for (int i = 0; i < BURST; i++) {
+            legacy_message_t message;
+            message.conn_handle = 0x81;
+            message.type = 0;
+            message.length = length;
+            memcpy(message.data, payload, length);
+            xQueueSend(queue, &message, 0);
+        }
+        for (int i = 0; i < BURST; i++) {
+            legacy_message_t message;
+            xQueueReceive(queue, &message, 0);
+            check += deliver(message.data, message.length);
+        }
+    }
+    return check;
+}
+
+static uint64_t run_after(bt_ring_t *ring, uint16_t length, uint32_t packets) {
+    uint64_t check = 0;
+    for (uint32_t sent = 0; sent < packets; sent += BURST) {
+        for (int i = 0; i < BURST; i++) {
+            bt_message_t message = {.conn_handle = 0x81, .length = length, .buffer = bt_pool_alloc(length)};
+            memcpy(bt_pool_buffer(message.buffer), payload, length);
+            bt_ring_push(ring, &message);
+        }
+        for (int i = 0; i < BURST; i++) {
+            bt_message_t message;
+            bt_ring_pop(ring, &message);
+            check += deliver(bt_pool_buffer(message.buffer), message.length);
+            bt_pool_free(message.buffer);
+        }
+    }
+    return check;
+}
+
+int main(int argc, char **argv) {
+    static const uint16_t sizes[] = {20, 64, 244, 512};
+    uint32_t packets = bench_iterations(argc, argv, 2000000) / BURST * BURST;
+    static uint8_t queue_storage[LEGACY_QUEUE_DEPTH * sizeof(legacy_message_t)];
+    static StaticQueue_t queue_buffer;
+    QueueHandle_t queue = xQueueCreateStatic(LEGACY_QUEUE_DEPTH, sizeof(legacy_message_t), queue_storage,
+                                             &queue_buffer);
+    static bt_ring_t ring;
+
+    bt_pool_init();
+    bt_ring_init(&ring);
+    for (int i = 0; i < MAX_PACKET_SIZE; i++) {
+        payload[i] = (uint8_t)(i * 7 + 1);
+    }
+
+    printf("RX hand-off, %lu packets per size\n", (unsigned long)packets);
+    printf("%6s  %16s  %16s  %14s  %14s\n", "bytes", "copied before", "copied after", "pps before", "pps after");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        uint16_t length = sizes[i];
+
+        uint64_t start = bench_now_ns();
+        uint64_t check_before = run_before(queue, length, packets);
+        uint64_t before_ns = bench_now_ns() - start;
+
+        start = bench_now_ns();
+        uint64_t check_after = run_after(&ring, length, packets);
+        uint64_t after_ns = bench_now_ns() - start;
+
+        if (check_before != check_after || bt_pool_available() != BT_PACKET_POOL_SIZE) {
+            fprintf(stderr, "FAIL: %u-byte packets were not delivered intact\n", length);
+            return 1;
+        }
+        bench_consume(check_after);
+
+        // Payload into the message, into the queue and out of it; payload
+        // into the pool, descriptor into the ring and out of it
+        uint32_t copied_before = length + 2 * sizeof(legacy_message_t);
+        uint32_t copied_after = length + 2 * sizeof(bt_message_t);
+        printf("%6u  %16lu  %16lu  %14.0f  %14.0f\n", length, (unsigned long)copied_before,
+               (unsigned long)copied_after, packets * 1e9 / before_ns, packets * 1e9 / after_ns);
+    }
+    return 0;
+}
@@ -0,0 +1,142 @@
+/*
+ * Compression Benchmark
+ *
+ * bt_zip on a deterministic telemetry corpus: JSON lines from eight sensor
+ * nodes whose readings drift, about 200 KB in all. The corpus is sent as
+ * writes of 64 to 512 bytes, each encoded as one block, as the message task
+ * does, and decoded again by a separate decoder.
+ *
+ * For each write size it reports the compression ratio (corpus bytes over
+ * block bytes, headers included), host CPU per KB to encode and to decode,
+ * and the effective goodput on the link bench_coalesce uses (50 KB/s and
+ * 1.25 ms per write), with and without compression. The zipped goodput
+ * charges the host's encode time to the link as if the two ran in series.
+ * Exits non-zero if any block does not decode to what was sent.
+ *
+ *     bench_zip [corpus repeats]
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "bt_zip.h"
+#include "bench.h"
+
+#define CORPUS_SIZE (200 * 1024)
+#define LINK_BYTES_PER_S 50000.0
+#define LINK_WRITE_COST_US 1250.0
+
+static char corpus[CORPUS_SIZE];
+static uint32_t corpus_length;
+
+static uint32_t random_state = 1;
+
+static uint32_t next_random(uint32_t range) {
+    random_state = random_state * 1103515245 + 12345;
+    return (random_state >> 16) % range;
+}
+
+static void make_corpus(void) {
+    static const char *const states[] = {"ok", "ok", "ok", "charging", "low_battery"};
+    int temperature[8];
+    int humidity[8];
+    int battery[8];
+    uint32_t seq = 0;
+    uint32_t time = 1712345678;
+
+    for (int node = 0; node < 8; node++) {
+        temperature[node] = 2100 + node * 40;
+        humidity[node] = 450 + node * 7;
+        battery[node] = 4100 - node * 15;
+    }
+    while (true) {
+        int node = next_random(8);
+        temperature[node] += (int)next_random(21) - 10;
+        humidity[node] += (int)next_random(5) - 2;
+        battery[node] -= next_random(3) == 0;
+        char line[160];
+        int length = snprintf(line, sizeof(line),
+                              "{\"node\":%d,\"seq\":%lu,\"t\":%lu,\"temp\":%d.%02d,\"hum\":%d.%d,\"rssi\":%d,"
+                              "\"batt\":%d.%03d,\"state\":\"%s\"}\n",
+                              node, (unsigned long)seq++, (unsigned long)(time += next_random(3)),
+                              temperature[node] / 100, temperature[node] % 100, humidity[node] / 10,
+                              humidity[node] % 10, -50 - (int)next_random(30), battery[node] / 1000,
+                              battery[node] % 1000, states[next_random(5)]);
+        if (corpus_length + length > CORPUS_SIZE) {
+            break;
+        }
+        memcpy(&corpus[corpus_length], line, length);
+        corpus_length += length;
+    }
+}
+
+typedef struct {
+    uint64_t coded_bytes;
+    uint32_t writes;
+    uint64_t encode_ns;
+    uint64_t decode_ns;
+} result_t;
+
+// Returns false if a block failed to decode to its input
+static bool run(uint16_t write_size, uint32_t repeats, result_t *result) {
+    static bt_zip_encoder_t encoder;
+    static bt_zip_decoder_t decoder;
+    uint8_t block[BT_ZIP_BLOCK_MAX + BT_ZIP_HEADER];
+    uint8_t decoded[BT_ZIP_BLOCK_MAX];
+
+    memset(result, 0, sizeof(*result));
+    bt_zip_encoder_init(&encoder);
+    bt_zip_decoder_init(&decoder);
+    for (uint32_t r = 0; r < repeats; r++) {
+        for (uint32_t offset = 0; offset < corpus_length; offset += write_size) {
+            const uint8_t *in = (const uint8_t *)&corpus[offset];
+            uint16_t length = corpus_length - offset < write_size ? corpus_length - offset : write_size;
+
+            uint64_t start = bench_now_ns();
+            uint16_t coded = bt_zip_encode(&encoder, in, length, block, sizeof(block));
+            uint64_t encoded = bench_now_ns();
+            int produced = coded > 2 ? bt_zip_decode(&decoder, &block[2], coded - 2, decoded, sizeof(decoded)) : -1;
+            result->decode_ns += bench_now_ns() - encoded;
+            result->encode_ns += encoded - start;
+
+            if (produced != length || memcmp(decoded, in, length) != 0) {
+                fprintf(stderr, "FAIL: %u-byte write at offset %lu did not round-trip\n", write_size,
+                        (unsigned long)offset);
+                return false;
+            }
+            result->coded_bytes += coded;
+            result->writes++;
+        }
+    }
+    return true;
+}
+
+// Bytes per second of corpus delivered when every write costs the link its
+// fixed time plus its bytes, and the encoder runs before each write
+static double goodput(double raw_bytes, double link_bytes, uint32_t writes, double cpu_ns) {
+    double seconds = writes * LINK_WRITE_COST_US / 1e6 + link_bytes / LINK_BYTES_PER_S + cpu_ns / 1e9;
+    return raw_bytes / seconds;
+}
+
+int main(int argc, char **argv) {
+    static const uint16_t write_sizes[] = {64, 128, 256, 512};
+    uint32_t repeats = bench_iterations(argc, argv, 10);
+    result_t result;
+
+    make_corpus();
+    double raw_bytes = (double)corpus_length * repeats;
+    printf("%lu-byte telemetry corpus, %lu passes\n", (unsigned long)corpus_length, (unsigned long)repeats);
+    printf("%6s %7s %12s %12s %13s %13s\n", "write", "ratio", "encode us/KB", "decode us/KB", "plain B/s",
+           "zipped B/s");
+    for (size_t i = 0; i < sizeof(write_sizes) / sizeof(write_sizes[0]); i++) {
+        if (!run(write_sizes[i], repeats, &result)) {
+            return 1;
+        }
+        bench_consume(result.coded_bytes);
+        double kilobytes = raw_bytes / 1024;
+        printf("%6u %7.2f %12.2f %12.2f %13.0f %13.0f\n", write_sizes[i], raw_bytes / result.coded_bytes,
+               result.encode_ns / 1000.0 / kilobytes, result.decode_ns / 1000.0 / kilobytes,
+               goodput(raw_bytes, raw_bytes, result.writes, 0),
+               goodput(raw_bytes, result.coded_bytes, result.writes, result.encode_ns));
+    }
+    return 0;
+}
@@ -0,0 +1,8 @@
+#ifndef ESP_BT_DEVICE_H
+#define ESP_BT_DEVICE_H
+
+#include "esp_err.h"
+
+esp_err_t esp_bt_dev_set_device_name(const char *name);
+
+#endif // ESP_BT_DEVICE_H
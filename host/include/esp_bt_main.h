@@ -0,0 +1,18 @@
+#ifndef ESP_BT_MAIN_H
+#define ESP_BT_MAIN_H
+
+#include "esp_err.h"
+
+// Host simulation build: enabling Bluedroid starts the simulated stack's
+// event thread (see sim.h)
+typedef enum {
+    ESP_BLUEDROID_STATUS_UNINITIALIZED = 0,
+    ESP_BLUEDROID_STATUS_INITIALIZED,
+    ESP_BLUEDROID_STATUS_ENABLED,
+} esp_bluedroid_status_t;
+
+esp_err_t esp_bluedroid_init(void);
+esp_err_t esp_bluedroid_enable(void);
+esp_bluedroid_status_t esp_bluedroid_get_status(void);
+
+#endif // ESP_BT_MAIN_H
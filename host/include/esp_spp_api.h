@@ -0,0 +1,90 @@
+#ifndef ESP_SPP_API_H
+#define ESP_SPP_API_H
+
+#include "esp_err.h"
+#include "esp_bt_defs.h"
+
+// Host simulation build: the SPP acceptor API. Events are raised by the
+// simulated stack's event thread (see sim.h).
+typedef enum {
+    ESP_SPP_SUCCESS = 0,
+    ESP_SPP_FAILURE,
+    ESP_SPP_BUSY,
+    ESP_SPP_NO_DATA,
+    ESP_SPP_NO_RESOURCE,
+    ESP_SPP_NEED_INIT,
+    ESP_SPP_NEED_DEINIT,
+    ESP_SPP_NO_CONNECTION,
+    ESP_SPP_NO_SERVER,
+} esp_spp_status_t;
+
+typedef enum {
+    ESP_SPP_MODE_CB = 0,
+    ESP_SPP_MODE_VFS,
+} esp_spp_mode_t;
+
+typedef enum {
+    ESP_SPP_INIT_EVT = 0,
+    ESP_SPP_UNINIT_EVT = 1,
+    ESP_SPP_DISCOVERY_COMP_EVT = 8,
+    ESP_SPP_OPEN_EVT = 26,
+    ESP_SPP_CLOSE_EVT = 27,
+    ESP_SPP_START_EVT = 28,
+    ESP_SPP_CL_INIT_EVT = 29,
+    ESP_SPP_DATA_IND_EVT = 30,
+    ESP_SPP_CONG_EVT = 31,
+    ESP_SPP_WRITE_EVT = 33,
+    ESP_SPP_SRV_OPEN_EVT = 34,
+    ESP_SPP_SRV_STOP_EVT = 35,
+} esp_spp_cb_event_t;
+
+typedef union {
+    struct spp_init_evt_param {
+        esp_spp_status_t status;
+    } init;
+    struct spp_start_evt_param {
+        esp_spp_status_t status;
+        uint32_t handle;
+        uint8_t sec_id;
+        uint8_t scn;
+        bool use_co;
+    } start;
+    struct spp_srv_open_evt_param {
+        esp_spp_status_t status;
+        uint32_t handle;
+        uint32_t new_listen_handle;
+        esp_bd_addr_t rem_bda;
+    } srv_open;
+    struct spp_close_evt_param {
+        esp_spp_status_t status;
+        uint32_t port_status;
+        uint32_t handle;
+        bool async;
+    } close;
+    struct spp_data_ind_evt_param {
+        esp_spp_status_t status;
+        uint32_t handle;
+        uint16_t len;
+        uint8_t *data;
+    } data_ind;
+    struct spp_write_evt_param {
+        esp_spp_status_t status;
+        uint32_t handle;
+        int len;
+        bool cong;
+    } write;
+    struct spp_cong_evt_param {
+        esp_spp_status_t status;
+        uint32_t handle;
+        bool cong;
+    } cong;
+} esp_spp_cb_param_t;
+
+typedef void (esp_spp_cb_t)(esp_spp_cb_event_t event, esp_spp_cb_param_t *param);
+
+esp_err_t esp_spp_register_callback(esp_spp_cb_t *callback);
+esp_err_t esp_spp_init(esp_spp_mode_t mode);
+esp_err_t esp_spp_write(uint32_t handle, int len, uint8_t *p_data);
+esp_err_t esp_spp_disconnect(uint32_t handle);
+
+#endif // ESP_SPP_API_H
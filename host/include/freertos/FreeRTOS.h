@@ -0,0 +1,92 @@
+#ifndef FREERTOS_H
+#define FREERTOS_H
+
+/*
+ * Host simulation of the FreeRTOS subset the firmware uses. Tasks are
+ * pthreads; queues, semaphores and task notifications are built on a mutex
+ * and condition variable each; a critical section is a recursive mutex, so it
+ * excludes other tasks as the real one does, without stopping the scheduler.
+ * One tick is one millisecond of the monotonic clock. Priorities and core
+ * affinity are accepted and ignored: the host scheduler decides.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "sdkconfig.h"
+#include "esp_attr.h"
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef uint8_t StackType_t; // Stack sizes are in bytes, as in ESP-IDF
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdFAIL pdFALSE
+#define pdPASS pdTRUE
+#define errQUEUE_EMPTY 0
+#define errQUEUE_FULL 0
+
+#define configTICK_RATE_HZ CONFIG_FREERTOS_HZ
+#define portTICK_PERIOD_MS (1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms) ((TickType_t)(((uint64_t)(ms) * configTICK_RATE_HZ) / 1000))
+#define portMAX_DELAY ((TickType_t)0xFFFFFFFF)
+#define portNUM_PROCESSORS 2
+#define tskNO_AFFINITY 0x7FFFFFFF
+
+// Critical sections
+typedef struct {
+    pthread_mutex_t mutex;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED { PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP }
+#define portMUX_INITIALIZE(mux) sim_mux_init(mux)
+#define portENTER_CRITICAL(mux) pthread_mutex_lock(&(mux)->mutex)
+#define portEXIT_CRITICAL(mux) pthread_mutex_unlock(&(mux)->mutex)
+#define portENTER_CRITICAL_ISR(mux) portENTER_CRITICAL(mux)
+#define portEXIT_CRITICAL_ISR(mux) portEXIT_CRITICAL(mux)
+#define taskENTER_CRITICAL(mux) portENTER_CRITICAL(mux)
+#define taskEXIT_CRITICAL(mux) portEXIT_CRITICAL(mux)
+#define portYIELD_FROM_ISR(woken) ((void)(woken))
+
+void sim_mux_init(portMUX_TYPE *mux);
+
+// A task. Notifications count, as used through xTaskNotifyGive.
+typedef struct sim_task {
+    pthread_t thread;
+    void (*function)(void *);
+    void *parameter;
+    char name[16];
+    pthread_mutex_t lock;
+    pthread_cond_t notified;
+    uint32_t notify_value;
+} StaticTask_t;
+typedef struct sim_task *TaskHandle_t;
+
+// A queue, or a semaphore as a queue of zero-size items
+typedef struct sim_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    uint8_t *storage;
+    UBaseType_t item_size;
+    UBaseType_t length;
+    UBaseType_t count;
+    UBaseType_t head;
+} StaticQueue_t;
+typedef StaticQueue_t StaticSemaphore_t;
+typedef struct sim_queue *QueueHandle_t;
+
+// A deadline on one of the simulation's service threads (software timers,
+// esp_timer, the Bluetooth stack's event thread)
+typedef struct sim_alarm {
+    struct sim_alarm *next;
+    uint64_t due_us;
+    bool armed;
+    void (*fire)(struct sim_alarm *alarm);
+} sim_alarm_t;
+
+TickType_t xTaskGetTickCount(void);
+
+#endif // FREERTOS_H
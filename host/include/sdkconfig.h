@@ -0,0 +1,9 @@
+#ifndef SDKCONFIG_H
+#define SDKCONFIG_H
+
+// Host simulation build: the menuconfig options the firmware reads. Features
+// the simulated stack does not model are left undefined.
+#define CONFIG_BT_BLUEDROID_PINNED_TO_CORE 0
+#define CONFIG_FREERTOS_HZ 1000
+
+#endif // SDKCONFIG_H
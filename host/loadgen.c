@@ -0,0 +1,241 @@
+/*
+ * Load Generator
+ *
+ * Runs bluetooth_spp.c on the host simulation with 1 to 8 peers, each
+ * sending fixed-size packets at a steady rate from its own thread. The data
+ * callback echoes every packet back, so both directions of the data path
+ * carry the load. Packets carry their peer, sequence number and send time;
+ * the report gives packets per second, one-way latency from the peer's send
+ * to the data callback, round trip back to the peer, and losses.
+ *
+ *     bt_loadgen [-p peers] [-r packets/s per peer] [-s bytes] [-t seconds]
+ *                [-b] [-l max loss %]
+ *
+ * -b connects the peers over BLE instead of SPP. Exits non-zero if more than
+ * the allowed share of packets or echoes went missing.
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bluetooth_spp.h"
+#include "bt_stats.h"
+#include "sim.h"
+
+#define MAX_PEERS 8
+#define HEADER_SIZE 16 // Peer, sequence and send time
+#define BLE_MTU 247
+#define DRAIN_TIMEOUT_MS 2000
+
+typedef struct {
+    int index;
+    uint32_t handle;
+    pthread_t thread;
+    uint32_t sent;
+    _Atomic uint32_t received; // By the data callback
+    _Atomic uint32_t echoed;   // Back at the peer
+} peer_t;
+
+static peer_t peers[MAX_PEERS];
+static int peer_count = 1;
+static uint32_t rate = 200;
+static uint16_t size = 64;
+static uint32_t seconds = 2;
+static bool ble;
+static uint32_t max_loss_percent;
+
+// One writer each: the dispatch task and the event thread
+static uint32_t rx_latency[LATENCY_HIST_BUCKETS];
+static uint32_t round_trip[LATENCY_HIST_BUCKETS];
+static _Atomic uint32_t echo_failures;
+
+static uint64_t now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void put_u32(uint8_t *out, uint32_t value) {
+    memcpy(out, &value, sizeof(value));
+}
+
+static uint32_t get_u32(const uint8_t *in) {
+    uint32_t value;
+    memcpy(&value, in, sizeof(value));
+    return value;
+}
+
+static uint64_t get_u64(const uint8_t *in) {
+    uint64_t value;
+    memcpy(&value, in, sizeof(value));
+    return value;
+}
+
+static peer_t *packet_peer(const uint8_t *data, uint16_t length) {
+    if (length < HEADER_SIZE) {
+        return NULL;
+    }
+    uint32_t index = get_u32(data);
+    return index < (uint32_t)peer_count ? &peers[index] : NULL;
+}
+
+// Dispatch task
+static void on_data(uint32_t conn_handle, const uint8_t *data, uint16_t length) {
+    peer_t *peer = packet_peer(data, length);
+    if (peer == NULL) {
+        return;
+    }
+    bt_latency_record(rx_latency, now_us() - get_u64(&data[8]));
+    atomic_fetch_add(&peer->received, 1);
+    if (bluetooth_spp_send_data(conn_handle, data, length) != ESP_OK) {
+        atomic_fetch_add(&echo_failures, 1);
+    }
+}
+
+// Event thread
+static void on_peer_receive(uint32_t conn_handle, const uint8_t *data, uint16_t length, void *context) {
+    peer_t *peer = packet_peer(data, length);
+    if (peer == NULL) {
+        return;
+    }
+    bt_latency_record(round_trip, now_us() - get_u64(&data[8]));
+    atomic_fetch_add(&peer->echoed, 1);
+}
+
+// Sends on absolute deadlines, so the rate holds however long each send takes
+static void *peer_thread(void *parameter) {
+    peer_t *peer = parameter;
+    uint8_t packet[MAX_PACKET_SIZE];
+    uint64_t interval_ns = 1000000000ull / rate;
+    uint64_t total = (uint64_t)rate * seconds;
+    struct timespec next;
+
+    memset(packet, 0xA5, size);
+    put_u32(packet, peer->index);
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (uint64_t seq = 0; seq < total; seq++) {
+        put_u32(&packet[4], seq);
+        uint64_t sent_us = now_us();
+        memcpy(&packet[8], &sent_us, sizeof(sent_us));
+        if (sim_peer_send(peer->handle, packet, size) == ESP_OK) {
+            peer->sent++;
+        }
+        uint64_t ns = next.tv_nsec + interval_ns;
+        next.tv_sec += ns / 1000000000;
+        next.tv_nsec = ns % 1000000000;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    return NULL;
+}
+
+static uint32_t total_of(size_t offset) {
+    uint32_t total = 0;
+    for (int i = 0; i < peer_count; i++) {
+        total += atomic_load((_Atomic uint32_t *)((uint8_t *)&peers[i] + offset));
+    }
+    return total;
+}
+
+static uint32_t total_sent(void) {
+    uint32_t total = 0;
+    for (int i = 0; i < peer_count; i++) {
+        total += peers[i].sent;
+    }
+    return total;
+}
+
+static uint32_t loss_percent(uint32_t expected, uint32_t got) {
+    return expected ? (uint32_t)((uint64_t)(expected - got) * 100 / expected) : 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-p peers 1-%d] [-r packets/s per peer] [-s bytes %d-%d] [-t seconds] [-b] "
+            "[-l max loss %%]\n", name, MAX_PEERS, HEADER_SIZE, MAX_PACKET_SIZE);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    int option;
+    while ((option = getopt(argc, argv, "p:r:s:t:bl:")) != -1) {
+        switch (option) {
+            case 'p': peer_count = atoi(optarg); break;
+            case 'r': rate = strtoul(optarg, NULL, 0); break;
+            case 's': size = strtoul(optarg, NULL, 0); break;
+            case 't': seconds = strtoul(optarg, NULL, 0); break;
+            case 'b': ble = true; break;
+            case 'l': max_loss_percent = strtoul(optarg, NULL, 0); break;
+            default: usage(argv[0]);
+        }
+    }
+    uint16_t size_max = ble ? BLE_MTU - 3 : MAX_PACKET_SIZE;
+    if (peer_count < 1 || peer_count > MAX_PEERS || rate == 0 || size < HEADER_SIZE || size > size_max) {
+        usage(argv[0]);
+    }
+
+    bluetooth_spp_set_data_callback(on_data);
+    sim_set_peer_sink(on_peer_receive, NULL);
+    bluetooth_spp_init();
+
+    // The GATT service is up once registration and the attribute table have
+    // gone through the event thread
+    for (int i = 0; i < peer_count; i++) {
+        esp_bd_addr_t address = {0x02, 0x00, 0x00, 0x00, 0x00, i + 1};
+        peers[i].index = i;
+        for (int attempt = 0; attempt < 100 && peers[i].handle == 0; attempt++) {
+            sim_sync();
+            peers[i].handle = ble ? sim_ble_connect(address, BLE_MTU) : sim_spp_connect(address);
+        }
+        if (peers[i].handle == 0) {
+            fprintf(stderr, "peer %d could not connect\n", i);
+            return 1;
+        }
+    }
+    sim_sync();
+
+    uint64_t start_us = now_us();
+    for (int i = 0; i < peer_count; i++) {
+        pthread_create(&peers[i].thread, NULL, peer_thread, &peers[i]);
+    }
+    for (int i = 0; i < peer_count; i++) {
+        pthread_join(peers[i].thread, NULL);
+    }
+    uint64_t elapsed_us = now_us() - start_us;
+
+    // Let the pipeline and links drain
+    uint32_t sent = total_sent();
+    for (int waited = 0; waited < DRAIN_TIMEOUT_MS; waited += 10) {
+        if (total_of(offsetof(peer_t, echoed)) + atomic_load(&echo_failures) >= sent) {
+            break;
+        }
+        usleep(10000);
+    }
+    sim_sync();
+    uint32_t received = total_of(offsetof(peer_t, received));
+    uint32_t echoed = total_of(offsetof(peer_t, echoed));
+
+    sim_stats_t stats;
+    sim_get_stats(&stats);
+    printf("%d %s peer(s), %u-byte packets at %lu/s each for %lu s\n", peer_count, ble ? "BLE" : "SPP", size,
+           (unsigned long)rate, (unsigned long)seconds);
+    printf("rx:   %lu sent, %lu received, %lu pps, latency p50 %lu us p99 %lu us\n", (unsigned long)sent,
+           (unsigned long)received, (unsigned long)((uint64_t)received * 1000000 / elapsed_us),
+           (unsigned long)bt_latency_percentile(rx_latency, 50), (unsigned long)bt_latency_percentile(rx_latency, 99));
+    printf("echo: %lu received, %lu send failures, round trip p50 %lu us p99 %lu us\n", (unsigned long)echoed,
+           (unsigned long)atomic_load(&echo_failures), (unsigned long)bt_latency_percentile(round_trip, 50),
+           (unsigned long)bt_latency_percentile(round_trip, 99));
+    printf("link: %lu writes, %lu congestions, %lu rejected\n", (unsigned long)stats.writes,
+           (unsigned long)stats.congestions, (unsigned long)stats.rejected);
+    bluetooth_spp_print_connection_status();
+
+    uint32_t rx_loss = loss_percent(sent, received);
+    uint32_t echo_loss = loss_percent(received, echoed);
+    if (rx_loss > max_loss_percent || echo_loss > max_loss_percent) {
+        fprintf(stderr, "FAIL: lost %lu%% received, %lu%% echoed (allowed %lu%%)\n", (unsigned long)rx_loss,
+                (unsigned long)echo_loss, (unsigned long)max_loss_percent);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,223 @@
+/*
+ * Capture Replayer
+ *
+ * Runs a recording from bluetooth_spp_dump_capture() through bluetooth_spp.c
+ * on the host simulation. The input is the device's console output: the hex
+ * lines between "CAPTURE BEGIN <bytes>" and "CAPTURE END" are collected and
+ * other lines skipped, so a whole serial log can be given. The data callback
+ * echoes every packet, as loadgen does, so the TX path runs too (replayed
+ * peers' writes are dropped at the link). The report counts the packets and
+ * bytes the data callback saw per replayed connection.
+ *
+ *     bt_replay [-s speed %] [-e packets] [file]
+ *     bt_replay -w file
+ *
+ * -s replays at the given percentage of the recorded pace (default 100, 0 as
+ * fast as possible). -e exits non-zero unless exactly that many packets
+ * reached the data callback. -w instead records a short session of one SPP
+ * and one BLE peer on the simulation and writes its dump to file, for
+ * trying the replayer without a device.
+ */
+
+#include <ctype.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bluetooth_spp.h"
+#include "sim.h"
+
+#define MAX_HANDLES 16
+#define LINE_MAX_LENGTH 1024
+#define DRAIN_TIMEOUT_MS 2000
+
+// Recording session for -w
+#define RECORD_PACKETS 40  // Per peer
+#define RECORD_SIZE 48
+#define RECORD_INTERVAL_US 5000
+#define RECORD_BLE_MTU 247
+
+typedef struct {
+    uint32_t handle;
+    uint32_t packets;
+    uint64_t bytes;
+} handle_count_t;
+
+// Dispatch task
+static handle_count_t counts[MAX_HANDLES];
+static int count_used;
+static _Atomic uint32_t received;
+
+static void on_data(uint32_t conn_handle, const uint8_t *data, uint16_t length) {
+    handle_count_t *count = NULL;
+    for (int i = 0; i < count_used && !count; i++) {
+        if (counts[i].handle == conn_handle) {
+            count = &counts[i];
+        }
+    }
+    if (!count && count_used < MAX_HANDLES) {
+        count = &counts[count_used++];
+        count->handle = conn_handle;
+    }
+    if (count) {
+        count->packets++;
+        count->bytes += length;
+    }
+    bluetooth_spp_send_data(conn_handle, data, length);
+    atomic_fetch_add(&received, 1);
+}
+
+static int hex_value(int c) {
+    return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
+// The recording between the markers; NULL if there is none or it is short
+static uint8_t *read_recording(FILE *in, uint32_t *length) {
+    char line[LINE_MAX_LENGTH];
+    uint8_t *recording = NULL;
+    unsigned long size = 0;
+    uint32_t got = 0;
+
+    while (fgets(line, sizeof(line), in)) {
+        if (recording == NULL) {
+            if (sscanf(line, "CAPTURE BEGIN %lu", &size) == 1 && size > 0) {
+                recording = malloc(size);
+            }
+            continue;
+        }
+        if (strncmp(line, "CAPTURE END", 11) == 0) {
+            break;
+        }
+        size_t digits = strspn(line, "0123456789abcdefABCDEF");
+        if (digits == 0 || digits % 2 != 0 || strspn(&line[digits], "\r\n") != strlen(&line[digits])) {
+            continue; // Another task's output
+        }
+        for (size_t i = 0; i < digits && got < size; i += 2) {
+            recording[got++] = hex_value(line[i]) << 4 | hex_value(line[i + 1]);
+        }
+    }
+    if (recording == NULL || got != size) {
+        fprintf(stderr, "no complete capture: %lu of %lu bytes\n", (unsigned long)got, size);
+        free(recording);
+        return NULL;
+    }
+    *length = got;
+    return recording;
+}
+
+// One SPP and one BLE peer send packets and go; the firmware's echoes give
+// the recording write completions as well
+static int record_session(const char *path) {
+    esp_bd_addr_t spp_address = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+    esp_bd_addr_t ble_address = {0x02, 0x00, 0x00, 0x00, 0x00, 0x02};
+    uint32_t handles[2] = {0, 0};
+    uint8_t packet[RECORD_SIZE];
+
+    bluetooth_spp_capture_start(MAX_PACKET_SIZE);
+    for (int attempt = 0; attempt < 100 && (handles[0] == 0 || handles[1] == 0); attempt++) {
+        sim_sync();
+        handles[0] = handles[0] ? handles[0] : sim_spp_connect(spp_address);
+        handles[1] = handles[1] ? handles[1] : sim_ble_connect(ble_address, RECORD_BLE_MTU);
+    }
+    if (handles[0] == 0 || handles[1] == 0) {
+        fprintf(stderr, "peers could not connect\n");
+        return 1;
+    }
+    sim_sync();
+    for (int i = 0; i < RECORD_PACKETS; i++) {
+        for (int p = 0; p < 2; p++) {
+            memset(packet, p * 0x40 + i, sizeof(packet));
+            sim_peer_send(handles[p], packet, sizeof(packet));
+        }
+        usleep(RECORD_INTERVAL_US);
+    }
+    for (int waited = 0; waited < DRAIN_TIMEOUT_MS && atomic_load(&received) < 2 * RECORD_PACKETS; waited += 10) {
+        usleep(10000);
+    }
+    sim_sync();
+    sim_disconnect(handles[0]);
+    sim_disconnect(handles[1]);
+    sim_sync();
+    bluetooth_spp_capture_stop();
+
+    // The dump prints to stdout
+    fflush(stdout);
+    if (freopen(path, "w", stdout) == NULL) {
+        perror(path);
+        return 1;
+    }
+    bluetooth_spp_dump_capture();
+    fflush(stdout);
+    fprintf(stderr, "recorded %lu packets to %s\n", (unsigned long)atomic_load(&received), path);
+    return atomic_load(&received) == 2 * RECORD_PACKETS ? 0 : 1;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-s speed %%] [-e packets] [file]\n       %s -w file\n", name, name);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    uint32_t speed = 100;
+    long expected = -1;
+    const char *record_path = NULL;
+    int option;
+    while ((option = getopt(argc, argv, "s:e:w:")) != -1) {
+        switch (option) {
+            case 's': speed = strtoul(optarg, NULL, 0); break;
+            case 'e': expected = strtol(optarg, NULL, 0); break;
+            case 'w': record_path = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind < argc - 1 || (record_path && optind < argc)) {
+        usage(argv[0]);
+    }
+
+    bluetooth_spp_set_data_callback(on_data);
+    bluetooth_spp_init();
+    if (record_path) {
+        return record_session(record_path);
+    }
+
+    FILE *in = optind < argc ? fopen(argv[optind], "r") : stdin;
+    if (in == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+    uint32_t length;
+    uint8_t *recording = read_recording(in, &length);
+    if (recording == NULL) {
+        return 1;
+    }
+    sim_sync();
+
+    esp_err_t ret = bluetooth_spp_replay(recording, length, speed);
+    uint32_t settled = 0;
+    for (int waited = 0; waited < DRAIN_TIMEOUT_MS; waited += 10) {
+        usleep(10000);
+        uint32_t now = atomic_load(&received);
+        if (now == settled) {
+            break;
+        }
+        settled = now;
+    }
+    sim_sync();
+
+    printf("%lu-byte recording replayed at %lu%%: %s\n", (unsigned long)length, (unsigned long)speed,
+           esp_err_to_name(ret));
+    for (int i = 0; i < count_used; i++) {
+        printf("  connection 0x%08lx: %lu packets, %llu bytes\n", (unsigned long)counts[i].handle,
+               (unsigned long)counts[i].packets, (unsigned long long)counts[i].bytes);
+    }
+    free(recording);
+
+    uint32_t total = atomic_load(&received);
+    if (ret != ESP_OK || (expected >= 0 && total != (uint32_t)expected)) {
+        fprintf(stderr, "FAIL: replay %s, %lu packets delivered (expected %ld)\n", esp_err_to_name(ret),
+                (unsigned long)total, expected);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,69 @@
+#ifndef SIM_H
+#define SIM_H
+
+/*
+ * Host simulation of the Bluetooth stack, for running bluetooth_spp.c on a
+ * development machine. One event thread stands in for Bluedroid's BTC task:
+ * every SPP, GATTS and GAP callback runs on it, in time order. Simulated
+ * peers connect over SPP or BLE, send data the firmware receives, and get
+ * the firmware's writes through a link model: writes are serialised at the
+ * link's byte rate plus a fixed cost per write, complete (ESP_SPP_WRITE_EVT / ESP_GATTS_CONF_EVT) once
+ * sent, and reach the peer's sink one latency later. A link congests when
+ * queue_depth writes are outstanding and clears at half that.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "esp_bt_defs.h"
+#include "esp_spp_api.h"
+#include "esp_gatts_api.h"
+
+typedef struct {
+    uint32_t rate_bytes_per_s; // 0 sends instantly
+    uint32_t write_cost_us;    // Link time each write takes on top of its bytes: headers, slot or
+                               // connection event granularity
+    uint32_t latency_us;       // One way, for data in both directions
+    uint16_t queue_depth;      // Outstanding writes that congest the link; 0 never congests
+} sim_link_config_t;
+
+#define SIM_LINK_DEFAULT { .rate_bytes_per_s = 0, .write_cost_us = 0, .latency_us = 0, .queue_depth = 0 }
+
+// Data the firmware wrote, as it arrives at the peer. Runs on the event thread.
+typedef void (*sim_peer_sink_t)(uint32_t conn_handle, const uint8_t *data, uint16_t length, void *context);
+
+typedef struct {
+    uint32_t writes;          // Accepted by esp_spp_write / esp_ble_gatts_send_indicate
+    uint64_t write_bytes;
+    uint32_t delivered;       // Reached a peer
+    uint64_t delivered_bytes;
+    uint32_t lost_at_close;   // Outstanding when their link closed, never completed
+    uint32_t congestions;     // Times a link became congested
+    uint32_t rejected;        // Writes refused: no such link, or larger than the BLE MTU allows
+    uint32_t events;          // Callbacks run on the event thread
+} sim_stats_t;
+
+// Link model for links connected from now on
+void sim_set_link_config(const sim_link_config_t *config);
+
+// Peers. Both return the connection handle the firmware will use for the
+// link (for BLE, CONN_HANDLE_FROM_BLE of the conn_id), or 0 if the stack is
+// not up. A BLE peer exchanges the given ATT MTU and subscribes to
+// notifications once connected.
+uint32_t sim_spp_connect(const esp_bd_addr_t address);
+uint32_t sim_ble_connect(const esp_bd_addr_t address, uint16_t mtu);
+void sim_disconnect(uint32_t conn_handle);
+esp_err_t sim_peer_send(uint32_t conn_handle, const uint8_t *data, uint16_t length);
+void sim_set_peer_sink(sim_peer_sink_t sink, void *context);
+
+// Raw events, delivered on the event thread after everything already due.
+// The parameters are copied; memory they point to must stay valid until
+// sim_sync() returns.
+void sim_inject_spp_event(esp_spp_cb_event_t event, const esp_spp_cb_param_t *param);
+void sim_inject_gatts_event(esp_gatts_cb_event_t event, const esp_ble_gatts_cb_param_t *param);
+
+// Wait until every event due by now has been handled
+void sim_sync(void);
+void sim_get_stats(sim_stats_t *stats);
+
+#endif // SIM_H
@@ -0,0 +1,684 @@
+/*
+ * Host Simulation: Bluedroid
+ *
+ * The controller, Bluedroid bring-up, BLE GAP, GATT server and SPP APIs
+ * bluetooth_spp.c calls, over a set of simulated peers (see sim.h). Every
+ * callback is an event on one alarm service, the stand-in for the BTC task,
+ * so callbacks run one at a time in time order, as on the device. API calls
+ * that complete asynchronously on the device (registration, attribute
+ * tables, advertising, writes) post their completion events; writes go
+ * through the link model, which is guarded with the peer table by one lock.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_bt.h"
+#include "esp_bt_main.h"
+#include "esp_bt_device.h"
+#include "esp_gap_bt_api.h"
+#include "esp_gap_ble_api.h"
+#include "esp_gatts_api.h"
+#include "esp_gatt_common_api.h"
+#include "esp_spp_api.h"
+#include "bt_config.h"
+#include "sim.h"
+#include "sim_internal.h"
+
+#define MAX_PEERS 32
+#define GATTS_IF 3
+#define ATTR_HANDLE_BASE 40
+#define ATTR_TABLE_MAX 16
+#define SPP_HANDLE_BASE 0x81
+#define ATT_DEFAULT_MTU 23
+#define ATT_NOTIFY_OVERHEAD 3
+#define CCCD_UUID 0x2902
+
+typedef enum {
+    EVENT_SPP,
+    EVENT_GATTS,
+    EVENT_GAP,
+    EVENT_WRITE_DONE, // A write has left the link: complete it
+    EVENT_DELIVER,    // A write reaches its peer's sink
+    EVENT_SYNC
+} event_kind_t;
+
+typedef struct {
+    sim_alarm_t alarm; // First, so the service's alarm is the event
+    event_kind_t kind;
+    int event;            // Callback event; for a write, the attribute it notified
+    union {
+        esp_spp_cb_param_t spp;
+        esp_ble_gatts_cb_param_t gatts;
+        esp_ble_gap_cb_param_t gap;
+    } param;
+    uint32_t conn_handle; // Link events only
+    uint32_t generation;
+    uint16_t length;
+    uint8_t data[];       // Payload the parameters point at
+} event_t;
+
+typedef struct {
+    bool used;
+    bool ble;
+    uint32_t handle;
+    uint32_t generation;   // Tells a reused entry's events from the previous link's
+    esp_bd_addr_t address;
+    uint16_t mtu;
+    sim_link_config_t link;
+    uint64_t down_busy_us; // When the link finishes sending the firmware's writes
+    uint64_t up_busy_us;   // When it finishes sending the peer's data
+    uint32_t outstanding;  // Writes not yet completed
+    bool congested;
+} peer_t;
+
+static sim_alarm_service_t btc = SIM_ALARM_SERVICE_INITIALIZER("BTC");
+static pthread_mutex_t stack_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t synced = PTHREAD_COND_INITIALIZER;
+static uint64_t syncs_posted;
+static uint64_t syncs_done;
+
+static esp_bluedroid_status_t bluedroid_status = ESP_BLUEDROID_STATUS_UNINITIALIZED;
+static esp_spp_cb_t *spp_callback;
+static esp_gatts_cb_t gatts_callback;
+static esp_gap_ble_cb_t gap_callback;
+
+static uint16_t attr_handles[ATTR_TABLE_MAX];
+static uint16_t rx_attr_handle;  // Peers write data here
+static uint16_t ccc_attr_handle; // and subscribe here
+static uint16_t local_mtu = ATT_DEFAULT_MTU;
+
+static peer_t peers[MAX_PEERS];
+static uint32_t next_spp_handle = SPP_HANDLE_BASE;
+static uint32_t generations;
+static sim_link_config_t link_config = SIM_LINK_DEFAULT;
+static sim_peer_sink_t peer_sink;
+static void *peer_sink_context;
+static sim_stats_t stats;
+
+static void fire_event(sim_alarm_t *alarm);
+
+static event_t *new_event(event_kind_t kind, int event, const uint8_t *data, uint16_t length) {
+    event_t *ev = calloc(1, sizeof(*ev) + length);
+    if (ev == NULL) {
+        fprintf(stderr, "sim: out of memory for a stack event\n");
+        abort();
+    }
+    ev->alarm.fire = fire_event;
+    ev->kind = kind;
+    ev->event = event;
+    ev->length = length;
+    if (length) {
+        memcpy(ev->data, data, length);
+    }
+    return ev;
+}
+
+static void post_at(event_t *ev, uint64_t due_us) {
+    sim_alarm_arm(&btc, &ev->alarm, due_us);
+}
+
+static void post(event_t *ev) {
+    post_at(ev, sim_now_us());
+}
+
+static uint64_t transmit_us(const sim_link_config_t *link, uint16_t length) {
+    uint64_t bytes_us = link->rate_bytes_per_s ? (uint64_t)length * 1000000 / link->rate_bytes_per_s : 0;
+    return link->write_cost_us + bytes_us;
+}
+
+// Callers hold stack_lock
+static peer_t *find_peer(uint32_t conn_handle) {
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (peers[i].used && peers[i].handle == conn_handle) {
+            return &peers[i];
+        }
+    }
+    return NULL;
+}
+
+static peer_t *add_peer(uint32_t conn_handle, bool ble, const esp_bd_addr_t address) {
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (!peers[i].used) {
+            peer_t *peer = &peers[i];
+            memset(peer, 0, sizeof(*peer));
+            peer->used = true;
+            peer->ble = ble;
+            peer->handle = conn_handle;
+            peer->generation = ++generations;
+            memcpy(peer->address, address, sizeof(esp_bd_addr_t));
+            peer->mtu = ATT_DEFAULT_MTU;
+            peer->link = link_config;
+            return peer;
+        }
+    }
+    return NULL;
+}
+
+// Writes still outstanding on a closed link never complete
+static void remove_peer(peer_t *peer) {
+    stats.lost_at_close += peer->outstanding;
+    peer->used = false;
+}
+
+// Event thread
+
+static void complete_write(event_t *ev) {
+    pthread_mutex_lock(&stack_lock);
+    peer_t *peer = find_peer(ev->conn_handle);
+    if (peer == NULL || peer->generation != ev->generation) {
+        pthread_mutex_unlock(&stack_lock);
+        return;
+    }
+    bool ble = peer->ble;
+    bool became_congested = false;
+    bool cleared = false;
+    peer->outstanding--;
+    if (peer->link.queue_depth && !peer->congested && peer->outstanding >= peer->link.queue_depth) {
+        peer->congested = became_congested = true;
+        stats.congestions++;
+    } else if (peer->congested && peer->outstanding <= peer->link.queue_depth / 2) {
+        peer->congested = false;
+        cleared = true;
+    }
+    bool congested = peer->congested;
+    pthread_mutex_unlock(&stack_lock);
+
+    if (ble && gatts_callback) {
+        esp_ble_gatts_cb_param_t param = {.conf = {.status = ESP_GATT_OK,
+                                                   .conn_id = CONN_HANDLE_TO_BLE(ev->conn_handle),
+                                                   .handle = ev->event, .len = ev->length}};
+        gatts_callback(ESP_GATTS_CONF_EVT, GATTS_IF, &param);
+        if (became_congested || cleared) {
+            param.congest.conn_id = CONN_HANDLE_TO_BLE(ev->conn_handle);
+            param.congest.congested = congested;
+            gatts_callback(ESP_GATTS_CONGEST_EVT, GATTS_IF, &param);
+        }
+    } else if (!ble && spp_callback) {
+        esp_spp_cb_param_t param = {.write = {.status = ESP_SPP_SUCCESS, .handle = ev->conn_handle,
+                                              .len = ev->length, .cong = congested}};
+        spp_callback(ESP_SPP_WRITE_EVT, &param);
+        if (cleared) {
+            param.cong.status = ESP_SPP_SUCCESS;
+            param.cong.handle = ev->conn_handle;
+            param.cong.cong = false;
+            spp_callback(ESP_SPP_CONG_EVT, &param);
+        }
+    }
+}
+
+static void deliver(event_t *ev) {
+    pthread_mutex_lock(&stack_lock);
+    peer_t *peer = find_peer(ev->conn_handle);
+    bool open = peer != NULL && peer->generation == ev->generation;
+    if (open) {
+        stats.delivered++;
+        stats.delivered_bytes += ev->length;
+    }
+    sim_peer_sink_t sink = peer_sink;
+    void *context = peer_sink_context;
+    pthread_mutex_unlock(&stack_lock);
+
+    if (open && sink) {
+        sink(ev->conn_handle, ev->data, ev->length, context);
+    }
+}
+
+static void fire_event(sim_alarm_t *alarm) {
+    event_t *ev = (event_t *)alarm;
+
+    // Parameters that carry data point at the event's own copy
+    if (ev->kind == EVENT_SPP && ev->event == ESP_SPP_DATA_IND_EVT && ev->length) {
+        ev->param.spp.data_ind.data = ev->data;
+    } else if (ev->kind == EVENT_GATTS && ev->event == ESP_GATTS_WRITE_EVT && ev->length) {
+        ev->param.gatts.write.value = ev->data;
+    }
+
+    switch (ev->kind) {
+        case EVENT_SPP:
+            if (spp_callback) {
+                spp_callback(ev->event, &ev->param.spp);
+            }
+            break;
+        case EVENT_GATTS:
+            if (gatts_callback) {
+                gatts_callback(ev->event, GATTS_IF, &ev->param.gatts);
+            }
+            break;
+        case EVENT_GAP:
+            if (gap_callback) {
+                gap_callback(ev->event, &ev->param.gap);
+            }
+            break;
+        case EVENT_WRITE_DONE:
+            complete_write(ev);
+            break;
+        case EVENT_DELIVER:
+            deliver(ev);
+            break;
+        case EVENT_SYNC:
+            break;
+    }
+
+    pthread_mutex_lock(&stack_lock);
+    stats.events++;
+    if (ev->kind == EVENT_SYNC) {
+        syncs_done++;
+        pthread_cond_broadcast(&synced);
+    }
+    pthread_mutex_unlock(&stack_lock);
+    free(ev);
+}
+
+// Controller and Bluedroid
+
+esp_err_t esp_bt_controller_mem_release(esp_bt_mode_t mode) {
+    return ESP_OK;
+}
+
+esp_err_t esp_bt_controller_init(esp_bt_controller_config_t *config) {
+    return ESP_OK;
+}
+
+esp_err_t esp_bt_controller_enable(esp_bt_mode_t mode) {
+    return ESP_OK;
+}
+
+esp_err_t esp_bluedroid_init(void) {
+    bluedroid_status = ESP_BLUEDROID_STATUS_INITIALIZED;
+    return ESP_OK;
+}
+
+esp_err_t esp_bluedroid_enable(void) {
+    if (bluedroid_status != ESP_BLUEDROID_STATUS_INITIALIZED) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    bluedroid_status = ESP_BLUEDROID_STATUS_ENABLED;
+    return ESP_OK;
+}
+
+esp_bluedroid_status_t esp_bluedroid_get_status(void) {
+    return bluedroid_status;
+}
+
+esp_err_t esp_bt_dev_set_device_name(const char *name) {
+    return ESP_OK;
+}
+
+esp_err_t esp_bt_gap_set_scan_mode(esp_bt_connection_mode_t c_mode, esp_bt_discovery_mode_t d_mode) {
+    return ESP_OK;
+}
+
+// BLE GAP
+
+esp_err_t esp_ble_gap_register_callback(esp_gap_ble_cb_t callback) {
+    gap_callback = callback;
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_set_device_name(const char *name) {
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_config_adv_data(esp_ble_adv_data_t *adv_data) {
+    event_t *ev = new_event(EVENT_GAP, adv_data->set_scan_rsp ? ESP_GAP_BLE_SCAN_RSP_DATA_SET_COMPLETE_EVT
+                                                              : ESP_GAP_BLE_ADV_DATA_SET_COMPLETE_EVT, NULL, 0);
+    ev->param.gap.adv_data_cmpl.status = ESP_BT_STATUS_SUCCESS;
+    post(ev);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_start_advertising(esp_ble_adv_params_t *adv_params) {
+    event_t *ev = new_event(EVENT_GAP, ESP_GAP_BLE_ADV_START_COMPLETE_EVT, NULL, 0);
+    ev->param.gap.adv_start_cmpl.status = ESP_BT_STATUS_SUCCESS;
+    post(ev);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_stop_advertising(void) {
+    event_t *ev = new_event(EVENT_GAP, ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT, NULL, 0);
+    ev->param.gap.adv_stop_cmpl.status = ESP_BT_STATUS_SUCCESS;
+    post(ev);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_update_conn_params(esp_ble_conn_update_params_t *params) {
+    event_t *ev = new_event(EVENT_GAP, ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT, NULL, 0);
+    ev->param.gap.update_conn_params.status = ESP_BT_STATUS_SUCCESS;
+    memcpy(ev->param.gap.update_conn_params.bda, params->bda, sizeof(esp_bd_addr_t));
+    ev->param.gap.update_conn_params.min_int = params->min_int;
+    ev->param.gap.update_conn_params.max_int = params->max_int;
+    ev->param.gap.update_conn_params.latency = params->latency;
+    ev->param.gap.update_conn_params.conn_int = params->max_int;
+    ev->param.gap.update_conn_params.timeout = params->timeout;
+    post(ev);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_set_pkt_data_len(esp_bd_addr_t remote_device, uint16_t tx_data_length) {
+    event_t *ev = new_event(EVENT_GAP, ESP_GAP_BLE_SET_PKT_LENGTH_COMPLETE_EVT, NULL, 0);
+    ev->param.gap.pkt_data_length_cmpl.status = ESP_BT_STATUS_SUCCESS;
+    ev->param.gap.pkt_data_length_cmpl.params.rx_len = tx_data_length;
+    ev->param.gap.pkt_data_length_cmpl.params.tx_len = tx_data_length;
+    post(ev);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_set_preferred_phy(esp_bd_addr_t remote_bda, esp_ble_gap_all_phys_t all_phys_mask,
+                                        esp_ble_gap_phy_mask_t tx_phy_mask, esp_ble_gap_phy_mask_t rx_phy_mask,
+                                        esp_ble_gap_prefer_phy_options_t phy_options) {
+    return ESP_OK;
+}
+
+// GATT server
+
+esp_err_t esp_ble_gatt_set_local_mtu(uint16_t mtu) {
+    if (mtu < ATT_DEFAULT_MTU || mtu > ESP_GATT_MAX_MTU_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    local_mtu = mtu;
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_register_callback(esp_gatts_cb_t callback) {
+    gatts_callback = callback;
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_app_register(uint16_t app_id) {
+    event_t *ev = new_event(EVENT_GATTS, ESP_GATTS_REG_EVT, NULL, 0);
+    ev->param.gatts.reg.status = ESP_GATT_OK;
+    ev->param.gatts.reg.app_id = app_id;
+    post(ev);
+    return ESP_OK;
+}
+
+static uint16_t attr_uuid16(const esp_gatts_attr_db_t *attr) {
+    if (attr->att_desc.uuid_length != ESP_UUID_LEN_16) {
+        return 0;
+    }
+    return attr->att_desc.uuid_p[0] | (attr->att_desc.uuid_p[1] << 8);
+}
+
+// Handles are numbered from ATTR_HANDLE_BASE in table order. The one writable
+// 128-bit value is where peers send data; the CCCD is where they subscribe.
+esp_err_t esp_ble_gatts_create_attr_tab(const esp_gatts_attr_db_t *gatts_attr_db, esp_gatt_if_t gatts_if,
+                                        uint16_t max_nb_attr, uint8_t srvc_inst_id) {
+    if (max_nb_attr > ATTR_TABLE_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (uint16_t i = 0; i < max_nb_attr; i++) {
+        attr_handles[i] = ATTR_HANDLE_BASE + i;
+        if (gatts_attr_db[i].att_desc.uuid_length == ESP_UUID_LEN_128 && i > 0 &&
+            (gatts_attr_db[i].att_desc.perm & ESP_GATT_PERM_WRITE)) {
+            rx_attr_handle = attr_handles[i];
+        } else if (attr_uuid16(&gatts_attr_db[i]) == CCCD_UUID) {
+            ccc_attr_handle = attr_handles[i];
+        }
+    }
+    event_t *ev = new_event(EVENT_GATTS, ESP_GATTS_CREAT_ATTR_TAB_EVT, NULL, 0);
+    ev->param.gatts.add_attr_tab.status = ESP_GATT_OK;
+    ev->param.gatts.add_attr_tab.svc_inst_id = srvc_inst_id;
+    ev->param.gatts.add_attr_tab.num_handle = max_nb_attr;
+    ev->param.gatts.add_attr_tab.handles = attr_handles;
+    post(ev);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_start_service(uint16_t service_handle) {
+    event_t *ev = new_event(EVENT_GATTS, ESP_GATTS_START_EVT, NULL, 0);
+    ev->param.gatts.start.status = ESP_GATT_OK;
+    ev->param.gatts.start.service_handle = service_handle;
+    post(ev);
+    return ESP_OK;
+}
+
+// The firmware's writes, over either transport: serialised at the link rate,
+// completed once sent, delivered one latency later
+static esp_err_t link_write(uint32_t conn_handle, uint16_t attr_handle, const uint8_t *data, uint16_t length) {
+    pthread_mutex_lock(&stack_lock);
+    peer_t *peer = find_peer(conn_handle);
+    if (peer == NULL || (peer->ble && length > peer->mtu - ATT_NOTIFY_OVERHEAD)) {
+        stats.rejected++;
+        pthread_mutex_unlock(&stack_lock);
+        return peer == NULL ? ESP_FAIL : ESP_ERR_INVALID_SIZE;
+    }
+    uint64_t now = sim_now_us();
+    uint64_t start = peer->down_busy_us > now ? peer->down_busy_us : now;
+    peer->down_busy_us = start + transmit_us(&peer->link, length);
+    peer->outstanding++;
+    stats.writes++;
+    stats.write_bytes += length;
+
+    event_t *done = new_event(EVENT_WRITE_DONE, attr_handle, NULL, 0);
+    event_t *arrival = new_event(EVENT_DELIVER, 0, data, length);
+    done->conn_handle = arrival->conn_handle = conn_handle;
+    done->generation = arrival->generation = peer->generation;
+    done->length = length;
+    post_at(done, peer->down_busy_us);
+    post_at(arrival, peer->down_busy_us + peer->link.latency_us);
+    pthread_mutex_unlock(&stack_lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gatts_send_indicate(esp_gatt_if_t gatts_if, uint16_t conn_id, uint16_t attr_handle,
+                                      uint16_t value_len, uint8_t *value, bool need_confirm) {
+    return link_write(CONN_HANDLE_FROM_BLE(conn_id), attr_handle, value, value_len);
+}
+
+static void close_link(uint32_t conn_handle) {
+    pthread_mutex_lock(&stack_lock);
+    peer_t *peer = find_peer(conn_handle);
+    if (peer == NULL) {
+        pthread_mutex_unlock(&stack_lock);
+        return;
+    }
+    event_t *ev;
+    if (peer->ble) {
+        ev = new_event(EVENT_GATTS, ESP_GATTS_DISCONNECT_EVT, NULL, 0);
+        ev->param.gatts.disconnect.conn_id = CONN_HANDLE_TO_BLE(conn_handle);
+        memcpy(ev->param.gatts.disconnect.remote_bda, peer->address, sizeof(esp_bd_addr_t));
+        ev->param.gatts.disconnect.reason = 0x13; // Remote user terminated connection
+    } else {
+        ev = new_event(EVENT_SPP, ESP_SPP_CLOSE_EVT, NULL, 0);
+        ev->param.spp.close.status = ESP_SPP_SUCCESS;
+        ev->param.spp.close.handle = conn_handle;
+    }
+    remove_peer(peer);
+    post(ev);
+    pthread_mutex_unlock(&stack_lock);
+}
+
+esp_err_t esp_ble_gatts_close(esp_gatt_if_t gatts_if, uint16_t conn_id) {
+    close_link(CONN_HANDLE_FROM_BLE(conn_id));
+    return ESP_OK;
+}
+
+esp_err_t esp_ble_gap_disconnect(esp_bd_addr_t remote_device) {
+    uint32_t conn_handle = 0;
+    pthread_mutex_lock(&stack_lock);
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (peers[i].used && peers[i].ble && memcmp(peers[i].address, remote_device, sizeof(esp_bd_addr_t)) == 0) {
+            conn_handle = peers[i].handle;
+        }
+    }
+    pthread_mutex_unlock(&stack_lock);
+    if (conn_handle == 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    close_link(conn_handle);
+    return ESP_OK;
+}
+
+// SPP
+
+esp_err_t esp_spp_register_callback(esp_spp_cb_t *callback) {
+    spp_callback = callback;
+    return ESP_OK;
+}
+
+esp_err_t esp_spp_init(esp_spp_mode_t mode) {
+    event_t *ev = new_event(EVENT_SPP, ESP_SPP_INIT_EVT, NULL, 0);
+    ev->param.spp.init.status = ESP_SPP_SUCCESS;
+    post(ev);
+    ev = new_event(EVENT_SPP, ESP_SPP_START_EVT, NULL, 0);
+    ev->param.spp.start.status = ESP_SPP_SUCCESS;
+    post(ev);
+    return ESP_OK;
+}
+
+esp_err_t esp_spp_write(uint32_t handle, int len, uint8_t *p_data) {
+    if (len <= 0 || len > UINT16_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return link_write(handle, 0, p_data, len);
+}
+
+esp_err_t esp_spp_disconnect(uint32_t handle) {
+    close_link(handle);
+    return ESP_OK;
+}
+
+// Simulated peers
+
+void sim_set_link_config(const sim_link_config_t *config) {
+    pthread_mutex_lock(&stack_lock);
+    link_config = *config;
+    pthread_mutex_unlock(&stack_lock);
+}
+
+uint32_t sim_spp_connect(const esp_bd_addr_t address) {
+    if (spp_callback == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&stack_lock);
+    uint32_t conn_handle = next_spp_handle++;
+    peer_t *peer = add_peer(conn_handle, false, address);
+    if (peer == NULL) {
+        pthread_mutex_unlock(&stack_lock);
+        return 0;
+    }
+    event_t *ev = new_event(EVENT_SPP, ESP_SPP_SRV_OPEN_EVT, NULL, 0);
+    ev->param.spp.srv_open.status = ESP_SPP_SUCCESS;
+    ev->param.spp.srv_open.handle = conn_handle;
+    memcpy(ev->param.spp.srv_open.rem_bda, address, sizeof(esp_bd_addr_t));
+    post(ev);
+    pthread_mutex_unlock(&stack_lock);
+    return conn_handle;
+}
+
+uint32_t sim_ble_connect(const esp_bd_addr_t address, uint16_t mtu) {
+    if (gatts_callback == NULL || rx_attr_handle == 0 || ccc_attr_handle == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&stack_lock);
+    uint16_t conn_id = 0;
+    while (conn_id < MAX_PEERS && find_peer(CONN_HANDLE_FROM_BLE(conn_id)) != NULL) {
+        conn_id++;
+    }
+    uint32_t conn_handle = CONN_HANDLE_FROM_BLE(conn_id);
+    peer_t *peer = conn_id < MAX_PEERS ? add_peer(conn_handle, true, address) : NULL;
+    if (peer == NULL) {
+        pthread_mutex_unlock(&stack_lock);
+        return 0;
+    }
+    event_t *ev = new_event(EVENT_GATTS, ESP_GATTS_CONNECT_EVT, NULL, 0);
+    ev->param.gatts.connect.conn_id = conn_id;
+    ev->param.gatts.connect.link_role = 1;
+    memcpy(ev->param.gatts.connect.remote_bda, address, sizeof(esp_bd_addr_t));
+    post(ev);
+
+    if (mtu > ATT_DEFAULT_MTU) {
+        peer->mtu = mtu < local_mtu ? mtu : local_mtu;
+        ev = new_event(EVENT_GATTS, ESP_GATTS_MTU_EVT, NULL, 0);
+        ev->param.gatts.mtu.conn_id = conn_id;
+        ev->param.gatts.mtu.mtu = peer->mtu;
+        post(ev);
+    }
+
+    static const uint8_t notify_on[2] = {0x01, 0x00};
+    ev = new_event(EVENT_GATTS, ESP_GATTS_WRITE_EVT, notify_on, sizeof(notify_on));
+    ev->param.gatts.write.conn_id = conn_id;
+    memcpy(ev->param.gatts.write.bda, address, sizeof(esp_bd_addr_t));
+    ev->param.gatts.write.handle = ccc_attr_handle;
+    ev->param.gatts.write.len = sizeof(notify_on);
+    post(ev);
+    pthread_mutex_unlock(&stack_lock);
+    return conn_handle;
+}
+
+void sim_disconnect(uint32_t conn_handle) {
+    close_link(conn_handle);
+}
+
+// The peer's data is serialised at the link rate too, and arrives one
+// latency after it is sent
+esp_err_t sim_peer_send(uint32_t conn_handle, const uint8_t *data, uint16_t length) {
+    pthread_mutex_lock(&stack_lock);
+    peer_t *peer = find_peer(conn_handle);
+    if (peer == NULL) {
+        pthread_mutex_unlock(&stack_lock);
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (length == 0 || (peer->ble && length > peer->mtu - ATT_NOTIFY_OVERHEAD)) {
+        pthread_mutex_unlock(&stack_lock);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    uint64_t now = sim_now_us();
+    uint64_t start = peer->up_busy_us > now ? peer->up_busy_us : now;
+    peer->up_busy_us = start + transmit_us(&peer->link, length);
+
+    event_t *ev;
+    if (peer->ble) {
+        ev = new_event(EVENT_GATTS, ESP_GATTS_WRITE_EVT, data, length);
+        ev->param.gatts.write.conn_id = CONN_HANDLE_TO_BLE(conn_handle);
+        memcpy(ev->param.gatts.write.bda, peer->address, sizeof(esp_bd_addr_t));
+        ev->param.gatts.write.handle = rx_attr_handle;
+        ev->param.gatts.write.len = length;
+    } else {
+        ev = new_event(EVENT_SPP, ESP_SPP_DATA_IND_EVT, data, length);
+        ev->param.spp.data_ind.status = ESP_SPP_SUCCESS;
+        ev->param.spp.data_ind.handle = conn_handle;
+        ev->param.spp.data_ind.len = length;
+    }
+    post_at(ev, peer->up_busy_us + peer->link.latency_us);
+    pthread_mutex_unlock(&stack_lock);
+    return ESP_OK;
+}
+
+void sim_set_peer_sink(sim_peer_sink_t sink, void *context) {
+    pthread_mutex_lock(&stack_lock);
+    peer_sink = sink;
+    peer_sink_context = context;
+    pthread_mutex_unlock(&stack_lock);
+}
+
+void sim_inject_spp_event(esp_spp_cb_event_t event, const esp_spp_cb_param_t *param) {
+    event_t *ev = new_event(EVENT_SPP, event, NULL, 0);
+    ev->param.spp = *param;
+    post(ev);
+}
+
+void sim_inject_gatts_event(esp_gatts_cb_event_t event, const esp_ble_gatts_cb_param_t *param) {
+    event_t *ev = new_event(EVENT_GATTS, event, NULL, 0);
+    ev->param.gatts = *param;
+    post(ev);
+}
+
+// Syncs are posted under the lock, so they fire in the order they were
+// counted and ours is done once that many have fired
+void sim_sync(void) {
+    pthread_mutex_lock(&stack_lock);
+    uint64_t target = ++syncs_posted;
+    post(new_event(EVENT_SYNC, 0, NULL, 0));
+    while (syncs_done < target) {
+        pthread_cond_wait(&synced, &stack_lock);
+    }
+    pthread_mutex_unlock(&stack_lock);
+}
+
+void sim_get_stats(sim_stats_t *stats_out) {
+    pthread_mutex_lock(&stack_lock);
+    *stats_out = stats;
+    pthread_mutex_unlock(&stack_lock);
+}
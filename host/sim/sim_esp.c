@@ -0,0 +1,135 @@
+/*
+ * Host Simulation: ESP-IDF System Services
+ *
+ * Logging to stderr, error names, and esp_timer: the microsecond clock, and
+ * one-shot and periodic timers whose callbacks run on one service thread, as
+ * on the esp_timer task.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "sim_internal.h"
+
+// Logging
+
+static int log_level = -1;
+
+void esp_log_level_set(const char *tag, esp_log_level_t level) {
+    log_level = level;
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...) {
+    if (log_level < 0) {
+        const char *setting = getenv("SIM_LOG");
+        log_level = setting ? atoi(setting) : ESP_LOG_WARN;
+    }
+    if ((int)level > log_level) {
+        return;
+    }
+    static const char letters[] = "NEWIDV";
+    va_list args;
+    va_start(args, format);
+    flockfile(stderr);
+    fprintf(stderr, "%c (%llu) %s: ", letters[level], (unsigned long long)(sim_now_us() / 1000), tag);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    funlockfile(stderr);
+    va_end(args);
+}
+
+const char *esp_err_to_name(esp_err_t code) {
+    switch (code) {
+        case ESP_OK: return "ESP_OK";
+        case ESP_FAIL: return "ESP_FAIL";
+        case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+        case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+        case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+        case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+        case ESP_ERR_INVALID_RESPONSE: return "ESP_ERR_INVALID_RESPONSE";
+        case ESP_ERR_INVALID_CRC: return "ESP_ERR_INVALID_CRC";
+        case ESP_ERR_INVALID_VERSION: return "ESP_ERR_INVALID_VERSION";
+        default: return "UNKNOWN ERROR";
+    }
+}
+
+// esp_timer
+
+struct esp_timer {
+    sim_alarm_t alarm; // First, so the service's alarm is the timer
+    esp_timer_cb_t callback;
+    void *arg;
+    uint64_t period_us; // 0 for one-shot
+};
+
+static sim_alarm_service_t timer_service = SIM_ALARM_SERVICE_INITIALIZER("esp_timer");
+
+static void fire_timer(sim_alarm_t *alarm) {
+    struct esp_timer *timer = (struct esp_timer *)alarm;
+    if (timer->period_us) {
+        sim_alarm_arm(&timer_service, alarm, alarm->due_us + timer->period_us);
+    }
+    timer->callback(timer->arg);
+}
+
+int64_t esp_timer_get_time(void) {
+    return (int64_t)sim_now_us();
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args, esp_timer_handle_t *out_handle) {
+    if (create_args == NULL || create_args->callback == NULL || out_handle == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    struct esp_timer *timer = calloc(1, sizeof(*timer));
+    if (timer == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    timer->alarm.fire = fire_timer;
+    timer->callback = create_args->callback;
+    timer->arg = create_args->arg;
+    *out_handle = timer;
+    return ESP_OK;
+}
+
+// As in ESP-IDF, starting a running timer fails rather than restarting it
+static esp_err_t start(esp_timer_handle_t timer, uint64_t timeout_us, uint64_t period_us) {
+    if (esp_timer_is_active(timer)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    timer->period_us = period_us;
+    sim_alarm_arm(&timer_service, &timer->alarm, sim_now_us() + timeout_us);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+    return start(timer, timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period_us) {
+    return start(timer, period_us, period_us);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+    return sim_alarm_disarm(&timer_service, &timer->alarm) ? ESP_OK : ESP_ERR_INVALID_STATE;
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer) {
+    if (esp_timer_is_active(timer)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    free(timer);
+    return ESP_OK;
+}
+
+bool esp_timer_is_active(esp_timer_handle_t timer) {
+    pthread_mutex_lock(&timer_service.lock);
+    bool armed = timer->alarm.armed;
+    pthread_mutex_unlock(&timer_service.lock);
+    return armed;
+}
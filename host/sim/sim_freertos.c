@@ -0,0 +1,459 @@
+/*
+ * Host Simulation: FreeRTOS
+ *
+ * Tasks run as detached pthreads; queues, semaphores and task notifications
+ * are a mutex and a condition variable each, with timed waits against the
+ * monotonic clock. Software timers fire on one service thread, standing in
+ * for the FreeRTOS timer task. This is enough to run the data path's tasks
+ * with real concurrency on a development machine: it does not model
+ * priorities, so results measure the code, not the ESP32's scheduler.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
+#include "sim_internal.h"
+
+static uint64_t start_us;
+
+static uint64_t monotonic_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+__attribute__((constructor)) static void start_clock(void) {
+    start_us = monotonic_us();
+}
+
+uint64_t sim_now_us(void) {
+    return monotonic_us() - start_us;
+}
+
+void sim_cond_init(pthread_cond_t *cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+bool sim_cond_wait_until(pthread_cond_t *cond, pthread_mutex_t *lock, uint64_t deadline_us) {
+    uint64_t absolute = start_us + deadline_us;
+    struct timespec until = {.tv_sec = absolute / 1000000, .tv_nsec = (absolute % 1000000) * 1000};
+    return pthread_cond_timedwait(cond, lock, &until) == 0;
+}
+
+static uint64_t deadline_after(TickType_t ticks) {
+    return sim_now_us() + (uint64_t)ticks * portTICK_PERIOD_MS * 1000;
+}
+
+// One wait for a condition the caller re-checks. portMAX_DELAY waits forever;
+// false once the deadline has passed.
+static bool wait(pthread_cond_t *cond, pthread_mutex_t *lock, TickType_t ticks, uint64_t deadline_us) {
+    if (ticks == portMAX_DELAY) {
+        pthread_cond_wait(cond, lock);
+        return true;
+    }
+    if (sim_now_us() >= deadline_us) {
+        return false;
+    }
+    sim_cond_wait_until(cond, lock, deadline_us);
+    return true;
+}
+
+// Alarm services
+
+static void *alarm_service_task(void *parameter) {
+    sim_alarm_service_t *service = parameter;
+
+    pthread_mutex_lock(&service->lock);
+    while (true) {
+        sim_alarm_t *alarm = service->armed;
+        if (alarm == NULL) {
+            pthread_cond_wait(&service->changed, &service->lock);
+            continue;
+        }
+        if (alarm->due_us > sim_now_us()) {
+            sim_cond_wait_until(&service->changed, &service->lock, alarm->due_us);
+            continue;
+        }
+        service->armed = alarm->next;
+        alarm->armed = false;
+        pthread_mutex_unlock(&service->lock);
+        alarm->fire(alarm);
+        pthread_mutex_lock(&service->lock);
+    }
+    return NULL;
+}
+
+static void unlink_alarm(sim_alarm_service_t *service, sim_alarm_t *alarm) {
+    for (sim_alarm_t **link = &service->armed; *link != NULL; link = &(*link)->next) {
+        if (*link == alarm) {
+            *link = alarm->next;
+            break;
+        }
+    }
+    alarm->armed = false;
+}
+
+void sim_alarm_arm(sim_alarm_service_t *service, sim_alarm_t *alarm, uint64_t due_us) {
+    pthread_mutex_lock(&service->lock);
+    if (!service->started) {
+        sim_cond_init(&service->changed);
+        if (pthread_create(&service->thread, NULL, alarm_service_task, service) != 0) {
+            fprintf(stderr, "sim: cannot start %s\n", service->name);
+            abort();
+        }
+        pthread_detach(service->thread);
+        service->started = true;
+    }
+    if (alarm->armed) {
+        unlink_alarm(service, alarm);
+    }
+    sim_alarm_t **link = &service->armed;
+    while (*link != NULL && (*link)->due_us <= due_us) {
+        link = &(*link)->next;
+    }
+    alarm->due_us = due_us;
+    alarm->next = *link;
+    alarm->armed = true;
+    *link = alarm;
+    pthread_cond_signal(&service->changed);
+    pthread_mutex_unlock(&service->lock);
+}
+
+bool sim_alarm_disarm(sim_alarm_service_t *service, sim_alarm_t *alarm) {
+    pthread_mutex_lock(&service->lock);
+    bool was_armed = alarm->armed;
+    if (was_armed) {
+        unlink_alarm(service, alarm);
+    }
+    pthread_mutex_unlock(&service->lock);
+    return was_armed;
+}
+
+// Critical sections
+
+void sim_mux_init(portMUX_TYPE *mux) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&mux->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+// Tasks
+
+static __thread struct sim_task *current_task;
+
+static void init_task(struct sim_task *task, TaskFunction_t function, const char *name, void *parameter) {
+    memset(task, 0, sizeof(*task));
+    task->function = function;
+    task->parameter = parameter;
+    snprintf(task->name, sizeof(task->name), "%s", name ? name : "");
+    pthread_mutex_init(&task->lock, NULL);
+    sim_cond_init(&task->notified);
+}
+
+static void *task_entry(void *parameter) {
+    current_task = parameter;
+    pthread_setname_np(pthread_self(), current_task->name);
+    current_task->function(current_task->parameter);
+    return NULL;
+}
+
+static bool start_task(struct sim_task *task) {
+    if (pthread_create(&task->thread, NULL, task_entry, task) != 0) {
+        return false;
+    }
+    pthread_detach(task->thread);
+    return true;
+}
+
+TaskHandle_t xTaskCreateStatic(TaskFunction_t function, const char *name, uint32_t stack_depth, void *parameter,
+                               UBaseType_t priority, StackType_t *stack, StaticTask_t *task_buffer) {
+    init_task(task_buffer, function, name, parameter);
+    return start_task(task_buffer) ? task_buffer : NULL;
+}
+
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t function, const char *name, uint32_t stack_depth,
+                                           void *parameter, UBaseType_t priority, StackType_t *stack,
+                                           StaticTask_t *task_buffer, BaseType_t core_id) {
+    return xTaskCreateStatic(function, name, stack_depth, parameter, priority, stack, task_buffer);
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name, uint32_t stack_depth, void *parameter,
+                       UBaseType_t priority, TaskHandle_t *created) {
+    struct sim_task *task = malloc(sizeof(*task));
+    if (task == NULL) {
+        return pdFAIL;
+    }
+    init_task(task, function, name, parameter);
+    if (!start_task(task)) {
+        free(task);
+        return pdFAIL;
+    }
+    if (created) {
+        *created = task;
+    }
+    return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stack_depth, void *parameter,
+                                   UBaseType_t priority, TaskHandle_t *created, BaseType_t core_id) {
+    return xTaskCreate(function, name, stack_depth, parameter, priority, created);
+}
+
+// Only a task deleting itself is supported; the task's memory is not freed,
+// as handles to it may outlive it
+void vTaskDelete(TaskHandle_t task) {
+    if (task == NULL || task == current_task) {
+        pthread_exit(NULL);
+    }
+    fprintf(stderr, "sim: vTaskDelete of another task is not supported\n");
+    abort();
+}
+
+void vTaskDelay(TickType_t ticks) {
+    uint64_t us = (uint64_t)ticks * portTICK_PERIOD_MS * 1000;
+    struct timespec delay = {.tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000};
+    while (nanosleep(&delay, &delay) != 0) {
+    }
+}
+
+TickType_t xTaskGetTickCount(void) {
+    return (TickType_t)(sim_now_us() / (portTICK_PERIOD_MS * 1000));
+}
+
+// Threads the simulation did not start (the test's main thread) get a task
+// of their own on first use, so they can wait for notifications
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    if (current_task == NULL) {
+        current_task = malloc(sizeof(*current_task));
+        init_task(current_task, NULL, "main", NULL);
+        current_task->thread = pthread_self();
+    }
+    return current_task;
+}
+
+BaseType_t xPortGetCoreID(void) {
+    return 0;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+    pthread_mutex_lock(&task->lock);
+    task->notify_value++;
+    pthread_cond_signal(&task->notified);
+    pthread_mutex_unlock(&task->lock);
+    return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *higher_priority_woken) {
+    xTaskNotifyGive(task);
+    if (higher_priority_woken) {
+        *higher_priority_woken = pdFALSE;
+    }
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait) {
+    struct sim_task *task = xTaskGetCurrentTaskHandle();
+    uint64_t deadline_us = deadline_after(ticks_to_wait);
+
+    pthread_mutex_lock(&task->lock);
+    while (task->notify_value == 0 && wait(&task->notified, &task->lock, ticks_to_wait, deadline_us)) {
+    }
+    uint32_t value = task->notify_value;
+    if (value > 0) {
+        task->notify_value = clear_on_exit ? 0 : value - 1;
+    }
+    pthread_mutex_unlock(&task->lock);
+    return value;
+}
+
+// Queues and semaphores
+
+static void init_queue(struct sim_queue *queue, UBaseType_t length, UBaseType_t item_size, uint8_t *storage) {
+    memset(queue, 0, sizeof(*queue));
+    pthread_mutex_init(&queue->lock, NULL);
+    sim_cond_init(&queue->changed);
+    queue->storage = storage;
+    queue->item_size = item_size;
+    queue->length = length;
+}
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t length, UBaseType_t item_size, uint8_t *storage,
+                                 StaticQueue_t *queue_buffer) {
+    init_queue(queue_buffer, length, item_size, storage);
+    return queue_buffer;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    struct sim_queue *queue = malloc(sizeof(*queue));
+    uint8_t *storage = item_size ? malloc((size_t)length * item_size) : NULL;
+    if (queue == NULL || (item_size && storage == NULL)) {
+        free(queue);
+        free(storage);
+        return NULL;
+    }
+    init_queue(queue, length, item_size, storage);
+    return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+    pthread_cond_destroy(&queue->changed);
+    pthread_mutex_destroy(&queue->lock);
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait) {
+    uint64_t deadline_us = deadline_after(ticks_to_wait);
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->length && wait(&queue->changed, &queue->lock, ticks_to_wait, deadline_us)) {
+    }
+    if (queue->count == queue->length) {
+        pthread_mutex_unlock(&queue->lock);
+        return errQUEUE_FULL;
+    }
+    if (queue->item_size) {
+        UBaseType_t slot = (queue->head + queue->count) % queue->length;
+        memcpy(&queue->storage[slot * queue->item_size], item, queue->item_size);
+    }
+    queue->count++;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks_to_wait) {
+    uint64_t deadline_us = deadline_after(ticks_to_wait);
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && wait(&queue->changed, &queue->lock, ticks_to_wait, deadline_us)) {
+    }
+    if (queue->count == 0) {
+        pthread_mutex_unlock(&queue->lock);
+        return errQUEUE_EMPTY;
+    }
+    if (queue->item_size) {
+        memcpy(item, &queue->storage[queue->head * queue->item_size], queue->item_size);
+    }
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    pthread_cond_broadcast(&queue->changed);
+    pthread_mutex_unlock(&queue->lock);
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+    pthread_mutex_lock(&queue->lock);
+    UBaseType_t count = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue) {
+    pthread_mutex_lock(&queue->lock);
+    UBaseType_t spaces = queue->length - queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return spaces;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *buffer) {
+    init_queue(buffer, 1, 0, NULL);
+    buffer->count = 1;
+    return buffer;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    SemaphoreHandle_t mutex = xQueueCreate(1, 0);
+    if (mutex) {
+        mutex->count = 1;
+    }
+    return mutex;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *buffer) {
+    init_queue(buffer, 1, 0, NULL);
+    return buffer;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) {
+    return xQueueCreate(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count) {
+    SemaphoreHandle_t semaphore = xQueueCreate(max_count, 0);
+    if (semaphore) {
+        semaphore->count = initial_count;
+    }
+    return semaphore;
+}
+
+// Software timers
+
+static sim_alarm_service_t timer_service = SIM_ALARM_SERVICE_INITIALIZER("Tmr Svc");
+
+// Auto-reload timers are re-armed before the callback runs, from their due
+// time, so a slow callback does not make the period drift
+static void fire_timer(sim_alarm_t *alarm) {
+    struct sim_timer *timer = (struct sim_timer *)alarm;
+    if (timer->auto_reload) {
+        sim_alarm_arm(&timer_service, alarm, alarm->due_us + (uint64_t)timer->period * portTICK_PERIOD_MS * 1000);
+    }
+    timer->callback(timer);
+}
+
+TimerHandle_t xTimerCreateStatic(const char *name, TickType_t period, UBaseType_t auto_reload, void *id,
+                                 TimerCallbackFunction_t callback, StaticTimer_t *timer_buffer) {
+    memset(timer_buffer, 0, sizeof(*timer_buffer));
+    timer_buffer->alarm.fire = fire_timer;
+    timer_buffer->name = name;
+    timer_buffer->period = period;
+    timer_buffer->auto_reload = auto_reload;
+    timer_buffer->id = id;
+    timer_buffer->callback = callback;
+    return timer_buffer;
+}
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period, UBaseType_t auto_reload, void *id,
+                           TimerCallbackFunction_t callback) {
+    StaticTimer_t *timer = malloc(sizeof(*timer));
+    return timer ? xTimerCreateStatic(name, period, auto_reload, id, callback, timer) : NULL;
+}
+
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t ticks_to_wait) {
+    sim_alarm_arm(&timer_service, &timer->alarm, deadline_after(timer->period));
+    return pdPASS;
+}
+
+BaseType_t xTimerReset(TimerHandle_t timer, TickType_t ticks_to_wait) {
+    return xTimerStart(timer, ticks_to_wait);
+}
+
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t ticks_to_wait) {
+    sim_alarm_disarm(&timer_service, &timer->alarm);
+    return pdPASS;
+}
+
+BaseType_t xTimerChangePeriod(TimerHandle_t timer, TickType_t period, TickType_t ticks_to_wait) {
+    timer->period = period;
+    return xTimerStart(timer, ticks_to_wait);
+}
+
+BaseType_t xTimerIsTimerActive(TimerHandle_t timer) {
+    pthread_mutex_lock(&timer_service.lock);
+    bool armed = timer->alarm.armed;
+    pthread_mutex_unlock(&timer_service.lock);
+    return armed;
+}
+
+void *pvTimerGetTimerID(TimerHandle_t timer) {
+    return timer->id;
+}
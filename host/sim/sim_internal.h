@@ -0,0 +1,35 @@
+#ifndef SIM_INTERNAL_H
+#define SIM_INTERNAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "freertos/FreeRTOS.h"
+
+// A thread that fires alarms in deadline order, one at a time. Alarms due at
+// the same time fire in the order they were armed. The thread starts with the
+// first alarm armed.
+typedef struct {
+    const char *name;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    sim_alarm_t *armed; // Sorted by due_us
+    pthread_t thread;
+    bool started;
+} sim_alarm_service_t;
+
+#define SIM_ALARM_SERVICE_INITIALIZER(service_name) \
+    { .name = (service_name), .lock = PTHREAD_MUTEX_INITIALIZER, .armed = NULL, .started = false }
+
+// Microseconds of the monotonic clock since the simulation started
+uint64_t sim_now_us(void);
+
+// Condition variables timed against the monotonic clock; false on timeout
+void sim_cond_init(pthread_cond_t *cond);
+bool sim_cond_wait_until(pthread_cond_t *cond, pthread_mutex_t *lock, uint64_t deadline_us);
+
+// Arming an armed alarm moves it; disarm returns whether it was armed
+void sim_alarm_arm(sim_alarm_service_t *service, sim_alarm_t *alarm, uint64_t due_us);
+bool sim_alarm_disarm(sim_alarm_service_t *service, sim_alarm_t *alarm);
+
+#endif // SIM_INTERNAL_H
@@ -0,0 +1,75 @@
+/*
+ * Handle Index Test
+ *
+ * bt_index against a plain array of what each handle should map to, through
+ * random connects and disconnects of handles that all share one hash
+ * position, so every chain runs through tombstones. A handle is sometimes
+ * inserted again while still indexed, as open_slot may do for a replayed or
+ * quickly reused handle; it must end up indexed once, so that one remove
+ * clears it.
+ *
+ * The source is included to reach index_hash, which picks the colliding
+ * handles.
+ *
+ *     test_handle_index [operations]
+ */
+
+#include <stdio.h>
+#include "../../main/bt_handle_index.c"
+#include "../bench/bench.h"
+
+#define HANDLES 6 // Colliding handles in play, within the table's quarter
+
+static uint32_t handles[HANDLES];
+static uint32_t expected[HANDLES]; // Slot, MAX_CONNECTIONS when not indexed
+static uint32_t random_state = 1;
+
+static uint32_t next_random(uint32_t range) {
+    random_state = random_state * 1103515245 + 12345;
+    return (random_state >> 16) % range;
+}
+
+static int count_keys(uint32_t handle) {
+    int count = 0;
+    for (int i = 0; i < BT_HANDLE_INDEX_SIZE; i++) {
+        count += atomic_load(&index_keys[i]) == handle;
+    }
+    return count;
+}
+
+int main(int argc, char **argv) {
+    uint32_t operations = bench_iterations(argc, argv, 100000);
+
+    uint32_t target = index_hash(0x81);
+    for (uint32_t handle = 0x81, found = 0; found < HANDLES; handle++) {
+        if (index_hash(handle) == target) {
+            handles[found] = handle;
+            expected[found++] = MAX_CONNECTIONS;
+        }
+    }
+
+    bt_index_init();
+    for (uint32_t op = 0; op < operations; op++) {
+        int h = next_random(HANDLES);
+        if (next_random(3) == 0) {
+            bt_index_remove(handles[h]);
+            expected[h] = MAX_CONNECTIONS;
+        } else {
+            expected[h] = next_random(MAX_CONNECTIONS);
+            bt_index_insert(handles[h], expected[h]);
+        }
+
+        for (int i = 0; i < HANDLES; i++) {
+            uint32_t slot = bt_index_lookup(handles[i]);
+            int keys = count_keys(handles[i]);
+            if (slot != expected[i] || keys != (expected[i] < MAX_CONNECTIONS)) {
+                fprintf(stderr, "FAIL: after %lu operations handle 0x%lx maps to %lu (expected %lu), indexed %d times\n",
+                        (unsigned long)(op + 1), (unsigned long)handles[i], (unsigned long)slot,
+                        (unsigned long)expected[i], keys);
+                return 1;
+            }
+        }
+    }
+    printf("%lu operations on %d colliding handles, index consistent\n", (unsigned long)operations, HANDLES);
+    return 0;
+}
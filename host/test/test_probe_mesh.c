@@ -0,0 +1,185 @@
+/*
+ * Mesh Probe Simulation Test
+ *
+ * Drives bt_probe.c over a simulated mesh, as bluetooth_mesh.c drives it over
+ * the real one: six nodes in a line, 0x0001 to 0x0006, where each node only
+ * hears its neighbours. Every hop loses 10% of messages and takes 10-30 ms.
+ * A relay passes on a message with its TTL reduced by one, and the addressed
+ * node answers a ping with bt_probe_answer(). Node 0x0001 probes its
+ * neighbour and the far end of the line.
+ *
+ * After the simulated run, each target must show:
+ *
+ * - delivery within 5 points of 0.9 raised to the hops of the round trip
+ * - every echo's relay count, out and back, equal to the hops minus one
+ * - an RTT median in the bucket that the per-hop delays predict
+ *
+ *     test_probe_mesh [simulated seconds]
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "bt_probe.h"
+#include "bt_stats.h"
+#include "../bench/bench.h"
+
+#define NODES 6
+#define HOP_LOSS_PERCENT 10
+#define HOP_DELAY_MIN_MS 10
+#define HOP_DELAY_MAX_MS 30
+#define PROBE_TTL 7
+#define PROBE_INTERVAL_MS 250
+#define FRAMES_MAX 256
+
+// A message on its way to one node
+typedef struct {
+    bool used;
+    uint32_t at_ms;
+    int node;      // Receiving node
+    int source;    // Originating node
+    int dst;       // Addressed node
+    bool echo;
+    uint8_t ttl;   // As received
+    uint8_t params[BT_PROBE_PING_SIZE + BT_PROBE_PADDING_MAX];
+    uint16_t length;
+} frame_t;
+
+static frame_t frames[FRAMES_MAX];
+static bt_probe_t probe;
+static uint32_t now;
+static uint32_t random_state = 1;
+static int failures;
+
+static uint32_t next_random(uint32_t range) {
+    random_state = random_state * 1103515245 + 12345;
+    return (random_state >> 16) % range;
+}
+
+static uint16_t address_of(int node) {
+    return node + 1;
+}
+
+// One hop from the sender towards dst, unless it is lost on the way
+static bool transmit(int from, int source, int dst, bool echo, uint8_t ttl, const uint8_t *params, uint16_t length) {
+    if (next_random(100) < HOP_LOSS_PERCENT) {
+        return true;
+    }
+    for (int i = 0; i < FRAMES_MAX; i++) {
+        frame_t *frame = &frames[i];
+        if (frame->used) {
+            continue;
+        }
+        frame->used = true;
+        frame->at_ms = now + HOP_DELAY_MIN_MS + next_random(HOP_DELAY_MAX_MS - HOP_DELAY_MIN_MS + 1);
+        frame->node = dst > from ? from + 1 : from - 1;
+        frame->source = source;
+        frame->dst = dst;
+        frame->echo = echo;
+        frame->ttl = ttl;
+        memcpy(frame->params, params, length);
+        frame->length = length;
+        return true;
+    }
+    return false;
+}
+
+// bt_probe sink on node 0x0001
+static bool probe_send(void *context, uint16_t dst, uint8_t ttl, const uint8_t *params, uint16_t length) {
+    return transmit(0, 0, dst - 1, false, ttl, params, length);
+}
+
+static void receive(const frame_t *frame) {
+    if (frame->node != frame->dst) {
+        if (frame->ttl >= 2) {
+            transmit(frame->node, frame->source, frame->dst, frame->echo, frame->ttl - 1, frame->params,
+                     frame->length);
+        }
+        return;
+    }
+    if (frame->echo) {
+        bt_probe_echo_input(&probe, frame->params, frame->length, frame->ttl, now);
+        return;
+    }
+    uint8_t echo[BT_PROBE_ECHO_SIZE];
+    uint8_t ttl;
+    uint16_t length = bt_probe_answer(frame->params, frame->length, frame->ttl, echo, &ttl);
+    if (length > 0) {
+        transmit(frame->node, frame->node, frame->source, true, ttl, echo, length);
+    }
+}
+
+static frame_t *next_frame(void) {
+    frame_t *next = NULL;
+    for (int i = 0; i < FRAMES_MAX; i++) {
+        if (frames[i].used && (!next || frames[i].at_ms < next->at_ms)) {
+            next = &frames[i];
+        }
+    }
+    return next;
+}
+
+static void check(bool ok, int node, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "FAIL: target 0x%04x: %s\n", address_of(node), what);
+        failures++;
+    }
+}
+
+static void check_target(int node) {
+    const bt_probe_stats_t *stats = bt_probe_stats(&probe, address_of(node));
+    int hops = node;
+    double expected = pow(1 - HOP_LOSS_PERCENT / 100.0, 2 * hops);
+    double delivery = bt_probe_delivery_permille(stats) / 1000.0;
+
+    // A round trip takes between 2 * hops * min and 2 * hops * max delay, so
+    // its median falls in the log2 bucket of the middle of that range
+    uint32_t middle_ms = 2 * hops * (HOP_DELAY_MIN_MS + HOP_DELAY_MAX_MS) / 2;
+    uint32_t bucket_ms[LATENCY_HIST_BUCKETS] = {0};
+    bt_latency_record(bucket_ms, middle_ms);
+    uint32_t p50 = bt_latency_percentile(stats->rtt_hist, 50);
+
+    printf("0x%04x, %d hop(s): sent %lu, answered %lu, lost %lu, delivery %.1f%% (expected %.1f%%), "
+           "RTT min %lu p50<=%lu max %lu ms\n",
+           address_of(node), hops, (unsigned long)stats->sent, (unsigned long)stats->answered,
+           (unsigned long)stats->lost, delivery * 100, expected * 100, (unsigned long)stats->rtt_min_ms,
+           (unsigned long)p50, (unsigned long)stats->rtt_max_ms);
+
+    check(stats->answered + stats->lost > 100, node, "too few pings settled");
+    check(fabs(delivery - expected) <= 0.05, node, "delivery ratio off the loss model");
+    check(stats->hops_out[hops - 1] == stats->echoes && stats->hops_back[hops - 1] == stats->echoes, node,
+          "relay counts do not match the line");
+    check(bt_latency_percentile(bucket_ms, 50) == p50, node, "RTT median outside the predicted bucket");
+    check(stats->rtt_min_ms >= 2 * hops * HOP_DELAY_MIN_MS && stats->rtt_max_ms <= 2 * hops * HOP_DELAY_MAX_MS,
+          node, "RTT outside the per-hop delays");
+}
+
+int main(int argc, char **argv) {
+    uint32_t end_ms = bench_iterations(argc, argv, 300) * 1000;
+    static const int targets[] = {1, NODES - 1};
+
+    bt_probe_init(&probe, probe_send, NULL);
+    for (size_t i = 0; i < sizeof(targets) / sizeof(targets[0]); i++) {
+        bt_probe_add(&probe, address_of(targets[i]), PROBE_INTERVAL_MS, PROBE_TTL, 0, 0);
+    }
+
+    uint32_t tick_ms = 0;
+    while (now < end_ms) {
+        frame_t *frame = next_frame();
+        if (frame && frame->at_ms < tick_ms) {
+            now = frame->at_ms;
+            frame_t arrived = *frame;
+            frame->used = false;
+            receive(&arrived);
+        } else {
+            now = tick_ms;
+            uint32_t delay = bt_probe_tick(&probe, now);
+            tick_ms = now + (delay ? delay : 1);
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(targets) / sizeof(targets[0]); i++) {
+        check_target(targets[i]);
+    }
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,157 @@
+/*
+ * SPSC Ring Stress Test
+ *
+ * One producer thread and one consumer thread on a bt_ring_t, as the
+ * Bluetooth callback and the message task use each connection's rings:
+ *
+ * - lossless: the producer retries while the ring is full; every message
+ *   must arrive once, in order, intact
+ * - drop-oldest: the producer evicts the oldest entry when the ring is full,
+ *   racing the consumer's pops for it; every message must be either popped
+ *   or evicted, exactly once, and pops must stay in order
+ *
+ * The lossless run's throughput is printed next to a FreeRTOS queue (a mutex
+ * and condition variable on the host) carrying the same descriptors.
+ *
+ *     test_ring_stress [messages]
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "bt_ring.h"
+#include "../bench/bench.h"
+
+typedef enum {
+    MODE_LOSSLESS,
+    MODE_DROP_OLDEST,
+    MODE_QUEUE
+} stress_mode_t;
+
+static stress_mode_t mode;
+static uint32_t total;
+static bt_ring_t ring;
+static QueueHandle_t queue;
+static uint8_t *seen;          // Per message: popped or evicted
+static uint32_t evicted;       // Producer only
+static _Atomic int failures;
+
+static void fail(const char *what, uint32_t seq) {
+    if (atomic_fetch_add(&failures, 1) < 10) {
+        fprintf(stderr, "FAIL: %s at message %lu\n", what, (unsigned long)seq);
+    }
+}
+
+// Each field carries the sequence number, so a torn copy shows
+static bt_message_t make_message(uint32_t seq) {
+    return (bt_message_t){.conn_handle = seq, .timestamp_us = ~seq, .buffer = (uint16_t)seq,
+                          .length = (uint16_t)(seq >> 16)};
+}
+
+static bool intact(const bt_message_t *message) {
+    uint32_t seq = message->conn_handle;
+    return message->timestamp_us == ~seq && message->buffer == (uint16_t)seq &&
+           message->length == (uint16_t)(seq >> 16);
+}
+
+static void mark_seen(uint32_t seq) {
+    if (seq >= total || seen[seq]++) {
+        fail("message delivered twice", seq);
+    }
+}
+
+static void *producer(void *parameter) {
+    for (uint32_t seq = 0; seq < total; seq++) {
+        bt_message_t message = make_message(seq);
+        if (mode == MODE_QUEUE) {
+            xQueueSend(queue, &message, portMAX_DELAY);
+            continue;
+        }
+        while (!bt_ring_push(&ring, &message)) {
+            bt_message_t oldest;
+            if (mode == MODE_DROP_OLDEST && bt_ring_evict(&ring, &oldest)) {
+                if (!intact(&oldest)) {
+                    fail("evicted message torn", oldest.conn_handle);
+                }
+                mark_seen(oldest.conn_handle);
+                evicted++;
+            } else {
+                sched_yield();
+            }
+        }
+    }
+    return NULL;
+}
+
+// Stops after the last message, which is never evicted as nothing follows it
+static void *consumer(void *parameter) {
+    uint32_t expected = 0;
+    uint32_t done = 0;
+    while (done < total) {
+        bt_message_t message;
+        if (mode == MODE_QUEUE) {
+            xQueueReceive(queue, &message, portMAX_DELAY);
+        } else if (!bt_ring_pop(&ring, &message)) {
+            sched_yield();
+            continue;
+        }
+        uint32_t seq = message.conn_handle;
+        if (!intact(&message)) {
+            fail("popped message torn", seq);
+        } else if (mode == MODE_DROP_OLDEST ? seq < expected : seq != expected) {
+            fail("message out of order", seq);
+        }
+        if (mode == MODE_DROP_OLDEST) {
+            mark_seen(seq);
+            if (seq == total - 1) {
+                break;
+            }
+        }
+        expected = seq + 1;
+        done++;
+    }
+    return NULL;
+}
+
+static double run(stress_mode_t run_mode) {
+    pthread_t threads[2];
+    mode = run_mode;
+    evicted = 0;
+    bt_ring_init(&ring);
+    uint64_t start = bench_now_ns();
+    pthread_create(&threads[0], NULL, consumer, NULL);
+    pthread_create(&threads[1], NULL, producer, NULL);
+    pthread_join(threads[1], NULL);
+    pthread_join(threads[0], NULL);
+    return total * 1e9 / (bench_now_ns() - start);
+}
+
+int main(int argc, char **argv) {
+    total = bench_iterations(argc, argv, 2000000);
+    seen = calloc(total, 1);
+    static uint8_t queue_storage[BT_RING_SIZE * sizeof(bt_message_t)];
+    static StaticQueue_t queue_buffer;
+    queue = xQueueCreateStatic(BT_RING_SIZE, sizeof(bt_message_t), queue_storage, &queue_buffer);
+
+    double ring_rate = run(MODE_LOSSLESS);
+    double queue_rate = run(MODE_QUEUE);
+    printf("lossless: %lu messages, ring %.0f/s, mutex queue %.0f/s\n", (unsigned long)total, ring_rate,
+           queue_rate);
+
+    run(MODE_DROP_OLDEST);
+    uint32_t missing = 0;
+    for (uint32_t seq = 0; seq < total; seq++) {
+        missing += !seen[seq];
+    }
+    printf("drop-oldest: %lu evicted, %lu lost\n", (unsigned long)evicted, (unsigned long)missing);
+    if (missing) {
+        fail("messages neither popped nor evicted", missing);
+    }
+
+    free(seen);
+    return atomic_load(&failures) ? 1 : 0;
+}
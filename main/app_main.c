@@ -4,6 +4,7 @@
  * This example demonstrates how to use ESP-IDF to build an ESP32 app that can operate in either:
  *   - Bluetooth Mesh mode (BLE Mesh Generic OnOff Server)
  *   - Bluetooth CDC/SPP mode (Classic SPP or BLE UART, up to 8 connections)
+ *   - Gateway mode (BLE UART clients send commands into the mesh)
  *
  * To switch modes, change the BLUETOOTH_MODE macro below.
  *
@@ -16,15 +17,32 @@
 #include "nvs_flash.h"
 #include "esp_log.h"
 #include "bluetooth_mesh.h"
+#include "bluetooth_spp.h"
 
-// Mode selection: set to BLUETOOTH_MODE_MESH or BLUETOOTH_MODE_SPP
+// Mode selection: set to BLUETOOTH_MODE_MESH, BLUETOOTH_MODE_SPP or BLUETOOTH_MODE_GATEWAY
 #define BLUETOOTH_MODE_MESH 0
 #define BLUETOOTH_MODE_SPP 1
+#define BLUETOOTH_MODE_GATEWAY 2
 #ifndef BLUETOOTH_MODE
 #define BLUETOOTH_MODE BLUETOOTH_MODE_MESH // Change to BLUETOOTH_MODE_SPP for SPP/CDC mode
 #endif
+#define PROBE_REPORT_INTERVAL_S 10 // Mesh probe statistics are printed this often
 
-void bluetooth_spp_init(void);
+// Gateway: BT_GW_FRAME_COMMAND frames from a client become mesh commands, and
+// each command's outcome goes back to that client as a BT_GW_FRAME_STATUS frame
+static void gateway_frame_cb(uint32_t conn_handle, const uint8_t *frame, uint16_t length) {
+    if (length <= BT_GW_FRAME_HEADER || frame[0] != BT_GW_FRAME_COMMAND) {
+        return;
+    }
+    uint16_t tag = ((uint16_t)frame[1] << 8) | frame[2];
+    uint16_t dst = ((uint16_t)frame[3] << 8) | frame[4];
+    bluetooth_mesh_gateway_submit(conn_handle, tag, dst, &frame[BT_GW_FRAME_HEADER], length - BT_GW_FRAME_HEADER);
+}
+
+static void gateway_status_cb(uint32_t origin, uint16_t tag, bt_gw_status_t status) {
+    uint8_t frame[] = { BT_GW_FRAME_STATUS, tag >> 8, tag, status };
+    bluetooth_spp_send_frame(origin, frame, sizeof(frame));
+}
 
 void app_main(void) {
     // Initialize NVS
@@ -37,7 +55,8 @@ void app_main(void) {
 
     // Print startup info
     printf("\nESP32 Bluetooth Multi-Connection Example\n");
-    printf("Mode: %s\n", BLUETOOTH_MODE == BLUETOOTH_MODE_MESH ? "Mesh" : "SPP/CDC");
+    printf("Mode: %s\n", BLUETOOTH_MODE == BLUETOOTH_MODE_MESH ? "Mesh" :
+                         BLUETOOTH_MODE == BLUETOOTH_MODE_SPP ? "SPP/CDC" : "Gateway");
 
     // Initialize Bluetooth based on mode
     if (BLUETOOTH_MODE == BLUETOOTH_MODE_MESH) {
@@ -48,6 +67,21 @@ void app_main(void) {
         } else {
             printf("BLE Mesh node ready. Provision with a mesh app.\n");
         }
+    } else if (BLUETOOTH_MODE == BLUETOOTH_MODE_GATEWAY) {
+        // Clients speak length-prefixed frames; the BLE server brings up the
+        // stack and the mesh joins it
+        frame_config_t framing = { .mode = FRAME_MODE_LENGTH_PREFIXED };
+        printf("Initializing SPP/BLE-to-Mesh gateway...\n");
+        bluetooth_spp_set_default_framing(&framing);
+        bluetooth_spp_set_frame_callback(gateway_frame_cb);
+        bluetooth_mesh_set_gateway_status_callback(gateway_status_cb);
+        bluetooth_spp_init();
+        ret = bluetooth_mesh_init();
+        if (ret != ESP_OK) {
+            printf("BLE Mesh init failed!\n");
+        } else {
+            printf("Gateway ready. Provision it and bind an app key to the gateway model.\n");
+        }
     } else {
         printf("Initializing Bluetooth SPP/CDC mode...\n");
         bluetooth_spp_init();
@@ -55,7 +89,11 @@ void app_main(void) {
     }
 
     // Main loop (extend here for periodic tasks, status, etc.)
+    uint32_t seconds = 0;
     while (1) {
         vTaskDelay(pdMS_TO_TICKS(1000));
+        if (BLUETOOTH_MODE != BLUETOOTH_MODE_SPP && ++seconds % PROBE_REPORT_INTERVAL_S == 0) {
+            bluetooth_mesh_print_probe_report();
+        }
     }
 } 
\ No newline at end of file
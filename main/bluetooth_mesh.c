@@ -2,22 +2,120 @@
  * BLE Mesh Node Implementation (Generic OnOff Server)
  *
  * This file initializes the ESP32 as a BLE Mesh node using ESP-IDF.
- * Extend the event handlers below to add your own mesh logic (e.g., control GPIOs, relay messages).
+ * Incoming messages are routed by opcode through a table built at compile
+ * time: SIG generic server messages arrive already parsed by the stack, vendor
+ * model messages as raw parameters, and both reach their handler the same way.
+ * Extend the table below to add your own mesh logic (e.g., control GPIOs).
+ *
+ * The Generic OnOff Server keeps real state, answers Get, Set and Set
+ * Unacknowledged, and publishes its state. Publications are coalesced: a
+ * group toggled rapidly sends one status per MESH_PUB_WINDOW_MS instead of
+ * one per change.
+ *
+ * The gateway vendor model carries batches of commands built by bt_gateway.c
+ * from an SPP/BLE client's frames. Nodes unpack a batch and run each command
+ * through the same dispatch table, as if it had arrived on its own.
+ *
+ * In dense rooms every message is heard many times. Repeats are dropped by a
+ * dedup cache before dispatch, and a token bucket pauses this node's
+ * relaying while the traffic it hears exceeds MESH_RELAY_RATE, leaving the
+ * rebroadcast to its neighbours.
+ *
+ * The probe vendor model measures the mesh from the node: bt_probe.c pings
+ * chosen addresses and every node answers with an echo, giving per
+ * destination RTT histograms, relay counts and delivery ratios.
  */
 
 #include "bluetooth_mesh.h"
 #include <stdio.h>
 #include <string.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
 #include "esp_bt.h"
+#include "esp_bt_main.h"
+#include "esp_timer.h"
 #include "esp_ble_mesh_defs.h"
 #include "esp_ble_mesh_common_api.h"
 #include "esp_ble_mesh_networking_api.h"
 #include "esp_ble_mesh_provisioning_api.h"
+#include "esp_ble_mesh_generic_model_api.h"
+#include "esp_ble_mesh_config_model_api.h"
 #include "nvs_flash.h"
+#include "bt_gateway.h"
+#include "bt_mesh_filter.h"
+#include "bt_probe.h"
+#include "bt_stats.h"
 
 #define TAG "BLE_MESH"
 
+#define TID_WINDOW_US 6000000 // A repeated TID from the same source within this is a retransmission
+#define GATEWAY_TICK_MS 10    // Gateway timer period while batches are open or awaiting status
+
+#define MESH_CID 0x02E5 // Espressif Company ID
+#define MESH_GATEWAY_MODEL_ID 0x0001
+#define MESH_PROBE_MODEL_ID 0x0002
+#define MESH_OP_GW_BATCH  ESP_BLE_MESH_MODEL_OP_3(0x01, MESH_CID)
+#define MESH_OP_GW_STATUS ESP_BLE_MESH_MODEL_OP_3(0x02, MESH_CID)
+#define MESH_OP_PROBE_PING ESP_BLE_MESH_MODEL_OP_3(0x03, MESH_CID)
+#define MESH_OP_PROBE_ECHO ESP_BLE_MESH_MODEL_OP_3(0x04, MESH_CID)
+
+// One received access message, as handed to an opcode handler
+typedef struct {
+    esp_ble_mesh_model_t *model;
+    esp_ble_mesh_msg_ctx_t *ctx;
+    const uint8_t *data;                                 // Vendor models and batched commands: raw parameters
+    uint16_t length;
+    const esp_ble_mesh_generic_server_cb_value_t *value; // SIG generic server: parsed by the stack
+} mesh_msg_t;
+
+typedef void (*mesh_op_handler_t)(const mesh_msg_t *msg);
+
+typedef struct {
+    uint32_t opcode;
+    mesh_op_handler_t handler;
+} mesh_op_t;
+
+// Last Set seen, for telling retransmissions from new transactions
+typedef struct {
+    uint8_t tid;
+    uint16_t src;
+    uint16_t dst;
+    int64_t time_us;
+} mesh_last_set_t;
+
+static void onoff_get(const mesh_msg_t *msg);
+static void onoff_set(const mesh_msg_t *msg);
+static void gateway_batch(const mesh_msg_t *msg);
+static void gateway_status(const mesh_msg_t *msg);
+static void probe_ping(const mesh_msg_t *msg);
+static void probe_echo(const mesh_msg_t *msg);
+static void publish_timer_cb(TimerHandle_t timer);
+static void gateway_timer_cb(TimerHandle_t timer);
+static void probe_timer_cb(TimerHandle_t timer);
+static void relay_timer_cb(TimerHandle_t timer);
+
+// Opcode dispatch table, sorted by opcode for the binary search
+#define MESH_OPS(X) \
+    X(ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_GET,       onoff_get) \
+    X(ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET,       onoff_set) \
+    X(ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET_UNACK, onoff_set) \
+    X(MESH_OP_GW_BATCH,                          gateway_batch) \
+    X(MESH_OP_GW_STATUS,                         gateway_status) \
+    X(MESH_OP_PROBE_PING,                        probe_ping) \
+    X(MESH_OP_PROBE_ECHO,                        probe_echo)
+
+#define MESH_OP_ENTRY(opcode, handler) { opcode, handler },
+static const mesh_op_t mesh_ops[] = { MESH_OPS(MESH_OP_ENTRY) };
+#undef MESH_OP_ENTRY
+
+// Each opcode must be below the next: expands to 0 < a && a < b && ... && z < max
+#define MESH_OP_BELOW(opcode, handler) (opcode) && (opcode) <
+_Static_assert(0 < MESH_OPS(MESH_OP_BELOW) UINT32_MAX, "mesh_ops must be sorted by opcode, without repeats");
+#undef MESH_OP_BELOW
+
 // Device UUID (can be random or based on MAC)
 static uint8_t dev_uuid[16] = {0xdd, 0xdd};
 
@@ -28,21 +126,391 @@ static esp_ble_mesh_prov_t prov = {
     .output_actions = 0,
 };
 
-// Generic OnOff Server Model
+// Configuration Server: lets a provisioner bind keys and set subscriptions,
+// and holds the relay state the relay limiter switches
+static esp_ble_mesh_cfg_srv_t config_server = {
+    .relay = ESP_BLE_MESH_RELAY_ENABLED,
+    .beacon = ESP_BLE_MESH_BEACON_ENABLED,
+    .friend_state = ESP_BLE_MESH_FRIEND_NOT_SUPPORTED,
+    .gatt_proxy = ESP_BLE_MESH_GATT_PROXY_ENABLED,
+    .default_ttl = 7,
+    .net_transmit = ESP_BLE_MESH_TRANSMIT(2, 20),
+    .relay_retransmit = ESP_BLE_MESH_TRANSMIT(2, 20),
+};
+
+// Generic OnOff Server state. The application answers Get and Set itself so
+// it sees every change and decides when to publish.
+ESP_BLE_MESH_MODEL_PUB_DEFINE(onoff_pub, 2 + 3, ROLE_NODE);
+
+static esp_ble_mesh_gen_onoff_srv_t onoff_server = {
+    .rsp_ctrl = {
+        .get_auto_rsp = ESP_BLE_MESH_SERVER_RSP_BY_APP,
+        .set_auto_rsp = ESP_BLE_MESH_SERVER_RSP_BY_APP,
+    },
+};
+
+// Configuration and Generic OnOff Server Models
 static esp_ble_mesh_model_t root_models[] = {
-    ESP_BLE_MESH_MODEL_GEN_ONOFF_SRV(NULL, NULL, NULL),
+    ESP_BLE_MESH_MODEL_CFG_SRV(&config_server),
+    ESP_BLE_MESH_MODEL_GEN_ONOFF_SRV(&onoff_pub, &onoff_server),
+};
+
+// Gateway vendor model: sends batches on a gateway, receives them on a node
+static esp_ble_mesh_model_op_t gateway_model_ops[] = {
+    ESP_BLE_MESH_MODEL_OP(MESH_OP_GW_BATCH, BT_GW_BATCH_HEADER),
+    ESP_BLE_MESH_MODEL_OP(MESH_OP_GW_STATUS, BT_GW_STATUS_SIZE),
+    ESP_BLE_MESH_MODEL_OP_END,
+};
+
+// Probe vendor model: every node echoes pings; any node may send them
+static esp_ble_mesh_model_op_t probe_model_ops[] = {
+    ESP_BLE_MESH_MODEL_OP(MESH_OP_PROBE_PING, BT_PROBE_PING_SIZE),
+    ESP_BLE_MESH_MODEL_OP(MESH_OP_PROBE_ECHO, BT_PROBE_ECHO_SIZE),
+    ESP_BLE_MESH_MODEL_OP_END,
+};
+
+static esp_ble_mesh_model_t vendor_models[] = {
+    ESP_BLE_MESH_VENDOR_MODEL(MESH_CID, MESH_GATEWAY_MODEL_ID, gateway_model_ops, NULL, NULL),
+    ESP_BLE_MESH_VENDOR_MODEL(MESH_CID, MESH_PROBE_MODEL_ID, probe_model_ops, NULL, NULL),
 };
 
+#define GATEWAY_MODEL (&vendor_models[0])
+#define PROBE_MODEL (&vendor_models[1])
+
 static esp_ble_mesh_elem_t elements[] = {
-    ESP_BLE_MESH_ELEMENT(0, root_models, ESP_BLE_MESH_MODEL_NONE),
+    ESP_BLE_MESH_ELEMENT(0, root_models, vendor_models),
 };
 
 static esp_ble_mesh_comp_t composition = {
-    .cid = 0x02E5, // Espressif Company ID
+    .cid = MESH_CID,
     .elements = elements,
     .element_count = ARRAY_SIZE(elements),
 };
 
+// OnOff state is changed from the stack's task, the timer task and the
+// application, so it and the publication window are kept under one lock
+static portMUX_TYPE onoff_lock = portMUX_INITIALIZER_UNLOCKED;
+static mesh_last_set_t last_set;
+static mesh_onoff_callback_t onoff_callback = NULL;
+static uint32_t publish_window_ms = MESH_PUB_WINDOW_MS;
+static uint8_t published_onoff;
+static bool publish_window_open = false;
+static bool publish_pending = false;
+static TimerHandle_t publish_timer = NULL;
+static StaticTimer_t publish_timer_buffer;
+
+// Gateway. Submissions (dispatch task), statuses (mesh task) and the tick
+// (timer task) meet under gateway_lock.
+static bt_gw_t gateway;
+static uint16_t mesh_net_idx = ESP_BLE_MESH_KEY_PRIMARY;
+static mesh_gateway_status_callback_t gateway_callback = NULL;
+static SemaphoreHandle_t gateway_lock = NULL;
+static StaticSemaphore_t gateway_lock_buffer;
+static TimerHandle_t gateway_timer = NULL;
+static StaticTimer_t gateway_timer_buffer;
+static _Atomic bool gateway_ready; // Lock and timer exist; SPP clients may submit before this
+
+// Receive filtering. The dedup cache is the mesh task's; the relay limiter
+// and the statistics are shared with relay_timer under filter_lock.
+static bt_dedup_t dedup_cache;
+static portMUX_TYPE filter_lock = portMUX_INITIALIZER_UNLOCKED;
+static bt_bucket_t relay_bucket;
+static uint32_t relay_rate = MESH_RELAY_RATE;
+static uint32_t relay_burst = MESH_RELAY_BURST;
+static uint8_t relay_state = ESP_BLE_MESH_RELAY_ENABLED; // As last set here or by the provisioner
+static bool relay_configured = true; // The provisioner wants this node to relay (from Relay Set)
+static mesh_filter_stats_t filter_stats;
+static TimerHandle_t relay_timer = NULL; // Resumes paused relaying
+static StaticTimer_t relay_timer_buffer;
+
+// Probes. Started by the application, ticked by probe_timer and fed echoes by
+// the mesh task, all under probe_lock.
+static bt_probe_t probe;
+static SemaphoreHandle_t probe_lock = NULL;
+static StaticSemaphore_t probe_lock_buffer;
+static TimerHandle_t probe_timer = NULL;
+static StaticTimer_t probe_timer_buffer;
+static _Atomic bool probe_ready; // Lock and timer exist; the application may call before this
+
+// Find the handler for an opcode
+static const mesh_op_t *find_op(uint32_t opcode) {
+    int low = 0;
+    int high = (int)ARRAY_SIZE(mesh_ops) - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (mesh_ops[mid].opcode == opcode) {
+            return &mesh_ops[mid];
+        }
+        if (mesh_ops[mid].opcode < opcode) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return NULL;
+}
+
+static bool dispatch(const mesh_msg_t *msg) {
+    const mesh_op_t *op = find_op(msg->ctx->recv_op);
+    if (!op) {
+        ESP_LOGD(TAG, "No handler for opcode 0x%06lx", (unsigned long)msg->ctx->recv_op);
+        return false;
+    }
+    op->handler(msg);
+    return true;
+}
+
+// Send the current state in a Generic OnOff Status, to the model's publish
+// address. Nothing is sent before a publish address is configured.
+static void publish_onoff(uint8_t onoff) {
+    esp_ble_mesh_model_t *model = onoff_server.model;
+    if (!model || !model->pub || model->pub->publish_addr == ESP_BLE_MESH_ADDR_UNASSIGNED) {
+        return;
+    }
+    esp_err_t err = esp_ble_mesh_model_publish(model, ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_STATUS,
+                                               sizeof(onoff), &onoff, ROLE_NODE);
+    if (err) {
+        ESP_LOGW(TAG, "OnOff publish failed: %s", esp_err_to_name(err));
+    }
+}
+
+// Apply a new OnOff state, report it and publish it now or at the end of the
+// current publication window
+static void change_onoff(uint8_t onoff, uint16_t source) {
+    bool publish = false;
+    bool changed;
+
+    portENTER_CRITICAL(&onoff_lock);
+    changed = onoff_server.state.onoff != onoff;
+    onoff_server.state.onoff = onoff;
+    onoff_server.state.target_onoff = onoff;
+    if (changed) {
+        if (publish_window_open) {
+            publish_pending = true;
+        } else {
+            publish = true;
+            publish_window_open = publish_window_ms > 0;
+            published_onoff = onoff;
+        }
+    }
+    portEXIT_CRITICAL(&onoff_lock);
+
+    if (!changed) {
+        return;
+    }
+    if (publish) {
+        publish_onoff(onoff);
+        if (publish_window_ms > 0) {
+            xTimerChangePeriod(publish_timer, pdMS_TO_TICKS(publish_window_ms), 0);
+        }
+    }
+    if (onoff_callback) {
+        onoff_callback(onoff, source);
+    }
+}
+
+// End of a publication window: publish the state it settled on, if that is
+// not what was last published, and open another window for it
+static void publish_timer_cb(TimerHandle_t timer) {
+    bool publish;
+    uint8_t onoff;
+
+    portENTER_CRITICAL(&onoff_lock);
+    onoff = onoff_server.state.onoff;
+    publish = publish_pending && onoff != published_onoff;
+    publish_pending = false;
+    publish_window_open = publish && publish_window_ms > 0;
+    if (publish) {
+        published_onoff = onoff;
+    }
+    portEXIT_CRITICAL(&onoff_lock);
+
+    if (publish) {
+        publish_onoff(onoff);
+        if (publish_window_ms > 0) {
+            xTimerChangePeriod(timer, pdMS_TO_TICKS(publish_window_ms), 0);
+        }
+    }
+}
+
+static void send_onoff_status(const mesh_msg_t *msg) {
+    uint8_t onoff = onoff_server.state.onoff;
+    esp_err_t err = esp_ble_mesh_server_model_send_msg(onoff_server.model, msg->ctx, ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_STATUS,
+                                                       sizeof(onoff), &onoff);
+    if (err) {
+        ESP_LOGW(TAG, "OnOff status to 0x%04x failed: %s", msg->ctx->addr, esp_err_to_name(err));
+    }
+}
+
+static void onoff_get(const mesh_msg_t *msg) {
+    send_onoff_status(msg);
+}
+
+// Set and Set Unacknowledged. Transition time and delay are not supported;
+// the state changes at once.
+static void onoff_set(const mesh_msg_t *msg) {
+    esp_ble_mesh_server_recv_gen_onoff_set_t set;
+    int64_t now = esp_timer_get_time();
+
+    // Batched commands arrive unparsed: onoff(1) tid(1), then optional timing
+    if (msg->value) {
+        set = msg->value->set.onoff;
+    } else if (msg->length >= 2) {
+        set.onoff = msg->data[0];
+        set.tid = msg->data[1];
+    } else {
+        return;
+    }
+    if (set.onoff > 1) {
+        return; // Prohibited value
+    }
+    bool repeat = last_set.tid == set.tid && last_set.src == msg->ctx->addr &&
+                  last_set.dst == msg->ctx->recv_dst && now - last_set.time_us < TID_WINDOW_US;
+    last_set = (mesh_last_set_t){ set.tid, msg->ctx->addr, msg->ctx->recv_dst, now };
+
+    if (!repeat) {
+        change_onoff(set.onoff, msg->ctx->addr);
+    }
+    if (msg->ctx->recv_op == ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET) {
+        send_onoff_status(msg);
+    }
+}
+
+static uint32_t now_ms(void) {
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+// Send a vendor message from one of this node's models, with its bound app key
+static bool send_vendor(esp_ble_mesh_model_t *model, uint16_t dst, uint8_t ttl, uint32_t opcode,
+                        const uint8_t *params, uint16_t length) {
+    if (model->keys[0] == ESP_BLE_MESH_KEY_UNUSED) {
+        return false;
+    }
+    esp_ble_mesh_msg_ctx_t ctx = {
+        .net_idx = mesh_net_idx,
+        .app_idx = model->keys[0],
+        .addr = dst,
+        .send_ttl = ttl,
+    };
+    return esp_ble_mesh_server_model_send_msg(model, &ctx, opcode, length, (uint8_t *)params) == ESP_OK;
+}
+
+// bt_gw sink: one batch to the mesh through the gateway model's bound app key
+static bool gateway_send(void *context, uint16_t dst, const uint8_t *params, uint16_t length) {
+    if (!send_vendor(GATEWAY_MODEL, dst, ESP_BLE_MESH_TTL_DEFAULT, MESH_OP_GW_BATCH, params, length)) {
+        ESP_LOGW(TAG, "Gateway batch to 0x%04x failed", dst);
+        return false;
+    }
+    return true;
+}
+
+static void gateway_report(void *context, uint32_t origin, uint16_t tag, bt_gw_status_t status) {
+    if (gateway_callback) {
+        gateway_callback(origin, tag, status);
+    }
+}
+
+// Keep the tick running while the gateway has work outstanding; called locked
+static void gateway_schedule(void) {
+    if (bt_gw_idle(&gateway)) {
+        xTimerStop(gateway_timer, 0);
+    } else if (!xTimerIsTimerActive(gateway_timer)) {
+        xTimerStart(gateway_timer, 0);
+    }
+}
+
+static void gateway_timer_cb(TimerHandle_t timer) {
+    xSemaphoreTake(gateway_lock, portMAX_DELAY);
+    bt_gw_tick(&gateway, now_ms());
+    gateway_schedule();
+    xSemaphoreGive(gateway_lock);
+}
+
+// One command of a received batch, run as if it had arrived on its own.
+// Batches inside batches are not followed.
+static bool gateway_command(void *context, uint32_t opcode, const uint8_t *message, uint16_t length) {
+    const mesh_msg_t *batch = context;
+    esp_ble_mesh_msg_ctx_t ctx = *batch->ctx;
+    uint32_t ignored;
+    int opcode_size = bt_gw_parse_opcode(message, length, &ignored);
+
+    if (opcode == MESH_OP_GW_BATCH || opcode == MESH_OP_GW_STATUS) {
+        return false;
+    }
+    ctx.recv_op = opcode;
+    mesh_msg_t msg = {
+        .model = batch->model,
+        .ctx = &ctx,
+        .data = message + opcode_size,
+        .length = length - opcode_size,
+    };
+    return dispatch(&msg);
+}
+
+// Node side of the gateway: run a batch and, if it was addressed to this
+// node alone, tell the gateway which commands had a handler
+static void gateway_batch(const mesh_msg_t *msg) {
+    uint8_t status[BT_GW_STATUS_SIZE];
+    if (bt_gw_unpack(msg->data, msg->length, gateway_command, (void *)msg, status) < 0) {
+        ESP_LOGW(TAG, "Malformed gateway batch from 0x%04x", msg->ctx->addr);
+    }
+    if (ESP_BLE_MESH_ADDR_IS_UNICAST(msg->ctx->recv_dst)) {
+        esp_ble_mesh_server_model_send_msg(GATEWAY_MODEL, msg->ctx, MESH_OP_GW_STATUS, sizeof(status), status);
+    }
+}
+
+// Gateway side: a node's status for a unicast batch
+static void gateway_status(const mesh_msg_t *msg) {
+    xSemaphoreTake(gateway_lock, portMAX_DELAY);
+    bt_gw_ack(&gateway, msg->ctx->addr, msg->data, msg->length);
+    gateway_schedule();
+    xSemaphoreGive(gateway_lock);
+}
+
+// bt_probe sink
+static bool probe_send(void *context, uint16_t dst, uint8_t ttl, const uint8_t *params, uint16_t length) {
+    return send_vendor(PROBE_MODEL, dst, ttl, MESH_OP_PROBE_PING, params, length);
+}
+
+// Tick the prober and sleep until it next needs to run; called locked
+static void probe_schedule(void) {
+    uint32_t delay = bt_probe_tick(&probe, now_ms());
+    if (delay == UINT32_MAX) {
+        xTimerStop(probe_timer, 0);
+        return;
+    }
+    xTimerChangePeriod(probe_timer, pdMS_TO_TICKS(delay) ? pdMS_TO_TICKS(delay) : 1, 0);
+}
+
+static void probe_timer_cb(TimerHandle_t timer) {
+    xSemaphoreTake(probe_lock, portMAX_DELAY);
+    probe_schedule();
+    xSemaphoreGive(probe_lock);
+}
+
+// Every node answers pings, to the sender and with the sender's TTL, so both
+// directions cross the same number of relays when the routes are symmetric
+static void probe_ping(const mesh_msg_t *msg) {
+    uint8_t echo[BT_PROBE_ECHO_SIZE];
+    uint8_t ttl;
+    uint16_t length;
+
+    // Our own pings to groups we belong to come back locally; they measure nothing
+    if (msg->ctx->addr == esp_ble_mesh_get_primary_element_address()) {
+        return;
+    }
+    length = bt_probe_answer(msg->data, msg->length, msg->ctx->recv_ttl, echo, &ttl);
+    if (length > 0) {
+        send_vendor(PROBE_MODEL, msg->ctx->addr, ttl, MESH_OP_PROBE_ECHO, echo, length);
+    }
+}
+
+static void probe_echo(const mesh_msg_t *msg) {
+    xSemaphoreTake(probe_lock, portMAX_DELAY);
+    bt_probe_echo_input(&probe, msg->data, msg->length, msg->ctx->recv_ttl, now_ms());
+    xSemaphoreGive(probe_lock);
+}
+
 // Event handler for provisioning and configuration events
 static void ble_mesh_prov_cb(esp_ble_mesh_prov_cb_event_t event, esp_ble_mesh_prov_cb_param_t *param) {
     switch (event) {
@@ -51,7 +519,7 @@ static void ble_mesh_prov_cb(esp_ble_mesh_prov_cb_event_t event, esp_ble_mesh_pr
             break;
         case ESP_BLE_MESH_NODE_PROV_COMPLETE_EVT:
             ESP_LOGI(TAG, "Provisioning complete! NetIdx: 0x%04x, Addr: 0x%04x", param->node_prov_complete.net_idx, param->node_prov_complete.addr);
-            // TODO: Add your logic here for when provisioning is complete (e.g., start application logic)
+            mesh_net_idx = param->node_prov_complete.net_idx;
             break;
         case ESP_BLE_MESH_NODE_PROV_RESET_EVT:
             ESP_LOGI(TAG, "Node reset");
@@ -62,43 +530,352 @@ static void ble_mesh_prov_cb(esp_ble_mesh_prov_cb_event_t event, esp_ble_mesh_pr
     }
 }
 
-// Event handler for mesh model messages
+// Relay limiter. The stack relays without a per-packet hook or any report of
+// what it relayed, so the load is judged from the messages reaching this
+// node's models and the budget is applied to the node's relay state: every
+// such message spends a token, and once the bucket is empty relaying stays
+// off until half the burst has refilled. A node that mostly relays may hear
+// nothing for its own models meanwhile, so relay_timer resumes it. The
+// provisioner's own setting is tracked separately (ble_mesh_config_server_cb)
+// and always respected.
+
+// Called under filter_lock. Turns a paused relay back on once half the burst
+// has refilled; returns the ms it must still wait, 0 if it is not paused now.
+static uint32_t resume_relay(uint32_t now) {
+    if (!relay_configured || relay_state != ESP_BLE_MESH_RELAY_DISABLED) {
+        return 0;
+    }
+    uint32_t wait_ms = bt_bucket_wait_ms(&relay_bucket, relay_burst / 2, now);
+    if (wait_ms == 0) {
+        relay_state = ESP_BLE_MESH_RELAY_ENABLED;
+        config_server.relay = relay_state;
+    }
+    return wait_ms;
+}
+
+static void schedule_relay_resume(uint32_t wait_ms) {
+    if (wait_ms > 0 && wait_ms != UINT32_MAX) {
+        xTimerChangePeriod(relay_timer, pdMS_TO_TICKS(wait_ms) ? pdMS_TO_TICKS(wait_ms) : 1, 0);
+    }
+}
+
+static void limit_relay(uint32_t now) {
+    uint32_t wait_ms = 0;
+
+    portENTER_CRITICAL(&filter_lock);
+    filter_stats.received++;
+    if (relay_configured && relay_rate != 0) {
+        if (relay_state == ESP_BLE_MESH_RELAY_DISABLED) {
+            resume_relay(now);
+        } else if (!bt_bucket_take(&relay_bucket, now)) {
+            relay_state = ESP_BLE_MESH_RELAY_DISABLED;
+            config_server.relay = relay_state;
+            filter_stats.relay_pauses++;
+            wait_ms = resume_relay(now);
+        }
+        if (relay_state == ESP_BLE_MESH_RELAY_ENABLED) {
+            filter_stats.received_relaying++;
+        } else {
+            filter_stats.received_paused++;
+        }
+    }
+    portEXIT_CRITICAL(&filter_lock);
+    schedule_relay_resume(wait_ms);
+}
+
+static void relay_timer_cb(TimerHandle_t timer) {
+    portENTER_CRITICAL(&filter_lock);
+    uint32_t wait_ms = resume_relay(now_ms());
+    portEXIT_CRITICAL(&filter_lock);
+    schedule_relay_resume(wait_ms);
+}
+
+// Configuration server changes. A Relay Set from the provisioner replaces
+// whatever the limiter had chosen, paused or not.
+static void ble_mesh_config_server_cb(esp_ble_mesh_cfg_server_cb_event_t event,
+                                      esp_ble_mesh_cfg_server_cb_param_t *param) {
+    if (event == ESP_BLE_MESH_CFG_SERVER_STATE_CHANGE_EVT && param->ctx.recv_op == ESP_BLE_MESH_MODEL_OP_RELAY_SET) {
+        portENTER_CRITICAL(&filter_lock);
+        relay_state = config_server.relay;
+        relay_configured = relay_state == ESP_BLE_MESH_RELAY_ENABLED;
+        portEXIT_CRITICAL(&filter_lock);
+        ESP_LOGI(TAG, "Relay %s by the provisioner", relay_configured ? "enabled" : "disabled");
+    }
+}
+
+// Messages whose parameters carry a transaction id (the OnOff Set TID, the
+// gateway and probe seq), so two with the same parameters are one
+// transaction heard twice. A Get carries none: asked twice, it is answered twice.
+static bool carries_transaction(uint32_t opcode) {
+    switch (opcode) {
+        case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET:
+        case ESP_BLE_MESH_MODEL_OP_GEN_ONOFF_SET_UNACK:
+        case MESH_OP_GW_BATCH:
+        case MESH_OP_GW_STATUS:
+        case MESH_OP_PROBE_PING:
+        case MESH_OP_PROBE_ECHO:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Every received message passes here before dispatch; false drops a repeat
+// of one delivered within MESH_DEDUP_WINDOW_MS. The stack does not expose
+// sequence numbers to models, so a message is recognised by its source,
+// destination, opcode and parameters, transaction id included.
+static bool accept_message(const esp_ble_mesh_msg_ctx_t *ctx, const void *params, uint16_t length) {
+    uint32_t now = now_ms();
+    limit_relay(now);
+    if (!carries_transaction(ctx->recv_op)) {
+        return true;
+    }
+
+    uint32_t key = bt_dedup_key(ctx->addr, ctx->recv_dst, ctx->recv_op, params, length);
+    if (bt_dedup_seen(&dedup_cache, key, now, MESH_DEDUP_WINDOW_MS)) {
+        portENTER_CRITICAL(&filter_lock);
+        filter_stats.duplicates++;
+        portEXIT_CRITICAL(&filter_lock);
+        return false;
+    }
+    return true;
+}
+
+// Event handler for SIG generic server models: Get and Set reach the dispatch
+// table already parsed
+static void ble_mesh_generic_server_cb(esp_ble_mesh_generic_server_cb_event_t event,
+                                       esp_ble_mesh_generic_server_cb_param_t *param) {
+    const void *params = NULL;
+    uint16_t length = 0;
+
+    if (event == ESP_BLE_MESH_GENERIC_SERVER_RECV_SET_MSG_EVT) {
+        params = &param->value.set.onoff;
+        length = sizeof(param->value.set.onoff);
+    } else if (event != ESP_BLE_MESH_GENERIC_SERVER_RECV_GET_MSG_EVT) {
+        return;
+    }
+    if (accept_message(&param->ctx, params, length)) {
+        mesh_msg_t msg = {
+            .model = param->model,
+            .ctx = &param->ctx,
+            .value = &param->value,
+        };
+        dispatch(&msg);
+    }
+}
+
+// Event handler for vendor model messages
 static void ble_mesh_model_cb(esp_ble_mesh_model_cb_event_t event, esp_ble_mesh_model_cb_param_t *param) {
-    if (event == ESP_BLE_MESH_MODEL_OPERATION_EVT) {
-        ESP_LOGI(TAG, "Received mesh message, opcode: 0x%04x", param->model_operation.opcode);
-        // TODO: Add your message handling here (e.g., toggle GPIO, respond to mesh commands)
+    if (event == ESP_BLE_MESH_MODEL_OPERATION_EVT &&
+        accept_message(param->model_operation.ctx, param->model_operation.msg, param->model_operation.length)) {
+        mesh_msg_t msg = {
+            .model = param->model_operation.model,
+            .ctx = param->model_operation.ctx,
+            .data = param->model_operation.msg,
+            .length = param->model_operation.length,
+        };
+        dispatch(&msg);
     }
 }
 
-esp_err_t bluetooth_mesh_init(void) {
-    esp_err_t err;
-    ESP_LOGI(TAG, "Initializing BLE Mesh node...");
+void bluetooth_mesh_set_onoff_callback(mesh_onoff_callback_t callback) {
+    onoff_callback = callback;
+}
 
-    // Initialize Bluetooth controller
-    esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
-    err = esp_bt_controller_init(&bt_cfg);
-    if (err) {
-        ESP_LOGE(TAG, "Bluetooth controller init failed: %s", esp_err_to_name(err));
-        return err;
+uint8_t bluetooth_mesh_get_onoff(void) {
+    return onoff_server.state.onoff;
+}
+
+// Change the state locally, as a switch or a sensor would; source is reported
+// as the unassigned address
+void bluetooth_mesh_set_onoff(uint8_t onoff) {
+    change_onoff(onoff ? 1 : 0, ESP_BLE_MESH_ADDR_UNASSIGNED);
+}
+
+void bluetooth_mesh_set_publish_window(uint32_t window_ms) {
+    publish_window_ms = window_ms;
+}
+
+void bluetooth_mesh_set_gateway_status_callback(mesh_gateway_status_callback_t callback) {
+    gateway_callback = callback;
+}
+
+// Queue an access message (opcode and parameters) for a unicast or group
+// address; origin and tag come back with its outcome. Commands arriving
+// before bluetooth_mesh_init() has set the gateway up fail at once.
+void bluetooth_mesh_gateway_submit(uint32_t origin, uint16_t tag, uint16_t dst, const uint8_t *message, uint16_t length) {
+    if (!atomic_load_explicit(&gateway_ready, memory_order_acquire)) {
+        if (gateway_callback) {
+            gateway_callback(origin, tag, BT_GW_FAILED);
+        }
+        return;
     }
-    err = esp_bt_controller_enable(ESP_BT_MODE_BLE);
-    if (err) {
-        ESP_LOGE(TAG, "Bluetooth controller enable failed: %s", esp_err_to_name(err));
-        return err;
+    xSemaphoreTake(gateway_lock, portMAX_DELAY);
+    bt_gw_submit(&gateway, origin, tag, dst, message, length, now_ms());
+    gateway_schedule();
+    xSemaphoreGive(gateway_lock);
+}
+
+// Send open batches without waiting out their hold time
+void bluetooth_mesh_gateway_flush(void) {
+    if (!atomic_load_explicit(&gateway_ready, memory_order_acquire)) {
+        return;
     }
-    err = esp_bluedroid_init();
-    if (err) {
-        ESP_LOGE(TAG, "Bluedroid init failed: %s", esp_err_to_name(err));
-        return err;
+    xSemaphoreTake(gateway_lock, portMAX_DELAY);
+    bt_gw_flush(&gateway, now_ms());
+    gateway_schedule();
+    xSemaphoreGive(gateway_lock);
+}
+
+// Relaying pauses while more than rate messages a second (beyond a burst)
+// are heard; rate 0 turns the limiter off. Call before bluetooth_mesh_init().
+void bluetooth_mesh_set_relay_limit(uint32_t rate, uint32_t burst) {
+    relay_rate = rate;
+    relay_burst = burst;
+}
+
+void bluetooth_mesh_get_filter_stats(mesh_filter_stats_t *stats) {
+    portENTER_CRITICAL(&filter_lock);
+    *stats = filter_stats;
+    portEXIT_CRITICAL(&filter_lock);
+}
+
+// Ping dst (unicast or group) every interval_ms with the given TTL, padding
+// pings by padding bytes to exercise segmentation. Starting a probe again
+// changes its settings and keeps its statistics. The probe calls fail with
+// ESP_ERR_INVALID_STATE until bluetooth_mesh_init() has set the prober up.
+esp_err_t bluetooth_mesh_probe_start(uint16_t dst, uint32_t interval_ms, uint8_t ttl, uint8_t padding) {
+    if (!atomic_load_explicit(&probe_ready, memory_order_acquire)) {
+        return ESP_ERR_INVALID_STATE;
     }
-    err = esp_bluedroid_enable();
-    if (err) {
-        ESP_LOGE(TAG, "Bluedroid enable failed: %s", esp_err_to_name(err));
-        return err;
+    xSemaphoreTake(probe_lock, portMAX_DELAY);
+    bool added = bt_probe_add(&probe, dst, interval_ms, ttl, padding, now_ms());
+    if (added) {
+        probe_schedule();
+    }
+    xSemaphoreGive(probe_lock);
+    return added ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t bluetooth_mesh_probe_stop(uint16_t dst) {
+    if (!atomic_load_explicit(&probe_ready, memory_order_acquire)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(probe_lock, portMAX_DELAY);
+    bool removed = bt_probe_remove(&probe, dst);
+    probe_schedule();
+    xSemaphoreGive(probe_lock);
+    return removed ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t bluetooth_mesh_probe_get_stats(uint16_t dst, bt_probe_stats_t *stats) {
+    if (!atomic_load_explicit(&probe_ready, memory_order_acquire)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(probe_lock, portMAX_DELAY);
+    const bt_probe_stats_t *found = bt_probe_stats(&probe, dst);
+    if (found) {
+        *stats = *found;
+    }
+    xSemaphoreGive(probe_lock);
+    return found ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+// One line per probed destination on the serial console
+void bluetooth_mesh_print_probe_report(void) {
+    bt_probe_target_t targets[BT_PROBE_TARGETS];
+
+    if (!atomic_load_explicit(&probe_ready, memory_order_acquire)) {
+        return;
+    }
+    xSemaphoreTake(probe_lock, portMAX_DELAY);
+    memcpy(targets, probe.targets, sizeof(targets));
+    xSemaphoreGive(probe_lock);
+
+    for (int i = 0; i < BT_PROBE_TARGETS; i++) {
+        const bt_probe_stats_t *stats = &targets[i].stats;
+        if (targets[i].dst == ESP_BLE_MESH_ADDR_UNASSIGNED) {
+            continue;
+        }
+        uint32_t delivery = bt_probe_delivery_permille(stats);
+        uint32_t hops = 0;
+        for (int h = 1; h < BT_PROBE_HOP_BUCKETS; h++) {
+            if (stats->hops_out[h] > stats->hops_out[hops]) {
+                hops = h;
+            }
+        }
+        printf("Probe 0x%04x: sent %lu, answered %lu, lost %lu (%lu.%lu%% delivered), echoes %lu, "
+               "RTT min %lu avg %lu p50<=%lu p90<=%lu max %lu ms, hops %lu\n",
+               targets[i].dst, (unsigned long)stats->sent, (unsigned long)stats->answered,
+               (unsigned long)stats->lost, (unsigned long)(delivery / 10), (unsigned long)(delivery % 10),
+               (unsigned long)stats->echoes, (unsigned long)(stats->echoes ? stats->rtt_min_ms : 0),
+               (unsigned long)(stats->echoes ? stats->rtt_sum_ms / stats->echoes : 0),
+               (unsigned long)bt_latency_percentile(stats->rtt_hist, 50),
+               (unsigned long)bt_latency_percentile(stats->rtt_hist, 90), (unsigned long)stats->rtt_max_ms,
+               (unsigned long)hops);
+    }
+}
+
+void bluetooth_mesh_get_gateway_stats(bt_gw_stats_t *stats) {
+    if (!atomic_load_explicit(&gateway_ready, memory_order_acquire)) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    xSemaphoreTake(gateway_lock, portMAX_DELAY);
+    *stats = gateway.stats;
+    xSemaphoreGive(gateway_lock);
+}
+
+esp_err_t bluetooth_mesh_init(void) {
+    esp_err_t err;
+    ESP_LOGI(TAG, "Initializing BLE Mesh node...");
+
+    publish_timer = xTimerCreateStatic("mesh_pub", pdMS_TO_TICKS(MESH_PUB_WINDOW_MS), pdFALSE, NULL,
+                                       publish_timer_cb, &publish_timer_buffer);
+    bt_gw_init(&gateway, gateway_send, gateway_report, NULL);
+    bt_dedup_init(&dedup_cache);
+    bt_probe_init(&probe, probe_send, NULL);
+    probe_lock = xSemaphoreCreateMutexStatic(&probe_lock_buffer);
+    probe_timer = xTimerCreateStatic("mesh_probe", pdMS_TO_TICKS(BT_PROBE_MIN_INTERVAL_MS), pdFALSE, NULL,
+                                     probe_timer_cb, &probe_timer_buffer);
+    atomic_store_explicit(&probe_ready, true, memory_order_release);
+    bt_bucket_init(&relay_bucket, relay_rate, relay_burst, now_ms());
+    relay_timer = xTimerCreateStatic("mesh_relay", 1, pdFALSE, NULL, relay_timer_cb, &relay_timer_buffer);
+    gateway_lock = xSemaphoreCreateMutexStatic(&gateway_lock_buffer);
+    gateway_timer = xTimerCreateStatic("mesh_gw", pdMS_TO_TICKS(GATEWAY_TICK_MS), pdTRUE, NULL,
+                                       gateway_timer_cb, &gateway_timer_buffer);
+    atomic_store_explicit(&gateway_ready, true, memory_order_release);
+
+    // Initialize Bluetooth controller, unless the SPP/BLE server already has
+    // (gateway mode shares one stack)
+    if (esp_bluedroid_get_status() != ESP_BLUEDROID_STATUS_ENABLED) {
+        esp_bt_controller_config_t bt_cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
+        err = esp_bt_controller_init(&bt_cfg);
+        if (err) {
+            ESP_LOGE(TAG, "Bluetooth controller init failed: %s", esp_err_to_name(err));
+            return err;
+        }
+        err = esp_bt_controller_enable(ESP_BT_MODE_BLE);
+        if (err) {
+            ESP_LOGE(TAG, "Bluetooth controller enable failed: %s", esp_err_to_name(err));
+            return err;
+        }
+        err = esp_bluedroid_init();
+        if (err) {
+            ESP_LOGE(TAG, "Bluedroid init failed: %s", esp_err_to_name(err));
+            return err;
+        }
+        err = esp_bluedroid_enable();
+        if (err) {
+            ESP_LOGE(TAG, "Bluedroid enable failed: %s", esp_err_to_name(err));
+            return err;
+        }
     }
 
     // Register BLE Mesh event handlers
     esp_ble_mesh_register_prov_callback(ble_mesh_prov_cb);
+    esp_ble_mesh_register_generic_server_callback(ble_mesh_generic_server_cb);
+    esp_ble_mesh_register_config_server_callback(ble_mesh_config_server_cb);
     esp_ble_mesh_register_custom_model_callback(ble_mesh_model_cb);
 
     // Initialize BLE Mesh node
@@ -109,4 +886,4 @@ esp_err_t bluetooth_mesh_init(void) {
     }
     ESP_LOGI(TAG, "BLE Mesh node initialized. Waiting for provisioning...");
     return ESP_OK;
-} 
\ No newline at end of file
+}
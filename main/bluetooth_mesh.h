@@ -1,9 +1,61 @@
 #ifndef BLUETOOTH_MESH_H
 #define BLUETOOTH_MESH_H
 
+#include <stdint.h>
+#include <stdbool.h>
 #include "esp_err.h"
+#include "bt_gateway.h"
+#include "bt_probe.h"
+
+// Configuration
+#define MESH_PUB_WINDOW_MS 200 // Default: state changes within this window share one publication
+#define MESH_DEDUP_WINDOW_MS 500 // The same transaction from the same source within this is a repeat
+#define MESH_RELAY_RATE 20       // Default: messages heard per second before relaying pauses
+#define MESH_RELAY_BURST 40      // ...beyond a burst of this many
 
 // Initialize BLE Mesh node (Generic OnOff Server)
 esp_err_t bluetooth_mesh_init(void);
 
-#endif // BLUETOOTH_MESH_H 
\ No newline at end of file
+// Generic OnOff state. Changes from the mesh and from the application are
+// both reported to the callback and published.
+typedef void (*mesh_onoff_callback_t)(uint8_t onoff, uint16_t source);
+void bluetooth_mesh_set_onoff_callback(mesh_onoff_callback_t callback);
+uint8_t bluetooth_mesh_get_onoff(void);
+void bluetooth_mesh_set_onoff(uint8_t onoff);
+
+// Publication coalescing. The first change publishes at once; further changes
+// within window_ms are folded into one publication of the state at the end
+// of the window. 0 publishes every change.
+void bluetooth_mesh_set_publish_window(uint32_t window_ms);
+
+// SPP/BLE-to-mesh gateway (see bt_gateway.h). Commands to the same address
+// are packed into batch messages; each command's outcome is reported once.
+// The callback runs with the gateway locked and must not submit or flush.
+typedef void (*mesh_gateway_status_callback_t)(uint32_t origin, uint16_t tag, bt_gw_status_t status);
+void bluetooth_mesh_set_gateway_status_callback(mesh_gateway_status_callback_t callback);
+void bluetooth_mesh_gateway_submit(uint32_t origin, uint16_t tag, uint16_t dst, const uint8_t *message, uint16_t length);
+void bluetooth_mesh_gateway_flush(void);
+void bluetooth_mesh_get_gateway_stats(bt_gw_stats_t *stats);
+
+// Receive filtering for dense deployments
+typedef struct {
+    uint32_t received;         // Messages addressed to this node's models
+    uint32_t duplicates;       // Dropped as repeats before dispatch
+    // Of received, those that arrived while this node relayed and while the
+    // limiter had relaying paused. The stack does not report what it relays,
+    // so these show the load the limiter judged, not packets relayed.
+    uint32_t received_relaying;
+    uint32_t received_paused;
+    uint32_t relay_pauses; // Times the limiter paused relaying
+} mesh_filter_stats_t;
+void bluetooth_mesh_set_relay_limit(uint32_t rate, uint32_t burst);
+void bluetooth_mesh_get_filter_stats(mesh_filter_stats_t *stats);
+
+// Latency and delivery probes (see bt_probe.h). Every node running this
+// firmware answers pings once the probe model has an app key bound.
+esp_err_t bluetooth_mesh_probe_start(uint16_t dst, uint32_t interval_ms, uint8_t ttl, uint8_t padding);
+esp_err_t bluetooth_mesh_probe_stop(uint16_t dst);
+esp_err_t bluetooth_mesh_probe_get_stats(uint16_t dst, bt_probe_stats_t *stats);
+void bluetooth_mesh_print_probe_report(void);
+
+#endif // BLUETOOTH_MESH_H
@@ -1,38 +1,286 @@
 /*
- * Bluetooth SPP/BLE UART Implementation (up to 8 connections)
+ * Bluetooth SPP/BLE UART Implementation (up to MAX_CONNECTIONS connections)
  *
  * This implementation provides both Classic Bluetooth SPP and BLE UART functionality
- * with support for up to 8 concurrent connections, message relay, and status monitoring.
+ * with support for up to MAX_CONNECTIONS concurrent connections (8 by default),
+ * message relay, and status monitoring.
  */
 
 #include "bluetooth_spp.h"
+#include "freertos/timers.h"
+#include "esp_timer.h"
+#include "bt_packet_pool.h"
+#include "bt_ring.h"
+#include "bt_sched.h"
+#include "bt_handle_index.h"
+#include "bt_stats.h"
+#include "bt_log.h"
+#include "bt_framer.h"
+#include "bt_link.h"
+#include "bt_rpc.h"
+#include "bt_zip.h"
+#include "bt_capture.h"
 
 static const char *TAG = "BT_SPP";
 
+#define LOG_DRAIN_INTERVAL_MS 100
+#define LOG_TASK_STACK 3072
+
+#define INVALID_HANDLE 0xFFFFFFFF
+#define INFLIGHT_WITHDRAWN 0xFFFFFFFF // In-flight broadcast id of a write the stack refused
+#define BLE_DEFAULT_MTU 23
+#define BLE_NOTIFY_OVERHEAD 3 // ATT opcode and attribute handle
+#define SLOT_MASK_WORDS ((MAX_CONNECTIONS + 31) / 32)
+#define DISPATCH_TICK_MS 20 // Dispatch task wake-up period while transfers or RPC calls are outstanding
+#define XFER_MIN_CHUNK 64  // Smallest chunk offered, even on links with a smaller payload
+
+// Compression negotiation state of a slot
+enum {
+    ZIP_OFF = 0,
+    ZIP_AWAIT_HELLO, // Until the first received data says whether the peer offers it
+    ZIP_ACTIVE
+};
+
+// One compressed connection's codec state
+typedef struct {
+    uint32_t handle;           // Connection it was assigned to
+    uint32_t slot;
+    bt_zip_encoder_t encoder;  // Message task
+    bt_zip_decoder_t decoder;  // Dispatch task
+    bt_framer_t framer;        // Dispatch task: splits the received stream into blocks
+} zip_stream_t;
+
+// Bulk transfer ownership of a slot
+enum {
+    XFER_FREE = 0,
+    XFER_CLAIMED, // An application task is setting the transfer up
+    XFER_ACTIVE   // The dispatch task owns it
+};
+
+_Static_assert(TRAFFIC_CLASS_COUNT == BT_LANES, "Traffic classes map one-to-one onto scheduler lanes");
+
+// Link type of a connection slot
+typedef enum {
+    TRANSPORT_SPP = 0,
+    TRANSPORT_BLE
+} transport_t;
+
+// Per-connection data path state. The connection table below is only written
+// on connect/disconnect under connections_mutex; the data path uses these
+// atomics and rings instead, so Bluetooth callbacks never block on it.
+typedef struct {
+    _Atomic uint32_t handle;
+    _Atomic int state;
+    _Atomic int tx_credits;     // Writes the link may still accept before a completion
+    int tx_credit_limit;        // Allowance for the slot's transport
+    _Atomic bool tx_congested;  // Set by the stack's congestion events
+    _Atomic int rx_in_flight;   // Pool buffers held by this connection's RX path
+    transport_t transport;
+    portMUX_TYPE tx_lock; // Serializes application senders on this slot
+    _Atomic uint16_t link_payload_max; // Largest single write the link takes
+    _Atomic bool notify_enabled;       // BLE: client enabled notifications on the TX characteristic
+    uint16_t tx_offset;                // Bytes of the head TX message already written (BLE segments)
+    int tx_lane;                       // Lane of that message while tx_offset is non-zero
+    bt_ring_t rx_ring;    // Bluetooth callback -> message task
+    bt_ring_t tx_rings[BT_LANES]; // Application senders -> message task, one per traffic class
+    bt_lane_sched_t tx_lanes;     // Owned by the message task
+    bool tx_lanes_strict;         // Its copy of the lane policy
+    _Atomic bool tx_lanes_stale;  // Lane policy changed or slot reopened; the message task reloads
+    bt_ring_t dispatch_ring; // Message task -> dispatch task (received data)
+    
+    // Statistics. The Bluetooth task is the only writer of the counters in
+    // connections[] and publishes them under stats_lock; latency.rx_delivery
+    // belongs to the dispatch task and the rates to the stats timer.
+    bt_seqlock_t stats_lock;
+    connection_latency_t latency;
+    uint32_t tx_inflight_us[TX_INFLIGHT_MAX]; // Send-call times of writes awaiting completion
+    _Atomic uint32_t tx_inflight_broadcast[TX_INFLIGHT_MAX]; // Their broadcast ids, 0 for unicast
+    _Atomic uint32_t tx_inflight_head; // Pushed by the message task
+    _Atomic uint32_t tx_inflight_tail; // Claimed with compare-and-swap (take_inflight)
+    uint32_t closed_handle;            // Handle of the connection last closed here
+    uint64_t rate_last_rx_bytes;
+    uint64_t rate_last_tx_bytes;
+    bt_link_t link; // Link profile, owned by the stats timer
+    _Atomic uint32_t reap_handle; // Idle peer the stats timer asks the message task to close
+    _Atomic uint32_t tx_dropped;  // Broadcasts not queued here; counted by the broadcasting task
+    
+    // Framing. frame_config holds the BT_FRAME_* flags in its low byte and a
+    // change count above them, so the message task restarts reassembly on any
+    // change or reconnect; the framer itself belongs to the dispatch task.
+    _Atomic uint32_t frame_config;
+    bt_framer_t framer;
+    
+    // Bulk transfer. While xfer_state is XFER_ACTIVE, frames from xfer_handle
+    // go to the transfer instead of the frame callback, and only the dispatch
+    // task touches xfer; xfer_cancel asks it to abort.
+    _Atomic int xfer_state;
+    _Atomic bool xfer_cancel;
+    uint32_t xfer_handle;
+    bt_xfer_t xfer;
+    
+    // Compression. The dispatch task settles zip_state with the first received
+    // data and assigns the stream; the message task switches zip_tx on once
+    // its hello reply is on the link and encodes every later message.
+    _Atomic int zip_state;
+    zip_stream_t *zip;
+    bool zip_tx;
+    
+    // TX coalescing, all under tx_lock. The open batch is a pool buffer that
+    // senders append to until it is pushed onto the TX ring of its class.
+    tx_coalesce_config_t coalesce;
+    uint16_t batch_buffer;       // BT_POOL_INVALID when no batch is open
+    uint8_t batch_lane;
+    uint16_t batch_length;
+    uint32_t batch_timestamp_us; // First send into the batch, for TX latency
+    esp_timer_handle_t batch_timer;
+} conn_slot_t;
+
 // Global variables
 static connection_info_t connections[MAX_CONNECTIONS];
+static conn_slot_t slots[MAX_CONNECTIONS];
 static SemaphoreHandle_t connections_mutex;
-static QueueHandle_t message_queue;
 static TaskHandle_t message_task_handle;
+static TaskHandle_t dispatch_task_handle;
+static TimerHandle_t stats_timer;
+static TaskHandle_t log_task_handle;
+static _Atomic uint32_t active_slots[SLOT_MASK_WORDS]; // Slots with work for the message task
+static _Atomic uint32_t dispatch_slots[SLOT_MASK_WORDS]; // Slots with received data for the dispatch task
+static _Atomic uint32_t rx_class_slots[BT_LANES][SLOT_MASK_WORDS]; // Slots by RX traffic class
+// Published under lane_policy_seq; writers are serialized by lane_policy_mux
+// and each slot's lanes are reloaded by the message task (load_tx_lanes)
+static lane_policy_config_t lane_policy = {
+    .policy = LANE_DEFAULT_POLICY,
+    .weights = LANE_DEFAULT_WEIGHTS,
+};
+static bt_seqlock_t lane_policy_seq;
+static portMUX_TYPE lane_policy_mux = portMUX_INITIALIZER_UNLOCKED;
+static bt_drr_t rx_drr; // Owned by the message task, weights set by the application
+static bt_drr_t tx_drr;
+// Published under rx_policy_seq, writers serialized by rx_policy_mux; the
+// Bluetooth callbacks read a copy per packet (load_rx_policy)
+static rx_policy_config_t rx_policy = {
+    .policy = RX_DEFAULT_POLICY,
+    .deadline_ms = RX_DEFAULT_DEADLINE_MS,
+    .quota = RX_DEFAULT_QUOTA,
+};
+static bt_seqlock_t rx_policy_seq;
+static portMUX_TYPE rx_policy_mux = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t rx_space_sem; // Given by the pipeline when RX_POLICY_BLOCK waits
+
+// Per-stage CPU accounting, each written only by its own stage
+typedef struct {
+    bt_seqlock_t lock;
+    uint64_t busy_us;
+    uint32_t messages;
+} stage_stats_t;
+
+static stage_stats_t io_stats;
+static stage_stats_t dispatch_stats;
+
+// Storage for the module's RTOS objects, so initialization never touches the
+// heap that Bluedroid depends on
+static StaticSemaphore_t connections_mutex_buffer;
+static StaticSemaphore_t rx_space_sem_buffer;
+static StaticTimer_t stats_timer_buffer;
+static StaticTask_t message_task_buffer;
+static StaticTask_t dispatch_task_buffer;
+static StaticTask_t log_task_buffer;
+static StackType_t message_task_stack[PIPELINE_IO_STACK];
+static StackType_t dispatch_task_stack[PIPELINE_DISPATCH_STACK];
+static StackType_t log_task_stack[LOG_TASK_STACK];
+static _Atomic int rx_space_waiters;
+static uint8_t default_frame_flags = BT_FRAME_NONE;
 static data_received_callback_t data_callback = NULL;
+static frame_received_callback_t frame_callback = NULL;
+static broadcast_complete_callback_t broadcast_callback = NULL;
+static xfer_complete_callback_t xfer_callback = NULL;
+static _Atomic int active_transfers; // Slots in XFER_ACTIVE
+static bool rpc_enabled = false;
+static bool compression_enabled = false;
+static zip_stream_t zip_streams[ZIP_MAX_STREAMS];
+static uint8_t inflate_buffer[BT_ZIP_BLOCK_MAX]; // Dispatch task
+static uint32_t broadcast_ids[BT_PACKET_POOL_SIZE]; // Id of the broadcast a shared buffer carries
+static _Atomic uint32_t next_broadcast_id = 1;
 static bool bluetooth_initialized = false;
 static char device_name[ESP_BT_GAP_MAX_BDNAME_LEN + 1] = DEVICE_NAME;
 static char ble_device_name[ESP_BT_GAP_MAX_BDNAME_LEN + 1] = BLE_DEVICE_NAME;
 
-// BLE UART Service UUIDs
-static const uint16_t BLE_UART_SERVICE_UUID = 0x6E400001B5A3F393E0A9E50E24DCCA9E;
-static const uint16_t BLE_UART_TX_CHAR_UUID = 0x6E400002B5A3F393E0A9E50E24DCCA9E;
-static const uint16_t BLE_UART_RX_CHAR_UUID = 0x6E400003B5A3F393E0A9E50E24DCCA9E;
+// Traffic capture. Bluetooth callbacks and the replayer record under
+// capture_lock; a dump reads the ring while capture_paused keeps them out.
+static bt_capture_t capture;
+static uint8_t capture_buffer[CAPTURE_BUFFER_SIZE];
+static portMUX_TYPE capture_lock = portMUX_INITIALIZER_UNLOCKED;
+static _Atomic bool capture_enabled;
+static bool capture_paused;
+static _Atomic bool replay_running;
+static uint8_t replay_buffer[MAX_PACKET_SIZE]; // Received data padded out where the capture cut it short
+
+// BLE UART service (Nordic UART Service compatible). The peer writes to the RX
+// characteristic and subscribes to notifications on the TX characteristic.
+#define NUS_APP_ID 0
+#define NUS_MAX_VALUE_LEN MAX_PACKET_SIZE // Not the 514 a 517 MTU allows: 512 is the ATT value limit and the largest packet buffer
+
+_Static_assert(NUS_MAX_VALUE_LEN <= BLE_MAX_MTU - BLE_NOTIFY_OVERHEAD, "A NUS value must fit one notification");
+
+enum {
+    NUS_IDX_SVC,
+    NUS_IDX_RX_CHAR,
+    NUS_IDX_RX_VAL,
+    NUS_IDX_TX_CHAR,
+    NUS_IDX_TX_VAL,
+    NUS_IDX_TX_CCC,
+    NUS_IDX_NB,
+};
+
+// 128-bit UUIDs, least significant byte first
+static const uint8_t BLE_UART_SERVICE_UUID[ESP_UUID_LEN_128] = {
+    0x9E, 0xCA, 0xDC, 0x24, 0x0E, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x01, 0x00, 0x40, 0x6E,
+};
+static const uint8_t BLE_UART_RX_CHAR_UUID[ESP_UUID_LEN_128] = {
+    0x9E, 0xCA, 0xDC, 0x24, 0x0E, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x02, 0x00, 0x40, 0x6E,
+};
+static const uint8_t BLE_UART_TX_CHAR_UUID[ESP_UUID_LEN_128] = {
+    0x9E, 0xCA, 0xDC, 0x24, 0x0E, 0xE5, 0xA9, 0xE0, 0x93, 0xF3, 0xA3, 0xB5, 0x03, 0x00, 0x40, 0x6E,
+};
+
+static const uint16_t primary_service_uuid = ESP_GATT_UUID_PRI_SERVICE;
+static const uint16_t character_declaration_uuid = ESP_GATT_UUID_CHAR_DECLARE;
+static const uint16_t character_client_config_uuid = ESP_GATT_UUID_CHAR_CLIENT_CONFIG;
+static const uint8_t char_prop_write = ESP_GATT_CHAR_PROP_BIT_WRITE | ESP_GATT_CHAR_PROP_BIT_WRITE_NR;
+static const uint8_t char_prop_notify = ESP_GATT_CHAR_PROP_BIT_NOTIFY;
+static uint8_t tx_ccc_value[2] = {0x00, 0x00};
+
+static const esp_gatts_attr_db_t nus_gatt_db[NUS_IDX_NB] = {
+    [NUS_IDX_SVC] = {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&primary_service_uuid, ESP_GATT_PERM_READ,
+                     ESP_UUID_LEN_128, ESP_UUID_LEN_128, (uint8_t *)BLE_UART_SERVICE_UUID}},
+    [NUS_IDX_RX_CHAR] = {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid, ESP_GATT_PERM_READ,
+                         sizeof(uint8_t), sizeof(uint8_t), (uint8_t *)&char_prop_write}},
+    [NUS_IDX_RX_VAL] = {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_128, (uint8_t *)BLE_UART_RX_CHAR_UUID, ESP_GATT_PERM_WRITE,
+                        NUS_MAX_VALUE_LEN, 0, NULL}},
+    [NUS_IDX_TX_CHAR] = {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid, ESP_GATT_PERM_READ,
+                         sizeof(uint8_t), sizeof(uint8_t), (uint8_t *)&char_prop_notify}},
+    [NUS_IDX_TX_VAL] = {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_128, (uint8_t *)BLE_UART_TX_CHAR_UUID, ESP_GATT_PERM_READ,
+                        NUS_MAX_VALUE_LEN, 0, NULL}},
+    [NUS_IDX_TX_CCC] = {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_client_config_uuid,
+                        ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE, sizeof(tx_ccc_value), sizeof(tx_ccc_value), tx_ccc_value}},
+};
+
+// BLE notification target, valid once the UART service is created
+static esp_gatt_if_t ble_gatts_if = ESP_GATT_IF_NONE;
+static uint16_t nus_handles[NUS_IDX_NB];
+static uint16_t ble_tx_attr_handle = 0;
 
 // BLE GATT interface
 static uint8_t adv_config_done = 0;
 #define adv_config_flag      (1 << 0)
 #define scan_rsp_config_flag (1 << 1)
 
+// The 128-bit service UUID leaves no room for the name in the advertising
+// packet, so the name goes in the scan response
 static esp_ble_adv_data_t adv_data = {
     .set_scan_rsp = false,
-    .include_name = true,
-    .include_txpower = true,
+    .include_name = false,
+    .include_txpower = false,
     .min_interval = 0x0006,
     .max_interval = 0x0010,
     .appearance = 0x00,
@@ -41,7 +289,7 @@ static esp_ble_adv_data_t adv_data = {
     .service_data_len = 0,
     .p_service_data = NULL,
     .service_uuid_len = sizeof(BLE_UART_SERVICE_UUID),
-    .p_service_uuid = (uint8_t *)&BLE_UART_SERVICE_UUID,
+    .p_service_uuid = (uint8_t *)BLE_UART_SERVICE_UUID,
     .flag = (ESP_BLE_ADV_FLAG_GEN_DISC | ESP_BLE_ADV_FLAG_BREDR_NOT_SPT),
 };
 
@@ -70,13 +318,77 @@ static esp_ble_adv_params_t adv_params = {
 
 // Function prototypes
 static void message_task(void *pvParameters);
+static void dispatch_task(void *pvParameters);
+static void record_stage(stage_stats_t *stats, int64_t start_us, uint32_t messages);
+static void signal_rx_space(void);
 static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t *param);
 static void gatts_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param);
 static void spp_event_handler(esp_spp_cb_event_t event, esp_spp_cb_param_t *param);
 static uint32_t find_free_connection_slot(void);
+static bool slot_drained(uint32_t conn_idx);
+static uint32_t drain_slot(uint32_t conn_idx);
 static uint32_t find_connection_by_handle(uint32_t handle);
-static void update_connection_activity(uint32_t conn_handle);
-static void print_connection_status(void);
+static void update_connection_activity(uint32_t conn_idx);
+static void mark_slot_active(uint32_t conn_idx);
+static void open_slot(uint32_t conn_idx, uint32_t handle, transport_t transport);
+static void close_slot(uint32_t conn_idx);
+static uint32_t connect_peer(uint32_t handle, const uint8_t *address, transport_t transport);
+static uint32_t disconnect_peer(uint32_t handle);
+static void receive_data(uint32_t conn_handle, const uint8_t *data, uint16_t length);
+static void set_notify(uint32_t conn_handle, bool enabled);
+static void set_link_mtu(uint32_t conn_handle, uint16_t mtu);
+static void capture_event(bt_capture_type_t type, uint32_t handle, uint32_t value, bool flag, const uint8_t *data, uint16_t length);
+static void replay_event(const bt_capture_event_t *event);
+static void queue_received_data(uint32_t conn_idx, uint32_t conn_handle, const uint8_t *data, uint16_t length);
+static void count_rx_drop(uint32_t conn_idx);
+static void count_tx_drop(uint32_t conn_idx);
+static void load_rx_policy(rx_policy_config_t *policy);
+static bool wait_for_rx_space(TickType_t deadline);
+static esp_err_t queue_tx_data(uint32_t conn_idx, uint32_t conn_handle, const uint8_t *data, uint16_t length, uint8_t lane);
+static esp_err_t queue_tx_buffer(uint32_t conn_idx, uint32_t conn_handle, uint16_t buffer, uint16_t length, uint8_t type, uint8_t lane);
+static esp_err_t coalesce_tx_data(uint32_t conn_idx, uint32_t conn_handle, const uint8_t *data, uint16_t length, uint8_t lane);
+static bool push_tx_batch(conn_slot_t *slot, uint32_t conn_idx);
+static void flush_tx_batch(uint32_t conn_idx);
+static void batch_timer_callback(void *arg);
+static uint8_t frame_flags(const frame_config_t *config);
+static void set_frame_flags(conn_slot_t *slot, uint8_t flags);
+static void deliver_message(const bt_message_t *message);
+static void deliver_frame(void *context, const uint8_t *frame, uint16_t length);
+static void deliver_payload(const bt_message_t *message, uint8_t *data, uint16_t length);
+static void negotiate_compression(const bt_message_t *message, int offer);
+static void inflate_block(void *context, const uint8_t *block, uint16_t length);
+static bool encode_tx_message(conn_slot_t *slot, int lane, bt_message_t *message);
+static esp_err_t queue_frame(uint32_t conn_idx, uint32_t conn_handle, const uint8_t *data, uint16_t length, uint8_t lane);
+static esp_err_t claim_transfer(uint32_t conn_handle, uint32_t *conn_idx);
+static void activate_transfer(uint32_t conn_idx, uint32_t conn_handle);
+static bool xfer_send_packet(void *context, const uint8_t *packet, uint16_t length, bool control);
+static void service_transfers(void);
+static void check_transfer_done(uint32_t conn_idx);
+static uint32_t now_ms(void);
+static bool rpc_send_packet(uint32_t conn_handle, const uint8_t *packet, uint16_t length);
+static bool dispatch_needs_tick(void);
+static bool tx_ready(conn_slot_t *slot);
+static uint32_t tx_lane_mask(conn_slot_t *slot);
+static int select_tx_lane(conn_slot_t *slot);
+static void load_tx_lanes(conn_slot_t *slot);
+static uint32_t tx_backlog(conn_slot_t *slot);
+static uint32_t take_next_slot(uint32_t *round, int w);
+static void set_rx_class(uint32_t conn_idx, uint8_t traffic_class);
+static uint16_t tx_segment_length(conn_slot_t *slot, const bt_message_t *message);
+static bool transmit_message(const bt_message_t *message);
+static void restart_advertising(void);
+static void complete_tx(uint32_t conn_handle, bool success, uint16_t length);
+static bool take_inflight(conn_slot_t *slot, uint32_t *sent_us, uint32_t *broadcast_id);
+static void pop_withdrawn(conn_slot_t *slot);
+static void fail_inflight(conn_slot_t *slot, uint32_t conn_handle);
+static void set_tx_congested(uint32_t conn_handle, bool congested);
+static void record_rx_activity(uint32_t conn_idx, uint16_t length);
+static void snapshot_connection(uint32_t conn_idx, connection_info_t *info);
+static void stats_timer_callback(TimerHandle_t timer);
+static void manage_link(uint32_t conn_idx, uint32_t rate_bps);
+static void apply_link_profile(uint32_t conn_idx, bt_link_profile_t profile);
+static void log_task(void *pvParameters);
+static void print_log_record(uint8_t level, const char *tag, uint32_t timestamp_us, const char *text);
 
 // Initialize Bluetooth SPP/BLE UART
 void bluetooth_spp_init(void) {
@@ -84,28 +396,74 @@ void bluetooth_spp_init(void) {
     
     ESP_LOGI(TAG, "Initializing Bluetooth SPP/BLE UART...");
     
-    // Initialize mutex for thread safety
-    connections_mutex = xSemaphoreCreateMutex();
-    if (connections_mutex == NULL) {
-        ESP_LOGE(TAG, "Failed to create mutex");
-        return;
-    }
+    // Initialize mutex for thread safety. Every RTOS object below is
+    // statically allocated, so none of them can fail for lack of memory.
+    connections_mutex = xSemaphoreCreateMutexStatic(&connections_mutex_buffer);
+    rx_space_sem = xSemaphoreCreateBinaryStatic(&rx_space_sem_buffer);
     
-    // Initialize message queue
-    message_queue = xQueueCreate(20, sizeof(bt_message_t));
-    if (message_queue == NULL) {
-        ESP_LOGE(TAG, "Failed to create message queue");
-        vSemaphoreDelete(connections_mutex);
-        return;
-    }
+    // Initialize packet pool
+    bt_pool_init();
     
-    // Initialize connection array
+    bt_drr_init(&rx_drr);
+    bt_drr_init(&tx_drr);
+    bt_index_init();
+    
+    // Initialize connection array and per-slot rings
     memset(connections, 0, sizeof(connections));
+    for (int i = 0; i < ZIP_MAX_STREAMS; i++) {
+        zip_streams[i].handle = INVALID_HANDLE;
+    }
     for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        connections[i].handle = 0xFFFFFFFF;
+        connections[i].handle = INVALID_HANDLE;
         connections[i].state = CONN_STATE_DISCONNECTED;
+        atomic_init(&slots[i].handle, INVALID_HANDLE);
+        slots[i].closed_handle = INVALID_HANDLE;
+        atomic_init(&slots[i].reap_handle, INVALID_HANDLE);
+        atomic_init(&slots[i].state, CONN_STATE_DISCONNECTED);
+        atomic_init(&slots[i].tx_credits, TX_CREDITS_PER_CONNECTION);
+        slots[i].tx_credit_limit = TX_CREDITS_PER_CONNECTION;
+        atomic_init(&slots[i].tx_congested, false);
+        atomic_init(&slots[i].rx_in_flight, 0);
+        atomic_init(&slots[i].xfer_state, XFER_FREE);
+        atomic_init(&slots[i].xfer_cancel, false);
+        atomic_init(&slots[i].zip_state, ZIP_OFF);
+        portMUX_INITIALIZE(&slots[i].tx_lock);
+        bt_ring_init(&slots[i].rx_ring);
+        for (int lane = 0; lane < BT_LANES; lane++) {
+            bt_ring_init(&slots[i].tx_rings[lane]);
+        }
+        bt_ring_init(&slots[i].dispatch_ring);
+        slots[i].batch_buffer = BT_POOL_INVALID;
+        
+        const esp_timer_create_args_t batch_timer_args = {
+            .callback = batch_timer_callback,
+            .arg = (void *)(uintptr_t)i,
+            .name = "tx_batch",
+        };
+        ESP_ERROR_CHECK(esp_timer_create(&batch_timer_args, &slots[i].batch_timer));
+    }
+    
+    // Data path logging is deferred to a low-priority task so that formatting
+    // and UART output never limit packet throughput
+    bt_log_init();
+    log_task_handle = xTaskCreateStatic(log_task, "bt_log_task", LOG_TASK_STACK, NULL, 1,
+                                        log_task_stack, &log_task_buffer);
+    
+    // Periodic throughput averaging
+    stats_timer = xTimerCreateStatic("bt_stats", pdMS_TO_TICKS(STATS_RATE_INTERVAL_MS), pdTRUE, NULL,
+                                     stats_timer_callback, &stats_timer_buffer);
+    if (xTimerStart(stats_timer, 0) != pdPASS) {
+        ESP_LOGW(TAG, "Throughput averaging unavailable");
     }
     
+    // Start the pipeline, consumer first, before any callback can notify it
+    dispatch_task_handle = xTaskCreateStaticPinnedToCore(dispatch_task, "bt_dispatch_task", PIPELINE_DISPATCH_STACK, NULL,
+                                                         PIPELINE_DISPATCH_PRIORITY, dispatch_task_stack,
+                                                         &dispatch_task_buffer, PIPELINE_DISPATCH_CORE);
+    message_task_handle = xTaskCreateStaticPinnedToCore(message_task, "bt_message_task", PIPELINE_IO_STACK, NULL,
+                                                        PIPELINE_IO_PRIORITY, message_task_stack,
+                                                        &message_task_buffer, PIPELINE_IO_CORE);
+    
     // Initialize Bluetooth controller and stack
     ESP_ERROR_CHECK(esp_bt_controller_mem_release(ESP_BT_MODE_CLASSIC_BT));
     
@@ -147,6 +505,18 @@ void bluetooth_spp_init(void) {
         return;
     }
     
+    // The UART service is created once the app registration completes
+    ret = esp_ble_gatts_app_register(NUS_APP_ID);
+    if (ret) {
+        ESP_LOGE(TAG, "GATTS app register failed: %s", esp_err_to_name(ret));
+        return;
+    }
+    
+    ret = esp_ble_gatt_set_local_mtu(BLE_MAX_MTU);
+    if (ret) {
+        ESP_LOGW(TAG, "Set local MTU failed: %s", esp_err_to_name(ret));
+    }
+    
     // Register SPP callback for Classic Bluetooth
     ret = esp_spp_register_callback(spp_event_handler);
     if (ret) {
@@ -179,30 +549,176 @@ void bluetooth_spp_init(void) {
     }
     adv_config_done |= scan_rsp_config_flag;
     
-    // Start message processing task
-    xTaskCreate(message_task, "bt_message_task", 4096, NULL, 5, &message_task_handle);
-    
     bluetooth_initialized = true;
     ESP_LOGI(TAG, "Bluetooth SPP/BLE UART initialized successfully");
     ESP_LOGI(TAG, "Device name: %s (Classic), %s (BLE)", device_name, ble_device_name);
 }
 
-// Message processing task
+// Message processing task, the first pipeline stage: the single consumer of
+// every slot's RX and TX ring. Producers, write completions and congestion
+// changes mark their slot active and wake it with a task notification. It then
+// runs deficit round robin rounds over the active slots only, for RX hand-off
+// and TX draining separately, until nothing more can be done, so a chatty peer
+// gets no more than its weighted share of bytes and idle slots cost nothing. A
+// link that is congested or out of credits keeps its TX backlog queued without
+// holding up any other link, and a slot whose dispatch ring is full keeps its
+// RX backlog until the dispatch task makes room.
 static void message_task(void *pvParameters) {
     bt_message_t message;
     
     while (1) {
-        if (xQueueReceive(message_queue, &message, portMAX_DELAY) == pdTRUE) {
-            if (message.type == 0) { // Received data
-                if (data_callback) {
-                    data_callback(message.conn_handle, message.data, message.length);
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        int64_t start_us = esp_timer_get_time();
+        uint32_t handled = 0;
+        
+        bool pending = true;
+        while (pending) {
+            pending = false;
+            for (int w = 0; w < SLOT_MASK_WORDS; w++) {
+                uint32_t round = atomic_exchange(&active_slots[w], 0);
+                while (round) {
+                    uint32_t i = take_next_slot(&round, w);
+                    conn_slot_t *slot = &slots[i];
+                    
+                    // Received data: hand it to the dispatch task. Under
+                    // RX_POLICY_DROP_OLDEST the callback may evict the head
+                    // after the peek, so the charge is for what was popped.
+                    if (bt_ring_peek(&slot->rx_ring, &message)) {
+                        uint32_t moved = 0;
+                        bt_drr_replenish(&rx_drr, i);
+                        while (bt_ring_count(&slot->dispatch_ring) < BT_RING_SIZE &&
+                               bt_ring_peek(&slot->rx_ring, &message) && bt_drr_allows(&rx_drr, i, message.length) &&
+                               bt_ring_pop(&slot->rx_ring, &message)) {
+                            bt_drr_charge(&rx_drr, i, message.length);
+                            bt_ring_push(&slot->dispatch_ring, &message);
+                            moved++;
+                        }
+                        if (bt_ring_count(&slot->rx_ring) == 0) {
+                            bt_drr_reset(&rx_drr, i);
+                        }
+                        if (moved > 0) {
+                            atomic_fetch_or(&dispatch_slots[w], 1u << (i % 32));
+                            xTaskNotifyGive(dispatch_task_handle);
+                            signal_rx_space();
+                            handled += moved;
+                        }
+                    }
+                    
+                    // Data to send, lane by lane within the slot's share. A
+                    // closed slot is emptied instead, so nothing queued for the
+                    // peer that left can reach the next one.
+                    if (atomic_exchange(&slot->tx_lanes_stale, false)) {
+                        load_tx_lanes(slot);
+                    }
+                    // An idle peer the stats timer wants closed
+                    uint32_t reap = atomic_exchange(&slot->reap_handle, INVALID_HANDLE);
+                    if (reap != INVALID_HANDLE) {
+                        bluetooth_spp_disconnect(reap);
+                    }
+                    if (atomic_load(&slot->state) != CONN_STATE_CONNECTED) {
+                        handled += drain_slot(i);
+                    } else if (tx_ready(slot) && tx_lane_mask(slot) != 0) {
+                        int lane;
+                        bt_drr_replenish(&tx_drr, i);
+                        while (tx_ready(slot) && (lane = select_tx_lane(slot)) >= 0 &&
+                               bt_ring_peek(&slot->tx_rings[lane], &message)) {
+                            // On a compressing link each message becomes one
+                            // block, encoded just before its first byte goes out
+                            if (slot->zip_tx && !message.encoded && message.type != 3 &&
+                                !encode_tx_message(slot, lane, &message)) {
+                                bt_ring_pop(&slot->tx_rings[lane], &message);
+                                continue;
+                            }
+                            if (!bt_drr_consume(&tx_drr, i, tx_segment_length(slot, &message))) {
+                                break;
+                            }
+                            bt_lane_charge(&slot->tx_lanes, lane);
+                            slot->tx_lane = lane;
+                            if (transmit_message(&message)) {
+                                bt_ring_pop(&slot->tx_rings[lane], &message);
+                            }
+                            handled++;
+                        }
+                        if (tx_backlog(slot) == 0) {
+                            bt_drr_reset(&tx_drr, i);
+                        }
+                    }
+                    
+                    // Still backlogged: serve again next round. A TX backlog that
+                    // is waiting on credits or congestion is re-marked by the
+                    // completion or congestion event instead, and an RX backlog
+                    // behind a full dispatch ring by the dispatch task.
+                    bool rx_backlog = bt_ring_count(&slot->rx_ring) > 0 &&
+                                      bt_ring_count(&slot->dispatch_ring) < BT_RING_SIZE;
+                    if (rx_backlog || (tx_ready(slot) && tx_lane_mask(slot) != 0)) {
+                        atomic_fetch_or(&active_slots[w], 1u << (i % 32));
+                    }
+                }
+                if (atomic_load(&active_slots[w]) != 0) {
+                    pending = true;
+                }
+            }
+        }
+        record_stage(&io_stats, start_us, handled);
+    }
+}
+
+// Dispatch task, the second pipeline stage: delivers what the message task
+// handed off, running framing and the application callbacks away from the
+// core that services the Bluetooth stack
+static void dispatch_task(void *pvParameters) {
+    bt_message_t message;
+    
+    while (1) {
+        // Bulk transfers and RPC calls need a periodic tick for retransmits and timeouts
+        ulTaskNotifyTake(pdTRUE, dispatch_needs_tick() ? pdMS_TO_TICKS(DISPATCH_TICK_MS) : portMAX_DELAY);
+        int64_t start_us = esp_timer_get_time();
+        uint32_t handled = 0;
+        
+        bool pending = true;
+        while (pending) {
+            pending = false;
+            for (int w = 0; w < SLOT_MASK_WORDS; w++) {
+                uint32_t round = atomic_exchange(&dispatch_slots[w], 0);
+                while (round) {
+                    uint32_t i = take_next_slot(&round, w);
+                    
+                    while (bt_ring_pop(&slots[i].dispatch_ring, &message)) {
+                        deliver_message(&message);
+                        handled++;
+                    }
+                    // Room again for data the message task had to hold back
+                    if (bt_ring_count(&slots[i].rx_ring) > 0) {
+                        mark_slot_active(i);
+                    }
+                }
+                if (atomic_load(&dispatch_slots[w]) != 0) {
+                    pending = true;
                 }
-                ESP_LOGI(TAG, "Received %d bytes from connection %lu", message.length, message.conn_handle);
-            } else if (message.type == 1) { // Data to send
-                // Handle sending data (implement based on connection type)
-                ESP_LOGI(TAG, "Sending %d bytes to connection %lu", message.length, message.conn_handle);
             }
         }
+        if (atomic_load(&active_transfers) > 0) {
+            service_transfers();
+        }
+        if (rpc_enabled && bt_rpc_pending() > 0) {
+            bt_rpc_tick(now_ms());
+        }
+        record_stage(&dispatch_stats, start_us, handled);
+    }
+}
+
+// Add one busy period to a stage's accounting
+static void record_stage(stage_stats_t *stats, int64_t start_us, uint32_t messages) {
+    bt_seq_write_begin(&stats->lock);
+    stats->busy_us += esp_timer_get_time() - start_us;
+    stats->messages += messages;
+    bt_seq_write_end(&stats->lock);
+}
+
+// Wake a Bluetooth callback waiting under RX_POLICY_BLOCK
+static void signal_rx_space(void) {
+    if (atomic_load(&rx_space_waiters) > 0) {
+        xSemaphoreGive(rx_space_sem);
     }
 }
 
@@ -236,7 +752,9 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param
             }
             break;
         case ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT:
-            ESP_LOGI(TAG, "Connection parameters updated");
+            ESP_LOGI(TAG, "Connection parameters updated: status %d, interval %d, latency %d, timeout %d",
+                     param->update_conn_params.status, param->update_conn_params.conn_int,
+                     param->update_conn_params.latency, param->update_conn_params.timeout);
             break;
         default:
             break;
@@ -246,51 +764,71 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param
 // GATTS event handler
 static void gatts_event_handler(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t *param) {
     switch (event) {
-        case ESP_GATTS_WRITE_EVT:
-            if (xSemaphoreTake(connections_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-                uint32_t conn_idx = find_connection_by_handle(param->write.conn_id);
-                if (conn_idx < MAX_CONNECTIONS) {
-                    // Queue received data
-                    bt_message_t message;
-                    message.conn_handle = param->write.conn_id;
-                    message.type = 0; // Received
-                    message.length = param->write.len;
-                    memcpy(message.data, param->write.value, param->write.len);
-                    xQueueSend(message_queue, &message, 0);
-                    
-                    update_connection_activity(param->write.conn_id);
-                    connections[conn_idx].bytes_received += param->write.len;
-                }
-                xSemaphoreGive(connections_mutex);
+        case ESP_GATTS_REG_EVT:
+            if (param->reg.status == ESP_GATT_OK) {
+                ble_gatts_if = gatts_if;
+                esp_ble_gatts_create_attr_tab(nus_gatt_db, gatts_if, NUS_IDX_NB, 0);
+            } else {
+                ESP_LOGE(TAG, "GATTS app register failed, status %d", param->reg.status);
+            }
+            break;
+        case ESP_GATTS_CREAT_ATTR_TAB_EVT:
+            if (param->add_attr_tab.status != ESP_GATT_OK || param->add_attr_tab.num_handle != NUS_IDX_NB) {
+                ESP_LOGE(TAG, "Create UART service failed, status %d", param->add_attr_tab.status);
+                break;
             }
+            memcpy(nus_handles, param->add_attr_tab.handles, sizeof(nus_handles));
+            ble_tx_attr_handle = nus_handles[NUS_IDX_TX_VAL];
+            esp_ble_gatts_start_service(nus_handles[NUS_IDX_SVC]);
+            ESP_LOGI(TAG, "BLE UART service started");
             break;
-        case ESP_GATTS_CONNECT_EVT:
+        case ESP_GATTS_WRITE_EVT: {
+            // Data path: no mutex, the slot lookup and ring push are lock-free
+            uint32_t conn_handle = CONN_HANDLE_FROM_BLE(param->write.conn_id);
+            if (param->write.handle == nus_handles[NUS_IDX_RX_VAL]) {
+                receive_data(conn_handle, param->write.value, param->write.len);
+            } else if (param->write.handle == nus_handles[NUS_IDX_TX_CCC] && param->write.len == 2) {
+                set_notify(conn_handle, (param->write.value[0] & 0x01) != 0);
+            }
+            break;
+        }
+        case ESP_GATTS_CONNECT_EVT: {
             ESP_LOGI(TAG, "BLE device connected, conn_id = %d", param->connect.conn_id);
-            if (xSemaphoreTake(connections_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-                uint32_t free_slot = find_free_connection_slot();
-                if (free_slot < MAX_CONNECTIONS) {
-                    connections[free_slot].handle = param->connect.conn_id;
-                    connections[free_slot].state = CONN_STATE_CONNECTED;
-                    memcpy(connections[free_slot].remote_addr, param->connect.remote_bda, 6);
-                    connections[free_slot].last_activity = xTaskGetTickCount();
-                    ESP_LOGI(TAG, "Connection %lu established", free_slot);
-                }
-                xSemaphoreGive(connections_mutex);
+            uint32_t conn_idx = connect_peer(CONN_HANDLE_FROM_BLE(param->connect.conn_id), param->connect.remote_bda,
+                                             TRANSPORT_BLE);
+            if (conn_idx < MAX_CONNECTIONS) {
+                ESP_LOGI(TAG, "Connection %lu established", conn_idx);
             }
+            
+            // Larger link layer packets and, on BLE 5 controllers, the 2M PHY;
+            // the MTU exchange is left to the client, which iOS always starts
+            esp_ble_gap_set_pkt_data_len(param->connect.remote_bda, BLE_DATA_LENGTH);
+#if CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+            esp_ble_gap_set_preferred_phy(param->connect.remote_bda, 0, ESP_BLE_GAP_PHY_2M_PREF_MASK,
+                                          ESP_BLE_GAP_PHY_2M_PREF_MASK, ESP_BLE_GAP_PHY_OPTIONS_NO_PREF);
+#endif
+            // Connectable advertising stops on connect; keep accepting peers
+            restart_advertising();
             break;
-        case ESP_GATTS_DISCONNECT_EVT:
+        }
+        case ESP_GATTS_DISCONNECT_EVT: {
             ESP_LOGI(TAG, "BLE device disconnected, conn_id = %d", param->disconnect.conn_id);
-            if (xSemaphoreTake(connections_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-                uint32_t conn_idx = find_connection_by_handle(param->disconnect.conn_id);
-                if (conn_idx < MAX_CONNECTIONS) {
-                    connections[conn_idx].state = CONN_STATE_DISCONNECTED;
-                    connections[conn_idx].handle = 0xFFFFFFFF;
-                    ESP_LOGI(TAG, "Connection %lu closed", conn_idx);
-                }
-                xSemaphoreGive(connections_mutex);
+            uint32_t conn_idx = disconnect_peer(CONN_HANDLE_FROM_BLE(param->disconnect.conn_id));
+            if (conn_idx < MAX_CONNECTIONS) {
+                ESP_LOGI(TAG, "Connection %lu closed", conn_idx);
             }
-            // Restart advertising
-            esp_ble_gap_start_advertising(&adv_params);
+            restart_advertising();
+            break;
+        }
+        case ESP_GATTS_MTU_EVT:
+            set_link_mtu(CONN_HANDLE_FROM_BLE(param->mtu.conn_id), param->mtu.mtu);
+            break;
+        case ESP_GATTS_CONF_EVT:
+            // Notification handed to the controller: return the TX credit
+            complete_tx(CONN_HANDLE_FROM_BLE(param->conf.conn_id), param->conf.status == ESP_GATT_OK, param->conf.len);
+            break;
+        case ESP_GATTS_CONGEST_EVT:
+            set_tx_congested(CONN_HANDLE_FROM_BLE(param->congest.conn_id), param->congest.congested);
             break;
         default:
             break;
@@ -307,110 +845,389 @@ static void spp_event_handler(esp_spp_cb_event_t event, esp_spp_cb_param_t *para
         case ESP_SPP_START_EVT:
             ESP_LOGI(TAG, "SPP server started");
             break;
-        case ESP_SPP_SRV_OPEN_EVT:
+        case ESP_SPP_SRV_OPEN_EVT: {
             ESP_LOGI(TAG, "SPP client connected");
-            if (xSemaphoreTake(connections_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-                uint32_t free_slot = find_free_connection_slot();
-                if (free_slot < MAX_CONNECTIONS) {
-                    connections[free_slot].handle = param->srv_open.handle;
-                    connections[free_slot].state = CONN_STATE_CONNECTED;
-                    memcpy(connections[free_slot].remote_addr, param->srv_open.rem_bda, 6);
-                    connections[free_slot].last_activity = xTaskGetTickCount();
-                    ESP_LOGI(TAG, "SPP Connection %lu established", free_slot);
-                }
-                xSemaphoreGive(connections_mutex);
+            uint32_t conn_idx = connect_peer(param->srv_open.handle, param->srv_open.rem_bda, TRANSPORT_SPP);
+            if (conn_idx < MAX_CONNECTIONS) {
+                ESP_LOGI(TAG, "SPP Connection %lu established", conn_idx);
             }
             break;
-        case ESP_SPP_CLOSE_EVT:
+        }
+        case ESP_SPP_CLOSE_EVT: {
             ESP_LOGI(TAG, "SPP connection closed");
-            if (xSemaphoreTake(connections_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-                uint32_t conn_idx = find_connection_by_handle(param->close.handle);
-                if (conn_idx < MAX_CONNECTIONS) {
-                    connections[conn_idx].state = CONN_STATE_DISCONNECTED;
-                    connections[conn_idx].handle = 0xFFFFFFFF;
-                    ESP_LOGI(TAG, "SPP Connection %lu closed", conn_idx);
-                }
-                xSemaphoreGive(connections_mutex);
+            uint32_t conn_idx = disconnect_peer(param->close.handle);
+            if (conn_idx < MAX_CONNECTIONS) {
+                ESP_LOGI(TAG, "SPP Connection %lu closed", conn_idx);
             }
             break;
+        }
         case ESP_SPP_DATA_IND_EVT:
-            if (xSemaphoreTake(connections_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-                uint32_t conn_idx = find_connection_by_handle(param->data_ind.handle);
-                if (conn_idx < MAX_CONNECTIONS) {
-                    // Queue received data
-                    bt_message_t message;
-                    message.conn_handle = param->data_ind.handle;
-                    message.type = 0; // Received
-                    message.length = param->data_ind.len;
-                    memcpy(message.data, param->data_ind.data, param->data_ind.len);
-                    xQueueSend(message_queue, &message, 0);
-                    
-                    update_connection_activity(param->data_ind.handle);
-                    connections[conn_idx].bytes_received += param->data_ind.len;
-                }
-                xSemaphoreGive(connections_mutex);
-            }
+            // Data path: no mutex, the slot lookup and ring push are lock-free
+            receive_data(param->data_ind.handle, param->data_ind.data, param->data_ind.len);
             break;
         case ESP_SPP_WRITE_EVT:
             if (param->write.status != ESP_SPP_SUCCESS) {
                 ESP_LOGE(TAG, "SPP write failed");
             }
+            complete_tx(param->write.handle, param->write.status == ESP_SPP_SUCCESS, param->write.len);
+            // The write was accepted but the link is now congested; hold off
+            // until ESP_SPP_CONG_EVT reports it clear again
+            if (param->write.cong) {
+                set_tx_congested(param->write.handle, true);
+            }
+            break;
+        case ESP_SPP_CONG_EVT:
+            set_tx_congested(param->cong.handle, param->cong.cong);
             break;
         default:
             break;
     }
 }
 
-// Send data to specific connection
+// Send data to specific connection. The data is copied into a pool buffer and
+// queued on the connection's TX ring; the message task performs the write.
 esp_err_t bluetooth_spp_send_data(uint32_t conn_handle, const uint8_t *data, uint16_t length) {
     if (!bluetooth_initialized || !data || length == 0 || length > MAX_PACKET_SIZE) {
         return ESP_ERR_INVALID_ARG;
     }
     
-    if (xSemaphoreTake(connections_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-        uint32_t conn_idx = find_connection_by_handle(conn_handle);
-        if (conn_idx < MAX_CONNECTIONS && connections[conn_idx].state == CONN_STATE_CONNECTED) {
-            esp_err_t ret = esp_spp_write(conn_handle, length, (uint8_t *)data);
-            if (ret == ESP_OK) {
-                connections[conn_idx].bytes_sent += length;
-                update_connection_activity(conn_handle);
-            }
-            xSemaphoreGive(connections_mutex);
-            return ret;
-        }
-        xSemaphoreGive(connections_mutex);
+    uint32_t conn_idx = find_connection_by_handle(conn_handle);
+    if (conn_idx >= MAX_CONNECTIONS || atomic_load(&slots[conn_idx].state) != CONN_STATE_CONNECTED) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    
+    return queue_tx_data(conn_idx, conn_handle, data, length, TRAFFIC_CLASS_INTERACTIVE);
+}
+
+// Send data in a given traffic class, e.g. a control command that must not
+// wait behind a bulk transfer to the same peer
+esp_err_t bluetooth_spp_send_data_class(uint32_t conn_handle, const uint8_t *data, uint16_t length, traffic_class_t traffic_class) {
+    if (!bluetooth_initialized || !data || length == 0 || length > MAX_PACKET_SIZE ||
+        traffic_class >= TRAFFIC_CLASS_COUNT) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    
+    uint32_t conn_idx = find_connection_by_handle(conn_handle);
+    if (conn_idx >= MAX_CONNECTIONS || atomic_load(&slots[conn_idx].state) != CONN_STATE_CONNECTED) {
+        return ESP_ERR_NOT_FOUND;
     }
     
-    return ESP_ERR_NOT_FOUND;
+    return queue_tx_data(conn_idx, conn_handle, data, length, traffic_class);
 }
 
-// Broadcast data to all connected devices
-esp_err_t bluetooth_spp_broadcast_data(const uint8_t *data, uint16_t length) {
+// Broadcast data to every connected SPP and BLE peer. The data is copied once
+// into a pool buffer whose reference is queued on each peer's TX ring, so the
+// call returns without waiting on any link. broadcast_id (may be NULL)
+// receives the id passed to the broadcast callback as each peer completes.
+// Succeeds if any peer was queued: retrying would duplicate the data to those
+// peers, so one that could not take it is only counted in its tx_dropped.
+esp_err_t bluetooth_spp_broadcast_data(const uint8_t *data, uint16_t length, uint32_t *broadcast_id) {
     if (!bluetooth_initialized || !data || length == 0 || length > MAX_PACKET_SIZE) {
         return ESP_ERR_INVALID_ARG;
     }
     
+    uint16_t buffer = bt_pool_alloc(length);
+    if (buffer == BT_POOL_INVALID) {
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(bt_pool_buffer(buffer), data, length);
+    
+    uint32_t id = atomic_fetch_add(&next_broadcast_id, 1);
+    while (id == 0 || id == INFLIGHT_WITHDRAWN) {
+        id = atomic_fetch_add(&next_broadcast_id, 1); // Both mark writes that are not broadcasts
+    }
+    broadcast_ids[buffer] = id;
+    if (broadcast_id) {
+        *broadcast_id = id;
+    }
+    
     esp_err_t ret = ESP_OK;
     int sent_count = 0;
     
-    if (xSemaphoreTake(connections_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-        for (int i = 0; i < MAX_CONNECTIONS; i++) {
-            if (connections[i].state == CONN_STATE_CONNECTED) {
-                esp_err_t write_ret = esp_spp_write(connections[i].handle, length, (uint8_t *)data);
-                if (write_ret == ESP_OK) {
-                    connections[i].bytes_sent += length;
-                    update_connection_activity(connections[i].handle);
-                    sent_count++;
-                } else {
-                    ret = write_ret;
-                }
+    // One reference per queued peer; the allocation's own reference is
+    // dropped at the end, after which the last completed peer frees it
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (atomic_load(&slots[i].state) == CONN_STATE_CONNECTED) {
+            bt_pool_retain(buffer);
+            esp_err_t queue_ret = queue_tx_buffer(i, atomic_load(&slots[i].handle), buffer, length, 2, TRAFFIC_CLASS_INTERACTIVE);
+            if (queue_ret == ESP_OK) {
+                sent_count++;
+            } else {
+                count_tx_drop(i);
+                ret = queue_ret;
             }
         }
-        xSemaphoreGive(connections_mutex);
     }
+    bt_pool_free(buffer);
     
-    ESP_LOGI(TAG, "Broadcast sent to %d connections", sent_count);
-    return ret;
+    BT_LOGI(BT_LOG_TAG_SPP, BT_LOG_FMT_BROADCAST, sent_count, 0, 0);
+    return sent_count > 0 ? ESP_OK : ret;
+}
+
+// Set the bandwidth share of a connection relative to the others (default 1).
+// Applies to both RX delivery and TX draining until the connection closes.
+esp_err_t bluetooth_spp_set_connection_weight(uint32_t conn_handle, uint16_t weight) {
+    uint32_t conn_idx = find_connection_by_handle(conn_handle);
+    if (conn_idx >= MAX_CONNECTIONS) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    
+    bt_drr_set_weight(&rx_drr, conn_idx, weight);
+    bt_drr_set_weight(&tx_drr, conn_idx, weight);
+    return ESP_OK;
+}
+
+// Select how received data is handled when the RX path is full
+void bluetooth_spp_set_rx_policy(const rx_policy_config_t *config) {
+    if (!config) {
+        return;
+    }
+    portENTER_CRITICAL(&rx_policy_mux);
+    bt_seq_write_begin(&rx_policy_seq);
+    rx_policy = *config;
+    bt_seq_write_end(&rx_policy_seq);
+    portEXIT_CRITICAL(&rx_policy_mux);
+    ESP_LOGI(TAG, "RX policy %d (deadline %lu ms, quota %d)", config->policy, config->deadline_ms, config->quota);
+}
+
+// Framing applied to connections opened from now on
+void bluetooth_spp_set_default_framing(const frame_config_t *config) {
+    if (!config) {
+        return;
+    }
+    default_frame_flags = frame_flags(config);
+}
+
+// Offer compression to peers that connect from now on. A peer takes it up by
+// starting its data with a bt_zip hello; anything else leaves the connection
+// uncompressed.
+void bluetooth_spp_set_compression(bool enabled) {
+    compression_enabled = enabled;
+}
+
+// Change the framing of one open connection. Any partial frame held for it is
+// discarded.
+esp_err_t bluetooth_spp_set_framing(uint32_t conn_handle, const frame_config_t *config) {
+    if (!config) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    
+    uint32_t conn_idx = find_connection_by_handle(conn_handle);
+    if (conn_idx >= MAX_CONNECTIONS) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    
+    set_frame_flags(&slots[conn_idx], frame_flags(config));
+    return ESP_OK;
+}
+
+// Send one frame, encoded with the connection's framing straight into the pool
+// buffer that is queued for transmission. The encoded frame must fit in one
+// packet.
+esp_err_t bluetooth_spp_send_frame(uint32_t conn_handle, const uint8_t *data, uint16_t length) {
+    if (!bluetooth_initialized || !data || length == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    
+    uint32_t conn_idx = find_connection_by_handle(conn_handle);
+    if (conn_idx >= MAX_CONNECTIONS || atomic_load(&slots[conn_idx].state) != CONN_STATE_CONNECTED) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    return queue_frame(conn_idx, conn_handle, data, length, TRAFFIC_CLASS_INTERACTIVE);
+}
+
+// Receive one bulk transfer on a framed connection into the sink. The peer
+// opens it with BT_XFER_OPEN; the transfer callback reports the outcome.
+esp_err_t bluetooth_spp_xfer_receive(uint32_t conn_handle, const bt_xfer_sink_t *sink) {
+    if (!sink || !sink->begin || !sink->write || !sink->finish) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    
+    uint32_t conn_idx;
+    esp_err_t ret = claim_transfer(conn_handle, &conn_idx);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    bt_xfer_listen(&slots[conn_idx].xfer, sink);
+    activate_transfer(conn_idx, conn_handle);
+    return ESP_OK;
+}
+
+// Send size bytes read from the source as one bulk transfer on a framed
+// connection. Chunks are sized to the link, and the peer may resume a
+// transfer with the same id from where an earlier attempt stopped.
+esp_err_t bluetooth_spp_xfer_send(uint32_t conn_handle, uint32_t transfer_id, uint32_t size, const bt_xfer_source_t *source) {
+    if (!source || !source->read || size == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    
+    uint32_t conn_idx;
+    esp_err_t ret = claim_transfer(conn_handle, &conn_idx);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+    
+    // Largest chunk whose DATA packet still fits one write once framed
+    conn_slot_t *slot = &slots[conn_idx];
+    uint8_t flags = atomic_load(&slot->frame_config) & 0xFF;
+    uint16_t payload_max = atomic_load(&slot->link_payload_max);
+    uint16_t chunk = BT_XFER_CHUNK_MAX;
+    while (chunk > XFER_MIN_CHUNK && bt_framer_encoded_size(flags, chunk + BT_XFER_DATA_OVERHEAD) > payload_max) {
+        chunk--;
+    }
+    
+    bt_xfer_start(&slot->xfer, transfer_id, size, chunk, source, now_ms());
+    activate_transfer(conn_idx, conn_handle);
+    return ESP_OK;
+}
+
+// Abort the connection's bulk transfer; the transfer callback still runs
+esp_err_t bluetooth_spp_xfer_cancel(uint32_t conn_handle) {
+    uint32_t conn_idx = find_connection_by_handle(conn_handle);
+    if (conn_idx >= MAX_CONNECTIONS || atomic_load(&slots[conn_idx].xfer_state) != XFER_ACTIVE) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    atomic_store(&slots[conn_idx].xfer_cancel, true);
+    xTaskNotifyGive(dispatch_task_handle);
+    return ESP_OK;
+}
+
+// Route RPC packets on framed connections: requests to the handler table
+// (indexed by method id, NULL for client-only use) and responses to the
+// calls awaiting them. Frames starting with BT_RPC_REQUEST or BT_RPC_RESPONSE
+// no longer reach the frame callback.
+void bluetooth_spp_rpc_init(const bt_rpc_handler_t *handlers, uint16_t count) {
+    bt_rpc_init(handlers, count, rpc_send_packet);
+    rpc_enabled = true;
+}
+
+// Start a call without waiting for it; complete runs with the response, or
+// with BT_RPC_TIMEOUT/BT_RPC_DISCONNECTED, on the dispatch task (or the
+// Bluetooth task for a disconnect). Any number of calls, up to
+// BT_RPC_MAX_PENDING in total, may be outstanding on one connection.
+esp_err_t bluetooth_spp_rpc_call(uint32_t conn_handle, uint8_t method, const uint8_t *args, uint16_t length,
+                                 bt_rpc_complete_t complete, void *context, uint32_t timeout_ms, uint16_t *request_id) {
+    if (!rpc_enabled || !bluetooth_initialized) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!complete || length > BT_RPC_ARGS_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    
+    uint32_t conn_idx = find_connection_by_handle(conn_handle);
+    if (conn_idx >= MAX_CONNECTIONS || atomic_load(&slots[conn_idx].state) != CONN_STATE_CONNECTED) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if ((atomic_load(&slots[conn_idx].frame_config) & BT_FRAME_MODE_MASK) == BT_FRAME_NONE) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    
+    uint16_t id = bt_rpc_call(conn_handle, method, args, length, complete, context, timeout_ms, now_ms());
+    if (id == 0) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (request_id) {
+        *request_id = id;
+    }
+    // Make sure the dispatch task is ticking for the timeout
+    xTaskNotifyGive(dispatch_task_handle);
+    return ESP_OK;
+}
+
+// Answer a request whose handler returned BT_RPC_DEFERRED
+esp_err_t bluetooth_spp_rpc_reply(uint32_t conn_handle, uint16_t request_id, uint8_t status, const uint8_t *reply, uint16_t length) {
+    if (!rpc_enabled) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return bt_rpc_reply(conn_handle, request_id, status, reply, length) ? ESP_OK : ESP_FAIL;
+}
+
+// Encode a frame with the connection's framing straight into the pool buffer
+// that is queued for transmission
+static esp_err_t queue_frame(uint32_t conn_idx, uint32_t conn_handle, const uint8_t *data, uint16_t length, uint8_t lane) {
+    uint8_t flags = atomic_load(&slots[conn_idx].frame_config) & 0xFF;
+    uint16_t size = bt_framer_encoded_size(flags, length);
+    if (size > MAX_PACKET_SIZE) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    
+    uint16_t buffer = bt_pool_alloc(size);
+    if (buffer == BT_POOL_INVALID) {
+        return ESP_ERR_NO_MEM;
+    }
+    uint16_t encoded = bt_framer_encode(flags, data, length, bt_pool_buffer(buffer), bt_pool_capacity(buffer));
+    if (encoded == 0) {
+        bt_pool_free(buffer);
+        return ESP_ERR_INVALID_SIZE;
+    }
+    return queue_tx_buffer(conn_idx, conn_handle, buffer, encoded, 1, lane);
+}
+
+// Enable, retune or disable TX coalescing on one connection. Disabling it
+// flushes any open batch.
+esp_err_t bluetooth_spp_set_tx_coalescing(uint32_t conn_handle, const tx_coalesce_config_t *config) {
+    if (!config || (config->flush_threshold > 0 && config->flush_deadline_us == 0)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    
+    uint32_t conn_idx = find_connection_by_handle(conn_handle);
+    if (conn_idx >= MAX_CONNECTIONS) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    
+    portENTER_CRITICAL(&slots[conn_idx].tx_lock);
+    slots[conn_idx].coalesce = *config;
+    portEXIT_CRITICAL(&slots[conn_idx].tx_lock);
+    
+    if (config->flush_threshold == 0) {
+        flush_tx_batch(conn_idx);
+    }
+    return ESP_OK;
+}
+
+// Send a connection's open TX batch now instead of waiting for its deadline
+esp_err_t bluetooth_spp_flush(uint32_t conn_handle) {
+    uint32_t conn_idx = find_connection_by_handle(conn_handle);
+    if (conn_idx >= MAX_CONNECTIONS) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    
+    flush_tx_batch(conn_idx);
+    return ESP_OK;
+}
+
+// Choose how each connection shares its TX between traffic classes
+void bluetooth_spp_set_lane_policy(const lane_policy_config_t *config) {
+    if (!config) {
+        return;
+    }
+    portENTER_CRITICAL(&lane_policy_mux);
+    bt_seq_write_begin(&lane_policy_seq);
+    lane_policy = *config;
+    bt_seq_write_end(&lane_policy_seq);
+    portEXIT_CRITICAL(&lane_policy_mux);
+    
+    // The lanes belong to the message task, which reloads them before it next
+    // sends on each slot
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        atomic_store(&slots[i].tx_lanes_stale, true);
+    }
+}
+
+// Set the class a connection's received data is delivered in: slots in a
+// higher class are served first in every scheduling round
+esp_err_t bluetooth_spp_set_rx_class(uint32_t conn_handle, traffic_class_t traffic_class) {
+    if (traffic_class >= TRAFFIC_CLASS_COUNT) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    
+    uint32_t conn_idx = find_connection_by_handle(conn_handle);
+    if (conn_idx >= MAX_CONNECTIONS) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    
+    set_rx_class(conn_idx, traffic_class);
+    return ESP_OK;
 }
 
 // Disconnect specific connection
@@ -419,11 +1236,21 @@ void bluetooth_spp_disconnect(uint32_t conn_handle) {
         return;
     }
     
+    // A replayed peer has no link to close, so it goes at once
+    if (CONN_HANDLE_IS_REPLAY(conn_handle)) {
+        disconnect_peer(conn_handle);
+        return;
+    }
+    
     if (xSemaphoreTake(connections_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
         uint32_t conn_idx = find_connection_by_handle(conn_handle);
         if (conn_idx < MAX_CONNECTIONS && connections[conn_idx].state == CONN_STATE_CONNECTED) {
             connections[conn_idx].state = CONN_STATE_DISCONNECTING;
-            esp_spp_disconnect(conn_handle);
+            if (CONN_HANDLE_IS_BLE(conn_handle)) {
+                esp_ble_gatts_close(ble_gatts_if, CONN_HANDLE_TO_BLE(conn_handle));
+            } else {
+                esp_spp_disconnect(conn_handle);
+            }
             ESP_LOGI(TAG, "Disconnecting connection %lu", conn_idx);
         }
         xSemaphoreGive(connections_mutex);
@@ -440,7 +1267,7 @@ void bluetooth_spp_get_connection_info(connection_info_t *conn_info, uint8_t *co
         *count = 0;
         for (int i = 0; i < MAX_CONNECTIONS; i++) {
             if (connections[i].state == CONN_STATE_CONNECTED) {
-                memcpy(&conn_info[*count], &connections[i], sizeof(connection_info_t));
+                snapshot_connection(i, &conn_info[*count]);
                 (*count)++;
             }
         }
@@ -448,63 +1275,1469 @@ void bluetooth_spp_get_connection_info(connection_info_t *conn_info, uint8_t *co
     }
 }
 
-// Set device name
-void bluetooth_spp_set_device_name(const char *name) {
-    if (!name) {
-        return;
+// Take a consistent copy of one connection's counters and latency histograms
+// without blocking the data path. latency may be NULL.
+esp_err_t bluetooth_spp_get_connection_snapshot(uint32_t conn_handle, connection_info_t *info, connection_latency_t *latency) {
+    if (!info) {
+        return ESP_ERR_INVALID_ARG;
     }
     
-    strncpy(device_name, name, ESP_BT_GAP_MAX_BDNAME_LEN);
-    device_name[ESP_BT_GAP_MAX_BDNAME_LEN] = '\0';
+    uint32_t conn_idx = find_connection_by_handle(conn_handle);
+    if (conn_idx >= MAX_CONNECTIONS) {
+        return ESP_ERR_NOT_FOUND;
+    }
     
-    if (bluetooth_initialized) {
-        esp_bt_dev_set_device_name(device_name);
-        esp_ble_gap_set_device_name(device_name);
+    snapshot_connection(conn_idx, info);
+    if (latency) {
+        // Histogram buckets are single words, so a plain copy never tears one
+        memcpy(latency, &slots[conn_idx].latency, sizeof(connection_latency_t));
     }
+    return ESP_OK;
 }
 
-// Set data received callback
-void bluetooth_spp_set_data_callback(data_received_callback_t callback) {
-    data_callback = callback;
-}
-
-// Helper functions
-static uint32_t find_free_connection_slot(void) {
+// Log counters, rates and latency percentiles of every connection
+void bluetooth_spp_print_connection_status(void) {
+    connection_info_t info;
+    int connected_count = 0;
+    
     for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (connections[i].state == CONN_STATE_DISCONNECTED) {
-            return i;
+        if (atomic_load(&slots[i].state) != CONN_STATE_CONNECTED) {
+            continue;
         }
+        connected_count++;
+        snapshot_connection(i, &info);
+        const connection_latency_t *latency = &slots[i].latency;
+        ESP_LOGI(TAG, "Connection %d: Handle=%lu, Bytes RX=%llu, Bytes TX=%llu, Packets RX=%lu, Packets TX=%lu",
+                 i, info.handle, info.bytes_received, info.bytes_sent, info.packets_received, info.packets_sent);
+        ESP_LOGI(TAG, "  Rate RX=%lu B/s, TX=%lu B/s, Dropped RX/TX=%lu/%lu, Frame errors=%lu, RX latency p50/p99=%lu/%lu us, TX latency p50/p99=%lu/%lu us",
+                 info.rx_rate_bps, info.tx_rate_bps, info.rx_dropped, info.tx_dropped, info.frame_errors,
+                 bt_latency_percentile(latency->rx_delivery, 50), bt_latency_percentile(latency->rx_delivery, 99),
+                 bt_latency_percentile(latency->tx_completion, 50), bt_latency_percentile(latency->tx_completion, 99));
     }
-    return MAX_CONNECTIONS; // No free slot
-}
+    ESP_LOGI(TAG, "Total connected: %d/%d", connected_count, MAX_CONNECTIONS);
+    
+    pipeline_stats_t pipeline;
+    bluetooth_spp_get_pipeline_stats(&pipeline);
+    uint64_t uptime = pipeline.uptime_us ? pipeline.uptime_us : 1;
+    ESP_LOGI(TAG, "Pipeline: message task %llu%% of core %d (%lu messages), dispatch task %llu%% of core %d (%lu messages)",
+             pipeline.io_busy_us * 100 / uptime, PIPELINE_IO_CORE, pipeline.io_messages,
+             pipeline.dispatch_busy_us * 100 / uptime, PIPELINE_DISPATCH_CORE, pipeline.dispatch_messages);
+    if (rpc_enabled) {
+        ESP_LOGI(TAG, "RPC: %lu calls pending, %lu responses dropped", bt_rpc_pending(), bt_rpc_dropped_responses());
+    }
+    
+    bluetooth_spp_print_memory_usage();
+}
 
-static uint32_t find_connection_by_handle(uint32_t handle) {
+// Log packet buffer usage per size class, for sizing BT_POOL_*_COUNT
+void bluetooth_spp_print_memory_usage(void) {
+    bt_pool_class_stats_t stats;
+    
+    ESP_LOGI(TAG, "Packet pool: %d bytes of %d budget", BT_POOL_BYTES, BT_POOL_BUDGET_BYTES);
+    for (int c = 0; c < BT_POOL_CLASSES; c++) {
+        bt_pool_class_stats(c, &stats);
+        ESP_LOGI(TAG, "  %d-byte class: %d/%d in use, high water %d, fallbacks %lu, failures %lu",
+                 stats.size, stats.in_use, stats.count, stats.high_water, stats.fallbacks, stats.failures);
+    }
+}
+
+// Consistent copy of each pipeline stage's CPU accounting
+void bluetooth_spp_get_pipeline_stats(pipeline_stats_t *stats) {
+    if (!stats) {
+        return;
+    }
+    
+    uint32_t seq;
+    do {
+        seq = bt_seq_read_begin(&io_stats.lock);
+        stats->io_busy_us = io_stats.busy_us;
+        stats->io_messages = io_stats.messages;
+    } while (bt_seq_read_retry(&io_stats.lock, seq));
+    do {
+        seq = bt_seq_read_begin(&dispatch_stats.lock);
+        stats->dispatch_busy_us = dispatch_stats.busy_us;
+        stats->dispatch_messages = dispatch_stats.messages;
+    } while (bt_seq_read_retry(&dispatch_stats.lock, seq));
+    stats->uptime_us = esp_timer_get_time();
+}
+
+// Set device name
+void bluetooth_spp_set_device_name(const char *name) {
+    if (!name) {
+        return;
+    }
+    
+    strncpy(device_name, name, ESP_BT_GAP_MAX_BDNAME_LEN);
+    device_name[ESP_BT_GAP_MAX_BDNAME_LEN] = '\0';
+    
+    if (bluetooth_initialized) {
+        esp_bt_dev_set_device_name(device_name);
+        esp_ble_gap_set_device_name(device_name);
+    }
+}
+
+// Start a new recording, discarding the previous one. Up to snap_length bytes
+// of each received packet are kept (0 records only their sizes).
+void bluetooth_spp_capture_start(uint16_t snap_length) {
+    portENTER_CRITICAL(&capture_lock);
+    bt_capture_init(&capture, capture_buffer, sizeof(capture_buffer),
+                    snap_length < MAX_PACKET_SIZE ? snap_length : MAX_PACKET_SIZE);
+    atomic_store(&capture_enabled, true);
+    portEXIT_CRITICAL(&capture_lock);
+}
+
+// Stop recording; the recording is kept for dumping
+void bluetooth_spp_capture_stop(void) {
+    portENTER_CRITICAL(&capture_lock);
+    atomic_store(&capture_enabled, false);
+    portEXIT_CRITICAL(&capture_lock);
+}
+
+// Print the recording for a host to collect; events arriving while it prints
+// are not recorded
+void bluetooth_spp_dump_capture(void) {
+    uint8_t line[CAPTURE_DUMP_LINE];
+    
+    portENTER_CRITICAL(&capture_lock);
+    capture_paused = true;
+    portEXIT_CRITICAL(&capture_lock);
+    
+    uint32_t size = bt_capture_size(&capture);
+    ESP_LOGI(TAG, "Capture: %lu records, %lu overwritten", capture.records, capture.overwritten);
+    printf("CAPTURE BEGIN %lu\n", size);
+    for (uint32_t offset = 0; offset < size;) {
+        uint32_t length = bt_capture_read(&capture, offset, line, sizeof(line));
+        for (uint32_t i = 0; i < length; i++) {
+            printf("%02x", line[i]);
+        }
+        printf("\n");
+        offset += length;
+    }
+    printf("CAPTURE END\n");
+    
+    portENTER_CRITICAL(&capture_lock);
+    capture_paused = false;
+    portEXIT_CRITICAL(&capture_lock);
+}
+
+// Feed a recording back into the data path. Recorded handles get
+// CONN_HANDLE_REPLAY_FLAG, so replayed peers run beside live ones: their data
+// reaches the application callbacks as usual, while what is sent to them is
+// dropped at the link and the recorded write completions and congestion pace
+// it instead. Peers still connected when the recording ends are disconnected.
+esp_err_t bluetooth_spp_replay(const uint8_t *recording, uint32_t length, uint32_t speed_percent) {
+    bt_capture_reader_t reader;
+    bt_capture_event_t event;
+    uint32_t replayed = 0;
+    
+    if (!bluetooth_initialized || !recording || !bt_capture_reader_init(&reader, recording, length)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (atomic_exchange(&replay_running, true)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    
+    int64_t start_us = esp_timer_get_time();
+    while (bt_capture_next(&reader, &event)) {
+        int64_t wait_us = start_us + (int64_t)bt_capture_due_us(&event, speed_percent) - esp_timer_get_time();
+        if (wait_us > 0 && pdMS_TO_TICKS(wait_us / 1000) > 0) {
+            vTaskDelay(pdMS_TO_TICKS(wait_us / 1000));
+        }
+        replay_event(&event);
+        replayed++;
+    }
+    
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        uint32_t handle = atomic_load(&slots[i].handle);
+        if (atomic_load(&slots[i].state) == CONN_STATE_CONNECTED && CONN_HANDLE_IS_REPLAY(handle)) {
+            disconnect_peer(handle);
+        }
+    }
+    atomic_store(&replay_running, false);
+    
+    ESP_LOGI(TAG, "Replayed %lu events in %lld ms%s", replayed, (esp_timer_get_time() - start_us) / 1000,
+             reader.error ? ", recording damaged" : "");
+    return reader.error ? ESP_ERR_INVALID_SIZE : ESP_OK;
+}
+
+// Set data received callback
+void bluetooth_spp_set_data_callback(data_received_callback_t callback) {
+    data_callback = callback;
+}
+
+// Set frame received callback
+void bluetooth_spp_set_frame_callback(frame_received_callback_t callback) {
+    frame_callback = callback;
+}
+
+// Set broadcast completion callback
+void bluetooth_spp_set_broadcast_callback(broadcast_complete_callback_t callback) {
+    broadcast_callback = callback;
+}
+
+// Set bulk transfer completion callback
+void bluetooth_spp_set_xfer_callback(xfer_complete_callback_t callback) {
+    xfer_callback = callback;
+}
+
+// Helper functions
+// A free slot, preferring one the message task has already drained
+static uint32_t find_free_connection_slot(void) {
+    uint32_t closing = MAX_CONNECTIONS;
     for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (connections[i].handle == handle) {
-            return i;
+        if (connections[i].state == CONN_STATE_DISCONNECTED) {
+            if (slot_drained(i)) {
+                return i;
+            }
+            if (closing == MAX_CONNECTIONS) {
+                closing = i;
+            }
+        }
+    }
+    return closing; // MAX_CONNECTIONS if there is no free slot
+}
+
+// A closed slot may be reused once nothing of its previous connection is left
+// queued for sending
+static bool slot_drained(uint32_t conn_idx) {
+    conn_slot_t *slot = &slots[conn_idx];
+    return tx_backlog(slot) == 0 && atomic_load(&slot->tx_inflight_tail) == atomic_load(&slot->tx_inflight_head);
+}
+
+// Advertise again while the connection table has room for another peer
+static void restart_advertising(void) {
+    if (find_free_connection_slot() < MAX_CONNECTIONS) {
+        esp_ble_gap_start_advertising(&adv_params);
+    }
+}
+
+// Constant-time lookup of a transport-tagged handle; MAX_CONNECTIONS if not found
+static uint32_t find_connection_by_handle(uint32_t handle) {
+    return bt_index_lookup(handle);
+}
+
+static void update_connection_activity(uint32_t conn_idx) {
+    connections[conn_idx].last_activity = xTaskGetTickCount();
+}
+
+// Queue a slot for the message task's next scheduling round
+static void mark_slot_active(uint32_t conn_idx) {
+    atomic_fetch_or(&active_slots[conn_idx / 32], 1u << (conn_idx % 32));
+    xTaskNotifyGive(message_task_handle);
+}
+
+// Make a new connection visible to the lock-free data path. The slot has been
+// drained (slot_drained), so its TX rings start empty.
+static void open_slot(uint32_t conn_idx, uint32_t handle, transport_t transport) {
+    conn_slot_t *slot = &slots[conn_idx];
+    slot->transport = transport;
+    bt_drr_set_weight(&rx_drr, conn_idx, BT_DRR_DEFAULT_WEIGHT);
+    bt_drr_set_weight(&tx_drr, conn_idx, BT_DRR_DEFAULT_WEIGHT);
+    slot->tx_credit_limit = transport == TRANSPORT_BLE ? BLE_TX_CREDITS_PER_CONNECTION : TX_CREDITS_PER_CONNECTION;
+    atomic_store(&slot->tx_credits, slot->tx_credit_limit);
+    atomic_store(&slot->tx_congested, false);
+    atomic_store(&slot->link_payload_max, transport == TRANSPORT_BLE ? BLE_DEFAULT_MTU - BLE_NOTIFY_OVERHEAD : MAX_PACKET_SIZE);
+    atomic_store(&slot->notify_enabled, false);
+    slot->coalesce.flush_threshold = 0;
+    memset(&slot->latency, 0, sizeof(slot->latency));
+    atomic_store(&slot->tx_inflight_head, 0);
+    atomic_store(&slot->tx_inflight_tail, 0);
+    slot->rate_last_rx_bytes = 0;
+    slot->rate_last_tx_bytes = 0;
+    bt_link_init(&slot->link);
+    atomic_store(&slot->reap_handle, INVALID_HANDLE);
+    atomic_store(&slot->tx_dropped, 0);
+    atomic_store(&slot->tx_lanes_stale, true);
+    set_rx_class(conn_idx, TRAFFIC_CLASS_INTERACTIVE);
+    set_frame_flags(slot, default_frame_flags);
+    slot->zip_tx = false;
+    atomic_store(&slot->zip_state, compression_enabled ? ZIP_AWAIT_HELLO : ZIP_OFF);
+    atomic_store_explicit(&slot->handle, handle, memory_order_release);
+    atomic_store_explicit(&slot->state, CONN_STATE_CONNECTED, memory_order_release);
+    bt_index_insert(handle, conn_idx);
+}
+
+// Retire a connection; the message task drains anything still queued for it
+// (drain_slot) before the slot can be reused
+static void close_slot(uint32_t conn_idx) {
+    conn_slot_t *slot = &slots[conn_idx];
+    uint32_t handle = atomic_load(&slot->handle);
+    bt_index_remove(handle);
+    atomic_store(&slot->zip_state, ZIP_OFF);
+    slot->closed_handle = handle;
+    atomic_store_explicit(&slot->state, CONN_STATE_DISCONNECTED, memory_order_release);
+    atomic_store_explicit(&slot->handle, INVALID_HANDLE, memory_order_release);
+    
+    // Nothing will send an open batch now
+    esp_timer_stop(slot->batch_timer);
+    portENTER_CRITICAL(&slot->tx_lock);
+    uint16_t batch = slot->batch_buffer;
+    slot->batch_buffer = BT_POOL_INVALID;
+    slot->coalesce.flush_threshold = 0;
+    portEXIT_CRITICAL(&slot->tx_lock);
+    if (batch != BT_POOL_INVALID) {
+        bt_pool_free(batch);
+    }
+    
+    // Writes still in flight will not complete now; a broadcast among them is
+    // reported failed to keep the one-callback-per-peer promise
+    fail_inflight(slot, handle);
+    mark_slot_active(conn_idx);
+    
+    if (rpc_enabled) {
+        bt_rpc_cancel_connection(handle);
+    }
+}
+
+// Stack events. The Bluetooth callbacks and the replayer both come through
+// these, so a replayed recording takes exactly the paths live traffic does,
+// and every event is captured on the way in.
+
+// Take a free slot for a new peer. Returns its index, MAX_CONNECTIONS if the
+// table is full.
+static uint32_t connect_peer(uint32_t handle, const uint8_t *address, transport_t transport) {
+    uint32_t free_slot = MAX_CONNECTIONS;
+    
+    capture_event(BT_CAPTURE_CONNECT, handle, 0, false, address, BT_CAPTURE_ADDRESS_SIZE);
+    if (xSemaphoreTake(connections_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+        free_slot = find_free_connection_slot();
+        // Drained slots come first, so if this one is still draining they all
+        // are. This is the stack's task, so it refuses rather than waits.
+        if (free_slot < MAX_CONNECTIONS && !slot_drained(free_slot)) {
+            ESP_LOGW(TAG, "Connection %lu still draining, connect refused", free_slot);
+            free_slot = MAX_CONNECTIONS;
+        }
+        if (free_slot < MAX_CONNECTIONS) {
+            bt_seq_write_begin(&slots[free_slot].stats_lock);
+            memset(&connections[free_slot], 0, sizeof(connection_info_t));
+            bt_seq_write_end(&slots[free_slot].stats_lock);
+            connections[free_slot].handle = handle;
+            connections[free_slot].state = CONN_STATE_CONNECTED;
+            memcpy(connections[free_slot].remote_addr, address, sizeof(esp_bd_addr_t));
+            connections[free_slot].last_activity = xTaskGetTickCount();
+            open_slot(free_slot, handle, transport);
+        }
+        xSemaphoreGive(connections_mutex);
+    }
+    return free_slot;
+}
+
+// Returns the index of the slot freed, MAX_CONNECTIONS if the peer had none
+static uint32_t disconnect_peer(uint32_t handle) {
+    uint32_t conn_idx = MAX_CONNECTIONS;
+    
+    capture_event(BT_CAPTURE_DISCONNECT, handle, 0, false, NULL, 0);
+    if (xSemaphoreTake(connections_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
+        conn_idx = find_connection_by_handle(handle);
+        if (conn_idx < MAX_CONNECTIONS) {
+            connections[conn_idx].state = CONN_STATE_DISCONNECTED;
+            connections[conn_idx].handle = INVALID_HANDLE;
+            close_slot(conn_idx);
         }
+        xSemaphoreGive(connections_mutex);
     }
-    return MAX_CONNECTIONS; // Not found
+    return conn_idx;
 }
 
-static void update_connection_activity(uint32_t conn_handle) {
+static void receive_data(uint32_t conn_handle, const uint8_t *data, uint16_t length) {
+    capture_event(BT_CAPTURE_DATA, conn_handle, length, false, data, length);
     uint32_t conn_idx = find_connection_by_handle(conn_handle);
     if (conn_idx < MAX_CONNECTIONS) {
-        connections[conn_idx].last_activity = xTaskGetTickCount();
+        queue_received_data(conn_idx, conn_handle, data, length);
+        record_rx_activity(conn_idx, length);
     }
 }
 
-static void print_connection_status(void) {
-    if (xSemaphoreTake(connections_mutex, pdMS_TO_TICKS(100)) == pdTRUE) {
-        int connected_count = 0;
-        for (int i = 0; i < MAX_CONNECTIONS; i++) {
-            if (connections[i].state == CONN_STATE_CONNECTED) {
-                connected_count++;
-                ESP_LOGI(TAG, "Connection %d: Handle=%lu, Bytes RX=%lu, Bytes TX=%lu", 
-                         i, connections[i].handle, connections[i].bytes_received, connections[i].bytes_sent);
+// BLE: the client enabled or disabled notifications on the TX characteristic
+static void set_notify(uint32_t conn_handle, bool enabled) {
+    capture_event(BT_CAPTURE_NOTIFY, conn_handle, 0, enabled, NULL, 0);
+    uint32_t conn_idx = find_connection_by_handle(conn_handle);
+    if (conn_idx >= MAX_CONNECTIONS) {
+        return;
+    }
+    atomic_store(&slots[conn_idx].notify_enabled, enabled);
+    if (enabled) {
+        mark_slot_active(conn_idx); // Anything queued meanwhile can go now
+    }
+}
+
+static void set_link_mtu(uint32_t conn_handle, uint16_t mtu) {
+    capture_event(BT_CAPTURE_MTU, conn_handle, mtu, false, NULL, 0);
+    uint32_t conn_idx = find_connection_by_handle(conn_handle);
+    if (conn_idx < MAX_CONNECTIONS) {
+        uint16_t payload_max = mtu - BLE_NOTIFY_OVERHEAD;
+        atomic_store(&slots[conn_idx].link_payload_max, payload_max < NUS_MAX_VALUE_LEN ? payload_max : NUS_MAX_VALUE_LEN);
+    }
+}
+
+// Record a stack event if a capture is running. Events of replayed peers are
+// not recorded: a recording taken during a replay holds only live traffic.
+static void capture_event(bt_capture_type_t type, uint32_t handle, uint32_t value, bool flag, const uint8_t *data, uint16_t length) {
+    if (!atomic_load_explicit(&capture_enabled, memory_order_relaxed) || CONN_HANDLE_IS_REPLAY(handle)) {
+        return;
+    }
+    bt_capture_event_t event = {
+        .type = type,
+        .flag = flag,
+        .handle = handle,
+        .value = value,
+        .data = data,
+        .kept = length,
+    };
+    uint32_t now_us = (uint32_t)esp_timer_get_time();
+    
+    portENTER_CRITICAL(&capture_lock);
+    if (atomic_load(&capture_enabled) && !capture_paused) {
+        bt_capture_record(&capture, &event, now_us);
+    }
+    portEXIT_CRITICAL(&capture_lock);
+}
+
+// Deliver one recorded event as the stack would have. A peer whose connect
+// was overwritten in the capture ring is opened on its first event, and on
+// BLE assumed subscribed.
+static void replay_event(const bt_capture_event_t *event) {
+    static const uint8_t no_address[BT_CAPTURE_ADDRESS_SIZE];
+    uint32_t handle = event->handle | CONN_HANDLE_REPLAY_FLAG;
+    transport_t transport = CONN_HANDLE_IS_BLE(handle) ? TRANSPORT_BLE : TRANSPORT_SPP;
+    
+    if (event->type == BT_CAPTURE_CONNECT) {
+        connect_peer(handle, event->data, transport);
+        return;
+    }
+    if (event->type != BT_CAPTURE_DISCONNECT && find_connection_by_handle(handle) >= MAX_CONNECTIONS) {
+        connect_peer(handle, no_address, transport);
+        if (transport == TRANSPORT_BLE) {
+            set_notify(handle, true);
+        }
+    }
+    
+    switch (event->type) {
+        case BT_CAPTURE_DISCONNECT:
+            disconnect_peer(handle);
+            break;
+        case BT_CAPTURE_DATA: {
+            // Data the capture cut short is padded with zeros to its length
+            const uint8_t *data = event->data;
+            uint16_t length = event->value;
+            if (event->kept < length) {
+                length = length < sizeof(replay_buffer) ? length : sizeof(replay_buffer);
+                memcpy(replay_buffer, event->data, event->kept);
+                memset(&replay_buffer[event->kept], 0, length - event->kept);
+                data = replay_buffer;
             }
+            receive_data(handle, data, length);
+            break;
+        }
+        case BT_CAPTURE_WRITE_DONE:
+            complete_tx(handle, event->flag, event->value);
+            break;
+        case BT_CAPTURE_CONGEST:
+            set_tx_congested(handle, event->flag);
+            break;
+        case BT_CAPTURE_MTU:
+            set_link_mtu(handle, event->value);
+            break;
+        case BT_CAPTURE_NOTIFY:
+            set_notify(handle, event->flag);
+            break;
+        default:
+            break;
+    }
+}
+
+// Copy received data into a pool buffer (the only copy on the RX path) and
+// push its descriptor onto the connection's RX ring. When the ring or pool is
+// full the configured RX policy decides what is dropped, and every drop is
+// counted against the connection.
+static void queue_received_data(uint32_t conn_idx, uint32_t conn_handle, const uint8_t *data, uint16_t length) {
+    conn_slot_t *slot = &slots[conn_idx];
+    rx_policy_config_t policy;
+    bt_message_t evicted;
+    
+    load_rx_policy(&policy);
+    if (length == 0 || length > MAX_PACKET_SIZE) {
+        BT_LOGW(BT_LOG_TAG_SPP, BT_LOG_FMT_RX_SIZE, length, conn_handle, 0);
+        count_rx_drop(conn_idx);
+        return;
+    }
+    
+    if (policy.policy == RX_POLICY_QUOTA && atomic_load(&slot->rx_in_flight) >= policy.quota) {
+        count_rx_drop(conn_idx);
+        return;
+    }
+    
+    // Get a buffer, evicting or waiting if the policy allows it
+    TickType_t deadline = xTaskGetTickCount() + pdMS_TO_TICKS(policy.deadline_ms);
+    uint16_t buffer = bt_pool_alloc(length);
+    while (buffer == BT_POOL_INVALID) {
+        if (policy.policy == RX_POLICY_DROP_OLDEST && bt_ring_evict(&slot->rx_ring, &evicted)) {
+            // Reuse the evicted packet's buffer directly when it is big enough
+            if (bt_pool_capacity(evicted.buffer) >= length) {
+                buffer = evicted.buffer;
+            } else {
+                bt_pool_free(evicted.buffer);
+                buffer = bt_pool_alloc(length);
+            }
+            atomic_fetch_sub(&slot->rx_in_flight, 1);
+            count_rx_drop(conn_idx);
+        } else if (policy.policy == RX_POLICY_BLOCK && wait_for_rx_space(deadline)) {
+            buffer = bt_pool_alloc(length);
+        } else {
+            count_rx_drop(conn_idx);
+            return;
+        }
+    }
+    memcpy(bt_pool_buffer(buffer), data, length);
+    
+    bt_message_t message = {
+        .conn_handle = conn_handle,
+        .timestamp_us = (uint32_t)esp_timer_get_time(),
+        .buffer = buffer,
+        .length = length,
+        .slot = conn_idx,
+        .type = 0, // Received
+    };
+    atomic_fetch_add(&slot->rx_in_flight, 1);
+    
+    // Queue it, again evicting or waiting if the ring is full
+    while (!bt_ring_push(&slot->rx_ring, &message)) {
+        if (policy.policy == RX_POLICY_DROP_OLDEST && bt_ring_evict(&slot->rx_ring, &evicted)) {
+            bt_pool_free(evicted.buffer);
+            atomic_fetch_sub(&slot->rx_in_flight, 1);
+            count_rx_drop(conn_idx);
+        } else if (policy.policy != RX_POLICY_BLOCK || !wait_for_rx_space(deadline)) {
+            bt_pool_free(buffer);
+            atomic_fetch_sub(&slot->rx_in_flight, 1);
+            count_rx_drop(conn_idx);
+            return;
         }
-        ESP_LOGI(TAG, "Total connected: %d/%d", connected_count, MAX_CONNECTIONS);
-        xSemaphoreGive(connections_mutex);
     }
-} 
\ No newline at end of file
+    
+    uint32_t depth = bt_ring_count(&slot->rx_ring);
+    if (depth > connections[conn_idx].rx_queue_high_water) {
+        bt_seq_write_begin(&slot->stats_lock);
+        connections[conn_idx].rx_queue_high_water = depth;
+        bt_seq_write_end(&slot->stats_lock);
+    }
+    mark_slot_active(conn_idx);
+}
+
+// The RX policy as last published by bluetooth_spp_set_rx_policy
+static void load_rx_policy(rx_policy_config_t *policy) {
+    uint32_t seq;
+    do {
+        seq = bt_seq_read_begin(&rx_policy_seq);
+        *policy = rx_policy;
+    } while (bt_seq_read_retry(&rx_policy_seq, seq));
+}
+
+// Account for a packet this module discarded, with a rate-limited warning
+static void count_rx_drop(uint32_t conn_idx) {
+    bt_seq_write_begin(&slots[conn_idx].stats_lock);
+    uint32_t dropped = ++connections[conn_idx].rx_dropped;
+    bt_seq_write_end(&slots[conn_idx].stats_lock);
+    if (dropped == 1 || dropped % 64 == 0) {
+        BT_LOGW(BT_LOG_TAG_SPP, BT_LOG_FMT_RX_DROP, conn_idx, dropped, 0);
+    }
+}
+
+// Account for a broadcast that could not be queued to one peer
+static void count_tx_drop(uint32_t conn_idx) {
+    uint32_t dropped = atomic_fetch_add(&slots[conn_idx].tx_dropped, 1) + 1;
+    if (dropped == 1 || dropped % 64 == 0) {
+        BT_LOGW(BT_LOG_TAG_SPP, BT_LOG_FMT_TX_DROP, conn_idx, dropped, 0);
+    }
+}
+
+// RX_POLICY_BLOCK: wait for the pipeline to free space, until the deadline
+static bool wait_for_rx_space(TickType_t deadline) {
+    TickType_t now = xTaskGetTickCount();
+    if ((int32_t)(deadline - now) <= 0) {
+        return false;
+    }
+    
+    // Make sure the message task is running before waiting on it
+    xTaskNotifyGive(message_task_handle);
+    atomic_fetch_add(&rx_space_waiters, 1);
+    BaseType_t woken = xSemaphoreTake(rx_space_sem, deadline - now);
+    atomic_fetch_sub(&rx_space_waiters, 1);
+    return woken == pdTRUE;
+}
+
+// Copy outgoing data into a pool buffer and push it onto the connection's TX ring
+static esp_err_t queue_tx_data(uint32_t conn_idx, uint32_t conn_handle, const uint8_t *data, uint16_t length, uint8_t lane) {
+    if (slots[conn_idx].coalesce.flush_threshold > 0 && lane != TRAFFIC_CLASS_CONTROL) {
+        return coalesce_tx_data(conn_idx, conn_handle, data, length, lane);
+    }
+    
+    uint16_t buffer = bt_pool_alloc(length);
+    if (buffer == BT_POOL_INVALID) {
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(bt_pool_buffer(buffer), data, length);
+    return queue_tx_buffer(conn_idx, conn_handle, buffer, length, 1, lane);
+}
+
+// Push an already filled pool buffer onto the connection's TX ring for a lane.
+// The buffer is freed if it cannot be queued.
+static esp_err_t queue_tx_buffer(uint32_t conn_idx, uint32_t conn_handle, uint16_t buffer, uint16_t length, uint8_t type, uint8_t lane) {
+    bt_message_t message = {
+        .conn_handle = conn_handle,
+        .timestamp_us = (uint32_t)esp_timer_get_time(),
+        .buffer = buffer,
+        .length = length,
+        .slot = conn_idx,
+        .type = type,
+    };
+    
+    // Senders only contend with each other, never with the Bluetooth callbacks.
+    // An open coalescing batch holds earlier data, so it goes first.
+    portENTER_CRITICAL(&slots[conn_idx].tx_lock);
+    push_tx_batch(&slots[conn_idx], conn_idx);
+    bool queued = bt_ring_push(&slots[conn_idx].tx_rings[lane], &message);
+    portEXIT_CRITICAL(&slots[conn_idx].tx_lock);
+    
+    if (!queued) {
+        bt_pool_free(buffer);
+        return ESP_ERR_NO_MEM;
+    }
+    mark_slot_active(conn_idx);
+    return ESP_OK;
+}
+
+// Append outgoing data to the connection's open batch. Writes that do not fit,
+// or belong to another lane, push the batch first so ordering is kept, and
+// writes as large as the batch limit bypass it.
+static esp_err_t coalesce_tx_data(uint32_t conn_idx, uint32_t conn_handle, const uint8_t *data, uint16_t length, uint8_t lane) {
+    conn_slot_t *slot = &slots[conn_idx];
+    esp_err_t ret = ESP_OK;
+    bool pushed = false;
+    bool opened = false;
+    
+    portENTER_CRITICAL(&slot->tx_lock);
+    uint16_t limit = slot->coalesce.flush_threshold;
+    uint16_t link_max = atomic_load(&slot->link_payload_max);
+    if (limit > link_max) {
+        limit = link_max;
+    }
+    
+    if (slot->batch_buffer != BT_POOL_INVALID &&
+        (slot->batch_length + length > limit || slot->batch_lane != lane)) {
+        if (push_tx_batch(slot, conn_idx)) {
+            pushed = true;
+        } else {
+            ret = ESP_ERR_NO_MEM;
+        }
+    }
+    
+    if (ret == ESP_OK && length >= limit) {
+        uint16_t buffer = bt_pool_alloc(length);
+        bt_message_t message = {
+            .conn_handle = conn_handle,
+            .timestamp_us = (uint32_t)esp_timer_get_time(),
+            .buffer = buffer,
+            .length = length,
+            .slot = conn_idx,
+            .type = 1, // To send
+        };
+        if (buffer == BT_POOL_INVALID) {
+            ret = ESP_ERR_NO_MEM;
+        } else {
+            memcpy(bt_pool_buffer(buffer), data, length);
+            if (bt_ring_push(&slot->tx_rings[lane], &message)) {
+                pushed = true;
+            } else {
+                bt_pool_free(buffer);
+                ret = ESP_ERR_NO_MEM;
+            }
+        }
+    } else if (ret == ESP_OK) {
+        if (slot->batch_buffer == BT_POOL_INVALID) {
+            slot->batch_buffer = bt_pool_alloc(limit);
+            slot->batch_length = 0;
+            slot->batch_lane = lane;
+            slot->batch_timestamp_us = (uint32_t)esp_timer_get_time();
+            opened = true;
+        }
+        if (slot->batch_buffer == BT_POOL_INVALID) {
+            ret = ESP_ERR_NO_MEM;
+            opened = false;
+        } else {
+            memcpy(bt_pool_buffer(slot->batch_buffer) + slot->batch_length, data, length);
+            slot->batch_length += length;
+            if (slot->batch_length >= limit && push_tx_batch(slot, conn_idx)) {
+                pushed = true;
+            }
+        }
+    }
+    uint32_t deadline_us = slot->coalesce.flush_deadline_us;
+    portEXIT_CRITICAL(&slot->tx_lock);
+    
+    if (opened) {
+        esp_timer_stop(slot->batch_timer);
+        esp_timer_start_once(slot->batch_timer, deadline_us);
+    }
+    if (pushed) {
+        mark_slot_active(conn_idx);
+    }
+    return ret;
+}
+
+// Move the open batch onto the TX ring; call with tx_lock held. A full ring
+// leaves the batch open.
+static bool push_tx_batch(conn_slot_t *slot, uint32_t conn_idx) {
+    if (slot->batch_buffer == BT_POOL_INVALID) {
+        return false;
+    }
+    
+    bt_message_t message = {
+        .conn_handle = atomic_load(&slot->handle),
+        .timestamp_us = slot->batch_timestamp_us,
+        .buffer = slot->batch_buffer,
+        .length = slot->batch_length,
+        .slot = conn_idx,
+        .type = 1, // To send
+    };
+    if (!bt_ring_push(&slot->tx_rings[slot->batch_lane], &message)) {
+        return false;
+    }
+    slot->batch_buffer = BT_POOL_INVALID;
+    return true;
+}
+
+static void flush_tx_batch(uint32_t conn_idx) {
+    conn_slot_t *slot = &slots[conn_idx];
+    
+    portENTER_CRITICAL(&slot->tx_lock);
+    bool pushed = push_tx_batch(slot, conn_idx);
+    bool pending = slot->batch_buffer != BT_POOL_INVALID;
+    uint32_t deadline_us = slot->coalesce.flush_deadline_us;
+    portEXIT_CRITICAL(&slot->tx_lock);
+    
+    if (pushed) {
+        mark_slot_active(conn_idx);
+    } else if (pending) {
+        // TX ring full: try again once the message task has drained some of it
+        esp_timer_stop(slot->batch_timer);
+        esp_timer_start_once(slot->batch_timer, deadline_us);
+    }
+}
+
+// Flush deadline of a connection's open batch
+static void batch_timer_callback(void *arg) {
+    flush_tx_batch((uint32_t)(uintptr_t)arg);
+}
+
+static uint8_t frame_flags(const frame_config_t *config) {
+    uint8_t flags = BT_FRAME_NONE;
+    if (config->mode == FRAME_MODE_LENGTH_PREFIXED) {
+        flags = BT_FRAME_LENGTH_PREFIXED;
+    } else if (config->mode == FRAME_MODE_COBS) {
+        flags = BT_FRAME_COBS;
+    }
+    if (flags != BT_FRAME_NONE && config->crc) {
+        flags |= BT_FRAME_CRC;
+    }
+    return flags;
+}
+
+// Publish new framing flags; bumping the change count makes the message task
+// reset the connection's framer before its next fragment
+static void set_frame_flags(conn_slot_t *slot, uint8_t flags) {
+    uint32_t config = atomic_load(&slot->frame_config);
+    atomic_store_explicit(&slot->frame_config, (((config >> 8) + 1) << 8) | flags, memory_order_release);
+}
+
+// Hand a received message to the application and recycle its buffer. On a
+// framed connection the fragment is fed to the connection's framer, which
+// decodes frames in place in the pool buffer where it can.
+static void deliver_message(const bt_message_t *message) {
+    conn_slot_t *slot = &slots[message->slot];
+    uint8_t *data = bt_pool_buffer(message->buffer);
+    uint16_t length = message->length;
+    
+    // The first data on a connection decides whether it is compressed
+    if (atomic_load(&slot->zip_state) == ZIP_AWAIT_HELLO) {
+        int offer = bt_zip_hello_parse(data, length);
+        negotiate_compression(message, offer);
+        if (offer >= 0) {
+            data += BT_ZIP_HELLO_SIZE;
+            length -= BT_ZIP_HELLO_SIZE;
+        }
+    }
+    
+    if (length > 0) {
+        if (atomic_load(&slot->zip_state) == ZIP_ACTIVE) {
+            bt_framer_feed(&slot->zip->framer, data, length, inflate_block, (void *)message);
+        } else {
+            deliver_payload(message, data, length);
+        }
+    }
+    bt_latency_record(slot->latency.rx_delivery,
+                      (uint32_t)esp_timer_get_time() - message->timestamp_us);
+    BT_LOGI(BT_LOG_TAG_SPP, BT_LOG_FMT_RX, message->length, message->conn_handle, 0);
+    bt_pool_free(message->buffer);
+    atomic_fetch_sub(&slot->rx_in_flight, 1);
+    signal_rx_space();
+}
+
+// Received bytes, decompressed if need be, to the data callback or through
+// the connection's framer to the frame callback
+static void deliver_payload(const bt_message_t *message, uint8_t *data, uint16_t length) {
+    conn_slot_t *slot = &slots[message->slot];
+    uint32_t config = atomic_load_explicit(&slot->frame_config, memory_order_acquire);
+    
+    if ((config & BT_FRAME_MODE_MASK) == BT_FRAME_NONE) {
+        if (data_callback) {
+            data_callback(message->conn_handle, data, length);
+        }
+    } else {
+        if (config != slot->framer.config) {
+            bt_framer_reset(&slot->framer, config);
+        }
+        uint32_t errors = slot->framer.errors;
+        bt_framer_feed(&slot->framer, data, length, deliver_frame, (void *)message);
+        connections[message->slot].frame_errors += slot->framer.errors - errors;
+    }
+}
+
+// Answer the peer's hello (offer is bt_zip_hello_parse() of its first data).
+// Accepting assigns a stream, which is taken back from connections that have
+// since closed, and queues a hello reply that switches the message task to
+// compressed blocks once it is sent.
+static void negotiate_compression(const bt_message_t *message, int offer) {
+    conn_slot_t *slot = &slots[message->slot];
+    uint8_t hello[BT_ZIP_HELLO_SIZE];
+    zip_stream_t *stream = NULL;
+    
+    if (offer < 0) {
+        atomic_store(&slot->zip_state, ZIP_OFF);
+        return;
+    }
+    for (int i = 0; offer > 0 && i < ZIP_MAX_STREAMS && !stream; i++) {
+        zip_stream_t *candidate = &zip_streams[i];
+        conn_slot_t *owner = &slots[candidate->slot];
+        if (candidate->handle == INVALID_HANDLE || atomic_load(&owner->handle) != candidate->handle ||
+            atomic_load(&owner->zip_state) != ZIP_ACTIVE) {
+            stream = candidate;
+        }
+    }
+    
+    bt_zip_hello(hello, stream != NULL);
+    if (!stream) {
+        atomic_store(&slot->zip_state, ZIP_OFF);
+        queue_tx_data(message->slot, message->conn_handle, hello, sizeof(hello), TRAFFIC_CLASS_CONTROL);
+        return;
+    }
+    
+    stream->handle = message->conn_handle;
+    stream->slot = message->slot;
+    bt_zip_decoder_init(&stream->decoder);
+    bt_framer_reset(&stream->framer, BT_FRAME_LENGTH_PREFIXED);
+    slot->zip = stream;
+    atomic_store(&slot->zip_state, ZIP_ACTIVE);
+    
+    uint16_t buffer = bt_pool_alloc(sizeof(hello));
+    if (buffer != BT_POOL_INVALID) {
+        memcpy(bt_pool_buffer(buffer), hello, sizeof(hello));
+    }
+    if (buffer == BT_POOL_INVALID ||
+        queue_tx_buffer(message->slot, message->conn_handle, buffer, sizeof(hello), 3, TRAFFIC_CLASS_CONTROL) != ESP_OK) {
+        // Without the reply the peer keeps sending uncompressed data, and
+        // only a reconnect can offer compression again
+        atomic_store(&slot->zip_state, ZIP_OFF);
+        stream->handle = INVALID_HANDLE;
+    }
+}
+
+// Block sink of the compression framer: context is the message that completed it
+static void inflate_block(void *context, const uint8_t *block, uint16_t length) {
+    const bt_message_t *message = context;
+    zip_stream_t *stream = slots[message->slot].zip;
+    
+    int produced = bt_zip_decode(&stream->decoder, block, length, inflate_buffer, sizeof(inflate_buffer));
+    if (produced < 0) {
+        connections[message->slot].frame_errors++;
+    } else if (produced > 0) {
+        deliver_payload(message, inflate_buffer, produced);
+    }
+}
+
+// Framer sink: context is the message the frame was completed by
+static void deliver_frame(void *context, const uint8_t *frame, uint16_t length) {
+    const bt_message_t *message = context;
+    conn_slot_t *slot = &slots[message->slot];
+    
+    // Routed by type, so calls and application frames keep flowing while a
+    // transfer runs
+    bool xfer_packet = length > 0 && frame[0] >= BT_XFER_OPEN && frame[0] <= BT_XFER_ABORT;
+    if (xfer_packet && atomic_load_explicit(&slot->xfer_state, memory_order_acquire) == XFER_ACTIVE &&
+        message->conn_handle == slot->xfer_handle) {
+        bt_xfer_input(&slot->xfer, frame, length, now_ms());
+        check_transfer_done(message->slot);
+    } else if (rpc_enabled && bt_rpc_input(message->conn_handle, frame, length)) {
+        // Handled as a request or response
+    } else if (frame_callback) {
+        frame_callback(message->conn_handle, frame, length);
+    }
+}
+
+// Reserve a connection's transfer state for an application task. Transfers
+// need framing, since every packet is one frame.
+static esp_err_t claim_transfer(uint32_t conn_handle, uint32_t *conn_idx) {
+    if (!bluetooth_initialized) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    
+    uint32_t idx = find_connection_by_handle(conn_handle);
+    if (idx >= MAX_CONNECTIONS || atomic_load(&slots[idx].state) != CONN_STATE_CONNECTED) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if ((atomic_load(&slots[idx].frame_config) & BT_FRAME_MODE_MASK) == BT_FRAME_NONE) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    
+    int expected = XFER_FREE;
+    if (!atomic_compare_exchange_strong(&slots[idx].xfer_state, &expected, XFER_CLAIMED)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    bt_xfer_init(&slots[idx].xfer, xfer_send_packet, (void *)(uintptr_t)idx);
+    *conn_idx = idx;
+    return ESP_OK;
+}
+
+// Hand a set-up transfer to the dispatch task
+static void activate_transfer(uint32_t conn_idx, uint32_t conn_handle) {
+    conn_slot_t *slot = &slots[conn_idx];
+    slot->xfer_handle = conn_handle;
+    atomic_store(&slot->xfer_cancel, false);
+    atomic_fetch_add(&active_transfers, 1);
+    atomic_store_explicit(&slot->xfer_state, XFER_ACTIVE, memory_order_release);
+    xTaskNotifyGive(dispatch_task_handle);
+}
+
+// Transfer packets: control packets on the control lane, chunks on the bulk
+// lane so transfers yield to everything else on the connection
+static bool xfer_send_packet(void *context, const uint8_t *packet, uint16_t length, bool control) {
+    uint32_t conn_idx = (uintptr_t)context;
+    uint8_t lane = control ? TRAFFIC_CLASS_CONTROL : TRAFFIC_CLASS_BULK;
+    return queue_frame(conn_idx, slots[conn_idx].xfer_handle, packet, length, lane) == ESP_OK;
+}
+
+// Dispatch task: retransmits, timeouts, cancellation and disconnects
+static void service_transfers(void) {
+    uint32_t now = now_ms();
+    
+    for (uint32_t i = 0; i < MAX_CONNECTIONS; i++) {
+        conn_slot_t *slot = &slots[i];
+        if (atomic_load_explicit(&slot->xfer_state, memory_order_acquire) != XFER_ACTIVE) {
+            continue;
+        }
+        if (atomic_load(&slot->xfer_cancel)) {
+            bt_xfer_abort(&slot->xfer, BT_XFER_ABORTED);
+        } else if (atomic_load(&slot->handle) != slot->xfer_handle ||
+                   atomic_load(&slot->state) != CONN_STATE_CONNECTED) {
+            bt_xfer_abort(&slot->xfer, BT_XFER_DISCONNECTED);
+        } else {
+            bt_xfer_tick(&slot->xfer, now);
+        }
+        check_transfer_done(i);
+    }
+}
+
+// Report a finished transfer and release the slot's transfer state
+static void check_transfer_done(uint32_t conn_idx) {
+    conn_slot_t *slot = &slots[conn_idx];
+    if (slot->xfer.state != BT_XFER_IDLE) {
+        return;
+    }
+    
+    ESP_LOGI(TAG, "Transfer %08lx on 0x%lx ended with status %d: %lu chunks, %lu retransmits, %lu bad",
+             slot->xfer.id, slot->xfer_handle, slot->xfer.status, slot->xfer.stats.chunks,
+             slot->xfer.stats.retransmits, slot->xfer.stats.crc_errors);
+    if (xfer_callback) {
+        xfer_callback(slot->xfer_handle, slot->xfer.id, slot->xfer.status, &slot->xfer.stats);
+    }
+    atomic_fetch_sub(&active_transfers, 1);
+    atomic_store_explicit(&slot->xfer_state, XFER_FREE, memory_order_release);
+}
+
+static uint32_t now_ms(void) {
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+// RPC transport: one frame on the interactive lane
+static bool rpc_send_packet(uint32_t conn_handle, const uint8_t *packet, uint16_t length) {
+    uint32_t conn_idx = find_connection_by_handle(conn_handle);
+    if (conn_idx >= MAX_CONNECTIONS || atomic_load(&slots[conn_idx].state) != CONN_STATE_CONNECTED) {
+        return false;
+    }
+    return queue_frame(conn_idx, conn_handle, packet, length, TRAFFIC_CLASS_INTERACTIVE) == ESP_OK;
+}
+
+static bool dispatch_needs_tick(void) {
+    return atomic_load(&active_transfers) > 0 || (rpc_enabled && bt_rpc_pending() > 0);
+}
+
+// A slot's TX ring may be serviced if the link can take another write, or if
+// the connection is gone and the backlog only needs discarding
+static bool tx_ready(conn_slot_t *slot) {
+    if (atomic_load(&slot->state) != CONN_STATE_CONNECTED) {
+        return true;
+    }
+    // BLE data waits until the client subscribes to notifications
+    if (slot->transport == TRANSPORT_BLE && !atomic_load(&slot->notify_enabled)) {
+        return false;
+    }
+    return atomic_load(&slot->tx_credits) > 0 && !atomic_load(&slot->tx_congested);
+}
+
+// Lanes with a message that may be sent now (bit n = lane n). The last
+// BT_LANE_RESERVED_CREDITS credits are kept for the control lane, so a command
+// never waits for a bulk write to complete.
+static uint32_t tx_lane_mask(conn_slot_t *slot) {
+    uint32_t mask = 0;
+    for (int lane = 0; lane < BT_LANES; lane++) {
+        if (bt_ring_count(&slot->tx_rings[lane]) > 0) {
+            mask |= 1u << lane;
+        }
+    }
+    // Only a live link has credits to keep; a closed one is discarding
+    if (atomic_load(&slot->state) == CONN_STATE_CONNECTED &&
+        atomic_load(&slot->tx_credits) <= BT_LANE_RESERVED_CREDITS) {
+        mask &= 1u << TRAFFIC_CLASS_CONTROL;
+    }
+    return mask;
+}
+
+// Lane to send from next; a message part-way through its BLE segments finishes first
+static int select_tx_lane(conn_slot_t *slot) {
+    if (slot->tx_offset > 0) {
+        return slot->tx_lane;
+    }
+    return bt_lane_select(&slot->tx_lanes, tx_lane_mask(slot), slot->tx_lanes_strict);
+}
+
+// Restart a slot's lane scheduler under the current lane policy. Message task only.
+static void load_tx_lanes(conn_slot_t *slot) {
+    lane_policy_config_t policy;
+    uint32_t seq;
+    do {
+        seq = bt_seq_read_begin(&lane_policy_seq);
+        policy = lane_policy;
+    } while (bt_seq_read_retry(&lane_policy_seq, seq));
+    bt_lane_init(&slot->tx_lanes, policy.weights);
+    slot->tx_lanes_strict = policy.policy == LANE_POLICY_STRICT;
+}
+
+// Discard everything still queued on a closed slot, reporting broadcasts as
+// not sent. This is left to the message task, the rings' consumer: close_slot
+// runs on the Bluetooth task and could free a message this task is part-way
+// through writing.
+static uint32_t drain_slot(uint32_t conn_idx) {
+    conn_slot_t *slot = &slots[conn_idx];
+    bt_message_t message;
+    uint32_t discarded = 0;
+    
+    for (int lane = 0; lane < BT_LANES; lane++) {
+        while (bt_ring_pop(&slot->tx_rings[lane], &message)) {
+            transmit_message(&message); // Releases it: the connection is gone
+            discarded++;
+        }
+    }
+    slot->tx_offset = 0;
+    bt_drr_reset(&tx_drr, conn_idx);
+    
+    // A write made just as close_slot ran may have missed its sweep
+    fail_inflight(slot, slot->closed_handle);
+    return discarded;
+}
+
+// Messages queued for transmission across all lanes
+static uint32_t tx_backlog(conn_slot_t *slot) {
+    uint32_t count = 0;
+    for (int lane = 0; lane < BT_LANES; lane++) {
+        count += bt_ring_count(&slot->tx_rings[lane]);
+    }
+    return count;
+}
+
+// Next slot of a scheduling round, slots in a higher RX class first
+static uint32_t take_next_slot(uint32_t *round, int w) {
+    uint32_t pick = *round;
+    for (int lane = 0; lane < BT_LANES - 1; lane++) {
+        uint32_t in_class = *round & atomic_load(&rx_class_slots[lane][w]);
+        if (in_class) {
+            pick = in_class;
+            break;
+        }
+    }
+    uint32_t bit = pick & -pick;
+    *round &= ~bit;
+    return w * 32 + __builtin_ctz(bit);
+}
+
+static void set_rx_class(uint32_t conn_idx, uint8_t traffic_class) {
+    uint32_t bit = 1u << (conn_idx % 32);
+    for (int lane = 0; lane < BT_LANES; lane++) {
+        if (lane == traffic_class) {
+            atomic_fetch_or(&rx_class_slots[lane][conn_idx / 32], bit);
+        } else {
+            atomic_fetch_and(&rx_class_slots[lane][conn_idx / 32], ~bit);
+        }
+    }
+}
+
+// Bytes the next write of a message will carry. BLE notifications are limited
+// to the negotiated MTU, so longer messages go out in several segments.
+static uint16_t tx_segment_length(conn_slot_t *slot, const bt_message_t *message) {
+    uint16_t remaining = message->length - slot->tx_offset;
+    if (slot->transport == TRANSPORT_BLE) {
+        uint16_t link_max = atomic_load(&slot->link_payload_max);
+        if (remaining > link_max) {
+            return link_max;
+        }
+    }
+    return remaining;
+}
+
+// Give back one TX credit, never exceeding the per-link allowance
+static void release_tx_credit(conn_slot_t *slot) {
+    int credits = atomic_load(&slot->tx_credits);
+    while (credits < slot->tx_credit_limit &&
+           !atomic_compare_exchange_weak(&slot->tx_credits, &credits, credits + 1)) {
+    }
+}
+
+// Hand one write to the stack. Both esp_spp_write and esp_ble_gatts_send_indicate
+// copy the payload, so the buffer can go back to the pool as soon as the last
+// segment is written; the credit is held until the stack reports the write
+// complete. Notifications are not acknowledged by the peer, so several can be
+// queued for the same connection event.
+static esp_err_t write_to_link(conn_slot_t *slot, uint32_t conn_handle, uint8_t *data, uint16_t length) {
+    // Replayed peers are not on the air; the recording's completions return
+    // the credit
+    if (CONN_HANDLE_IS_REPLAY(conn_handle)) {
+        return ESP_OK;
+    }
+    if (slot->transport == TRANSPORT_BLE) {
+        if (ble_gatts_if == ESP_GATT_IF_NONE || ble_tx_attr_handle == 0) {
+            return ESP_ERR_INVALID_STATE;
+        }
+        return esp_ble_gatts_send_indicate(ble_gatts_if, CONN_HANDLE_TO_BLE(conn_handle), ble_tx_attr_handle,
+                                           length, data, false);
+    }
+    return esp_spp_write(conn_handle, length, data);
+}
+
+// Write the next segment of the head TX message if its connection is still the
+// one it was queued for. Returns true once the message is finished with (fully
+// written, failed or discarded) and has been released.
+static bool transmit_message(const bt_message_t *message) {
+    conn_slot_t *slot = &slots[message->slot];
+    uint32_t broadcast_id = message->type == 2 ? broadcast_ids[message->buffer] : 0;
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+    bool finished = true;
+    bool reported = false;
+    uint16_t length = 0;
+    
+    if (atomic_load(&slot->state) == CONN_STATE_CONNECTED && atomic_load(&slot->handle) == message->conn_handle) {
+        length = tx_segment_length(slot, message);
+        finished = slot->tx_offset + length == message->length;
+        if (slot->tx_offset == 0) {
+            BT_LOGI(BT_LOG_TAG_SPP, BT_LOG_FMT_TX, message->length, message->conn_handle, 0);
+        }
+        atomic_fetch_sub(&slot->tx_credits, 1);
+        
+        // Record the write before handing it over: the stack can complete it
+        // on the Bluetooth task before write_to_link returns. A broadcast
+        // completes with its last segment.
+        uint32_t head = atomic_load(&slot->tx_inflight_head);
+        uint32_t recorded = finished ? broadcast_id : 0;
+        slot->tx_inflight_us[head % TX_INFLIGHT_MAX] = message->timestamp_us;
+        atomic_store(&slot->tx_inflight_broadcast[head % TX_INFLIGHT_MAX], recorded);
+        atomic_store_explicit(&slot->tx_inflight_head, head + 1, memory_order_release);
+        ret = write_to_link(slot, message->conn_handle, bt_pool_buffer(message->buffer) + slot->tx_offset, length);
+        if (ret == ESP_OK) {
+            update_connection_activity(message->slot);
+        } else {
+            // Withdraw the record. If a disconnect took it first, the
+            // broadcast has been reported from there.
+            BT_LOGW(BT_LOG_TAG_SPP, BT_LOG_FMT_TX_FAIL, message->conn_handle, ret, 0);
+            uint32_t left = atomic_exchange(&slot->tx_inflight_broadcast[head % TX_INFLIGHT_MAX], INFLIGHT_WITHDRAWN);
+            reported = recorded != 0 && left == 0;
+            pop_withdrawn(slot);
+            finished = true;
+        }
+    }
+    
+    if (!finished) {
+        slot->tx_offset += length;
+        return false;
+    }
+    slot->tx_offset = 0;
+    
+    // Everything after our hello reply goes out compressed
+    if (message->type == 3 && ret == ESP_OK) {
+        bt_zip_encoder_init(&slot->zip->encoder);
+        slot->zip_tx = true;
+    }
+    
+    // A broadcast that never reached the link completes here with the reason
+    if (broadcast_id && ret != ESP_OK && !reported && broadcast_callback) {
+        broadcast_callback(broadcast_id, message->conn_handle, ret);
+    }
+    bt_pool_free(message->buffer);
+    return true;
+}
+
+// Replace a message on a compressing link by its compressed block, in its own
+// buffer when that is exclusive and large enough, and write the result back
+// to the ring so later segments see it. False if no buffer could be had; the
+// message is then dropped like a failed write.
+static bool encode_tx_message(conn_slot_t *slot, int lane, bt_message_t *message) {
+    // Left for transmit_message to discard
+    if (atomic_load(&slot->state) != CONN_STATE_CONNECTED || atomic_load(&slot->handle) != message->conn_handle) {
+        return true;
+    }
+    
+    uint16_t size = message->length + BT_ZIP_HEADER;
+    uint16_t target = message->buffer;
+    if (message->type == 2 || bt_pool_capacity(target) < size) {
+        target = bt_pool_alloc(size);
+        if (target == BT_POOL_INVALID) {
+            uint32_t broadcast_id = message->type == 2 ? broadcast_ids[message->buffer] : 0;
+            BT_LOGW(BT_LOG_TAG_SPP, BT_LOG_FMT_TX_FAIL, message->conn_handle, ESP_ERR_NO_MEM, 0);
+            if (broadcast_id && broadcast_callback) {
+                broadcast_callback(broadcast_id, message->conn_handle, ESP_ERR_NO_MEM);
+            }
+            bt_pool_free(message->buffer);
+            return false;
+        }
+    }
+    
+    uint16_t length = bt_zip_encode(&slot->zip->encoder, bt_pool_buffer(message->buffer), message->length,
+                                    bt_pool_buffer(target), bt_pool_capacity(target));
+    if (target != message->buffer) {
+        if (message->type == 2) {
+            broadcast_ids[target] = broadcast_ids[message->buffer];
+        }
+        bt_pool_free(message->buffer);
+    }
+    message->buffer = target;
+    message->length = length;
+    message->encoded = 1;
+    bt_ring_replace(&slot->tx_rings[lane], message);
+    return true;
+}
+
+// Write completion from the stack (ESP_SPP_WRITE_EVT / ESP_GATTS_CONF_EVT)
+static void complete_tx(uint32_t conn_handle, bool success, uint16_t length) {
+    capture_event(BT_CAPTURE_WRITE_DONE, conn_handle, length, success, NULL, 0);
+    uint32_t conn_idx = find_connection_by_handle(conn_handle);
+    if (conn_idx >= MAX_CONNECTIONS) {
+        return;
+    }
+    conn_slot_t *slot = &slots[conn_idx];
+    
+    // Completions arrive in submission order, so the oldest in-flight
+    // entry belongs to this write
+    uint32_t sent_us;
+    uint32_t broadcast_id = 0;
+    if (take_inflight(slot, &sent_us, &broadcast_id)) {
+        bt_latency_record(slot->latency.tx_completion, (uint32_t)esp_timer_get_time() - sent_us);
+    }
+    if (broadcast_id && broadcast_callback) {
+        broadcast_callback(broadcast_id, conn_handle, success ? ESP_OK : ESP_FAIL);
+    }
+    
+    if (success) {
+        bt_seq_write_begin(&slot->stats_lock);
+        connections[conn_idx].bytes_sent += length;
+        connections[conn_idx].packets_sent++;
+        bt_seq_write_end(&slot->stats_lock);
+    }
+    release_tx_credit(slot);
+    pop_withdrawn(slot);
+    mark_slot_active(conn_idx);
+}
+
+// Take the oldest write in flight. Completions take entries on the Bluetooth
+// task, and close_slot and drain_slot take what is left when the peer goes, so
+// each is claimed with compare-and-swap. The broadcast id is then swapped
+// out, so it is reported once even if the write is withdrawn meanwhile.
+static bool take_inflight(conn_slot_t *slot, uint32_t *sent_us, uint32_t *broadcast_id) {
+    uint32_t tail = atomic_load(&slot->tx_inflight_tail);
+    do {
+        if (tail == atomic_load_explicit(&slot->tx_inflight_head, memory_order_acquire)) {
+            return false;
+        }
+        *sent_us = slot->tx_inflight_us[tail % TX_INFLIGHT_MAX];
+    } while (!atomic_compare_exchange_weak(&slot->tx_inflight_tail, &tail, tail + 1));
+    uint32_t id = atomic_exchange(&slot->tx_inflight_broadcast[tail % TX_INFLIGHT_MAX], 0);
+    *broadcast_id = id == INFLIGHT_WITHDRAWN ? 0 : id;
+    return true;
+}
+
+// Drop withdrawn writes from the front of the in-flight queue, returning
+// their credits. Called by the failed write and after each completion, so
+// whichever comes second finds a withdrawn write that was queued behind
+// others at the front.
+static void pop_withdrawn(conn_slot_t *slot) {
+    uint32_t tail = atomic_load(&slot->tx_inflight_tail);
+    while (tail != atomic_load_explicit(&slot->tx_inflight_head, memory_order_acquire) &&
+           atomic_load(&slot->tx_inflight_broadcast[tail % TX_INFLIGHT_MAX]) == INFLIGHT_WITHDRAWN) {
+        if (atomic_compare_exchange_weak(&slot->tx_inflight_tail, &tail, tail + 1)) {
+            release_tx_credit(slot);
+            tail++;
+        }
+    }
+}
+
+// Writes to a closed connection whose completions will never come
+static void fail_inflight(conn_slot_t *slot, uint32_t conn_handle) {
+    uint32_t sent_us;
+    uint32_t broadcast_id;
+    while (take_inflight(slot, &sent_us, &broadcast_id)) {
+        if (broadcast_id && broadcast_callback) {
+            broadcast_callback(broadcast_id, conn_handle, ESP_FAIL);
+        }
+    }
+}
+
+// Congestion change from the stack; writing resumes once the link clears
+static void set_tx_congested(uint32_t conn_handle, bool congested) {
+    capture_event(BT_CAPTURE_CONGEST, conn_handle, 0, congested, NULL, 0);
+    uint32_t conn_idx = find_connection_by_handle(conn_handle);
+    if (conn_idx >= MAX_CONNECTIONS) {
+        return;
+    }
+    atomic_store(&slots[conn_idx].tx_congested, congested);
+    if (!congested) {
+        mark_slot_active(conn_idx);
+    }
+}
+
+// Count data received from the air, whether or not it could be queued
+static void record_rx_activity(uint32_t conn_idx, uint16_t length) {
+    bt_seq_write_begin(&slots[conn_idx].stats_lock);
+    connections[conn_idx].bytes_received += length;
+    connections[conn_idx].packets_received++;
+    bt_seq_write_end(&slots[conn_idx].stats_lock);
+    update_connection_activity(conn_idx);
+}
+
+// Consistent copy of a connection record, retried if the Bluetooth task
+// updated it meanwhile
+static void snapshot_connection(uint32_t conn_idx, connection_info_t *info) {
+    uint32_t seq;
+    do {
+        seq = bt_seq_read_begin(&slots[conn_idx].stats_lock);
+        memcpy(info, &connections[conn_idx], sizeof(connection_info_t));
+    } while (bt_seq_read_retry(&slots[conn_idx].stats_lock, seq));
+    info->tx_dropped = atomic_load(&slots[conn_idx].tx_dropped);
+    info->compressed = atomic_load(&slots[conn_idx].zip_state) == ZIP_ACTIVE;
+}
+
+// Fold the bytes moved during the last interval into each connection's
+// moving-average throughput
+static void stats_timer_callback(TimerHandle_t timer) {
+    connection_info_t info;
+    
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (atomic_load(&slots[i].state) != CONN_STATE_CONNECTED) {
+            continue;
+        }
+        conn_slot_t *slot = &slots[i];
+        snapshot_connection(i, &info);
+        
+        uint32_t rx_rate = (uint32_t)((info.bytes_received - slot->rate_last_rx_bytes) * 1000 / STATS_RATE_INTERVAL_MS);
+        uint32_t tx_rate = (uint32_t)((info.bytes_sent - slot->rate_last_tx_bytes) * 1000 / STATS_RATE_INTERVAL_MS);
+        slot->rate_last_rx_bytes = info.bytes_received;
+        slot->rate_last_tx_bytes = info.bytes_sent;
+        
+        // Single-word stores outside the sequence lock; readers never see them torn
+        connections[i].rx_rate_bps = bt_ewma_update(info.rx_rate_bps, rx_rate);
+        connections[i].tx_rate_bps = bt_ewma_update(info.tx_rate_bps, tx_rate);
+        
+        manage_link(i, connections[i].rx_rate_bps + connections[i].tx_rate_bps);
+    }
+}
+
+// Give airtime to the busy links and reap the dead ones. Runs on every stats
+// sample, after the rates are updated. This is the timer task, which must not
+// wait on connections_mutex, so the message task closes idle peers.
+static void manage_link(uint32_t conn_idx, uint32_t rate_bps) {
+    conn_slot_t *slot = &slots[conn_idx];
+    uint32_t idle_ms = (xTaskGetTickCount() - connections[conn_idx].last_activity) * portTICK_PERIOD_MS;
+    
+    if (LINK_IDLE_TIMEOUT_MS > 0 && idle_ms >= LINK_IDLE_TIMEOUT_MS) {
+        if (connections[conn_idx].state == CONN_STATE_CONNECTED &&
+            atomic_exchange(&slot->reap_handle, atomic_load(&slot->handle)) == INVALID_HANDLE) {
+            ESP_LOGW(TAG, "Connection %lu idle for %lu ms, disconnecting", conn_idx, idle_ms);
+            mark_slot_active(conn_idx);
+        }
+        return;
+    }
+    
+    // Classic links have no connection parameters to tune
+    if (slot->transport != TRANSPORT_BLE) {
+        return;
+    }
+    bool backlogged = tx_backlog(slot) > 0;
+    if (bt_link_update(&slot->link, rate_bps, idle_ms, backlogged)) {
+        apply_link_profile(conn_idx, slot->link.profile);
+    }
+}
+
+// Ask the central for the profile's connection parameters and, on BLE 5
+// controllers, the matching PHY: 2M for fast links, 1M otherwise
+static void apply_link_profile(uint32_t conn_idx, bt_link_profile_t profile) {
+    if (CONN_HANDLE_IS_REPLAY(atomic_load(&slots[conn_idx].handle))) {
+        return;
+    }
+    const bt_link_params_t *params = bt_link_params(profile);
+    esp_ble_conn_update_params_t update = {
+        .min_int = params->min_interval,
+        .max_int = params->max_interval,
+        .latency = params->latency,
+        .timeout = params->timeout,
+    };
+    memcpy(update.bda, connections[conn_idx].remote_addr, sizeof(esp_bd_addr_t));
+    
+    esp_err_t ret = esp_ble_gap_update_conn_params(&update);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Connection %lu parameter update failed: %s", conn_idx, esp_err_to_name(ret));
+    }
+#if CONFIG_BT_BLE_50_FEATURES_SUPPORTED
+    esp_ble_gap_phy_mask_t phy = profile == BT_LINK_FAST ? ESP_BLE_GAP_PHY_2M_PREF_MASK : ESP_BLE_GAP_PHY_1M_PREF_MASK;
+    esp_ble_gap_set_preferred_phy(connections[conn_idx].remote_addr, 0, phy, phy, ESP_BLE_GAP_PHY_OPTIONS_NO_PREF);
+#endif
+    ESP_LOGI(TAG, "Connection %lu moved to link profile %d", conn_idx, profile);
+}
+
+// Low-priority task that formats deferred data path log records
+static void log_task(void *pvParameters) {
+    while (1) {
+        bt_log_drain(print_log_record);
+        vTaskDelay(pdMS_TO_TICKS(LOG_DRAIN_INTERVAL_MS));
+    }
+}
+
+static void print_log_record(uint8_t level, const char *tag, uint32_t timestamp_us, const char *text) {
+    switch (level) {
+        case BT_LOG_LEVEL_ERROR:
+            ESP_LOGE(tag, "[%lu us] %s", timestamp_us, text);
+            break;
+        case BT_LOG_LEVEL_WARN:
+            ESP_LOGW(tag, "[%lu us] %s", timestamp_us, text);
+            break;
+        case BT_LOG_LEVEL_INFO:
+            ESP_LOGI(tag, "[%lu us] %s", timestamp_us, text);
+            break;
+        default:
+            ESP_LOGD(tag, "[%lu us] %s", timestamp_us, text);
+            break;
+    }
+}
@@ -18,12 +18,45 @@
 #include "esp_gatts_api.h"
 #include "esp_bt_defs.h"
 #include "esp_gatt_common_api.h"
+#include "bt_config.h"
+#include "bt_xfer.h"
+#include "bt_rpc.h"
 
-// Configuration
-#define MAX_CONNECTIONS 8
-#define MAX_PACKET_SIZE 512
+// Configuration (data path sizing lives in bt_config.h)
+#define RX_DEFAULT_POLICY RX_POLICY_DROP_NEWEST
+#define RX_DEFAULT_DEADLINE_MS 20
+#define RX_DEFAULT_QUOTA 4          // Pool buffers one connection may hold under RX_POLICY_QUOTA
 #define DEVICE_NAME "ESP32_Multi_SPP"
 #define BLE_DEVICE_NAME "ESP32_Multi_BLE"
+#define BLE_MAX_MTU 517       // Largest ATT MTU offered in the MTU exchange
+#define BLE_DATA_LENGTH 251   // LE Data Length Extension payload requested per link layer packet
+#define LINK_IDLE_TIMEOUT_MS 300000 // Disconnect peers silent this long; 0 keeps them forever
+#define ZIP_MAX_STREAMS 2     // Connections that may have compression negotiated at once
+#define CAPTURE_BUFFER_SIZE 8192 // Traffic capture ring; the most recent records that fit are kept
+#define CAPTURE_DUMP_LINE 32     // Recording bytes per hex line when dumped
+
+// Data path pipeline. The message task (RX scheduling, TX writes) runs on the
+// core the Bluetooth stack is pinned to; the dispatch task (framing and
+// application callbacks) runs on the other one, so heavy application work
+// never delays servicing the radio.
+#ifndef PIPELINE_IO_CORE
+#ifdef CONFIG_BT_BLUEDROID_PINNED_TO_CORE
+#define PIPELINE_IO_CORE CONFIG_BT_BLUEDROID_PINNED_TO_CORE
+#else
+#define PIPELINE_IO_CORE 0
+#endif
+#endif
+#ifndef PIPELINE_DISPATCH_CORE
+#if CONFIG_FREERTOS_UNICORE
+#define PIPELINE_DISPATCH_CORE PIPELINE_IO_CORE
+#else
+#define PIPELINE_DISPATCH_CORE (1 - PIPELINE_IO_CORE)
+#endif
+#endif
+#define PIPELINE_IO_PRIORITY 6
+#define PIPELINE_IO_STACK 4096
+#define PIPELINE_DISPATCH_PRIORITY 4
+#define PIPELINE_DISPATCH_STACK 6144
 
 // Connection states
 typedef enum {
@@ -39,29 +72,159 @@ typedef struct {
     connection_state_t state;
     esp_bd_addr_t remote_addr;
     char remote_name[ESP_BT_GAP_MAX_BDNAME_LEN + 1];
-    uint32_t bytes_received;
-    uint32_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t bytes_sent;
+    uint32_t packets_received;
+    uint32_t packets_sent;        // Writes confirmed complete by the stack
+    uint32_t rx_rate_bps;         // Moving average of received bytes per second
+    uint32_t tx_rate_bps;         // Moving average of sent bytes per second
     uint32_t last_activity;
+    uint32_t rx_dropped;          // Packets discarded by this module, not lost on air
+    uint32_t tx_dropped;          // Broadcasts that could not be queued to this peer
+    uint16_t rx_queue_high_water; // Deepest the connection's RX ring has been
+    uint32_t frame_errors;        // Frames discarded for bad length, encoding or CRC, and bad compressed blocks
+    bool compressed;              // Compression negotiated with the peer
 } connection_info_t;
 
-// Message structure for inter-task communication
+// Latency histograms: bucket 0 counts 0 us, bucket n counts [2^(n-1), 2^n) us
+typedef struct {
+    uint32_t rx_delivery[LATENCY_HIST_BUCKETS];   // Bluetooth callback to data callback
+    uint32_t tx_completion[LATENCY_HIST_BUCKETS]; // Send call to write complete
+} connection_latency_t;
+
+// What to do with received data when the RX ring or packet pool is full
+typedef enum {
+    RX_POLICY_DROP_NEWEST = 0, // Discard the packet that just arrived
+    RX_POLICY_DROP_OLDEST,     // Discard the connection's oldest queued packet to make room
+    RX_POLICY_BLOCK,           // Hold the Bluetooth callback up to deadline_ms, then drop newest
+    RX_POLICY_QUOTA            // Cap each connection at quota buffers, then drop newest
+} rx_policy_t;
+
+typedef struct {
+    rx_policy_t policy;
+    uint32_t deadline_ms; // RX_POLICY_BLOCK only
+    uint16_t quota;       // RX_POLICY_QUOTA only
+} rx_policy_config_t;
+
+// Framing of a connection's byte stream. With framing enabled, received
+// fragments are reassembled and whole frames go to the frame callback instead
+// of the data callback.
+typedef enum {
+    FRAME_MODE_NONE = 0,        // Deliver fragments as they arrive
+    FRAME_MODE_LENGTH_PREFIXED, // 16-bit big-endian length, then the body
+    FRAME_MODE_COBS             // COBS-encoded body terminated by a zero byte
+} frame_mode_t;
+
+typedef struct {
+    frame_mode_t mode;
+    bool crc; // Body ends with a CRC-16/CCITT-FALSE of the payload
+} frame_config_t;
+
+// Optional per-connection TX coalescing: small sends are packed into one
+// write, which goes out once flush_threshold bytes are batched (capped at the
+// link's payload size), on bluetooth_spp_flush(), or flush_deadline_us after
+// the first byte entered the batch, whichever comes first
+typedef struct {
+    uint16_t flush_threshold;   // 0 disables coalescing
+    uint32_t flush_deadline_us;
+} tx_coalesce_config_t;
+
+// Time each pipeline stage has spent working since start-up, measured from
+// wake-up to going back to sleep (so it includes any preemption)
+typedef struct {
+    uint64_t uptime_us;
+    uint64_t io_busy_us;       // Message task
+    uint64_t dispatch_busy_us; // Dispatch task
+    uint32_t io_messages;      // Received messages handed on and writes made
+    uint32_t dispatch_messages; // Received messages delivered to the application
+} pipeline_stats_t;
+
+// Traffic classes. Each connection has a TX lane per class, chosen per send,
+// and an RX class that orders its delivery against other connections. Order
+// is kept within a class but not across classes.
+typedef enum {
+    TRAFFIC_CLASS_CONTROL = 0, // Commands; never coalesced, and one TX credit is kept for them
+    TRAFFIC_CLASS_INTERACTIVE, // Default for sends, broadcasts and new connections
+    TRAFFIC_CLASS_BULK,        // Transfers that should yield to everything else
+    TRAFFIC_CLASS_COUNT
+} traffic_class_t;
+
+typedef enum {
+    LANE_POLICY_STRICT = 0, // Always send from the highest-priority class with data
+    LANE_POLICY_WEIGHTED    // Share packets between classes by weight, highest class first
+} lane_policy_t;
+
 typedef struct {
-    uint32_t conn_handle;
-    uint8_t data[MAX_PACKET_SIZE];
-    uint16_t length;
-    uint8_t type; // 0 = received, 1 = to send
-} bt_message_t;
+    lane_policy_t policy;
+    uint8_t weights[TRAFFIC_CLASS_COUNT]; // LANE_POLICY_WEIGHTED only
+} lane_policy_config_t;
+
+#define LANE_DEFAULT_POLICY LANE_POLICY_WEIGHTED
+#define LANE_DEFAULT_WEIGHTS {8, 4, 1}
 
 // Function declarations
 void bluetooth_spp_init(void);
 esp_err_t bluetooth_spp_send_data(uint32_t conn_handle, const uint8_t *data, uint16_t length);
-esp_err_t bluetooth_spp_broadcast_data(const uint8_t *data, uint16_t length);
+esp_err_t bluetooth_spp_send_data_class(uint32_t conn_handle, const uint8_t *data, uint16_t length, traffic_class_t traffic_class);
+esp_err_t bluetooth_spp_broadcast_data(const uint8_t *data, uint16_t length, uint32_t *broadcast_id);
+esp_err_t bluetooth_spp_set_connection_weight(uint32_t conn_handle, uint16_t weight);
+void bluetooth_spp_set_rx_policy(const rx_policy_config_t *config);
+void bluetooth_spp_set_lane_policy(const lane_policy_config_t *config);
+esp_err_t bluetooth_spp_set_rx_class(uint32_t conn_handle, traffic_class_t traffic_class);
+void bluetooth_spp_set_default_framing(const frame_config_t *config);
+void bluetooth_spp_set_compression(bool enabled);
+esp_err_t bluetooth_spp_set_framing(uint32_t conn_handle, const frame_config_t *config);
+esp_err_t bluetooth_spp_send_frame(uint32_t conn_handle, const uint8_t *data, uint16_t length);
+esp_err_t bluetooth_spp_set_tx_coalescing(uint32_t conn_handle, const tx_coalesce_config_t *config);
+esp_err_t bluetooth_spp_flush(uint32_t conn_handle);
+esp_err_t bluetooth_spp_xfer_receive(uint32_t conn_handle, const bt_xfer_sink_t *sink);
+esp_err_t bluetooth_spp_xfer_send(uint32_t conn_handle, uint32_t transfer_id, uint32_t size, const bt_xfer_source_t *source);
+esp_err_t bluetooth_spp_xfer_cancel(uint32_t conn_handle);
+void bluetooth_spp_rpc_init(const bt_rpc_handler_t *handlers, uint16_t count);
+esp_err_t bluetooth_spp_rpc_call(uint32_t conn_handle, uint8_t method, const uint8_t *args, uint16_t length,
+                                 bt_rpc_complete_t complete, void *context, uint32_t timeout_ms, uint16_t *request_id);
+esp_err_t bluetooth_spp_rpc_reply(uint32_t conn_handle, uint16_t request_id, uint8_t status, const uint8_t *reply, uint16_t length);
 void bluetooth_spp_disconnect(uint32_t conn_handle);
 void bluetooth_spp_get_connection_info(connection_info_t *conn_info, uint8_t *count);
+esp_err_t bluetooth_spp_get_connection_snapshot(uint32_t conn_handle, connection_info_t *info, connection_latency_t *latency);
+void bluetooth_spp_print_connection_status(void);
+void bluetooth_spp_get_pipeline_stats(pipeline_stats_t *stats);
+void bluetooth_spp_print_memory_usage(void);
 void bluetooth_spp_set_device_name(const char *name);
 
-// Callback function type for received data
+// Traffic capture and replay. A capture records every stack event on the data
+// path (connects, received data, write completions, congestion, MTU and
+// subscription changes, disconnects) with microsecond timestamps, keeping up
+// to snap_length bytes of each received packet; the format is in
+// bt_capture.h. The dump prints the recording as hex lines between
+// "CAPTURE BEGIN <bytes>" and "CAPTURE END" for a host to collect. Replay
+// feeds such a recording back through the same paths at speed_percent of the
+// recorded pace (100 real time, 0 as fast as possible) and blocks until done.
+void bluetooth_spp_capture_start(uint16_t snap_length);
+void bluetooth_spp_capture_stop(void);
+void bluetooth_spp_dump_capture(void);
+esp_err_t bluetooth_spp_replay(const uint8_t *recording, uint32_t length, uint32_t speed_percent);
+
+// Callback function type for received data. The data pointer is borrowed from
+// the packet pool and is only valid until the callback returns.
 typedef void (*data_received_callback_t)(uint32_t conn_handle, const uint8_t *data, uint16_t length);
 void bluetooth_spp_set_data_callback(data_received_callback_t callback);
 
+// Callback function type for whole frames on connections with framing enabled.
+// The frame is decoded in place in a pool buffer where possible and is only
+// valid until the callback returns.
+typedef void (*frame_received_callback_t)(uint32_t conn_handle, const uint8_t *frame, uint16_t length);
+void bluetooth_spp_set_frame_callback(frame_received_callback_t callback);
+
+// Callback function type for broadcast completion, called once per peer the
+// broadcast was queued to: ESP_OK when the write completed, an error if it
+// failed or the peer disconnected first. Runs on a Bluetooth or message task.
+typedef void (*broadcast_complete_callback_t)(uint32_t broadcast_id, uint32_t conn_handle, esp_err_t result);
+void bluetooth_spp_set_broadcast_callback(broadcast_complete_callback_t callback);
+
+// Callback function type for the end of a bulk transfer, successful or not.
+// Runs on the dispatch task.
+typedef void (*xfer_complete_callback_t)(uint32_t conn_handle, uint32_t transfer_id, bt_xfer_status_t status, const bt_xfer_stats_t *stats);
+void bluetooth_spp_set_xfer_callback(xfer_complete_callback_t callback);
+
 #endif // BLUETOOTH_SPP_H 
\ No newline at end of file
@@ -0,0 +1,256 @@
+/*
+ * Traffic Capture and Replay Format
+ *
+ * Records the events the SPP/BLE data path sees from the stack (connects,
+ * received data, write completions, congestion, disconnects) into a byte
+ * ring in a compact binary form: a type byte and varints, with time stored
+ * as the microseconds since the previous record, so a typical event costs a
+ * handful of bytes plus whatever data is kept. A recording is the magic
+ * followed by the ring's records, oldest first, and is walked back with the
+ * reader, which also turns recorded times into replay deadlines at any
+ * speed.
+ *
+ * The module has no ESP-IDF dependencies: recordings dumped from a device
+ * can be parsed and replayed by the same code on the host.
+ */
+
+#include <string.h>
+#include "bt_capture.h"
+
+#define FLAG_BIT 0x80
+
+// Handles keep their transport and replay flags in the top bits; stored
+// rotated into the low bits, a BLE conn_id still fits one varint byte
+static uint32_t pack_handle(uint32_t handle) {
+    return (handle << 2) | (handle >> 30);
+}
+
+static uint32_t unpack_handle(uint32_t packed) {
+    return (packed >> 2) | (packed << 30);
+}
+
+// Reads records from a buffer that may wrap at size
+typedef struct {
+    const uint8_t *buffer;
+    uint32_t size;
+    uint32_t position;
+    uint32_t remaining;
+} cursor_t;
+
+static bool take_byte(cursor_t *cursor, uint8_t *byte) {
+    if (cursor->remaining == 0) {
+        return false;
+    }
+    *byte = cursor->buffer[cursor->position];
+    cursor->position = cursor->position + 1 == cursor->size ? 0 : cursor->position + 1;
+    cursor->remaining--;
+    return true;
+}
+
+static bool take_varint(cursor_t *cursor, uint32_t *value) {
+    uint32_t result = 0;
+    uint8_t byte;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (!take_byte(cursor, &byte)) {
+            return false;
+        }
+        result |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+// One record. event->data points into the buffer and is only contiguous
+// when the buffer does not wrap, as in a recording being read.
+static bool decode(cursor_t *cursor, bt_capture_event_t *event, uint32_t *delta_us) {
+    uint8_t type;
+    uint32_t kept = 0;
+    if (!take_byte(cursor, &type) || !take_varint(cursor, delta_us) || !take_varint(cursor, &event->handle) ||
+        !take_varint(cursor, &event->value)) {
+        return false;
+    }
+    event->handle = unpack_handle(event->handle);
+    event->type = type & ~FLAG_BIT;
+    event->flag = (type & FLAG_BIT) != 0;
+    if (event->type == 0 || event->type >= BT_CAPTURE_TYPE_COUNT) {
+        return false;
+    }
+    if (event->type == BT_CAPTURE_CONNECT) {
+        kept = BT_CAPTURE_ADDRESS_SIZE;
+    } else if (event->type == BT_CAPTURE_DATA && !take_varint(cursor, &kept)) {
+        return false;
+    }
+    if (kept > cursor->remaining || kept > UINT16_MAX) {
+        return false;
+    }
+    event->data = kept ? &cursor->buffer[cursor->position] : NULL;
+    event->kept = kept;
+    cursor->position = (cursor->position + kept) % cursor->size;
+    cursor->remaining -= kept;
+    return true;
+}
+
+static uint32_t put_varint(uint8_t *out, uint32_t value) {
+    uint32_t length = 0;
+    while (value >= 0x80) {
+        out[length++] = value | 0x80;
+        value >>= 7;
+    }
+    out[length++] = value;
+    return length;
+}
+
+static void ring_write(bt_capture_t *capture, uint32_t *position, const uint8_t *data, uint32_t length) {
+    uint32_t first = capture->size - *position;
+    if (first > length) {
+        first = length;
+    }
+    memcpy(&capture->buffer[*position], data, first);
+    memcpy(capture->buffer, data + first, length - first);
+    *position = (*position + length) % capture->size;
+}
+
+// The ring only ever holds whole records it encoded itself, so the oldest
+// always decodes
+static void evict_oldest(bt_capture_t *capture) {
+    cursor_t cursor = {capture->buffer, capture->size, capture->tail, capture->used};
+    bt_capture_event_t event;
+    uint32_t delta_us;
+
+    decode(&cursor, &event, &delta_us);
+    capture->tail = cursor.position;
+    capture->used = cursor.remaining;
+    capture->records--;
+    capture->overwritten++;
+}
+
+// snap_length limits the data kept per DATA record; records must fit the
+// buffer, so it should be well below size
+void bt_capture_init(bt_capture_t *capture, uint8_t *buffer, uint32_t size, uint16_t snap_length) {
+    capture->buffer = buffer;
+    capture->size = size;
+    capture->snap_length = snap_length;
+    bt_capture_clear(capture);
+}
+
+void bt_capture_clear(bt_capture_t *capture) {
+    capture->tail = 0;
+    capture->used = 0;
+    capture->records = 0;
+    capture->overwritten = 0;
+    capture->last_us = 0;
+}
+
+// Append one event, overwriting the oldest records if needed. CONNECT events
+// must carry the peer address. False only if the record is larger than the
+// whole ring.
+bool bt_capture_record(bt_capture_t *capture, const bt_capture_event_t *event, uint32_t now_us) {
+    uint8_t header[BT_CAPTURE_HEADER_MAX];
+    uint32_t kept = 0;
+    uint32_t length = 0;
+
+    if (event->type == BT_CAPTURE_CONNECT) {
+        kept = BT_CAPTURE_ADDRESS_SIZE;
+    } else if (event->type == BT_CAPTURE_DATA) {
+        kept = event->kept < capture->snap_length ? event->kept : capture->snap_length;
+    }
+    header[length++] = event->type | (event->flag ? FLAG_BIT : 0);
+    length += put_varint(&header[length], capture->records ? now_us - capture->last_us : 0);
+    length += put_varint(&header[length], pack_handle(event->handle));
+    length += put_varint(&header[length], event->value);
+    if (event->type == BT_CAPTURE_DATA) {
+        length += put_varint(&header[length], kept);
+    }
+    if (length + kept > capture->size) {
+        return false;
+    }
+
+    while (capture->size - capture->used < length + kept) {
+        evict_oldest(capture);
+    }
+    uint32_t position = (capture->tail + capture->used) % capture->size;
+    ring_write(capture, &position, header, length);
+    if (kept > 0) {
+        ring_write(capture, &position, event->data, kept);
+    }
+    capture->used += length + kept;
+    capture->records++;
+    capture->last_us = now_us;
+    return true;
+}
+
+// Bytes in the recording bt_capture_read produces
+uint32_t bt_capture_size(const bt_capture_t *capture) {
+    return BT_CAPTURE_MAGIC_SIZE + capture->used;
+}
+
+// Copy up to length bytes of the recording, starting offset bytes in, so it
+// can be dumped in pieces without a second buffer. Returns the bytes copied.
+uint32_t bt_capture_read(const bt_capture_t *capture, uint32_t offset, uint8_t *out, uint32_t length) {
+    uint32_t copied = 0;
+
+    while (copied < length && offset < BT_CAPTURE_MAGIC_SIZE) {
+        out[copied++] = BT_CAPTURE_MAGIC[offset++];
+    }
+    offset -= BT_CAPTURE_MAGIC_SIZE;
+    while (copied < length && offset < capture->used) {
+        uint32_t position = (capture->tail + offset) % capture->size;
+        uint32_t run = capture->size - position;
+        if (run > capture->used - offset) {
+            run = capture->used - offset;
+        }
+        if (run > length - copied) {
+            run = length - copied;
+        }
+        memcpy(&out[copied], &capture->buffer[position], run);
+        copied += run;
+        offset += run;
+    }
+    return copied;
+}
+
+// False if the data is not a recording
+bool bt_capture_reader_init(bt_capture_reader_t *reader, const uint8_t *data, uint32_t length) {
+    memset(reader, 0, sizeof(*reader));
+    if (length < BT_CAPTURE_MAGIC_SIZE || memcmp(data, BT_CAPTURE_MAGIC, BT_CAPTURE_MAGIC_SIZE) != 0) {
+        return false;
+    }
+    reader->data = data;
+    reader->length = length;
+    reader->offset = BT_CAPTURE_MAGIC_SIZE;
+    return true;
+}
+
+// The next event, with its time counted from the first one; its data points
+// into the recording. False at the end, or with reader->error set if the
+// recording is damaged.
+bool bt_capture_next(bt_capture_reader_t *reader, bt_capture_event_t *event) {
+    if (reader->error || reader->offset >= reader->length) {
+        return false;
+    }
+    cursor_t cursor = {reader->data, reader->length, reader->offset, reader->length - reader->offset};
+    uint32_t delta_us;
+    if (!decode(&cursor, event, &delta_us)) {
+        reader->error = true;
+        return false;
+    }
+    reader->offset = reader->length - cursor.remaining;
+
+    // The first record's delta counts from a record that may since have been
+    // overwritten
+    reader->time_us = reader->started ? reader->time_us + delta_us : 0;
+    reader->started = true;
+    event->time_us = reader->time_us;
+    return true;
+}
+
+// When to replay an event, from the start of the replay: its recorded time at
+// speed_percent (100 is real time, 1000 ten times faster). Deadlines come from
+// the recorded times rather than from the previous event, so pacing errors do
+// not accumulate. Speed 0 replays without waiting.
+uint64_t bt_capture_due_us(const bt_capture_event_t *event, uint32_t speed_percent) {
+    return speed_percent ? event->time_us * 100 / speed_percent : 0;
+}
@@ -0,0 +1,76 @@
+#ifndef BT_CAPTURE_H
+#define BT_CAPTURE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bt_config.h"
+
+// Configuration
+#define BT_CAPTURE_MAGIC "BTC1" // Leads every recording
+#define BT_CAPTURE_MAGIC_SIZE 4
+#define BT_CAPTURE_HEADER_MAX 21 // Type byte and up to four varints
+#define BT_CAPTURE_ADDRESS_SIZE 6
+
+// Recorded events. Every record is a type byte (bit 7 carries the flag), then
+// as unsigned LEB128 varints the microseconds since the previous record, the
+// connection handle (rotated left by two bits) and the value, then for
+// CONNECT the peer address and for DATA a varint count of the kept bytes
+// followed by those bytes.
+typedef enum {
+    BT_CAPTURE_CONNECT = 1, // Data: peer address
+    BT_CAPTURE_DISCONNECT,
+    BT_CAPTURE_DATA,        // Value: bytes received; data: the first of them, up to the snap length
+    BT_CAPTURE_WRITE_DONE,  // Value: bytes written; flag: success
+    BT_CAPTURE_CONGEST,     // Flag: congested
+    BT_CAPTURE_MTU,         // Value: negotiated ATT MTU
+    BT_CAPTURE_NOTIFY,      // Flag: notifications enabled on the BLE TX characteristic
+    BT_CAPTURE_TYPE_COUNT
+} bt_capture_type_t;
+
+typedef struct {
+    bt_capture_type_t type;
+    bool flag;
+    uint32_t handle;
+    uint32_t value;
+    const uint8_t *data; // CONNECT and DATA only
+    uint16_t kept;       // Bytes at data
+    uint64_t time_us;    // Reader: time since the first record of the recording
+} bt_capture_event_t;
+
+// Recording ring. When a new record does not fit, the oldest whole records are
+// overwritten, so the ring always holds the most recent traffic. One writer at
+// a time; the caller locks around it.
+typedef struct {
+    uint8_t *buffer;
+    uint32_t size;
+    uint32_t tail;        // Offset of the oldest record
+    uint32_t used;        // Bytes held
+    uint32_t records;     // Records held
+    uint32_t overwritten; // Records dropped to make room
+    uint32_t last_us;     // Time of the newest record
+    uint16_t snap_length; // DATA bytes kept per record
+} bt_capture_t;
+
+// Walks a recording: the magic followed by records, as produced by
+// bt_capture_read
+typedef struct {
+    const uint8_t *data;
+    uint32_t length;
+    uint32_t offset;
+    uint64_t time_us;
+    bool started;
+    bool error; // Set if the recording ended inside a record or held an unknown type
+} bt_capture_reader_t;
+
+// Function declarations
+void bt_capture_init(bt_capture_t *capture, uint8_t *buffer, uint32_t size, uint16_t snap_length);
+void bt_capture_clear(bt_capture_t *capture);
+bool bt_capture_record(bt_capture_t *capture, const bt_capture_event_t *event, uint32_t now_us);
+uint32_t bt_capture_size(const bt_capture_t *capture);
+uint32_t bt_capture_read(const bt_capture_t *capture, uint32_t offset, uint8_t *out, uint32_t length);
+
+bool bt_capture_reader_init(bt_capture_reader_t *reader, const uint8_t *data, uint32_t length);
+bool bt_capture_next(bt_capture_reader_t *reader, bt_capture_event_t *event);
+uint64_t bt_capture_due_us(const bt_capture_event_t *event, uint32_t speed_percent);
+
+#endif // BT_CAPTURE_H
@@ -0,0 +1,49 @@
+#ifndef BT_CONFIG_H
+#define BT_CONFIG_H
+
+/*
+ * Data path configuration and types shared by the SPP/BLE module and its
+ * building blocks (packet pool, rings, scheduler, handle index). This header has
+ * no ESP-IDF dependencies, so those building blocks compile with any C11
+ * toolchain, including on a development host.
+ */
+
+#include <stdint.h>
+
+// Configuration
+#ifndef MAX_CONNECTIONS
+#define MAX_CONNECTIONS 8 // Override at build time on controllers that support more links
+#endif
+#define MAX_PACKET_SIZE 512
+#define TX_CREDITS_PER_CONNECTION 4     // SPP writes in flight per link before waiting for completion
+#define BLE_TX_CREDITS_PER_CONNECTION 8 // Notifications in flight per BLE link, so several go out per connection event
+#define TX_INFLIGHT_MAX 8               // The larger of the two
+#define LATENCY_HIST_BUCKETS 20      // Log2 microsecond buckets, the last one open-ended (>= ~0.5 s)
+#define STATS_RATE_INTERVAL_MS 1000  // Throughput EWMA sampling period
+#define BT_LANES 3                   // Traffic classes, 0 = highest priority
+
+// Connection handles are tagged with their transport, so a BLE conn_id can never
+// be mistaken for an SPP handle. SPP handles are used as-is.
+#define CONN_HANDLE_BLE_FLAG 0x80000000
+#define CONN_HANDLE_IS_BLE(handle) (((handle) & CONN_HANDLE_BLE_FLAG) != 0)
+#define CONN_HANDLE_FROM_BLE(conn_id) (CONN_HANDLE_BLE_FLAG | (uint32_t)(conn_id))
+#define CONN_HANDLE_TO_BLE(handle) ((uint16_t)((handle) & 0xFFFF))
+
+// Peers fed in from a recording by bluetooth_spp_replay keep their recorded
+// handle with this flag added, so they never collide with live peers
+#define CONN_HANDLE_REPLAY_FLAG 0x40000000
+#define CONN_HANDLE_IS_REPLAY(handle) (((handle) & CONN_HANDLE_REPLAY_FLAG) != 0)
+
+// Message descriptor for inter-task communication. The payload itself lives in
+// the packet pool (bt_packet_pool.h); only this small handle is queued.
+typedef struct {
+    uint32_t conn_handle;
+    uint32_t timestamp_us; // When the data entered this module (callback or send call)
+    uint16_t buffer; // Packet pool index
+    uint16_t length;
+    uint8_t slot;    // Index into the connection table
+    uint8_t type;    // 0 = received, 1 = to send, 2 = broadcast to send, 3 = compression hello to send
+    uint8_t encoded; // To send: already wrapped as a compressed block
+} bt_message_t;
+
+#endif // BT_CONFIG_H
@@ -0,0 +1,274 @@
+/*
+ * Streaming Frame Codec
+ *
+ * Turns a byte stream that arrives in arbitrary fragments (SPP reads, GATT
+ * writes) into whole frames, in either of two formats:
+ *   - length-prefixed: 16-bit big-endian body length, then the body
+ *   - COBS: the body with zero bytes encoded away, terminated by a zero byte
+ * With BT_FRAME_CRC the body ends with a CRC-16/CCITT-FALSE of the payload.
+ *
+ * Frames that lie entirely within one fragment are decoded in place in the
+ * caller's buffer and handed to the sink without copying. Only frames that
+ * straddle fragments are gathered in the framer's own buffer, and each byte is
+ * scanned once either way.
+ */
+
+#include <string.h>
+#include "bt_framer.h"
+
+static const uint16_t crc16_nibble_table[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+};
+
+// CRC-16/CCITT-FALSE (poly 0x1021); start with 0xFFFF
+uint16_t bt_crc16(uint16_t crc, const uint8_t *data, uint16_t length) {
+    for (uint16_t i = 0; i < length; i++) {
+        crc = (crc << 4) ^ crc16_nibble_table[((crc >> 12) ^ (data[i] >> 4)) & 0x0F];
+        crc = (crc << 4) ^ crc16_nibble_table[((crc >> 12) ^ data[i]) & 0x0F];
+    }
+    return crc;
+}
+
+void bt_framer_reset(bt_framer_t *framer, uint32_t config) {
+    framer->config = config;
+    framer->fill = 0;
+    framer->discarding = false;
+}
+
+// Check the optional CRC and pass the payload to the sink
+static void emit_frame(bt_framer_t *framer, const uint8_t *body, uint16_t length,
+                       bt_frame_sink_t sink, void *context) {
+    if (framer->config & BT_FRAME_CRC) {
+        if (length <= BT_FRAME_CRC_SIZE) {
+            framer->errors++;
+            return;
+        }
+        length -= BT_FRAME_CRC_SIZE;
+        uint16_t expected = ((uint16_t)body[length] << 8) | body[length + 1];
+        if (bt_crc16(0xFFFF, body, length) != expected) {
+            framer->errors++;
+            return;
+        }
+    }
+    framer->frames++;
+    sink(context, body, length);
+}
+
+static uint16_t read_length(const uint8_t *header) {
+    return ((uint16_t)header[0] << 8) | header[1];
+}
+
+static bool length_valid(const bt_framer_t *framer, uint16_t length) {
+    uint16_t min = (framer->config & BT_FRAME_CRC) ? BT_FRAME_CRC_SIZE + 1 : 1;
+    return length >= min && length <= BT_FRAME_MAX_SIZE - BT_FRAME_LENGTH_HEADER;
+}
+
+// A bad length leaves no way to find the next frame in this fragment, so the
+// rest of it is dropped and parsing restarts with the next fragment. Writers
+// that start each write on a frame boundary recover immediately.
+static void feed_length_prefixed(bt_framer_t *framer, const uint8_t *data, uint16_t length,
+                                 bt_frame_sink_t sink, void *context) {
+    uint32_t pos = 0;
+
+    while (pos < length) {
+        uint32_t avail = length - pos;
+        
+        // Fast path: a whole frame in this fragment
+        if (framer->fill == 0 && avail >= BT_FRAME_LENGTH_HEADER) {
+            uint16_t body = read_length(&data[pos]);
+            if (!length_valid(framer, body)) {
+                framer->errors++;
+                return;
+            }
+            if (avail >= BT_FRAME_LENGTH_HEADER + (uint32_t)body) {
+                emit_frame(framer, &data[pos + BT_FRAME_LENGTH_HEADER], body, sink, context);
+                pos += BT_FRAME_LENGTH_HEADER + body;
+                continue;
+            }
+        }
+        
+        // Gather a frame that spans fragments, header first
+        uint32_t want = framer->fill < BT_FRAME_LENGTH_HEADER
+                            ? BT_FRAME_LENGTH_HEADER - framer->fill
+                            : BT_FRAME_LENGTH_HEADER + read_length(framer->buffer) - framer->fill;
+        uint32_t take = avail < want ? avail : want;
+        memcpy(&framer->buffer[framer->fill], &data[pos], take);
+        framer->fill += take;
+        pos += take;
+        
+        if (framer->fill < BT_FRAME_LENGTH_HEADER) {
+            continue;
+        }
+        uint16_t body = read_length(framer->buffer);
+        if (!length_valid(framer, body)) {
+            framer->errors++;
+            framer->fill = 0;
+            return;
+        }
+        if (framer->fill == BT_FRAME_LENGTH_HEADER + body) {
+            emit_frame(framer, &framer->buffer[BT_FRAME_LENGTH_HEADER], body, sink, context);
+            framer->fill = 0;
+        }
+    }
+}
+
+// Decode COBS in place (output never overtakes input); -1 if malformed
+static int cobs_decode(uint8_t *buffer, uint16_t length) {
+    uint32_t in = 0;
+    uint32_t out = 0;
+
+    while (in < length) {
+        uint8_t code = buffer[in++];
+        if (code == 0 || in + code - 1 > length) {
+            return -1;
+        }
+        memmove(&buffer[out], &buffer[in], code - 1);
+        in += code - 1;
+        out += code - 1;
+        if (code != 0xFF && in < length) {
+            buffer[out++] = 0;
+        }
+    }
+    return out;
+}
+
+static void decode_cobs_frame(bt_framer_t *framer, uint8_t *encoded, uint16_t length,
+                              bt_frame_sink_t sink, void *context) {
+    if (length == 0) {
+        return; // Back-to-back delimiters carry no frame
+    }
+    int decoded = cobs_decode(encoded, length);
+    if (decoded <= 0) {
+        framer->errors++;
+        return;
+    }
+    emit_frame(framer, encoded, decoded, sink, context);
+}
+
+// COBS resynchronizes on every zero byte, so a corrupt or oversized frame only
+// costs that frame
+static void feed_cobs(bt_framer_t *framer, uint8_t *data, uint16_t length,
+                      bt_frame_sink_t sink, void *context) {
+    uint32_t pos = 0;
+
+    while (pos < length) {
+        const uint8_t *zero = memchr(&data[pos], 0, length - pos);
+        uint32_t end = zero ? (uint32_t)(zero - data) : length;
+        uint32_t chunk = end - pos;
+        
+        if (framer->discarding) {
+            framer->discarding = (zero == NULL);
+        } else if (zero && framer->fill == 0) {
+            // Fast path: decode straight out of the caller's buffer
+            decode_cobs_frame(framer, &data[pos], chunk, sink, context);
+        } else if (framer->fill + chunk > BT_FRAME_MAX_SIZE) {
+            framer->errors++;
+            framer->fill = 0;
+            framer->discarding = (zero == NULL);
+        } else {
+            memcpy(&framer->buffer[framer->fill], &data[pos], chunk);
+            framer->fill += chunk;
+            if (zero) {
+                decode_cobs_frame(framer, framer->buffer, framer->fill, sink, context);
+                framer->fill = 0;
+            }
+        }
+        pos = end + 1;
+    }
+}
+
+// Feed the next fragment of the stream. data may be modified: COBS frames are
+// decoded in place.
+void bt_framer_feed(bt_framer_t *framer, uint8_t *data, uint16_t length, bt_frame_sink_t sink, void *context) {
+    switch (framer->config & BT_FRAME_MODE_MASK) {
+        case BT_FRAME_LENGTH_PREFIXED:
+            feed_length_prefixed(framer, data, length, sink, context);
+            break;
+        case BT_FRAME_COBS:
+            feed_cobs(framer, data, length, sink, context);
+            break;
+        default:
+            sink(context, data, length);
+            break;
+    }
+}
+
+// Worst-case encoded size of a payload, delimiter or header included
+uint16_t bt_framer_encoded_size(uint32_t config, uint16_t length) {
+    uint32_t body = length + ((config & BT_FRAME_CRC) ? BT_FRAME_CRC_SIZE : 0);
+    uint32_t size;
+
+    switch (config & BT_FRAME_MODE_MASK) {
+        case BT_FRAME_LENGTH_PREFIXED:
+            size = BT_FRAME_LENGTH_HEADER + body;
+            break;
+        case BT_FRAME_COBS:
+            size = 1 + body + body / 254 + 1;
+            break;
+        default:
+            size = length;
+            break;
+    }
+    return size > UINT16_MAX ? UINT16_MAX : size;
+}
+
+typedef struct {
+    uint8_t *out;
+    uint32_t pos;
+    uint32_t code_pos;
+    uint8_t code;
+} cobs_encoder_t;
+
+static void cobs_put(cobs_encoder_t *enc, uint8_t byte) {
+    if (byte != 0) {
+        enc->out[enc->pos++] = byte;
+        enc->code++;
+    }
+    if (byte == 0 || enc->code == 0xFF) {
+        enc->out[enc->code_pos] = enc->code;
+        enc->code_pos = enc->pos++;
+        enc->code = 1;
+    }
+}
+
+// Encode one frame into out; returns its length, or 0 if it does not fit
+uint16_t bt_framer_encode(uint32_t config, const uint8_t *payload, uint16_t length, uint8_t *out, uint16_t out_size) {
+    uint32_t mode = config & BT_FRAME_MODE_MASK;
+    uint16_t size = bt_framer_encoded_size(config, length);
+    if (length == 0 || size > out_size || (mode != BT_FRAME_NONE && size > BT_FRAME_MAX_SIZE)) {
+        return 0;
+    }
+
+    uint8_t crc[BT_FRAME_CRC_SIZE];
+    uint16_t crc_len = 0;
+    if (config & BT_FRAME_CRC) {
+        uint16_t value = bt_crc16(0xFFFF, payload, length);
+        crc[0] = value >> 8;
+        crc[1] = value & 0xFF;
+        crc_len = BT_FRAME_CRC_SIZE;
+    }
+
+    if (mode == BT_FRAME_LENGTH_PREFIXED) {
+        uint16_t body = length + crc_len;
+        out[0] = body >> 8;
+        out[1] = body & 0xFF;
+        memcpy(&out[BT_FRAME_LENGTH_HEADER], payload, length);
+        memcpy(&out[BT_FRAME_LENGTH_HEADER + length], crc, crc_len);
+        return size;
+    }
+    if (mode == BT_FRAME_COBS) {
+        cobs_encoder_t enc = { .out = out, .pos = 1, .code_pos = 0, .code = 1 };
+        for (uint16_t i = 0; i < length; i++) {
+            cobs_put(&enc, payload[i]);
+        }
+        for (uint16_t i = 0; i < crc_len; i++) {
+            cobs_put(&enc, crc[i]);
+        }
+        out[enc.code_pos] = enc.code;
+        out[enc.pos++] = 0;
+        return enc.pos;
+    }
+    memcpy(out, payload, length);
+    return length;
+}
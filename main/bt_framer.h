@@ -0,0 +1,46 @@
+#ifndef BT_FRAMER_H
+#define BT_FRAMER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bt_config.h"
+
+// Framing flags: one mode plus the optional CRC
+#define BT_FRAME_NONE             0x00 // Pass fragments through unframed
+#define BT_FRAME_LENGTH_PREFIXED  0x01 // 16-bit big-endian length, then the body
+#define BT_FRAME_COBS             0x02 // COBS-encoded body terminated by a zero byte
+#define BT_FRAME_MODE_MASK        0x03
+#define BT_FRAME_CRC              0x80 // Body ends with a big-endian CRC-16/CCITT-FALSE of the payload
+
+#define BT_FRAME_LENGTH_HEADER 2
+#define BT_FRAME_CRC_SIZE 2
+
+// Largest encoded frame a connection can reassemble: a full-size packet with
+// its CRC, COBS-encoded. Every slot carries one, framing on or not.
+#ifndef BT_FRAME_MAX_SIZE
+#define BT_FRAME_MAX_BODY (MAX_PACKET_SIZE + BT_FRAME_CRC_SIZE)
+#define BT_FRAME_MAX_SIZE (1 + BT_FRAME_MAX_BODY + BT_FRAME_MAX_BODY / 254 + 1)
+#endif
+
+// Incremental decoder state for one byte stream. Owned by a single task.
+typedef struct {
+    uint32_t config;   // Framing flags in use; see bt_framer_reset
+    uint16_t fill;     // Bytes of a partial frame held in buffer
+    bool discarding;   // COBS: skipping an oversized frame up to the next delimiter
+    uint32_t frames;   // Frames delivered
+    uint32_t errors;   // Frames dropped for bad length, encoding or CRC
+    uint8_t buffer[BT_FRAME_MAX_SIZE];
+} bt_framer_t;
+
+// Receives each complete frame's payload. The pointer is only valid until the
+// sink returns.
+typedef void (*bt_frame_sink_t)(void *context, const uint8_t *frame, uint16_t length);
+
+// Function declarations
+void bt_framer_reset(bt_framer_t *framer, uint32_t config);
+void bt_framer_feed(bt_framer_t *framer, uint8_t *data, uint16_t length, bt_frame_sink_t sink, void *context);
+uint16_t bt_framer_encoded_size(uint32_t config, uint16_t length);
+uint16_t bt_framer_encode(uint32_t config, const uint8_t *payload, uint16_t length, uint8_t *out, uint16_t out_size);
+uint16_t bt_crc16(uint16_t crc, const uint8_t *data, uint16_t length);
+
+#endif // BT_FRAMER_H
@@ -0,0 +1,285 @@
+/*
+ * Mesh Gateway Aggregation
+ *
+ * Commands arriving from upstream (an SPP or BLE client) are collected per
+ * destination address and sent as one batch message, so a burst of small
+ * commands to a lighting group costs one mesh message instead of one each. A
+ * batch goes out when the next command would take it past BT_GW_MAX_SEGMENTS
+ * segments, when it has waited BT_GW_HOLD_MS, or when it is full. Segments
+ * are what the mesh pays for: each one is an advertising burst on every
+ * relay, and a lost segment delays the whole message, so the packing works
+ * in segment units rather than bytes.
+ *
+ * Every command's outcome is reported exactly once. Group batches are done
+ * once the mesh takes them; unicast batches wait for the receiver's status,
+ * which says per command whether it had a handler.
+ */
+
+#include <string.h>
+#include "bt_gateway.h"
+
+#define NO_DST 0x0000 // The mesh unassigned address
+
+_Static_assert(BT_GW_BATCH_COMMANDS <= 8, "The acknowledgment bitmap is one byte");
+_Static_assert(BT_GW_BATCH_PARAMS_MAX >= BT_GW_BATCH_HEADER + 1 + 1, "A batch must hold a one-byte command");
+_Static_assert(BT_GW_COMMAND_MAX <= UINT8_MAX, "Command lengths are stored in one byte");
+_Static_assert(BT_GW_COMMAND_MAX <= BT_GW_ACCESS_MAX - BT_GW_OPCODE_SIZE - BT_GW_BATCH_HEADER - 1,
+               "A command must fit the largest access message");
+
+static bool due(uint32_t now_ms, uint32_t deadline_ms) {
+    return (int32_t)(now_ms - deadline_ms) >= 0;
+}
+
+static bool is_unicast(uint16_t dst) {
+    return dst != NO_DST && dst < 0x8000;
+}
+
+static void report(bt_gw_t *gw, const bt_gw_command_t *commands, uint8_t count, bt_gw_status_t status) {
+    for (uint8_t i = 0; i < count; i++) {
+        gw->status(gw->context, commands[i].origin, commands[i].tag, status);
+    }
+}
+
+// Segments an access message of this many bytes (opcode included) takes
+uint8_t bt_gw_segments(uint16_t access_length) {
+    if (access_length <= BT_GW_UNSEG_MAX) {
+        return 1;
+    }
+    return (access_length + BT_GW_MIC_SIZE + BT_GW_SEGMENT_SIZE - 1) / BT_GW_SEGMENT_SIZE;
+}
+
+void bt_gw_init(bt_gw_t *gw, bt_gw_send_t send, bt_gw_status_cb_t status, void *context) {
+    memset(gw, 0, sizeof(*gw));
+    gw->send = send;
+    gw->status = status;
+    gw->context = context;
+}
+
+// Room for a unicast batch's acknowledgment; the oldest one is given up on
+// if all are taken
+static bt_gw_pending_t *claim_pending(bt_gw_t *gw) {
+    bt_gw_pending_t *oldest = &gw->pending[0];
+    for (int i = 0; i < BT_GW_PENDING; i++) {
+        if (gw->pending[i].dst == NO_DST) {
+            return &gw->pending[i];
+        }
+        if ((int32_t)(gw->pending[i].deadline_ms - oldest->deadline_ms) < 0) {
+            oldest = &gw->pending[i];
+        }
+    }
+    gw->stats.unacked++;
+    report(gw, oldest->commands, oldest->count, BT_GW_NO_ACK);
+    oldest->dst = NO_DST;
+    return oldest;
+}
+
+// Send a batch's parameters (seq already in place) and settle its commands
+static void send_batch(bt_gw_t *gw, uint16_t dst, uint8_t *params, uint16_t length,
+                       const bt_gw_command_t *commands, uint8_t count, uint32_t now_ms) {
+    uint8_t seq = gw->next_seq++;
+    params[0] = seq;
+
+    if (!gw->send(gw->context, dst, params, length)) {
+        gw->stats.failed++;
+        report(gw, commands, count, BT_GW_FAILED);
+        return;
+    }
+    gw->stats.messages++;
+    gw->stats.segments += bt_gw_segments(BT_GW_OPCODE_SIZE + length);
+
+    if (!is_unicast(dst)) {
+        report(gw, commands, count, BT_GW_SENT);
+        return;
+    }
+    bt_gw_pending_t *pending = claim_pending(gw);
+    pending->dst = dst;
+    pending->seq = seq;
+    pending->count = count;
+    pending->deadline_ms = now_ms + BT_GW_ACK_TIMEOUT_MS;
+    memcpy(pending->commands, commands, count * sizeof(bt_gw_command_t));
+}
+
+static void flush_batch(bt_gw_t *gw, bt_gw_batch_t *batch, uint32_t now_ms) {
+    send_batch(gw, batch->dst, batch->params, batch->length, batch->commands, batch->count, now_ms);
+    batch->dst = NO_DST;
+}
+
+// Queue one access message (opcode and parameters) for dst. The outcome is
+// reported through the status callback, immediately if it is rejected.
+void bt_gw_submit(bt_gw_t *gw, uint32_t origin, uint16_t tag, uint16_t dst, const uint8_t *message, uint16_t length,
+                  uint32_t now_ms) {
+    bt_gw_command_t command = { .origin = origin, .tag = tag };
+    uint32_t opcode;
+
+    if (dst == NO_DST || length > BT_GW_COMMAND_MAX || bt_gw_parse_opcode(message, length, &opcode) < 0) {
+        gw->status(gw->context, origin, tag, BT_GW_REJECTED);
+        return;
+    }
+    gw->stats.commands++;
+    uint16_t entry = 1 + length;
+
+    // Too big to share a batch: it goes alone, segmented as it must be
+    if (BT_GW_BATCH_HEADER + entry > BT_GW_BATCH_PARAMS_MAX) {
+        uint8_t params[BT_GW_BATCH_HEADER + 1 + BT_GW_COMMAND_MAX];
+        params[BT_GW_BATCH_HEADER] = length;
+        memcpy(&params[BT_GW_BATCH_HEADER + 1], message, length);
+        send_batch(gw, dst, params, BT_GW_BATCH_HEADER + entry, &command, 1, now_ms);
+        return;
+    }
+
+    bt_gw_batch_t *batch = NULL;
+    bt_gw_batch_t *free_batch = NULL;
+    bt_gw_batch_t *oldest = NULL;
+    for (int i = 0; i < BT_GW_BATCHES; i++) {
+        bt_gw_batch_t *candidate = &gw->batches[i];
+        if (candidate->dst == dst) {
+            batch = candidate;
+            break;
+        }
+        if (candidate->dst == NO_DST) {
+            if (!free_batch) {
+                free_batch = candidate;
+            }
+        } else if (!oldest || (int32_t)(candidate->opened_ms - oldest->opened_ms) < 0) {
+            oldest = candidate;
+        }
+    }
+
+    // A batch that cannot take this command without another segment goes now
+    if (batch && (batch->count == BT_GW_BATCH_COMMANDS || batch->length + entry > BT_GW_BATCH_PARAMS_MAX)) {
+        flush_batch(gw, batch, now_ms);
+    }
+    if (!batch || batch->dst == NO_DST) {
+        if (!batch) {
+            batch = free_batch;
+        }
+        if (!batch) {
+            flush_batch(gw, oldest, now_ms);
+            batch = oldest;
+        }
+        batch->dst = dst;
+        batch->count = 0;
+        batch->length = BT_GW_BATCH_HEADER;
+        batch->opened_ms = now_ms;
+    }
+
+    batch->params[batch->length] = length;
+    memcpy(&batch->params[batch->length + 1], message, length);
+    batch->length += entry;
+    batch->commands[batch->count++] = command;
+}
+
+// Send every open batch now
+void bt_gw_flush(bt_gw_t *gw, uint32_t now_ms) {
+    for (int i = 0; i < BT_GW_BATCHES; i++) {
+        if (gw->batches[i].dst != NO_DST) {
+            flush_batch(gw, &gw->batches[i], now_ms);
+        }
+    }
+}
+
+// Send batches that have waited long enough and give up on unicast batches
+// that were never acknowledged. Call periodically while bt_gw_idle() is false.
+void bt_gw_tick(bt_gw_t *gw, uint32_t now_ms) {
+    for (int i = 0; i < BT_GW_BATCHES; i++) {
+        bt_gw_batch_t *batch = &gw->batches[i];
+        if (batch->dst != NO_DST && due(now_ms, batch->opened_ms + BT_GW_HOLD_MS)) {
+            flush_batch(gw, batch, now_ms);
+        }
+    }
+    for (int i = 0; i < BT_GW_PENDING; i++) {
+        bt_gw_pending_t *pending = &gw->pending[i];
+        if (pending->dst != NO_DST && due(now_ms, pending->deadline_ms)) {
+            gw->stats.unacked++;
+            report(gw, pending->commands, pending->count, BT_GW_NO_ACK);
+            pending->dst = NO_DST;
+        }
+    }
+}
+
+// A batch status from a unicast receiver
+void bt_gw_ack(bt_gw_t *gw, uint16_t src, const uint8_t *params, uint16_t length) {
+    if (length < BT_GW_STATUS_SIZE) {
+        return;
+    }
+    for (int i = 0; i < BT_GW_PENDING; i++) {
+        bt_gw_pending_t *pending = &gw->pending[i];
+        if (pending->dst != src || pending->seq != params[0]) {
+            continue;
+        }
+        for (uint8_t n = 0; n < pending->count; n++) {
+            bt_gw_status_t status = (params[1] >> n) & 1 ? BT_GW_DELIVERED : BT_GW_UNSUPPORTED;
+            gw->status(gw->context, pending->commands[n].origin, pending->commands[n].tag, status);
+        }
+        pending->dst = NO_DST;
+        return;
+    }
+}
+
+bool bt_gw_idle(const bt_gw_t *gw) {
+    for (int i = 0; i < BT_GW_BATCHES; i++) {
+        if (gw->batches[i].dst != NO_DST) {
+            return false;
+        }
+    }
+    for (int i = 0; i < BT_GW_PENDING; i++) {
+        if (gw->pending[i].dst != NO_DST) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Read the opcode at the start of an access message; returns its size in
+// bytes, or -1 if the message is too short or the opcode is reserved. Vendor
+// opcodes come back as (opcode << 16) | company id, as the mesh stack
+// reports them.
+int bt_gw_parse_opcode(const uint8_t *message, uint16_t length, uint32_t *opcode) {
+    if (length < 1 || message[0] == 0x7F) {
+        return -1;
+    }
+    if ((message[0] & 0x80) == 0) {
+        *opcode = message[0];
+        return 1;
+    }
+    if ((message[0] & 0xC0) == 0x80) {
+        if (length < 2) {
+            return -1;
+        }
+        *opcode = ((uint32_t)message[0] << 8) | message[1];
+        return 2;
+    }
+    if (length < 3) {
+        return -1;
+    }
+    *opcode = ((uint32_t)message[0] << 16) | ((uint32_t)message[2] << 8) | message[1];
+    return 3;
+}
+
+// Receiver side: hand each command of a batch to command and fill in the
+// status to send back. Returns the number of commands, or -1 if the batch
+// is malformed (commands before the fault have been handled).
+int bt_gw_unpack(const uint8_t *params, uint16_t length, bt_gw_command_cb_t command, void *context,
+                 uint8_t *status) {
+    if (length < BT_GW_BATCH_HEADER) {
+        return -1;
+    }
+    status[0] = params[0];
+    status[1] = 0;
+
+    int count = 0;
+    uint16_t pos = BT_GW_BATCH_HEADER;
+    while (pos < length) {
+        uint16_t size = params[pos++];
+        uint32_t opcode;
+        if (size > length - pos || bt_gw_parse_opcode(&params[pos], size, &opcode) < 0) {
+            return -1;
+        }
+        if (command(context, opcode, &params[pos], size) && count < 8) {
+            status[1] |= 1 << count;
+        }
+        pos += size;
+        count++;
+    }
+    return count;
+}
@@ -0,0 +1,113 @@
+#ifndef BT_GATEWAY_H
+#define BT_GATEWAY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bt_config.h"
+
+// Configuration
+#ifndef BT_GW_MAX_SEGMENTS
+#define BT_GW_MAX_SEGMENTS 2      // Segments a batch may fill before it is sent; 1 keeps batches unsegmented
+#endif
+#define BT_GW_BATCHES 8           // Destinations with a batch open at once
+#define BT_GW_BATCH_COMMANDS 8    // Commands one batch carries (the width of the acknowledgment bitmap)
+#define BT_GW_HOLD_MS 30          // Longest a command waits for others to the same destination
+#define BT_GW_PENDING 8           // Unicast batches awaiting acknowledgment
+#define BT_GW_ACK_TIMEOUT_MS 2000 // Unicast batches unacknowledged this long are reported lost
+
+// Mesh access message sizes with a 32-bit TransMIC
+#define BT_GW_UNSEG_MAX 11      // Opcode and parameters that fit one unsegmented message
+#define BT_GW_SEGMENT_SIZE 12   // Upper transport bytes per segment
+#define BT_GW_MIC_SIZE 4
+#define BT_GW_ACCESS_MAX 380    // Largest access message
+#define BT_GW_OPCODE_SIZE 3     // The batch messages use vendor opcodes
+
+// Batch message parameters: seq(1), then per command len(1) and a complete
+// access message (opcode and parameters). A unicast receiver answers with a
+// status of seq(1) handled(1), bit n set if command n had a handler. The
+// one-byte length caps a command below what the largest batch could carry.
+#define BT_GW_BATCH_HEADER 1
+#define BT_GW_STATUS_SIZE 2
+#define BT_GW_COMMAND_MAX 255
+#define BT_GW_BATCH_PARAMS_MAX ((BT_GW_MAX_SEGMENTS > 1 ? BT_GW_MAX_SEGMENTS * BT_GW_SEGMENT_SIZE - BT_GW_MIC_SIZE \
+                                                          : BT_GW_UNSEG_MAX) - BT_GW_OPCODE_SIZE)
+
+// Upstream frames, one per frame of the connection's framing; tag is the
+// sender's own big-endian reference for the command
+#define BT_GW_FRAME_COMMAND 0xD0 // tag(2) dst(2) access message
+#define BT_GW_FRAME_STATUS  0xD1 // tag(2) status(1)
+#define BT_GW_FRAME_HEADER 5
+
+// Outcome of a command, reported exactly once
+typedef enum {
+    BT_GW_SENT = 0,    // Group destination: handed to the mesh
+    BT_GW_DELIVERED,   // Unicast: the receiver handled it
+    BT_GW_UNSUPPORTED, // Unicast: the receiver has no handler for its opcode
+    BT_GW_NO_ACK,      // Unicast: no acknowledgment in time
+    BT_GW_FAILED,      // The mesh did not take the message
+    BT_GW_REJECTED     // Malformed, too large or for the unassigned address
+} bt_gw_status_t;
+
+// Hands one batch to the mesh; false if it could not be sent
+typedef bool (*bt_gw_send_t)(void *context, uint16_t dst, const uint8_t *params, uint16_t length);
+typedef void (*bt_gw_status_cb_t)(void *context, uint32_t origin, uint16_t tag, bt_gw_status_t status);
+// Receiver side: one command unpacked from a batch
+typedef bool (*bt_gw_command_cb_t)(void *context, uint32_t opcode, const uint8_t *message, uint16_t length);
+
+typedef struct {
+    uint32_t origin; // Whoever submitted it, e.g. an SPP connection handle
+    uint16_t tag;
+} bt_gw_command_t;
+
+// Commands collecting for one destination
+typedef struct {
+    uint16_t dst;      // Unassigned (0) when free
+    uint8_t count;
+    uint16_t length;   // Parameter bytes so far
+    uint32_t opened_ms;
+    bt_gw_command_t commands[BT_GW_BATCH_COMMANDS];
+    uint8_t params[BT_GW_BATCH_PARAMS_MAX];
+} bt_gw_batch_t;
+
+// A sent unicast batch awaiting its status
+typedef struct {
+    uint16_t dst;      // Unassigned (0) when free
+    uint8_t seq;
+    uint8_t count;
+    uint32_t deadline_ms;
+    bt_gw_command_t commands[BT_GW_BATCH_COMMANDS];
+} bt_gw_pending_t;
+
+typedef struct {
+    uint32_t commands;    // Accepted
+    uint32_t messages;    // Batches sent
+    uint32_t segments;    // Segments those batches took (an unsegmented message counts 1)
+    uint32_t failed;      // Batches the mesh did not take
+    uint32_t unacked;     // Unicast batches reported lost
+} bt_gw_stats_t;
+
+// One gateway. Owned by a single task, or used under the caller's lock.
+typedef struct {
+    bt_gw_batch_t batches[BT_GW_BATCHES];
+    bt_gw_pending_t pending[BT_GW_PENDING];
+    uint8_t next_seq;
+    bt_gw_send_t send;
+    bt_gw_status_cb_t status;
+    void *context;
+    bt_gw_stats_t stats;
+} bt_gw_t;
+
+// Function declarations
+void bt_gw_init(bt_gw_t *gw, bt_gw_send_t send, bt_gw_status_cb_t status, void *context);
+void bt_gw_submit(bt_gw_t *gw, uint32_t origin, uint16_t tag, uint16_t dst, const uint8_t *message, uint16_t length,
+                  uint32_t now_ms);
+void bt_gw_flush(bt_gw_t *gw, uint32_t now_ms);
+void bt_gw_tick(bt_gw_t *gw, uint32_t now_ms);
+void bt_gw_ack(bt_gw_t *gw, uint16_t src, const uint8_t *params, uint16_t length);
+bool bt_gw_idle(const bt_gw_t *gw);
+uint8_t bt_gw_segments(uint16_t access_length);
+int bt_gw_parse_opcode(const uint8_t *message, uint16_t length, uint32_t *opcode);
+int bt_gw_unpack(const uint8_t *params, uint16_t length, bt_gw_command_cb_t command, void *context,
+                 uint8_t *status);
+
+#endif // BT_GATEWAY_H
@@ -0,0 +1,104 @@
+/*
+ * Connection Handle Index
+ *
+ * Maps a transport-tagged connection handle to its slot in the connection table
+ * in constant time, independent of MAX_CONNECTIONS. Inserts and removals happen
+ * only on connect/disconnect from the Bluetooth task; lookups may run from any
+ * task concurrently and never take a lock. A key is published after its slot,
+ * and removed entries become tombstones so that a concurrent lookup never stops
+ * short of a live entry further along the probe sequence.
+ */
+
+#include <stdatomic.h>
+#include "bt_handle_index.h"
+
+#define INDEX_EMPTY     0xFFFFFFFF
+#define INDEX_TOMBSTONE 0xFFFFFFFE
+#define INDEX_MASK      (BT_HANDLE_INDEX_SIZE - 1)
+
+static _Atomic uint32_t index_keys[BT_HANDLE_INDEX_SIZE];
+static uint8_t index_slots[BT_HANDLE_INDEX_SIZE];
+
+// Mix the handle bits; SPP handles and BLE conn_ids are small sequential numbers
+static uint32_t index_hash(uint32_t handle) {
+    handle ^= handle >> 16;
+    handle *= 0x45D9F3B;
+    handle ^= handle >> 16;
+    return handle & INDEX_MASK;
+}
+
+void bt_index_init(void) {
+    for (int i = 0; i < BT_HANDLE_INDEX_SIZE; i++) {
+        atomic_init(&index_keys[i], INDEX_EMPTY);
+        index_slots[i] = 0;
+    }
+}
+
+// The handle may already be indexed past a tombstone, so the whole chain is
+// searched before the first free position is reused
+void bt_index_insert(uint32_t handle, uint32_t slot) {
+    uint32_t pos = index_hash(handle);
+    uint32_t free_pos = BT_HANDLE_INDEX_SIZE;
+    for (int probe = 0; probe < BT_HANDLE_INDEX_SIZE; probe++, pos = (pos + 1) & INDEX_MASK) {
+        uint32_t key = atomic_load_explicit(&index_keys[pos], memory_order_relaxed);
+        if (key == handle) {
+            free_pos = pos;
+            break;
+        }
+        if (key == INDEX_TOMBSTONE && free_pos == BT_HANDLE_INDEX_SIZE) {
+            free_pos = pos;
+        }
+        if (key == INDEX_EMPTY) {
+            if (free_pos == BT_HANDLE_INDEX_SIZE) {
+                free_pos = pos;
+            }
+            break;
+        }
+    }
+    if (free_pos < BT_HANDLE_INDEX_SIZE) {
+        index_slots[free_pos] = slot;
+        atomic_store_explicit(&index_keys[free_pos], handle, memory_order_release);
+    }
+}
+
+void bt_index_remove(uint32_t handle) {
+    uint32_t pos = index_hash(handle);
+    for (int probe = 0; probe < BT_HANDLE_INDEX_SIZE; probe++, pos = (pos + 1) & INDEX_MASK) {
+        uint32_t key = atomic_load_explicit(&index_keys[pos], memory_order_relaxed);
+        if (key == INDEX_EMPTY) {
+            return;
+        }
+        if (key != handle) {
+            continue;
+        }
+
+        // If nothing follows, this entry and any tombstones before it can go
+        // back to empty; otherwise leave a tombstone to keep the chain intact
+        if (atomic_load_explicit(&index_keys[(pos + 1) & INDEX_MASK], memory_order_relaxed) != INDEX_EMPTY) {
+            atomic_store_explicit(&index_keys[pos], INDEX_TOMBSTONE, memory_order_release);
+            return;
+        }
+        atomic_store_explicit(&index_keys[pos], INDEX_EMPTY, memory_order_release);
+        pos = (pos - 1) & INDEX_MASK;
+        while (atomic_load_explicit(&index_keys[pos], memory_order_relaxed) == INDEX_TOMBSTONE) {
+            atomic_store_explicit(&index_keys[pos], INDEX_EMPTY, memory_order_release);
+            pos = (pos - 1) & INDEX_MASK;
+        }
+        return;
+    }
+}
+
+// Returns MAX_CONNECTIONS if the handle is not connected
+uint32_t bt_index_lookup(uint32_t handle) {
+    uint32_t pos = index_hash(handle);
+    for (int probe = 0; probe < BT_HANDLE_INDEX_SIZE; probe++, pos = (pos + 1) & INDEX_MASK) {
+        uint32_t key = atomic_load_explicit(&index_keys[pos], memory_order_acquire);
+        if (key == handle) {
+            return index_slots[pos];
+        }
+        if (key == INDEX_EMPTY) {
+            break;
+        }
+    }
+    return MAX_CONNECTIONS;
+}
@@ -0,0 +1,26 @@
+#ifndef BT_HANDLE_INDEX_H
+#define BT_HANDLE_INDEX_H
+
+#include <stdint.h>
+#include "bt_config.h"
+
+// Open-addressed table sized to stay at most a quarter full
+#if MAX_CONNECTIONS <= 8
+#define BT_HANDLE_INDEX_SIZE 32
+#elif MAX_CONNECTIONS <= 16
+#define BT_HANDLE_INDEX_SIZE 64
+#elif MAX_CONNECTIONS <= 32
+#define BT_HANDLE_INDEX_SIZE 128
+#elif MAX_CONNECTIONS <= 128
+#define BT_HANDLE_INDEX_SIZE 512
+#else
+#error "MAX_CONNECTIONS is limited to 128"
+#endif
+
+// Function declarations
+void bt_index_init(void);
+void bt_index_insert(uint32_t handle, uint32_t slot);
+void bt_index_remove(uint32_t handle);
+uint32_t bt_index_lookup(uint32_t handle);
+
+#endif // BT_HANDLE_INDEX_H
@@ -0,0 +1,59 @@
+/*
+ * Activity-driven Link Profiles
+ *
+ * Sorts connections into fast, balanced and idle profiles from their recent
+ * traffic rate, time since last activity and TX backlog, so that shared radio
+ * time goes to the peers that are using it. A profile only changes after it has
+ * won BT_LINK_HOLD_SAMPLES samples in a row, which keeps bursty links from
+ * flooding the controller with parameter updates.
+ */
+
+#include "bt_link.h"
+
+static const bt_link_params_t link_params[BT_LINK_PROFILES] = {
+    [BT_LINK_FAST]     = { .min_interval = 6,  .max_interval = 12,  .latency = 0, .timeout = 400 }, // 7.5-15 ms
+    [BT_LINK_BALANCED] = { .min_interval = 24, .max_interval = 40,  .latency = 0, .timeout = 400 }, // 30-50 ms
+    [BT_LINK_IDLE]     = { .min_interval = 80, .max_interval = 160, .latency = 4, .timeout = 600 }, // 100-200 ms
+};
+
+// New connections start balanced until their traffic says otherwise
+void bt_link_init(bt_link_t *link) {
+    link->profile = BT_LINK_BALANCED;
+    link->candidate = BT_LINK_BALANCED;
+    link->hold = 0;
+}
+
+static bt_link_profile_t classify(uint32_t rate_bps, uint32_t idle_ms, bool backlogged) {
+    // A TX backlog means latency is building up, whatever the rate
+    if (backlogged || rate_bps >= BT_LINK_BUSY_BPS) {
+        return BT_LINK_FAST;
+    }
+    if (rate_bps <= BT_LINK_IDLE_BPS && idle_ms >= BT_LINK_IDLE_AFTER_MS) {
+        return BT_LINK_IDLE;
+    }
+    return BT_LINK_BALANCED;
+}
+
+// Feed one sample; true when the link should move to link->profile
+bool bt_link_update(bt_link_t *link, uint32_t rate_bps, uint32_t idle_ms, bool backlogged) {
+    bt_link_profile_t profile = classify(rate_bps, idle_ms, backlogged);
+
+    if (profile == link->profile) {
+        link->hold = 0;
+        return false;
+    }
+    if (profile != link->candidate) {
+        link->candidate = profile;
+        link->hold = 0;
+    }
+    if (++link->hold < BT_LINK_HOLD_SAMPLES) {
+        return false;
+    }
+    link->profile = profile;
+    link->hold = 0;
+    return true;
+}
+
+const bt_link_params_t *bt_link_params(bt_link_profile_t profile) {
+    return &link_params[profile < BT_LINK_PROFILES ? profile : BT_LINK_BALANCED];
+}
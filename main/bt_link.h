@@ -0,0 +1,42 @@
+#ifndef BT_LINK_H
+#define BT_LINK_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bt_config.h"
+
+// Configuration
+#define BT_LINK_BUSY_BPS 2048       // Combined RX+TX rate that earns the fast profile
+#define BT_LINK_IDLE_BPS 64         // At or below this rate a link may go idle...
+#define BT_LINK_IDLE_AFTER_MS 5000  // ...once it has had no traffic for this long
+#define BT_LINK_HOLD_SAMPLES 2      // Consecutive samples a new profile must win before it is applied
+
+// Link profiles, from most to least airtime
+typedef enum {
+    BT_LINK_FAST = 0, // Short interval, no peripheral latency
+    BT_LINK_BALANCED,
+    BT_LINK_IDLE,     // Long interval with peripheral latency
+    BT_LINK_PROFILES
+} bt_link_profile_t;
+
+// Connection parameters of a profile, in Bluetooth units
+typedef struct {
+    uint16_t min_interval; // 1.25 ms
+    uint16_t max_interval; // 1.25 ms
+    uint16_t latency;      // Connection events the peripheral may skip
+    uint16_t timeout;      // Supervision timeout, 10 ms
+} bt_link_params_t;
+
+// Per-connection classifier state
+typedef struct {
+    bt_link_profile_t profile;   // Currently applied
+    bt_link_profile_t candidate; // Winning the last samples
+    uint8_t hold;                // How many samples in a row it has won
+} bt_link_t;
+
+// Function declarations
+void bt_link_init(bt_link_t *link);
+bool bt_link_update(bt_link_t *link, uint32_t rate_bps, uint32_t idle_ms, bool backlogged);
+const bt_link_params_t *bt_link_params(bt_link_profile_t profile);
+
+#endif // BT_LINK_H
@@ -0,0 +1,111 @@
+/*
+ * Deferred Binary Logging
+ *
+ * The ring is a bounded multi-producer/single-consumer queue: each cell carries
+ * a sequence number, producers claim a cell by advancing head with
+ * compare-and-swap and publish it by bumping the cell's sequence, and the
+ * single drainer consumes cells in order. A full ring drops the record and
+ * counts it rather than making the caller wait.
+ */
+
+#include <stdio.h>
+#include "bt_log.h"
+
+_Static_assert((BT_LOG_RING_SIZE & (BT_LOG_RING_SIZE - 1)) == 0, "BT_LOG_RING_SIZE must be a power of two");
+
+typedef struct {
+    _Atomic uint32_t seq;
+    bt_log_record_t record;
+} log_cell_t;
+
+#define BT_LOG_TEXT(id, text) text,
+static const char *const tag_names[] = { BT_LOG_TAGS(BT_LOG_TEXT) };
+static const char *const format_strings[] = { BT_LOG_FORMATS(BT_LOG_TEXT) };
+#undef BT_LOG_TEXT
+
+static log_cell_t log_ring[BT_LOG_RING_SIZE];
+static _Atomic uint32_t log_head;
+static uint32_t log_tail; // Drainer only
+static _Atomic uint32_t log_dropped;
+
+void bt_log_init(void) {
+    for (uint32_t i = 0; i < BT_LOG_RING_SIZE; i++) {
+        atomic_store(&log_ring[i].seq, i);
+    }
+    atomic_store(&log_head, 0);
+    log_tail = 0;
+    atomic_store(&log_dropped, 0);
+}
+
+// Store one record; never blocks and never formats
+void bt_log_write(uint8_t level, uint8_t tag, uint16_t format, uint32_t a0, uint32_t a1, uint32_t a2) {
+    uint32_t pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+    log_cell_t *cell;
+
+    while (1) {
+        cell = &log_ring[pos & (BT_LOG_RING_SIZE - 1)];
+        int32_t diff = (int32_t)(atomic_load_explicit(&cell->seq, memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+        }
+    }
+
+    cell->record.timestamp_us = BT_LOG_TIMESTAMP();
+    cell->record.level = level;
+    cell->record.tag = tag;
+    cell->record.format = format;
+    cell->record.args[0] = a0;
+    cell->record.args[1] = a1;
+    cell->record.args[2] = a2;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+}
+
+// Format and hand every pending record to the sink; returns how many were drained
+size_t bt_log_drain(bt_log_sink_t sink) {
+    char text[128];
+    size_t drained = 0;
+
+    while (1) {
+        log_cell_t *cell = &log_ring[log_tail & (BT_LOG_RING_SIZE - 1)];
+        if (atomic_load_explicit(&cell->seq, memory_order_acquire) != log_tail + 1) {
+            break;
+        }
+        
+        bt_log_record_t record = cell->record;
+        atomic_store_explicit(&cell->seq, log_tail + BT_LOG_RING_SIZE, memory_order_release);
+        log_tail++;
+        
+        if (sink) {
+            bt_log_format_record(&record, text, sizeof(text));
+            sink(record.level, bt_log_tag_name(record.tag), record.timestamp_us, text);
+        }
+        drained++;
+    }
+    return drained;
+}
+
+// Expand a record to text; also usable by a host-side decoder
+int bt_log_format_record(const bt_log_record_t *record, char *buf, size_t size) {
+    if (record->format >= BT_LOG_FMT_COUNT) {
+        return snprintf(buf, size, "<unknown format %u>", record->format);
+    }
+    return snprintf(buf, size, format_strings[record->format], (unsigned long)record->args[0],
+                    (unsigned long)record->args[1], (unsigned long)record->args[2]);
+}
+
+const char *bt_log_tag_name(uint8_t tag) {
+    return tag < BT_LOG_TAG_COUNT ? tag_names[tag] : "?";
+}
+
+// Records lost because the ring was full
+uint32_t bt_log_dropped(void) {
+    return atomic_load(&log_dropped);
+}
@@ -0,0 +1,84 @@
+#ifndef BT_LOG_H
+#define BT_LOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/*
+ * Deferred binary logging for the data path. A log call stores a small record
+ * (level, tag id, format id, up to three integer arguments) in a lock-free ring;
+ * the text is only formatted later, by bt_log_drain() from a low-priority task
+ * or by a host-side decoder working from a ring dump.
+ */
+
+// Configuration
+#ifndef BT_LOG_LEVEL
+#define BT_LOG_LEVEL BT_LOG_LEVEL_INFO // Calls below this level compile to nothing
+#endif
+#define BT_LOG_RING_SIZE 64             // Records; must be a power of two
+#define BT_LOG_MAX_ARGS 3
+
+#define BT_LOG_LEVEL_NONE    0
+#define BT_LOG_LEVEL_ERROR   1
+#define BT_LOG_LEVEL_WARN    2
+#define BT_LOG_LEVEL_INFO    3
+#define BT_LOG_LEVEL_DEBUG   4
+#define BT_LOG_LEVEL_VERBOSE 5
+
+#ifdef ESP_PLATFORM
+#include "esp_timer.h"
+#define BT_LOG_TIMESTAMP() ((uint32_t)esp_timer_get_time())
+#else
+#define BT_LOG_TIMESTAMP() 0
+#endif
+
+// Tags and formats. Arguments are passed as unsigned long, so formats use %lu/%lx.
+#define BT_LOG_TAGS(X) \
+    X(BT_LOG_TAG_SPP, "BT_SPP")
+
+#define BT_LOG_FORMATS(X) \
+    X(BT_LOG_FMT_RX,        "Received %lu bytes from connection %lu") \
+    X(BT_LOG_FMT_TX,        "Sending %lu bytes to connection %lu") \
+    X(BT_LOG_FMT_BROADCAST, "Broadcast sent to %lu connections") \
+    X(BT_LOG_FMT_RX_DROP,   "Connection %lu: %lu RX packets dropped") \
+    X(BT_LOG_FMT_RX_SIZE,   "Dropping %lu byte packet from connection %lu") \
+    X(BT_LOG_FMT_TX_FAIL,   "Write to connection %lu failed: 0x%lx") \
+    X(BT_LOG_FMT_TX_DROP,   "Connection %lu: %lu broadcasts dropped")
+
+#define BT_LOG_ENUM(id, text) id,
+typedef enum { BT_LOG_TAGS(BT_LOG_ENUM) BT_LOG_TAG_COUNT } bt_log_tag_t;
+typedef enum { BT_LOG_FORMATS(BT_LOG_ENUM) BT_LOG_FMT_COUNT } bt_log_format_t;
+#undef BT_LOG_ENUM
+
+typedef struct {
+    uint32_t timestamp_us;
+    uint8_t level;
+    uint8_t tag;
+    uint16_t format;
+    uint32_t args[BT_LOG_MAX_ARGS];
+} bt_log_record_t;
+
+// Receives each formatted line from bt_log_drain()
+typedef void (*bt_log_sink_t)(uint8_t level, const char *tag, uint32_t timestamp_us, const char *text);
+
+// Function declarations
+void bt_log_init(void);
+void bt_log_write(uint8_t level, uint8_t tag, uint16_t format, uint32_t a0, uint32_t a1, uint32_t a2);
+size_t bt_log_drain(bt_log_sink_t sink);
+int bt_log_format_record(const bt_log_record_t *record, char *buf, size_t size);
+const char *bt_log_tag_name(uint8_t tag);
+uint32_t bt_log_dropped(void);
+
+// Logging macros; levels above BT_LOG_LEVEL are removed at compile time
+#define BT_LOG_AT(level, tag, format, a0, a1, a2) do { \
+        if ((level) <= BT_LOG_LEVEL) { \
+            bt_log_write((level), (tag), (format), (uint32_t)(a0), (uint32_t)(a1), (uint32_t)(a2)); \
+        } \
+    } while (0)
+#define BT_LOGE(tag, format, a0, a1, a2) BT_LOG_AT(BT_LOG_LEVEL_ERROR, tag, format, a0, a1, a2)
+#define BT_LOGW(tag, format, a0, a1, a2) BT_LOG_AT(BT_LOG_LEVEL_WARN, tag, format, a0, a1, a2)
+#define BT_LOGI(tag, format, a0, a1, a2) BT_LOG_AT(BT_LOG_LEVEL_INFO, tag, format, a0, a1, a2)
+#define BT_LOGD(tag, format, a0, a1, a2) BT_LOG_AT(BT_LOG_LEVEL_DEBUG, tag, format, a0, a1, a2)
+
+#endif // BT_LOG_H
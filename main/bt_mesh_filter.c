@@ -0,0 +1,109 @@
+/*
+ * Mesh Traffic Filters for Dense Deployments
+ *
+ * With dozens of nodes in range, the same command reaches a node many times:
+ * senders repeat unacknowledged messages, and every relay that hears one
+ * forwards it. The dedup cache remembers fingerprints of recently delivered
+ * messages so repeats are dropped before any handler runs. Lookup scans a
+ * small ring of 32-bit keys, which is cheaper than the handler work it saves
+ * and needs no allocation or per-entry bookkeeping.
+ *
+ * The token bucket is a plain rate limiter; bluetooth_mesh.c uses one to
+ * decide whether this node should keep relaying when the traffic around it
+ * is heavy.
+ */
+
+#include <string.h>
+#include "bt_mesh_filter.h"
+
+_Static_assert((BT_DEDUP_ENTRIES & (BT_DEDUP_ENTRIES - 1)) == 0, "BT_DEDUP_ENTRIES must be a power of two");
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+static uint32_t fnv_bytes(uint32_t hash, const uint8_t *data, uint16_t length) {
+    for (uint16_t i = 0; i < length; i++) {
+        hash = (hash ^ data[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+void bt_dedup_init(bt_dedup_t *cache) {
+    memset(cache, 0, sizeof(*cache));
+}
+
+// Fingerprint of a message: who sent it where, and what it says. Never 0.
+uint32_t bt_dedup_key(uint16_t src, uint16_t dst, uint32_t opcode, const uint8_t *params, uint16_t length) {
+    uint8_t header[8] = {
+        src >> 8, src, dst >> 8, dst, opcode >> 24, opcode >> 16, opcode >> 8, opcode
+    };
+    uint32_t hash = fnv_bytes(FNV_OFFSET, header, sizeof(header));
+    if (length > 0) {
+        hash = fnv_bytes(hash, params, length);
+    }
+    return hash ? hash : 1;
+}
+
+// True if the same message was first seen less than window_ms ago; otherwise
+// it is remembered from now and false returned. Repeats do not extend the
+// window, so a sender retrying an acknowledged message for a lost reply gets
+// through once the window has passed.
+bool bt_dedup_seen(bt_dedup_t *cache, uint32_t key, uint32_t now_ms, uint32_t window_ms) {
+    for (uint32_t i = 0; i < BT_DEDUP_ENTRIES; i++) {
+        if (cache->keys[i] != key) {
+            continue;
+        }
+        if (now_ms - cache->times[i] < window_ms) {
+            return true;
+        }
+        cache->times[i] = now_ms;
+        return false;
+    }
+
+    uint32_t slot = cache->next++ & (BT_DEDUP_ENTRIES - 1);
+    cache->keys[slot] = key;
+    cache->times[slot] = now_ms;
+    return false;
+}
+
+// rate tokens per second, up to burst tokens saved; starts full
+void bt_bucket_init(bt_bucket_t *bucket, uint32_t rate, uint32_t burst, uint32_t now_ms) {
+    bucket->rate = rate;
+    bucket->capacity = burst * 1000;
+    bucket->level = bucket->capacity;
+    bucket->last_ms = now_ms;
+}
+
+static void refill(bt_bucket_t *bucket, uint32_t now_ms) {
+    uint32_t elapsed = now_ms - bucket->last_ms;
+    uint64_t level = bucket->level + (uint64_t)elapsed * bucket->rate;
+    bucket->level = level > bucket->capacity ? bucket->capacity : (uint32_t)level;
+    bucket->last_ms = now_ms;
+}
+
+// Spend one token if there is one
+bool bt_bucket_take(bt_bucket_t *bucket, uint32_t now_ms) {
+    refill(bucket, now_ms);
+    if (bucket->level < 1000) {
+        return false;
+    }
+    bucket->level -= 1000;
+    return true;
+}
+
+uint32_t bt_bucket_tokens(bt_bucket_t *bucket, uint32_t now_ms) {
+    refill(bucket, now_ms);
+    return bucket->level / 1000;
+}
+
+// Milliseconds until the bucket holds the given tokens, 0 if it already does
+uint32_t bt_bucket_wait_ms(bt_bucket_t *bucket, uint32_t tokens, uint32_t now_ms) {
+    refill(bucket, now_ms);
+    if (bucket->level >= tokens * 1000) {
+        return 0;
+    }
+    if (bucket->rate == 0) {
+        return UINT32_MAX;
+    }
+    return (tokens * 1000 - bucket->level + bucket->rate - 1) / bucket->rate;
+}
@@ -0,0 +1,37 @@
+#ifndef BT_MESH_FILTER_H
+#define BT_MESH_FILTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bt_config.h"
+
+// Configuration
+#define BT_DEDUP_ENTRIES 64 // Messages remembered (power of two)
+
+// Recently seen messages, as 32-bit fingerprints in a ring: the oldest entry
+// is overwritten by the next new message
+typedef struct {
+    uint32_t keys[BT_DEDUP_ENTRIES];  // 0 when empty
+    uint32_t times[BT_DEDUP_ENTRIES]; // When each was last seen, in ms
+    uint32_t next;
+} bt_dedup_t;
+
+// Token bucket in thousandths of a token, so slow rates still refill smoothly
+typedef struct {
+    uint32_t level;    // Thousandths of a token
+    uint32_t capacity; // Thousandths of a token
+    uint32_t rate;     // Tokens per second
+    uint32_t last_ms;
+} bt_bucket_t;
+
+// Function declarations
+void bt_dedup_init(bt_dedup_t *cache);
+uint32_t bt_dedup_key(uint16_t src, uint16_t dst, uint32_t opcode, const uint8_t *params, uint16_t length);
+bool bt_dedup_seen(bt_dedup_t *cache, uint32_t key, uint32_t now_ms, uint32_t window_ms);
+
+void bt_bucket_init(bt_bucket_t *bucket, uint32_t rate, uint32_t burst, uint32_t now_ms);
+bool bt_bucket_take(bt_bucket_t *bucket, uint32_t now_ms);
+uint32_t bt_bucket_tokens(bt_bucket_t *bucket, uint32_t now_ms);
+uint32_t bt_bucket_wait_ms(bt_bucket_t *bucket, uint32_t tokens, uint32_t now_ms);
+
+#endif // BT_MESH_FILTER_H
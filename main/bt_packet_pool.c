@@ -0,0 +1,190 @@
+/*
+ * Size-class Packet Buffer Pool
+ *
+ * Received packets are copied exactly once, from the Bluetooth stack into a pool
+ * buffer. Only the buffer index travels through the message rings, and the buffer
+ * is handed to the application by pointer before being returned to the pool.
+ *
+ * Buffers come in three statically allocated size classes, so a 4-byte command
+ * does not tie up a full MAX_PACKET_SIZE buffer. An allocation takes the
+ * smallest class that fits and falls back to larger ones when it is full.
+ * Indices run through the classes in order, smallest first.
+ *
+ * Free buffers are tracked in an atomic bitmap, so allocation and release are
+ * lock-free from any task and need nothing from the RTOS. Each buffer also has
+ * a reference count, so one copy of a broadcast can sit on every connection's
+ * TX ring at once; the buffer returns to the pool with its last reference.
+ */
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include "bt_packet_pool.h"
+
+_Static_assert(BT_POOL_BYTES <= BT_POOL_BUDGET_BYTES, "Packet pool exceeds BT_POOL_BUDGET_BYTES");
+_Static_assert(BT_PACKET_POOL_SIZE < BT_POOL_INVALID, "Too many packet buffers for 16-bit indices");
+
+#define POOL_WORDS ((BT_PACKET_POOL_SIZE + 31) / 32)
+
+typedef struct {
+    uint16_t size;
+    uint16_t count;
+    uint16_t first; // Index of the class's first buffer
+    uint8_t *storage;
+} pool_class_t;
+
+// Packet storage, per size class
+static uint8_t small_buffers[BT_POOL_SMALL_COUNT][BT_POOL_SMALL_SIZE];
+static uint8_t medium_buffers[BT_POOL_MEDIUM_COUNT][BT_POOL_MEDIUM_SIZE];
+static uint8_t large_buffers[BT_POOL_LARGE_COUNT][BT_POOL_LARGE_SIZE];
+
+static const pool_class_t pool_classes[BT_POOL_CLASSES] = {
+    { BT_POOL_SMALL_SIZE, BT_POOL_SMALL_COUNT, 0, &small_buffers[0][0] },
+    { BT_POOL_MEDIUM_SIZE, BT_POOL_MEDIUM_COUNT, BT_POOL_SMALL_COUNT, &medium_buffers[0][0] },
+    { BT_POOL_LARGE_SIZE, BT_POOL_LARGE_COUNT, BT_POOL_SMALL_COUNT + BT_POOL_MEDIUM_COUNT, &large_buffers[0][0] },
+};
+
+// Free-buffer bitmap over all indices (bit set = free) and each class's bits in it
+static _Atomic uint32_t free_map[POOL_WORDS];
+static uint32_t class_mask[BT_POOL_CLASSES][POOL_WORDS];
+static _Atomic uint8_t ref_counts[BT_PACKET_POOL_SIZE];
+
+// Usage statistics
+static _Atomic uint16_t class_in_use[BT_POOL_CLASSES];
+static _Atomic uint16_t class_high_water[BT_POOL_CLASSES];
+static _Atomic uint32_t class_fallbacks[BT_POOL_CLASSES];
+static _Atomic uint32_t class_failures[BT_POOL_CLASSES];
+
+static int class_of(uint16_t index) {
+    for (int c = BT_POOL_CLASSES - 1; c > 0; c--) {
+        if (index >= pool_classes[c].first) {
+            return c;
+        }
+    }
+    return 0;
+}
+
+// Initialize the pool with every buffer free
+void bt_pool_init(void) {
+    for (int w = 0; w < POOL_WORDS; w++) {
+        atomic_store(&free_map[w], 0);
+        for (int c = 0; c < BT_POOL_CLASSES; c++) {
+            class_mask[c][w] = 0;
+        }
+    }
+    for (int c = 0; c < BT_POOL_CLASSES; c++) {
+        for (int i = pool_classes[c].first; i < pool_classes[c].first + pool_classes[c].count; i++) {
+            class_mask[c][i / 32] |= 1u << (i % 32);
+        }
+        for (int w = 0; w < POOL_WORDS; w++) {
+            atomic_fetch_or(&free_map[w], class_mask[c][w]);
+        }
+        atomic_store(&class_in_use[c], 0);
+        atomic_store(&class_high_water[c], 0);
+        atomic_store(&class_fallbacks[c], 0);
+        atomic_store(&class_failures[c], 0);
+    }
+}
+
+static uint16_t alloc_from_class(int c) {
+    for (int w = 0; w < POOL_WORDS; w++) {
+        uint32_t map = atomic_load(&free_map[w]);
+        while (map & class_mask[c][w]) {
+            uint32_t available = map & class_mask[c][w];
+            uint32_t bit = available & -available;
+            if (atomic_compare_exchange_weak(&free_map[w], &map, map & ~bit)) {
+                uint16_t index = w * 32 + __builtin_ctz(bit);
+                atomic_store_explicit(&ref_counts[index], 1, memory_order_relaxed);
+                
+                uint16_t in_use = atomic_fetch_add(&class_in_use[c], 1) + 1;
+                uint16_t high = atomic_load(&class_high_water[c]);
+                while (in_use > high && !atomic_compare_exchange_weak(&class_high_water[c], &high, in_use)) {
+                }
+                return index;
+            }
+        }
+    }
+    return BT_POOL_INVALID;
+}
+
+// Take a free buffer of at least size bytes without blocking; returns
+// BT_POOL_INVALID if no class that fits has one left
+uint16_t bt_pool_alloc(uint16_t size) {
+    int wanted = -1;
+    for (int c = 0; c < BT_POOL_CLASSES; c++) {
+        if (size > pool_classes[c].size) {
+            continue;
+        }
+        if (wanted < 0) {
+            wanted = c;
+        }
+        uint16_t index = alloc_from_class(c);
+        if (index != BT_POOL_INVALID) {
+            if (c != wanted) {
+                atomic_fetch_add(&class_fallbacks[wanted], 1);
+            }
+            return index;
+        }
+    }
+    if (wanted >= 0) {
+        atomic_fetch_add(&class_failures[wanted], 1);
+    }
+    return BT_POOL_INVALID;
+}
+
+// Get the payload area of a buffer
+uint8_t *bt_pool_buffer(uint16_t index) {
+    if (index >= BT_PACKET_POOL_SIZE) {
+        return NULL;
+    }
+    const pool_class_t *pc = &pool_classes[class_of(index)];
+    return pc->storage + (size_t)(index - pc->first) * pc->size;
+}
+
+// Usable bytes in a buffer
+uint16_t bt_pool_capacity(uint16_t index) {
+    if (index >= BT_PACKET_POOL_SIZE) {
+        return 0;
+    }
+    return pool_classes[class_of(index)].size;
+}
+
+// Add a reference to an allocated buffer; each needs its own bt_pool_free
+void bt_pool_retain(uint16_t index) {
+    if (index >= BT_PACKET_POOL_SIZE) {
+        return;
+    }
+    atomic_fetch_add_explicit(&ref_counts[index], 1, memory_order_relaxed);
+}
+
+// Drop a reference, returning the buffer to the pool with the last one
+void bt_pool_free(uint16_t index) {
+    if (index >= BT_PACKET_POOL_SIZE) {
+        return;
+    }
+    if (atomic_fetch_sub_explicit(&ref_counts[index], 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+    atomic_fetch_sub(&class_in_use[class_of(index)], 1);
+    atomic_fetch_or(&free_map[index / 32], 1u << (index % 32));
+}
+
+// Number of buffers currently free, across all classes
+uint16_t bt_pool_available(void) {
+    uint16_t count = 0;
+    for (int w = 0; w < POOL_WORDS; w++) {
+        count += __builtin_popcount(atomic_load(&free_map[w]));
+    }
+    return count;
+}
+
+void bt_pool_class_stats(int size_class, bt_pool_class_stats_t *stats) {
+    if (size_class < 0 || size_class >= BT_POOL_CLASSES || !stats) {
+        return;
+    }
+    stats->size = pool_classes[size_class].size;
+    stats->count = pool_classes[size_class].count;
+    stats->in_use = atomic_load(&class_in_use[size_class]);
+    stats->high_water = atomic_load(&class_high_water[size_class]);
+    stats->fallbacks = atomic_load(&class_fallbacks[size_class]);
+    stats->failures = atomic_load(&class_failures[size_class]);
+}
@@ -0,0 +1,52 @@
+#ifndef BT_PACKET_POOL_H
+#define BT_PACKET_POOL_H
+
+#include <stdint.h>
+#include "bt_config.h"
+
+// Configuration: buffer size classes, smallest first
+#define BT_POOL_SMALL_SIZE 32
+#ifndef BT_POOL_SMALL_COUNT
+#define BT_POOL_SMALL_COUNT 32
+#endif
+#define BT_POOL_MEDIUM_SIZE 128
+#ifndef BT_POOL_MEDIUM_COUNT
+#define BT_POOL_MEDIUM_COUNT 16
+#endif
+#define BT_POOL_HEADROOM 4 // Room in a full-size buffer for a header added after queuing
+#define BT_POOL_LARGE_SIZE (MAX_PACKET_SIZE + BT_POOL_HEADROOM)
+#ifndef BT_POOL_LARGE_COUNT
+#define BT_POOL_LARGE_COUNT 12
+#endif
+#ifndef BT_POOL_BUDGET_BYTES
+#define BT_POOL_BUDGET_BYTES 10240 // Upper bound on packet storage, checked at compile time
+#endif
+
+#define BT_POOL_CLASSES 3
+#define BT_PACKET_POOL_SIZE (BT_POOL_SMALL_COUNT + BT_POOL_MEDIUM_COUNT + BT_POOL_LARGE_COUNT)
+#define BT_POOL_BYTES (BT_POOL_SMALL_COUNT * BT_POOL_SMALL_SIZE + BT_POOL_MEDIUM_COUNT * BT_POOL_MEDIUM_SIZE + \
+                       BT_POOL_LARGE_COUNT * BT_POOL_LARGE_SIZE)
+
+#define BT_POOL_INVALID 0xFFFF
+
+// Usage of one size class
+typedef struct {
+    uint16_t size;       // Bytes per buffer
+    uint16_t count;      // Buffers in the class
+    uint16_t in_use;
+    uint16_t high_water; // Most buffers ever in use at once
+    uint32_t fallbacks;  // Allocations served by a larger class because this one was full
+    uint32_t failures;   // Allocations that found no buffer in this or any larger class
+} bt_pool_class_stats_t;
+
+// Function declarations
+void bt_pool_init(void);
+uint16_t bt_pool_alloc(uint16_t size);
+uint8_t *bt_pool_buffer(uint16_t index);
+uint16_t bt_pool_capacity(uint16_t index);
+void bt_pool_retain(uint16_t index);
+void bt_pool_free(uint16_t index);
+uint16_t bt_pool_available(void);
+void bt_pool_class_stats(int size_class, bt_pool_class_stats_t *stats);
+
+#endif // BT_PACKET_POOL_H
@@ -0,0 +1,244 @@
+/*
+ * Mesh Latency and Delivery Probes
+ *
+ * A prober sends timestamped pings to unicast or group addresses, each at
+ * its own rate, and every node that receives one answers with an echo. The
+ * echo carries the ping's send time and both TTLs back, so the prober learns
+ * the round-trip time and the relay count each way without any clock
+ * agreement between nodes. Per destination it keeps a log2 RTT histogram,
+ * hop histograms and sent/answered/lost counts, from which the delivery
+ * ratio follows.
+ *
+ * The module knows nothing about the mesh stack: pings leave through a send
+ * callback and echoes come in as parameter bytes, so a simulated network on
+ * the host can drive it exactly as bluetooth_mesh.c does.
+ */
+
+#include <string.h>
+#include "bt_probe.h"
+#include "bt_stats.h"
+
+#define NO_DST 0x0000 // The mesh unassigned address
+
+static bool due(uint32_t now_ms, uint32_t deadline_ms) {
+    return (int32_t)(now_ms - deadline_ms) >= 0;
+}
+
+static bool is_group(uint16_t dst) {
+    return dst >= 0x8000;
+}
+
+static uint32_t get_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void record_hops(uint32_t *hist, uint8_t sent_ttl, uint8_t arrival_ttl) {
+    uint32_t hops = sent_ttl >= arrival_ttl ? sent_ttl - arrival_ttl : 0;
+    hist[hops < BT_PROBE_HOP_BUCKETS ? hops : BT_PROBE_HOP_BUCKETS - 1]++;
+}
+
+static bt_probe_target_t *find_target(bt_probe_t *probe, uint16_t dst) {
+    for (int i = 0; i < BT_PROBE_TARGETS; i++) {
+        if (probe->targets[i].dst == dst) {
+            return &probe->targets[i];
+        }
+    }
+    return NULL;
+}
+
+void bt_probe_init(bt_probe_t *probe, bt_probe_send_t send, void *context) {
+    memset(probe, 0, sizeof(*probe));
+    probe->send = send;
+    probe->context = context;
+}
+
+// Start probing dst every interval_ms with pings of the given TTL, padded by
+// padding bytes; the first ping goes on the next tick. Adding a target again
+// changes its settings and keeps its statistics.
+bool bt_probe_add(bt_probe_t *probe, uint16_t dst, uint32_t interval_ms, uint8_t ttl, uint8_t padding, uint32_t now_ms) {
+    if (dst == NO_DST || ttl < 2 || ttl > 0x7F || padding > BT_PROBE_PADDING_MAX) {
+        return false;
+    }
+    bt_probe_target_t *target = find_target(probe, dst);
+    if (!target) {
+        target = find_target(probe, NO_DST);
+        if (!target) {
+            return false;
+        }
+        memset(target, 0, sizeof(*target));
+        target->stats.rtt_min_ms = UINT32_MAX;
+    }
+    target->dst = dst;
+    target->interval_ms = interval_ms < BT_PROBE_MIN_INTERVAL_MS ? BT_PROBE_MIN_INTERVAL_MS : interval_ms;
+    target->ttl = ttl;
+    target->padding = padding;
+    target->next_ms = now_ms;
+    return true;
+}
+
+// Stop probing dst; its pings still outstanding are forgotten
+bool bt_probe_remove(bt_probe_t *probe, uint16_t dst) {
+    bt_probe_target_t *target = dst == NO_DST ? NULL : find_target(probe, dst);
+    if (!target) {
+        return false;
+    }
+    uint8_t index = target - probe->targets;
+    for (int i = 0; i < BT_PROBE_OUTSTANDING; i++) {
+        if (probe->pings[i].in_use && probe->pings[i].target == index) {
+            probe->pings[i].in_use = false;
+        }
+    }
+    target->dst = NO_DST;
+    return true;
+}
+
+const bt_probe_stats_t *bt_probe_stats(const bt_probe_t *probe, uint16_t dst) {
+    bt_probe_target_t *target = dst == NO_DST ? NULL : find_target((bt_probe_t *)probe, dst);
+    return target ? &target->stats : NULL;
+}
+
+static void settle(bt_probe_t *probe, bt_probe_ping_t *ping) {
+    bt_probe_stats_t *stats = &probe->targets[ping->target].stats;
+    if (ping->answered) {
+        stats->answered++;
+    } else {
+        stats->lost++;
+    }
+    ping->in_use = false;
+}
+
+// A ping slot, taking the oldest if all are in use
+static bt_probe_ping_t *claim_ping(bt_probe_t *probe) {
+    bt_probe_ping_t *oldest = NULL;
+    for (int i = 0; i < BT_PROBE_OUTSTANDING; i++) {
+        bt_probe_ping_t *ping = &probe->pings[i];
+        if (!ping->in_use) {
+            return ping;
+        }
+        if (!oldest || (int32_t)(ping->sent_ms - oldest->sent_ms) < 0) {
+            oldest = ping;
+        }
+    }
+    settle(probe, oldest);
+    return oldest;
+}
+
+static void send_ping(bt_probe_t *probe, bt_probe_target_t *target, uint32_t now_ms) {
+    uint8_t params[BT_PROBE_PING_SIZE + BT_PROBE_PADDING_MAX];
+    uint16_t seq = probe->next_seq++;
+
+    params[0] = seq >> 8;
+    params[1] = seq;
+    params[2] = now_ms >> 24;
+    params[3] = now_ms >> 16;
+    params[4] = now_ms >> 8;
+    params[5] = now_ms;
+    params[6] = target->ttl;
+    memset(&params[BT_PROBE_PING_SIZE], 0, target->padding);
+
+    if (!probe->send(probe->context, target->dst, target->ttl, params, BT_PROBE_PING_SIZE + target->padding)) {
+        target->stats.send_failed++;
+        return;
+    }
+    target->stats.sent++;
+    bt_probe_ping_t *ping = claim_ping(probe);
+    ping->in_use = true;
+    ping->answered = false;
+    ping->target = target - probe->targets;
+    ping->seq = seq;
+    ping->sent_ms = now_ms;
+}
+
+// Send the pings that are due and settle the ones that timed out. Returns the
+// ms until the next tick is needed, UINT32_MAX if there is nothing to do.
+uint32_t bt_probe_tick(bt_probe_t *probe, uint32_t now_ms) {
+    uint32_t next = UINT32_MAX;
+
+    for (int i = 0; i < BT_PROBE_OUTSTANDING; i++) {
+        bt_probe_ping_t *ping = &probe->pings[i];
+        if (!ping->in_use) {
+            continue;
+        }
+        uint32_t deadline = ping->sent_ms + BT_PROBE_TIMEOUT_MS;
+        if (due(now_ms, deadline)) {
+            settle(probe, ping);
+        } else if (deadline - now_ms < next) {
+            next = deadline - now_ms;
+        }
+    }
+    for (int i = 0; i < BT_PROBE_TARGETS; i++) {
+        bt_probe_target_t *target = &probe->targets[i];
+        if (target->dst == NO_DST) {
+            continue;
+        }
+        if (due(now_ms, target->next_ms)) {
+            send_ping(probe, target, now_ms);
+            // Keep the schedule unless the tick fell a whole interval behind
+            target->next_ms += target->interval_ms;
+            if (due(now_ms, target->next_ms)) {
+                target->next_ms = now_ms + target->interval_ms;
+            }
+        }
+        if (target->next_ms - now_ms < next) {
+            next = target->next_ms - now_ms;
+        }
+    }
+    return next;
+}
+
+// An echo received with the given TTL
+void bt_probe_echo_input(bt_probe_t *probe, const uint8_t *params, uint16_t length, uint8_t arrival_ttl,
+                         uint32_t now_ms) {
+    if (length < BT_PROBE_ECHO_SIZE) {
+        return;
+    }
+    uint16_t seq = ((uint16_t)params[0] << 8) | params[1];
+    bt_probe_ping_t *ping = NULL;
+    for (int i = 0; i < BT_PROBE_OUTSTANDING && !ping; i++) {
+        if (probe->pings[i].in_use && probe->pings[i].seq == seq) {
+            ping = &probe->pings[i];
+        }
+    }
+    // Echoes of settled pings come too late to say anything about delivery
+    if (!ping) {
+        return;
+    }
+
+    bt_probe_target_t *target = &probe->targets[ping->target];
+    bt_probe_stats_t *stats = &target->stats;
+    uint32_t rtt = now_ms - get_be32(&params[2]);
+    bt_latency_record(stats->rtt_hist, rtt);
+    stats->rtt_sum_ms += rtt;
+    if (rtt < stats->rtt_min_ms) {
+        stats->rtt_min_ms = rtt;
+    }
+    if (rtt > stats->rtt_max_ms) {
+        stats->rtt_max_ms = rtt;
+    }
+    record_hops(stats->hops_out, params[6], params[7]);
+    record_hops(stats->hops_back, params[6], arrival_ttl);
+    stats->echoes++;
+
+    ping->answered = true;
+    if (!is_group(target->dst)) {
+        settle(probe, ping);
+    }
+}
+
+// Responder side: build the echo for a ping that arrived with arrival_ttl.
+// Returns its size (0 for a malformed ping) and the TTL to send it with.
+uint16_t bt_probe_answer(const uint8_t *ping, uint16_t length, uint8_t arrival_ttl, uint8_t *echo, uint8_t *ttl) {
+    if (length < BT_PROBE_PING_SIZE) {
+        return 0;
+    }
+    memcpy(echo, ping, BT_PROBE_PING_SIZE);
+    echo[BT_PROBE_PING_SIZE] = arrival_ttl;
+    *ttl = ping[6];
+    return BT_PROBE_ECHO_SIZE;
+}
+
+// Share of settled pings that were answered, in thousandths
+uint32_t bt_probe_delivery_permille(const bt_probe_stats_t *stats) {
+    uint32_t settled = stats->answered + stats->lost;
+    return settled ? (uint32_t)((uint64_t)stats->answered * 1000 / settled) : 0;
+}
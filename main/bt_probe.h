@@ -0,0 +1,78 @@
+#ifndef BT_PROBE_H
+#define BT_PROBE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bt_config.h"
+
+// Configuration
+#define BT_PROBE_TARGETS 8         // Destinations probed at once
+#define BT_PROBE_OUTSTANDING 32    // Pings awaiting echoes across all targets
+#define BT_PROBE_TIMEOUT_MS 5000   // A ping with no echo this long is lost
+#define BT_PROBE_MIN_INTERVAL_MS 100
+#define BT_PROBE_PADDING_MAX 64    // Extra ping bytes, to probe segmented delivery
+#define BT_PROBE_HOP_BUCKETS 8     // Relay counts 0..6, the last bucket 7 or more
+
+// Message parameters; multi-byte fields are big-endian. A ping is answered
+// with an echo carrying its seq, time and TTL back, plus the TTL it arrived
+// with: the difference is the number of relays it passed.
+#define BT_PROBE_PING_SIZE 7 // seq(2) time_ms(4) ttl(1), then padding
+#define BT_PROBE_ECHO_SIZE 8 // seq(2) time_ms(4) ttl(1) arrival_ttl(1)
+
+typedef struct {
+    uint32_t sent;
+    uint32_t answered;    // Pings with at least one echo
+    uint32_t lost;        // Pings with no echo in BT_PROBE_TIMEOUT_MS
+    uint32_t echoes;      // All echoes; a group ping gets one per member that hears it
+    uint32_t send_failed; // Pings the mesh did not take
+    uint32_t rtt_min_ms;
+    uint32_t rtt_max_ms;
+    uint64_t rtt_sum_ms;  // Over all echoes
+    uint32_t rtt_hist[LATENCY_HIST_BUCKETS];   // bt_latency_record layout, in ms
+    uint32_t hops_out[BT_PROBE_HOP_BUCKETS];   // Relays on the way to the responder
+    uint32_t hops_back[BT_PROBE_HOP_BUCKETS];  // ...and on the way back
+} bt_probe_stats_t;
+
+typedef struct {
+    uint16_t dst;         // Unassigned (0) when free
+    uint32_t interval_ms;
+    uint8_t ttl;
+    uint8_t padding;
+    uint32_t next_ms;
+    bt_probe_stats_t stats;
+} bt_probe_target_t;
+
+// A ping awaiting echoes. Unicast pings are settled by their echo; group
+// pings stay until the timeout to count every member's echo.
+typedef struct {
+    bool in_use;
+    bool answered;
+    uint8_t target;
+    uint16_t seq;
+    uint32_t sent_ms;
+} bt_probe_ping_t;
+
+// Hands one ping to the mesh with the given TTL; false if it was not sent
+typedef bool (*bt_probe_send_t)(void *context, uint16_t dst, uint8_t ttl, const uint8_t *params, uint16_t length);
+
+// One prober. Owned by a single task, or used under the caller's lock.
+typedef struct {
+    bt_probe_target_t targets[BT_PROBE_TARGETS];
+    bt_probe_ping_t pings[BT_PROBE_OUTSTANDING];
+    uint16_t next_seq;
+    bt_probe_send_t send;
+    void *context;
+} bt_probe_t;
+
+// Function declarations
+void bt_probe_init(bt_probe_t *probe, bt_probe_send_t send, void *context);
+bool bt_probe_add(bt_probe_t *probe, uint16_t dst, uint32_t interval_ms, uint8_t ttl, uint8_t padding, uint32_t now_ms);
+bool bt_probe_remove(bt_probe_t *probe, uint16_t dst);
+const bt_probe_stats_t *bt_probe_stats(const bt_probe_t *probe, uint16_t dst);
+uint32_t bt_probe_tick(bt_probe_t *probe, uint32_t now_ms);
+void bt_probe_echo_input(bt_probe_t *probe, const uint8_t *params, uint16_t length, uint8_t arrival_ttl,
+                         uint32_t now_ms);
+uint16_t bt_probe_answer(const uint8_t *ping, uint16_t length, uint8_t arrival_ttl, uint8_t *echo, uint8_t *ttl);
+uint32_t bt_probe_delivery_permille(const bt_probe_stats_t *stats);
+
+#endif // BT_PROBE_H
@@ -0,0 +1,88 @@
+/*
+ * Lock-free Single-Producer/Single-Consumer Descriptor Ring
+ *
+ * Used for the per-connection RX and TX paths: the Bluetooth callback (or an
+ * application sender) is the only producer and the message task is the only
+ * consumer of each ring.
+ */
+
+#include "bt_ring.h"
+
+_Static_assert((BT_RING_SIZE & (BT_RING_SIZE - 1)) == 0, "BT_RING_SIZE must be a power of two");
+
+void bt_ring_init(bt_ring_t *ring) {
+    atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, 0, memory_order_relaxed);
+}
+
+// Producer side: returns false if the ring is full
+bool bt_ring_push(bt_ring_t *ring, const bt_message_t *message) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= BT_RING_SIZE) {
+        return false;
+    }
+
+    ring->entries[head & (BT_RING_SIZE - 1)] = *message;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+// Claim the oldest entry; shared by the consumer and producer-side eviction
+static bool take_oldest(bt_ring_t *ring, bt_message_t *message) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    while (1) {
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail == head) {
+            return false;
+        }
+
+        *message = ring->entries[tail & (BT_RING_SIZE - 1)];
+        if (atomic_compare_exchange_weak_explicit(&ring->tail, &tail, tail + 1,
+                                                  memory_order_acq_rel, memory_order_acquire)) {
+            return true;
+        }
+    }
+}
+
+// Consumer side: returns false if the ring is empty
+bool bt_ring_pop(bt_ring_t *ring, bt_message_t *message) {
+    return take_oldest(ring, message);
+}
+
+// Consumer side: look at the oldest entry without removing it
+bool bt_ring_peek(bt_ring_t *ring, bt_message_t *message) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail == head) {
+        return false;
+    }
+
+    *message = ring->entries[tail & (BT_RING_SIZE - 1)];
+    return true;
+}
+
+// Consumer side: rewrite the entry the next pop returns. Only for rings the
+// producer never evicts from.
+bool bt_ring_replace(bt_ring_t *ring, const bt_message_t *message) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail == head) {
+        return false;
+    }
+
+    ring->entries[tail & (BT_RING_SIZE - 1)] = *message;
+    return true;
+}
+
+// Producer side: remove the oldest entry to make room (drop-oldest policy)
+bool bt_ring_evict(bt_ring_t *ring, bt_message_t *message) {
+    return take_oldest(ring, message);
+}
+
+// Number of queued entries (approximate while either side is active)
+uint32_t bt_ring_count(bt_ring_t *ring) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return head - tail;
+}
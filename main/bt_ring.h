@@ -0,0 +1,34 @@
+#ifndef BT_RING_H
+#define BT_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "bt_config.h"
+
+// Configuration (must be a power of two)
+#ifndef BT_RING_SIZE
+#define BT_RING_SIZE 8
+#endif
+
+// Single-producer/single-consumer ring of message descriptors. Only the
+// producer writes head, so neither side ever blocks or takes a lock. The
+// producer may also evict the oldest entry when the ring is full; tail is
+// advanced with compare-and-swap so an eviction and a concurrent pop can never
+// both claim the same entry.
+typedef struct {
+    bt_message_t entries[BT_RING_SIZE];
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+} bt_ring_t;
+
+// Function declarations
+void bt_ring_init(bt_ring_t *ring);
+bool bt_ring_push(bt_ring_t *ring, const bt_message_t *message);
+bool bt_ring_pop(bt_ring_t *ring, bt_message_t *message);
+bool bt_ring_peek(bt_ring_t *ring, bt_message_t *message);
+bool bt_ring_replace(bt_ring_t *ring, const bt_message_t *message);
+bool bt_ring_evict(bt_ring_t *ring, bt_message_t *message);
+uint32_t bt_ring_count(bt_ring_t *ring);
+
+#endif // BT_RING_H
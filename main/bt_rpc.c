@@ -0,0 +1,243 @@
+/*
+ * Pipelined Binary RPC
+ *
+ * Requests carry a 16-bit id and responses echo it, so a client may have many
+ * calls outstanding on one connection and the server may answer them in any
+ * order, including later from another task (BT_RPC_DEFERRED). N calls then
+ * cost one burst of requests and one of responses instead of N round trips.
+ *
+ * Outstanding calls live in a fixed table claimed with compare-and-swap; the
+ * low bits of a request id index the table and the high bits are a per-entry
+ * generation, so late or duplicate responses never match a newer call. An
+ * entry completes exactly once, whichever of the response, the timeout tick or
+ * a disconnect claims it first.
+ */
+
+#include <string.h>
+#include "bt_rpc.h"
+
+_Static_assert((BT_RPC_MAX_PENDING & (BT_RPC_MAX_PENDING - 1)) == 0, "BT_RPC_MAX_PENDING must be a power of two");
+_Static_assert(BT_RPC_MAX_PENDING <= 256, "Request ids need room for a generation");
+
+#define ENTRY_MASK (BT_RPC_MAX_PENDING - 1)
+#define GENERATION_SHIFT __builtin_ctz(BT_RPC_MAX_PENDING)
+
+// Call entry states
+enum {
+    CALL_FREE = 0,
+    CALL_SENDING,    // Claimed by a caller; invisible to responses and timeouts
+    CALL_PENDING,
+    CALL_COMPLETING  // Claimed by whoever completes it
+};
+
+static bt_rpc_call_t calls[BT_RPC_MAX_PENDING];
+static uint16_t generations[BT_RPC_MAX_PENDING]; // Written only by an entry's claimant
+static _Atomic uint32_t next_entry;
+static _Atomic uint32_t pending_count;
+static _Atomic uint32_t dropped_responses;
+static const bt_rpc_handler_t *handler_table;
+static uint16_t handler_count;
+static bt_rpc_send_t send_packet;
+
+static bool due(uint32_t now_ms, uint32_t deadline_ms) {
+    return (int32_t)(now_ms - deadline_ms) >= 0;
+}
+
+static void write_header(uint8_t *packet, uint8_t type, uint16_t id, uint8_t code) {
+    packet[0] = type;
+    packet[1] = id >> 8;
+    packet[2] = id;
+    packet[3] = code;
+}
+
+// Take a pending entry for completion
+static bool claim_pending(bt_rpc_call_t *call) {
+    uint8_t expected = CALL_PENDING;
+    return atomic_compare_exchange_strong_explicit(&call->state, &expected, CALL_COMPLETING,
+                                                   memory_order_acquire, memory_order_relaxed);
+}
+
+// Hand a claimed entry back untouched
+static void unclaim(bt_rpc_call_t *call) {
+    atomic_store_explicit(&call->state, CALL_PENDING, memory_order_release);
+}
+
+static void complete_call(bt_rpc_call_t *call, uint8_t status, const uint8_t *reply, uint16_t length) {
+    call->complete(call->conn_handle, call->id, status, reply, length, call->context);
+    atomic_fetch_sub(&pending_count, 1);
+    atomic_store_explicit(&call->state, CALL_FREE, memory_order_release);
+}
+
+// The handler table is indexed by method id; NULL entries are unimplemented
+void bt_rpc_init(const bt_rpc_handler_t *handlers, uint16_t count, bt_rpc_send_t send) {
+    handler_table = handlers;
+    handler_count = handlers ? count : 0;
+    send_packet = send;
+}
+
+// Send a request without waiting for the response; returns its request id, or
+// 0 if the table is full or the request could not be queued (complete is then
+// never called)
+uint16_t bt_rpc_call(uint32_t conn_handle, uint8_t method, const uint8_t *args, uint16_t length,
+                     bt_rpc_complete_t complete, void *context, uint32_t timeout_ms, uint32_t now_ms) {
+    if (!send_packet || !complete || length > BT_RPC_ARGS_MAX || (length > 0 && !args)) {
+        return 0;
+    }
+
+    bt_rpc_call_t *call = NULL;
+    uint32_t start = atomic_fetch_add_explicit(&next_entry, 1, memory_order_relaxed);
+    uint32_t index;
+    for (uint32_t i = 0; i < BT_RPC_MAX_PENDING; i++) {
+        index = (start + i) & ENTRY_MASK;
+        uint8_t expected = CALL_FREE;
+        if (atomic_compare_exchange_strong_explicit(&calls[index].state, &expected, CALL_SENDING,
+                                                    memory_order_acquire, memory_order_relaxed)) {
+            call = &calls[index];
+            break;
+        }
+    }
+    if (!call) {
+        return 0;
+    }
+
+    uint16_t id;
+    do {
+        id = (uint16_t)((++generations[index] << GENERATION_SHIFT) | index);
+    } while (id == 0);
+    call->id = id;
+    call->conn_handle = conn_handle;
+    call->deadline_ms = now_ms + timeout_ms;
+    call->complete = complete;
+    call->context = context;
+
+    uint8_t packet[BT_RPC_HEADER + BT_RPC_ARGS_MAX];
+    write_header(packet, BT_RPC_REQUEST, id, method);
+    if (length > 0) {
+        memcpy(&packet[BT_RPC_HEADER], args, length);
+    }
+
+    // A response that somehow beats the switch to pending finds no call and is
+    // dropped; the call then times out rather than completing twice
+    if (!send_packet(conn_handle, packet, BT_RPC_HEADER + length)) {
+        atomic_store_explicit(&call->state, CALL_FREE, memory_order_release);
+        return 0;
+    }
+    atomic_fetch_add(&pending_count, 1);
+    atomic_store_explicit(&call->state, CALL_PENDING, memory_order_release);
+    return id;
+}
+
+// Answer a request whose handler returned BT_RPC_DEFERRED; any task may call it
+bool bt_rpc_reply(uint32_t conn_handle, uint16_t request_id, uint8_t status, const uint8_t *reply, uint16_t length) {
+    if (!send_packet || length > BT_RPC_REPLY_MAX || (length > 0 && !reply)) {
+        return false;
+    }
+
+    uint8_t packet[BT_RPC_HEADER + BT_RPC_REPLY_MAX];
+    write_header(packet, BT_RPC_RESPONSE, request_id, status);
+    if (length > 0) {
+        memcpy(&packet[BT_RPC_HEADER], reply, length);
+    }
+    return send_packet(conn_handle, packet, BT_RPC_HEADER + length);
+}
+
+static void handle_request(uint32_t conn_handle, uint16_t id, uint8_t method, const uint8_t *args, uint16_t length) {
+    uint8_t packet[BT_RPC_HEADER + BT_RPC_REPLY_MAX];
+    uint16_t reply_length = 0;
+    int status = BT_RPC_NO_METHOD;
+
+    // Handlers write their reply in place after the response header
+    if (method < handler_count && handler_table[method]) {
+        status = handler_table[method](conn_handle, id, args, length, &packet[BT_RPC_HEADER], &reply_length);
+    }
+    if (status == BT_RPC_DEFERRED) {
+        return;
+    }
+    if (status < 0 || status > 0xFF || reply_length > BT_RPC_REPLY_MAX) {
+        status = BT_RPC_BAD_REQUEST;
+        reply_length = 0;
+    }
+    write_header(packet, BT_RPC_RESPONSE, id, status);
+    if (!send_packet(conn_handle, packet, BT_RPC_HEADER + reply_length)) {
+        // The caller will time out; counted so the loss shows
+        atomic_fetch_add_explicit(&dropped_responses, 1, memory_order_relaxed);
+    }
+}
+
+static void handle_response(uint32_t conn_handle, uint16_t id, uint8_t status, const uint8_t *reply, uint16_t length) {
+    bt_rpc_call_t *call = &calls[id & ENTRY_MASK];
+    if (!claim_pending(call)) {
+        return;
+    }
+    // Late, duplicate or foreign responses leave the entry alone
+    if (call->id != id || call->conn_handle != conn_handle) {
+        unclaim(call);
+        return;
+    }
+    complete_call(call, status, reply, length);
+}
+
+// Offer one received frame; true if it was an RPC packet (even a malformed
+// one) and has been consumed
+bool bt_rpc_input(uint32_t conn_handle, const uint8_t *packet, uint16_t length) {
+    if (length == 0 || (packet[0] != BT_RPC_REQUEST && packet[0] != BT_RPC_RESPONSE)) {
+        return false;
+    }
+    if (length < BT_RPC_HEADER || !send_packet) {
+        return true;
+    }
+
+    uint16_t id = ((uint16_t)packet[1] << 8) | packet[2];
+    if (packet[0] == BT_RPC_REQUEST) {
+        handle_request(conn_handle, id, packet[3], &packet[BT_RPC_HEADER], length - BT_RPC_HEADER);
+    } else {
+        handle_response(conn_handle, id, packet[3], &packet[BT_RPC_HEADER], length - BT_RPC_HEADER);
+    }
+    return true;
+}
+
+// Fail calls whose deadline has passed. Call periodically while
+// bt_rpc_pending() is non-zero.
+//
+// This and bt_rpc_cancel_connection only claim entries that look like theirs:
+// a claim, however brief, makes a response arriving meanwhile miss its call.
+// The fields are checked again once claimed, as the entry may have been reused.
+void bt_rpc_tick(uint32_t now_ms) {
+    for (uint32_t i = 0; i < BT_RPC_MAX_PENDING; i++) {
+        bt_rpc_call_t *call = &calls[i];
+        if (atomic_load_explicit(&call->state, memory_order_acquire) != CALL_PENDING ||
+            !due(now_ms, call->deadline_ms) || !claim_pending(call)) {
+            continue;
+        }
+        if (due(now_ms, call->deadline_ms)) {
+            complete_call(call, BT_RPC_TIMEOUT, NULL, 0);
+        } else {
+            unclaim(call);
+        }
+    }
+}
+
+// Fail every call outstanding on a connection that has gone away
+void bt_rpc_cancel_connection(uint32_t conn_handle) {
+    for (uint32_t i = 0; i < BT_RPC_MAX_PENDING; i++) {
+        bt_rpc_call_t *call = &calls[i];
+        if (atomic_load_explicit(&call->state, memory_order_acquire) != CALL_PENDING ||
+            call->conn_handle != conn_handle || !claim_pending(call)) {
+            continue;
+        }
+        if (call->conn_handle == conn_handle) {
+            complete_call(call, BT_RPC_DISCONNECTED, NULL, 0);
+        } else {
+            unclaim(call);
+        }
+    }
+}
+
+uint32_t bt_rpc_pending(void) {
+    return atomic_load(&pending_count);
+}
+
+// Responses to received requests that the connection would not take
+uint32_t bt_rpc_dropped_responses(void) {
+    return atomic_load(&dropped_responses);
+}
@@ -0,0 +1,65 @@
+#ifndef BT_RPC_H
+#define BT_RPC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "bt_config.h"
+
+// Configuration
+#ifndef BT_RPC_MAX_PENDING
+#define BT_RPC_MAX_PENDING 32 // Calls in flight across all connections (power of two)
+#endif
+#define BT_RPC_ARGS_MAX 256   // Largest request argument block
+#define BT_RPC_REPLY_MAX 256  // Largest reply a handler may write
+
+// Packet types; each packet is one frame. The request id is big-endian.
+#define BT_RPC_REQUEST  0xC0 // id(2) method(1) args
+#define BT_RPC_RESPONSE 0xC1 // id(2) status(1) reply
+#define BT_RPC_HEADER 4
+
+// Call status. Handlers return BT_RPC_OK, an error of their own between 0x01
+// and 0xEF, or BT_RPC_DEFERRED to answer later with bt_rpc_reply().
+#define BT_RPC_OK           0x00
+#define BT_RPC_BAD_REQUEST  0xFC // Malformed request or reply too large
+#define BT_RPC_DISCONNECTED 0xFD // Local: the connection closed first
+#define BT_RPC_TIMEOUT      0xFE // Local: no response in time
+#define BT_RPC_NO_METHOD    0xFF
+#define BT_RPC_DEFERRED     (-1)
+
+// Server side: handles one request, writing up to BT_RPC_REPLY_MAX bytes of
+// reply. Handlers are looked up by method id in a constant table.
+typedef int (*bt_rpc_handler_t)(uint32_t conn_handle, uint16_t request_id, const uint8_t *args, uint16_t length,
+                                uint8_t *reply, uint16_t *reply_length);
+
+// Client side: called exactly once per call with the peer's status and reply,
+// or a local BT_RPC_TIMEOUT/BT_RPC_DISCONNECTED with no reply
+typedef void (*bt_rpc_complete_t)(uint32_t conn_handle, uint16_t request_id, uint8_t status,
+                                  const uint8_t *reply, uint16_t length, void *context);
+
+// Queues one packet on the connection; false if it cannot be sent now
+typedef bool (*bt_rpc_send_t)(uint32_t conn_handle, const uint8_t *packet, uint16_t length);
+
+// A call awaiting its response. Request ids carry the entry index in their low
+// bits, so a response finds its entry in one step.
+typedef struct {
+    _Atomic uint8_t state;
+    uint16_t id;
+    uint32_t conn_handle;
+    uint32_t deadline_ms;
+    bt_rpc_complete_t complete;
+    void *context;
+} bt_rpc_call_t;
+
+// Function declarations
+void bt_rpc_init(const bt_rpc_handler_t *handlers, uint16_t count, bt_rpc_send_t send);
+uint16_t bt_rpc_call(uint32_t conn_handle, uint8_t method, const uint8_t *args, uint16_t length,
+                     bt_rpc_complete_t complete, void *context, uint32_t timeout_ms, uint32_t now_ms);
+bool bt_rpc_reply(uint32_t conn_handle, uint16_t request_id, uint8_t status, const uint8_t *reply, uint16_t length);
+bool bt_rpc_input(uint32_t conn_handle, const uint8_t *packet, uint16_t length);
+void bt_rpc_tick(uint32_t now_ms);
+void bt_rpc_cancel_connection(uint32_t conn_handle);
+uint32_t bt_rpc_pending(void);
+uint32_t bt_rpc_dropped_responses(void);
+
+#endif // BT_RPC_H
@@ -0,0 +1,96 @@
+/*
+ * Deficit Round Robin Scheduler
+ *
+ * Shares the message task between connection slots in proportion to their
+ * weights, measured in bytes rather than packets. Each round a backlogged slot
+ * is credited weight * BT_DRR_QUANTUM bytes and may send packets while its
+ * deficit covers them; a slot that goes idle forfeits its leftover credit.
+ *
+ * Within a connection, traffic lanes decide which queued packet goes next:
+ * either strictly by priority, or by weight so that lower lanes keep a share.
+ */
+
+#include "bt_sched.h"
+
+void bt_drr_init(bt_drr_t *drr) {
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        drr->weight[i] = BT_DRR_DEFAULT_WEIGHT;
+        drr->deficit[i] = 0;
+    }
+}
+
+// A weight of 0 is treated as 1 so that no slot can be starved outright
+void bt_drr_set_weight(bt_drr_t *drr, uint32_t flow, uint16_t weight) {
+    if (flow < MAX_CONNECTIONS) {
+        drr->weight[flow] = weight ? weight : 1;
+    }
+}
+
+// Start of a round for a backlogged flow
+void bt_drr_replenish(bt_drr_t *drr, uint32_t flow) {
+    drr->deficit[flow] += (uint32_t)drr->weight[flow] * BT_DRR_QUANTUM;
+}
+
+// Charge a packet against the flow's deficit; false means wait for the next round
+bool bt_drr_consume(bt_drr_t *drr, uint32_t flow, uint32_t length) {
+    if (!bt_drr_allows(drr, flow, length)) {
+        return false;
+    }
+    bt_drr_charge(drr, flow, length);
+    return true;
+}
+
+// Whether the deficit covers a packet, without charging it
+bool bt_drr_allows(const bt_drr_t *drr, uint32_t flow, uint32_t length) {
+    return length <= drr->deficit[flow];
+}
+
+// Charge what was actually taken from a queue whose head can change between
+// bt_drr_allows and the dequeue; the deficit stops at zero
+void bt_drr_charge(bt_drr_t *drr, uint32_t flow, uint32_t length) {
+    drr->deficit[flow] = length < drr->deficit[flow] ? drr->deficit[flow] - length : 0;
+}
+
+// The flow's queue drained: leftover credit is not carried over
+void bt_drr_reset(bt_drr_t *drr, uint32_t flow) {
+    drr->deficit[flow] = 0;
+}
+
+// A weight of 0 is treated as 1, as for connections
+void bt_lane_init(bt_lane_sched_t *lanes, const uint8_t *weights) {
+    for (int lane = 0; lane < BT_LANES; lane++) {
+        lanes->weight[lane] = weights[lane] ? weights[lane] : 1;
+        lanes->credit[lane] = lanes->weight[lane];
+    }
+}
+
+// Pick the lane to serve from those with packets ready (bit n = lane n);
+// -1 if none. Strict mode always takes the highest-priority ready lane.
+int bt_lane_select(bt_lane_sched_t *lanes, uint32_t ready_mask, bool strict) {
+    if (ready_mask == 0) {
+        return -1;
+    }
+    if (strict) {
+        return __builtin_ctz(ready_mask);
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int lane = 0; lane < BT_LANES; lane++) {
+            if ((ready_mask & (1u << lane)) && lanes->credit[lane] > 0) {
+                return lane;
+            }
+        }
+        // Every ready lane has used its share: start a new round
+        for (int lane = 0; lane < BT_LANES; lane++) {
+            lanes->credit[lane] = lanes->weight[lane];
+        }
+    }
+    return __builtin_ctz(ready_mask);
+}
+
+// Account for a packet sent from a lane
+void bt_lane_charge(bt_lane_sched_t *lanes, int lane) {
+    if (lane >= 0 && lane < BT_LANES && lanes->credit[lane] > 0) {
+        lanes->credit[lane]--;
+    }
+}
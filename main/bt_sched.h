@@ -0,0 +1,39 @@
+#ifndef BT_SCHED_H
+#define BT_SCHED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bt_config.h"
+
+// Configuration
+#define BT_DRR_QUANTUM MAX_PACKET_SIZE // Bytes credited per weight unit per round
+#define BT_DRR_DEFAULT_WEIGHT 1
+#define BT_LANE_RESERVED_CREDITS 1 // TX credits only lane 0 may use
+
+// Deficit round robin state, one flow per connection slot
+typedef struct {
+    uint16_t weight[MAX_CONNECTIONS];
+    uint32_t deficit[MAX_CONNECTIONS];
+} bt_drr_t;
+
+// Per-connection choice between traffic lanes. Weighted mode is a packet-based
+// weighted round robin that always tries higher-priority lanes first.
+typedef struct {
+    uint8_t weight[BT_LANES];
+    uint8_t credit[BT_LANES];
+} bt_lane_sched_t;
+
+// Function declarations
+void bt_drr_init(bt_drr_t *drr);
+void bt_drr_set_weight(bt_drr_t *drr, uint32_t flow, uint16_t weight);
+void bt_drr_replenish(bt_drr_t *drr, uint32_t flow);
+bool bt_drr_consume(bt_drr_t *drr, uint32_t flow, uint32_t length);
+bool bt_drr_allows(const bt_drr_t *drr, uint32_t flow, uint32_t length);
+void bt_drr_charge(bt_drr_t *drr, uint32_t flow, uint32_t length);
+void bt_drr_reset(bt_drr_t *drr, uint32_t flow);
+
+void bt_lane_init(bt_lane_sched_t *lanes, const uint8_t *weights);
+int bt_lane_select(bt_lane_sched_t *lanes, uint32_t ready_mask, bool strict);
+void bt_lane_charge(bt_lane_sched_t *lanes, int lane);
+
+#endif // BT_SCHED_H
@@ -0,0 +1,66 @@
+/*
+ * Connection Statistics Helpers
+ *
+ * Log2-bucket latency histograms, exponentially weighted moving averages for
+ * throughput, and the sequence lock used to publish per-connection counters.
+ */
+
+#include "bt_stats.h"
+
+void bt_seq_write_begin(bt_seqlock_t *lock) {
+    atomic_fetch_add_explicit(&lock->seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+void bt_seq_write_end(bt_seqlock_t *lock) {
+    atomic_fetch_add_explicit(&lock->seq, 1, memory_order_release);
+}
+
+// Wait out a write in progress and return the sequence to validate against
+uint32_t bt_seq_read_begin(bt_seqlock_t *lock) {
+    uint32_t seq;
+    while ((seq = atomic_load_explicit(&lock->seq, memory_order_acquire)) & 1) {
+    }
+    return seq;
+}
+
+// True if a write overlapped the read and it must be repeated
+bool bt_seq_read_retry(bt_seqlock_t *lock, uint32_t start) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&lock->seq, memory_order_relaxed) != start;
+}
+
+// Bucket 0 counts 0 us, bucket n counts [2^(n-1), 2^n) us, and the last
+// bucket also takes everything longer
+void bt_latency_record(uint32_t *hist, uint32_t latency_us) {
+    uint32_t bucket = latency_us ? 32 - __builtin_clz(latency_us) : 0;
+    if (bucket >= LATENCY_HIST_BUCKETS) {
+        bucket = LATENCY_HIST_BUCKETS - 1;
+    }
+    hist[bucket]++;
+}
+
+// Upper bound in microseconds of the bucket holding the given percentile
+uint32_t bt_latency_percentile(const uint32_t *hist, uint32_t percent) {
+    uint64_t total = 0;
+    for (int i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+        total += hist[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    uint64_t target = (total * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen >= target) {
+            return i ? (1u << i) - 1 : 0;
+        }
+    }
+    return (1u << (LATENCY_HIST_BUCKETS - 1)) - 1;
+}
+
+uint32_t bt_ewma_update(uint32_t average, uint32_t sample) {
+    return average - (average >> BT_EWMA_SHIFT) + (sample >> BT_EWMA_SHIFT);
+}
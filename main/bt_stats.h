@@ -0,0 +1,29 @@
+#ifndef BT_STATS_H
+#define BT_STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "bt_config.h"
+
+// Configuration
+#define BT_EWMA_SHIFT 2 // Each new sample carries 1/4 of the weight
+
+// Sequence lock: lets one writer task update multi-word statistics (such as
+// 64-bit counters on a 32-bit CPU) while readers take consistent snapshots
+// without ever blocking the writer
+typedef struct {
+    _Atomic uint32_t seq;
+} bt_seqlock_t;
+
+// Function declarations
+void bt_seq_write_begin(bt_seqlock_t *lock);
+void bt_seq_write_end(bt_seqlock_t *lock);
+uint32_t bt_seq_read_begin(bt_seqlock_t *lock);
+bool bt_seq_read_retry(bt_seqlock_t *lock, uint32_t start);
+
+void bt_latency_record(uint32_t *hist, uint32_t latency_us);
+uint32_t bt_latency_percentile(const uint32_t *hist, uint32_t percent);
+uint32_t bt_ewma_update(uint32_t average, uint32_t sample);
+
+#endif // BT_STATS_H
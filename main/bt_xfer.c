@@ -0,0 +1,436 @@
+/*
+ * Bulk Transfer Protocol
+ *
+ * Moves one object of known size over a framed connection as numbered chunks.
+ * The sender keeps up to BT_XFER_WINDOW chunks in flight instead of waiting for
+ * each one, so throughput follows the link rather than the round trip. The
+ * receiver acknowledges cumulatively with a selective-acknowledgement bitmap
+ * of the chunks it holds beyond the first gap; the sender resends each gap
+ * once as soon as a later chunk is acknowledged, and falls back to resending
+ * the oldest chunk when nothing is acknowledged for BT_XFER_RETRY_MS.
+ *
+ * Every chunk carries its own CRC-16, so a corrupted chunk is simply not
+ * acknowledged and comes round again. A receiver's sink may report how much
+ * of the object it already holds, and the transfer then resumes from there.
+ */
+
+#include <string.h>
+#include "bt_xfer.h"
+#include "bt_framer.h"
+
+_Static_assert(BT_XFER_WINDOW <= 32, "The SACK bitmap covers at most 32 chunks");
+
+#define OPEN_SIZE 11
+#define ACK_SIZE 10
+#define ABORT_SIZE 2
+#define DATA_HEADER 5
+
+static void put32(uint8_t *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static uint32_t get32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static bool due(uint32_t now_ms, uint32_t deadline_ms) {
+    return (int32_t)(now_ms - deadline_ms) >= 0;
+}
+
+static bool send_ack(bt_xfer_t *xfer, bt_xfer_status_t status) {
+    uint8_t packet[ACK_SIZE];
+    packet[0] = BT_XFER_ACK;
+    packet[1] = status;
+    put32(&packet[2], xfer->base);
+    put32(&packet[6], xfer->held);
+    xfer->unacked = 0;
+    return xfer->send(xfer->send_context, packet, sizeof(packet), true);
+}
+
+static void send_abort(bt_xfer_t *xfer, bt_xfer_status_t status) {
+    uint8_t packet[ABORT_SIZE] = { BT_XFER_ABORT, status };
+    xfer->send(xfer->send_context, packet, sizeof(packet), true);
+}
+
+static void send_open(bt_xfer_t *xfer) {
+    uint8_t packet[OPEN_SIZE];
+    packet[0] = BT_XFER_OPEN;
+    put32(&packet[1], xfer->id);
+    put32(&packet[5], xfer->size);
+    packet[9] = xfer->chunk_size >> 8;
+    packet[10] = xfer->chunk_size;
+    xfer->send(xfer->send_context, packet, sizeof(packet), true);
+}
+
+static uint16_t chunk_length(const bt_xfer_t *xfer, uint32_t seq) {
+    uint32_t remaining = xfer->size - seq * xfer->chunk_size;
+    return remaining < xfer->chunk_size ? remaining : xfer->chunk_size;
+}
+
+// Leave the transfer with its outcome; a receiver's sink learns how far it got
+static void finish(bt_xfer_t *xfer, bt_xfer_status_t status) {
+    if (xfer->state == BT_XFER_RECEIVING) {
+        uint32_t received = xfer->base * xfer->chunk_size;
+        if (received > xfer->size) {
+            received = xfer->size;
+        }
+        if (!xfer->sink->finish(xfer->sink->context, status, received) && status == BT_XFER_COMPLETE) {
+            status = BT_XFER_IO_ERROR;
+        }
+    }
+    xfer->state = BT_XFER_IDLE;
+    xfer->status = status;
+}
+
+// The sender only stops on the final ACK, so it is retried from the tick until
+// the link takes it, or for as long as the sender would keep retransmitting
+static void complete_receive(bt_xfer_t *xfer, uint32_t now_ms) {
+    finish(xfer, BT_XFER_COMPLETE);
+    if (xfer->status != BT_XFER_COMPLETE) {
+        send_abort(xfer, xfer->status);
+    } else if (!send_ack(xfer, BT_XFER_COMPLETE)) {
+        xfer->deadline_ms = now_ms + BT_XFER_RETRY_MS * (BT_XFER_MAX_RETRIES + 1);
+        xfer->state = BT_XFER_CLOSING;
+    }
+}
+
+// Retry the final ACK; the transfer's outcome is already settled
+static void retry_final_ack(bt_xfer_t *xfer, uint32_t now_ms) {
+    if (send_ack(xfer, BT_XFER_COMPLETE) || due(now_ms, xfer->deadline_ms)) {
+        xfer->state = BT_XFER_IDLE;
+    }
+}
+
+// Read one chunk from the source and send it as a DATA packet. False if the
+// link cannot take it now or the read failed, which aborts the transfer.
+static bool send_chunk(bt_xfer_t *xfer, uint32_t seq) {
+    uint8_t packet[BT_XFER_CHUNK_MAX + BT_XFER_DATA_OVERHEAD];
+    uint16_t length = chunk_length(xfer, seq);
+
+    packet[0] = BT_XFER_DATA;
+    put32(&packet[1], seq);
+    if (!xfer->source->read(xfer->source->context, seq * xfer->chunk_size, &packet[DATA_HEADER], length)) {
+        bt_xfer_abort(xfer, BT_XFER_IO_ERROR);
+        return false;
+    }
+    uint16_t crc = bt_crc16(0xFFFF, packet, DATA_HEADER + length);
+    packet[DATA_HEADER + length] = crc >> 8;
+    packet[DATA_HEADER + length + 1] = crc;
+    return xfer->send(xfer->send_context, packet, length + BT_XFER_DATA_OVERHEAD, false);
+}
+
+// Fill the window with chunks not sent yet
+static void pump(bt_xfer_t *xfer, uint32_t now_ms) {
+    while (xfer->state == BT_XFER_SENDING && xfer->next < xfer->chunk_count &&
+           xfer->next - xfer->base < BT_XFER_WINDOW) {
+        if (!send_chunk(xfer, xfer->next)) {
+            return;
+        }
+        if (xfer->next == xfer->base) {
+            xfer->deadline_ms = now_ms + BT_XFER_RETRY_MS;
+        }
+        xfer->next++;
+        xfer->stats.chunks++;
+    }
+}
+
+void bt_xfer_init(bt_xfer_t *xfer, bt_xfer_send_t send, void *context) {
+    memset(xfer, 0, sizeof(*xfer));
+    xfer->send = send;
+    xfer->send_context = context;
+}
+
+// Wait for a peer to OPEN a transfer into the sink
+void bt_xfer_listen(bt_xfer_t *xfer, const bt_xfer_sink_t *sink) {
+    xfer->state = BT_XFER_LISTENING;
+    xfer->status = BT_XFER_OK;
+    xfer->sink = sink;
+    xfer->source = NULL;
+    memset(&xfer->stats, 0, sizeof(xfer->stats));
+}
+
+// Offer size bytes from the source to the peer; OPEN goes out on the next tick
+bool bt_xfer_start(bt_xfer_t *xfer, uint32_t id, uint32_t size, uint16_t chunk_size,
+                   const bt_xfer_source_t *source, uint32_t now_ms) {
+    if (xfer->state != BT_XFER_IDLE || !source || size == 0 ||
+        chunk_size == 0 || chunk_size > BT_XFER_CHUNK_MAX) {
+        return false;
+    }
+    xfer->id = id;
+    xfer->size = size;
+    xfer->chunk_size = chunk_size;
+    xfer->chunk_count = (size + chunk_size - 1) / chunk_size;
+    xfer->base = 0;
+    xfer->next = 0;
+    xfer->held = 0;
+    xfer->resent = 0;
+    xfer->retries = 0;
+    xfer->deadline_ms = now_ms;
+    xfer->source = source;
+    xfer->sink = NULL;
+    xfer->status = BT_XFER_OK;
+    memset(&xfer->stats, 0, sizeof(xfer->stats));
+    xfer->state = BT_XFER_OPENING;
+    return true;
+}
+
+static void receive_open(bt_xfer_t *xfer, const uint8_t *packet, uint16_t length, uint32_t now_ms) {
+    if (length < OPEN_SIZE) {
+        return;
+    }
+    uint32_t id = get32(&packet[1]);
+    uint32_t size = get32(&packet[5]);
+    uint16_t chunk_size = ((uint16_t)packet[9] << 8) | packet[10];
+
+    // Our ACK to the first OPEN was lost
+    if (xfer->state == BT_XFER_RECEIVING) {
+        if (id == xfer->id) {
+            send_ack(xfer, BT_XFER_OK);
+        }
+        return;
+    }
+    if (xfer->state != BT_XFER_LISTENING) {
+        return;
+    }
+
+    uint32_t resume = 0;
+    if (size == 0 || chunk_size == 0 || chunk_size > BT_XFER_CHUNK_MAX ||
+        !xfer->sink->begin(xfer->sink->context, id, size, &resume)) {
+        send_abort(xfer, BT_XFER_REJECTED);
+        finish(xfer, BT_XFER_REJECTED);
+        return;
+    }
+
+    xfer->id = id;
+    xfer->size = size;
+    xfer->chunk_size = chunk_size;
+    xfer->chunk_count = (size + chunk_size - 1) / chunk_size;
+    xfer->base = (resume < size ? resume : size) / chunk_size;
+    xfer->held = 0;
+    xfer->unacked = 0;
+    xfer->stats.resumed_at = xfer->base * chunk_size;
+    xfer->deadline_ms = now_ms + BT_XFER_IDLE_TIMEOUT_MS;
+    xfer->state = BT_XFER_RECEIVING;
+
+    if (xfer->base == xfer->chunk_count) {
+        complete_receive(xfer, now_ms);
+    } else {
+        send_ack(xfer, BT_XFER_OK);
+    }
+}
+
+static void receive_data(bt_xfer_t *xfer, const uint8_t *packet, uint16_t length, uint32_t now_ms) {
+    if (xfer->state != BT_XFER_RECEIVING) {
+        return;
+    }
+    if (length <= BT_XFER_DATA_OVERHEAD) {
+        xfer->stats.crc_errors++;
+        return;
+    }
+    uint16_t crc = ((uint16_t)packet[length - 2] << 8) | packet[length - 1];
+    uint32_t seq = get32(&packet[1]);
+    uint16_t payload = length - BT_XFER_DATA_OVERHEAD;
+    if (bt_crc16(0xFFFF, packet, length - 2) != crc ||
+        seq >= xfer->chunk_count || payload != chunk_length(xfer, seq)) {
+        xfer->stats.crc_errors++;
+        return;
+    }
+    xfer->deadline_ms = now_ms + BT_XFER_IDLE_TIMEOUT_MS;
+
+    // Already held: the sender missed an ACK, so repeat it
+    uint32_t offset = seq - xfer->base;
+    if (seq < xfer->base || (offset < 32 && (xfer->held & (1u << offset)))) {
+        xfer->stats.duplicates++;
+        send_ack(xfer, BT_XFER_OK);
+        return;
+    }
+    if (offset >= BT_XFER_WINDOW) {
+        return;
+    }
+
+    if (!xfer->sink->write(xfer->sink->context, seq * xfer->chunk_size, &packet[DATA_HEADER], payload)) {
+        send_abort(xfer, BT_XFER_IO_ERROR);
+        finish(xfer, BT_XFER_IO_ERROR);
+        return;
+    }
+    xfer->stats.chunks++;
+
+    uint32_t before = xfer->base;
+    xfer->held |= 1u << offset;
+    while (xfer->held & 1) {
+        xfer->held >>= 1;
+        xfer->base++;
+    }
+    if (xfer->base == xfer->chunk_count) {
+        complete_receive(xfer, now_ms);
+        return;
+    }
+
+    // Acknowledge at once when a gap opens or closes, so the sender can
+    // retransmit or refill its window; otherwise every few chunks
+    bool gap = offset != 0 || xfer->base - before > 1;
+    if (gap || ++xfer->unacked >= BT_XFER_ACK_EVERY) {
+        send_ack(xfer, BT_XFER_OK);
+    }
+}
+
+static void receive_ack(bt_xfer_t *xfer, const uint8_t *packet, uint16_t length, uint32_t now_ms) {
+    if (length < ACK_SIZE) {
+        return;
+    }
+    uint8_t status = packet[1];
+    uint32_t base = get32(&packet[2]);
+    uint32_t sack = get32(&packet[6]);
+    if (base > xfer->chunk_count) {
+        base = xfer->chunk_count;
+    }
+
+    // The first ACK says where the receiver wants to resume
+    if (xfer->state == BT_XFER_OPENING) {
+        xfer->base = base;
+        xfer->next = base;
+        xfer->resent = 0;
+        xfer->retries = 0;
+        xfer->stats.resumed_at = base * xfer->chunk_size;
+        xfer->deadline_ms = now_ms + BT_XFER_RETRY_MS;
+        xfer->state = BT_XFER_SENDING;
+    }
+    if (xfer->state != BT_XFER_SENDING) {
+        return;
+    }
+    if (status == BT_XFER_COMPLETE || base == xfer->chunk_count) {
+        finish(xfer, BT_XFER_COMPLETE);
+        return;
+    }
+    if (base < xfer->base) {
+        return;
+    }
+
+    if (base > xfer->base) {
+        uint32_t shift = base - xfer->base;
+        xfer->resent = shift < 32 ? xfer->resent >> shift : 0;
+        xfer->base = base;
+        if (xfer->next < base) {
+            xfer->next = base;
+        }
+        xfer->retries = 0;
+        xfer->deadline_ms = now_ms + BT_XFER_RETRY_MS;
+    }
+    xfer->held = sack;
+
+    // Fast retransmit: every chunk below the highest one held that is missing
+    if (sack) {
+        uint32_t top = 31 - __builtin_clz(sack);
+        for (uint32_t n = 0; n < top && xfer->base + n < xfer->next; n++) {
+            uint32_t bit = 1u << n;
+            if ((sack & bit) || (xfer->resent & bit)) {
+                continue;
+            }
+            if (!send_chunk(xfer, xfer->base + n)) {
+                break;
+            }
+            xfer->resent |= bit;
+            xfer->stats.retransmits++;
+        }
+    }
+    pump(xfer, now_ms);
+}
+
+// Feed one received packet (a whole frame) to the transfer
+void bt_xfer_input(bt_xfer_t *xfer, const uint8_t *packet, uint16_t length, uint32_t now_ms) {
+    if (length == 0 || xfer->state == BT_XFER_IDLE) {
+        return;
+    }
+    if (xfer->state == BT_XFER_CLOSING) {
+        // The sender is still retransmitting or reopening for want of our ACK
+        if (packet[0] == BT_XFER_ABORT) {
+            xfer->state = BT_XFER_IDLE;
+        } else if (packet[0] == BT_XFER_DATA || packet[0] == BT_XFER_OPEN) {
+            retry_final_ack(xfer, now_ms);
+        }
+        return;
+    }
+
+    switch (packet[0]) {
+        case BT_XFER_OPEN:
+            receive_open(xfer, packet, length, now_ms);
+            break;
+        case BT_XFER_DATA:
+            receive_data(xfer, packet, length, now_ms);
+            break;
+        case BT_XFER_ACK:
+            receive_ack(xfer, packet, length, now_ms);
+            break;
+        case BT_XFER_ABORT:
+            if (xfer->state != BT_XFER_LISTENING) {
+                uint8_t status = length >= ABORT_SIZE ? packet[1] : BT_XFER_ABORTED;
+                bool valid = status > BT_XFER_COMPLETE && status <= BT_XFER_DISCONNECTED;
+                finish(xfer, valid ? status : BT_XFER_ABORTED);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Drive timeouts and refill the window when the link had no room earlier.
+// Call every few tens of milliseconds while a transfer is active.
+void bt_xfer_tick(bt_xfer_t *xfer, uint32_t now_ms) {
+    switch (xfer->state) {
+        case BT_XFER_RECEIVING:
+            if (due(now_ms, xfer->deadline_ms)) {
+                bt_xfer_abort(xfer, BT_XFER_TIMEOUT);
+            }
+            break;
+        case BT_XFER_CLOSING:
+            retry_final_ack(xfer, now_ms);
+            break;
+        case BT_XFER_OPENING:
+            if (due(now_ms, xfer->deadline_ms)) {
+                if (xfer->retries++ > BT_XFER_MAX_RETRIES) {
+                    bt_xfer_abort(xfer, BT_XFER_TIMEOUT);
+                    break;
+                }
+                send_open(xfer);
+                xfer->deadline_ms = now_ms + BT_XFER_RETRY_MS;
+            }
+            break;
+        case BT_XFER_SENDING:
+            if (xfer->base < xfer->next && due(now_ms, xfer->deadline_ms)) {
+                if (++xfer->retries > BT_XFER_MAX_RETRIES) {
+                    bt_xfer_abort(xfer, BT_XFER_TIMEOUT);
+                    break;
+                }
+                // Start over from the oldest chunk; its ACK reveals the other gaps
+                xfer->resent = 0;
+                if (send_chunk(xfer, xfer->base)) {
+                    xfer->resent = 1;
+                    xfer->stats.retransmits++;
+                }
+                xfer->deadline_ms = now_ms + BT_XFER_RETRY_MS;
+            }
+            pump(xfer, now_ms);
+            break;
+        default:
+            break;
+    }
+}
+
+// End the transfer locally, telling the peer unless the link is gone. A
+// receiver still retrying its final ACK keeps its completed status.
+void bt_xfer_abort(bt_xfer_t *xfer, bt_xfer_status_t status) {
+    if (xfer->state == BT_XFER_IDLE) {
+        return;
+    }
+    if (xfer->state == BT_XFER_CLOSING) {
+        xfer->state = BT_XFER_IDLE;
+        return;
+    }
+    if (xfer->state != BT_XFER_LISTENING && status != BT_XFER_DISCONNECTED) {
+        send_abort(xfer, status);
+    }
+    finish(xfer, status);
+}
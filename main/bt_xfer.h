@@ -0,0 +1,107 @@
+#ifndef BT_XFER_H
+#define BT_XFER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bt_config.h"
+
+// Configuration
+#define BT_XFER_WINDOW 16            // Chunks a sender keeps in flight (at most 32, the SACK width)
+#define BT_XFER_CHUNK_MAX 480        // Largest chunk payload
+#define BT_XFER_ACK_EVERY 4          // Receiver acknowledges after this many in-order chunks
+#define BT_XFER_RETRY_MS 500         // Sender retransmits when no progress is acknowledged for this long
+#define BT_XFER_MAX_RETRIES 8        // ...and gives up after this many retransmits in a row
+#define BT_XFER_IDLE_TIMEOUT_MS 10000 // Receiver gives up on a sender silent this long
+
+// Packet types. Every packet is carried in one frame of the connection's
+// framing; multi-byte fields are big-endian.
+#define BT_XFER_OPEN  0xB0 // id(4) size(4) chunk_size(2): sender announces a transfer
+#define BT_XFER_DATA  0xB1 // seq(4) payload crc(2): CRC-16 of everything before it
+#define BT_XFER_ACK   0xB2 // status(1) base(4) sack(4): chunks below base held; sack bit n = chunk base+n held
+#define BT_XFER_ABORT 0xB3 // status(1)
+
+#define BT_XFER_DATA_OVERHEAD 7 // Type, sequence number and CRC around a chunk
+
+// Outcome of a transfer
+typedef enum {
+    BT_XFER_OK = 0,       // Still in progress
+    BT_XFER_COMPLETE,
+    BT_XFER_REJECTED,     // The sink refused the transfer, or it was malformed
+    BT_XFER_IO_ERROR,     // Sink write or source read failed
+    BT_XFER_TIMEOUT,
+    BT_XFER_ABORTED,      // Cancelled by the peer or the application
+    BT_XFER_DISCONNECTED
+} bt_xfer_status_t;
+
+typedef enum {
+    BT_XFER_IDLE = 0,
+    BT_XFER_LISTENING, // Receiver waiting for OPEN
+    BT_XFER_RECEIVING,
+    BT_XFER_OPENING,   // Sender waiting for the first ACK
+    BT_XFER_SENDING,
+    BT_XFER_CLOSING    // Receiver done; its final ACK waits for room on the link
+} bt_xfer_state_t;
+
+// Where received chunks go. Chunks arrive at their final offsets, possibly out
+// of order within the window, so a sink can place them without staging.
+typedef struct {
+    // Accept a transfer; *resume_offset is preset to 0 and may be raised to the
+    // number of leading bytes the sink already holds from an earlier attempt
+    bool (*begin)(void *context, uint32_t id, uint32_t size, uint32_t *resume_offset);
+    bool (*write)(void *context, uint32_t offset, const uint8_t *data, uint16_t length);
+    // End of the transfer; received counts the leading bytes held without gaps.
+    // Returning false turns BT_XFER_COMPLETE into BT_XFER_IO_ERROR.
+    bool (*finish)(void *context, bt_xfer_status_t status, uint32_t received);
+    void *context;
+} bt_xfer_sink_t;
+
+// Where sent chunks come from; chunks may be read more than once
+typedef struct {
+    bool (*read)(void *context, uint32_t offset, uint8_t *data, uint16_t length);
+    void *context;
+} bt_xfer_source_t;
+
+// Hands one packet to the link; control packets (OPEN, ACK, ABORT) should
+// overtake queued data. Returns false if the link cannot take it now.
+typedef bool (*bt_xfer_send_t)(void *context, const uint8_t *packet, uint16_t length, bool control);
+
+typedef struct {
+    uint32_t chunks;      // Accepted (receiver) or sent (sender), retransmits excluded
+    uint32_t retransmits; // Sender: chunks sent again
+    uint32_t crc_errors;  // Receiver: chunks dropped for a bad CRC or length
+    uint32_t duplicates;  // Receiver: chunks it already held
+    uint32_t resumed_at;  // Byte offset the transfer started from
+} bt_xfer_stats_t;
+
+// One end of a transfer. Owned by a single task.
+typedef struct {
+    bt_xfer_state_t state;
+    bt_xfer_status_t status;   // Outcome once back to BT_XFER_IDLE
+    uint32_t id;
+    uint32_t size;
+    uint16_t chunk_size;
+    uint32_t chunk_count;
+    uint32_t base;             // First chunk not yet held by the receiver
+    uint32_t held;             // Receiver: bit n = chunk base+n held. Sender: last SACK seen.
+    uint32_t resent;           // Sender: bit n = chunk base+n fast-retransmitted since the last timeout
+    uint32_t next;             // Sender: first chunk never sent
+    uint8_t unacked;           // Receiver: chunks accepted since the last ACK
+    uint8_t retries;
+    uint32_t deadline_ms;
+    const bt_xfer_sink_t *sink;
+    const bt_xfer_source_t *source;
+    bt_xfer_send_t send;
+    void *send_context;
+    bt_xfer_stats_t stats;
+} bt_xfer_t;
+
+// Function declarations
+void bt_xfer_init(bt_xfer_t *xfer, bt_xfer_send_t send, void *context);
+void bt_xfer_listen(bt_xfer_t *xfer, const bt_xfer_sink_t *sink);
+bool bt_xfer_start(bt_xfer_t *xfer, uint32_t id, uint32_t size, uint16_t chunk_size,
+                   const bt_xfer_source_t *source, uint32_t now_ms);
+void bt_xfer_input(bt_xfer_t *xfer, const uint8_t *packet, uint16_t length, uint32_t now_ms);
+void bt_xfer_tick(bt_xfer_t *xfer, uint32_t now_ms);
+void bt_xfer_abort(bt_xfer_t *xfer, bt_xfer_status_t status);
+
+#endif // BT_XFER_H
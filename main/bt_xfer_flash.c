@@ -0,0 +1,85 @@
+/*
+ * Flash Partition Transfer Sink
+ *
+ * Chunks are written at their final offsets as they arrive, so nothing is
+ * staged in RAM. Sectors are erased lazily, only ever moving forward, which
+ * keeps out-of-order chunks within the transfer window safe: the sector they
+ * land in is erased before the first write to it and never again.
+ *
+ * On resume the sender repeats any chunks past the last contiguous byte,
+ * including some that may already be on flash. NOR flash writes can only clear
+ * bits, so writing identical data a second time leaves it unchanged.
+ */
+
+#include "esp_log.h"
+#include "bt_xfer_flash.h"
+
+static const char *TAG = "BT_XFER";
+
+static bool flash_begin(void *context, uint32_t id, uint32_t size, uint32_t *resume_offset) {
+    bt_xfer_flash_t *flash = context;
+
+    if (size > flash->partition->size) {
+        ESP_LOGW(TAG, "Transfer of %lu bytes does not fit partition %s", size, flash->partition->label);
+        return false;
+    }
+    if (id == flash->id && size == flash->size) {
+        *resume_offset = flash->received;
+        ESP_LOGI(TAG, "Resuming transfer %08lx at %lu/%lu", id, flash->received, size);
+        return true;
+    }
+    flash->id = id;
+    flash->size = size;
+    flash->received = 0;
+    flash->erased_end = 0;
+    ESP_LOGI(TAG, "Receiving transfer %08lx (%lu bytes) into %s", id, size, flash->partition->label);
+    return true;
+}
+
+static bool flash_write(void *context, uint32_t offset, const uint8_t *data, uint16_t length) {
+    bt_xfer_flash_t *flash = context;
+    uint32_t end = offset + length;
+
+    if (end > flash->erased_end) {
+        uint32_t sector = flash->partition->erase_size;
+        uint32_t erase_end = (end + sector - 1) / sector * sector;
+        esp_err_t ret = esp_partition_erase_range(flash->partition, flash->erased_end, erase_end - flash->erased_end);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Erase at %lu failed: %s", flash->erased_end, esp_err_to_name(ret));
+            return false;
+        }
+        flash->erased_end = erase_end;
+    }
+
+    esp_err_t ret = esp_partition_write(flash->partition, offset, data, length);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Write at %lu failed: %s", offset, esp_err_to_name(ret));
+        return false;
+    }
+    return true;
+}
+
+static bool flash_finish(void *context, bt_xfer_status_t status, uint32_t received) {
+    bt_xfer_flash_t *flash = context;
+    flash->received = received;
+    if (status != BT_XFER_COMPLETE) {
+        ESP_LOGW(TAG, "Transfer %08lx stopped at %lu/%lu (status %d)", flash->id, received, flash->size, status);
+    }
+    return true;
+}
+
+esp_err_t bt_xfer_flash_init(bt_xfer_flash_t *flash, const esp_partition_t *partition) {
+    if (!flash || !partition) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    flash->partition = partition;
+    flash->erased_end = 0;
+    flash->id = 0;
+    flash->size = 0;
+    flash->received = 0;
+    flash->sink.begin = flash_begin;
+    flash->sink.write = flash_write;
+    flash->sink.finish = flash_finish;
+    flash->sink.context = flash;
+    return ESP_OK;
+}
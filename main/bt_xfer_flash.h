@@ -0,0 +1,24 @@
+#ifndef BT_XFER_FLASH_H
+#define BT_XFER_FLASH_H
+
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "bt_xfer.h"
+
+// Bulk transfer sink that writes chunks straight into a flash partition,
+// erasing sectors just ahead of the data. It remembers how far the last
+// transfer got, so the same transfer (same id and size) resumes from there
+// after a disconnect.
+typedef struct {
+    const esp_partition_t *partition;
+    uint32_t erased_end; // Bytes from the start of the partition erased for this transfer
+    uint32_t id;         // Last transfer begun
+    uint32_t size;
+    uint32_t received;   // Leading bytes of it known to be written
+    bt_xfer_sink_t sink; // Pass &sink to bluetooth_spp_xfer_receive()
+} bt_xfer_flash_t;
+
+// Function declarations
+esp_err_t bt_xfer_flash_init(bt_xfer_flash_t *flash, const esp_partition_t *partition);
+
+#endif // BT_XFER_FLASH_H
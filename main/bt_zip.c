@@ -0,0 +1,284 @@
+/*
+ * Streaming LZ Compression
+ *
+ * A small-window LZSS in the style of heatshrink: the output is a bit stream
+ * of literals (1, then 8 bits) and back-references (0, then a
+ * BT_ZIP_WINDOW_BITS distance and a BT_ZIP_LENGTH_BITS length). The window
+ * carries over from one block to the next, so a stream of short, repetitive
+ * writes such as text telemetry compresses against everything sent recently,
+ * not just against itself.
+ *
+ * Each block records its sequence number, and the encoder clears its history
+ * every BT_ZIP_RESET_INTERVAL blocks. A decoder that sees a gap (a block
+ * dropped before it) discards blocks until the next reset instead of
+ * producing garbage. A block that would not shrink is stored as-is.
+ *
+ * The encoder matches through hash chains in a static scratch area, so only
+ * one task may encode at a time; decoding needs no scratch.
+ */
+
+#include <string.h>
+#include "bt_zip.h"
+
+#define HASH_BITS 9
+#define NO_POSITION 0xFFFF
+#define SPAN (BT_ZIP_WINDOW + BT_ZIP_BLOCK_MAX)
+#define HELLO_MAGIC0 0xFA
+#define HELLO_MAGIC1 'Z'
+#define HELLO_PARAMS ((BT_ZIP_WINDOW_BITS << 4) | BT_ZIP_LENGTH_BITS)
+
+_Static_assert(SPAN < NO_POSITION, "Positions must fit the hash chains");
+
+// History followed by the block being encoded, with its match index
+static struct {
+    uint8_t data[SPAN];
+    uint16_t head[1 << HASH_BITS];
+    uint16_t prev[SPAN];
+} scratch;
+
+typedef struct {
+    uint8_t *out;
+    uint16_t size;
+    uint16_t pos;
+    uint32_t acc;
+    uint8_t count;
+    bool overflow;
+} bit_writer_t;
+
+typedef struct {
+    const uint8_t *in;
+    uint32_t bits; // Total
+    uint32_t pos;
+} bit_reader_t;
+
+static void put_bits(bit_writer_t *writer, uint32_t value, uint8_t count) {
+    writer->acc = (writer->acc << count) | value;
+    writer->count += count;
+    while (writer->count >= 8) {
+        writer->count -= 8;
+        if (writer->pos >= writer->size) {
+            writer->overflow = true;
+            return;
+        }
+        writer->out[writer->pos++] = writer->acc >> writer->count;
+    }
+}
+
+static void flush_bits(bit_writer_t *writer) {
+    if (writer->count > 0) {
+        put_bits(writer, 0, 8 - writer->count);
+    }
+}
+
+static uint32_t get_bits(bit_reader_t *reader, uint8_t count) {
+    uint32_t value = 0;
+    while (count--) {
+        value = (value << 1) | ((reader->in[reader->pos >> 3] >> (7 - (reader->pos & 7))) & 1);
+        reader->pos++;
+    }
+    return value;
+}
+
+static uint32_t hash(const uint8_t *p) {
+    return (((uint32_t)p[0] << 8 | p[1]) * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static void insert(uint16_t pos, uint16_t end) {
+    if (pos + 1 < end) {
+        uint32_t h = hash(&scratch.data[pos]);
+        scratch.prev[pos] = scratch.head[h];
+        scratch.head[h] = pos;
+    }
+}
+
+// Keep the last BT_ZIP_WINDOW bytes of history followed by data
+static void append_history(uint8_t *history, uint16_t *fill, const uint8_t *data, uint16_t length) {
+    if (length >= BT_ZIP_WINDOW) {
+        memcpy(history, data + length - BT_ZIP_WINDOW, BT_ZIP_WINDOW);
+        *fill = BT_ZIP_WINDOW;
+        return;
+    }
+    uint16_t keep = *fill < BT_ZIP_WINDOW - length ? *fill : BT_ZIP_WINDOW - length;
+    memmove(history, history + *fill - keep, keep);
+    memcpy(history + keep, data, length);
+    *fill = keep + length;
+}
+
+void bt_zip_encoder_init(bt_zip_encoder_t *encoder) {
+    memset(encoder, 0, sizeof(*encoder));
+}
+
+// Encode length bytes as one block. out may be the same buffer as in and must
+// hold length + BT_ZIP_HEADER bytes, the size of a stored block. Returns the
+// block size, or 0 if the arguments do not allow a block.
+uint16_t bt_zip_encode(bt_zip_encoder_t *encoder, const uint8_t *in, uint16_t length, uint8_t *out, uint16_t out_size) {
+    if (length == 0 || length > BT_ZIP_BLOCK_MAX || out_size < length + BT_ZIP_HEADER) {
+        return 0;
+    }
+
+    uint8_t flags = encoder->seq << BT_ZIP_SEQ_SHIFT;
+    if (encoder->since_reset == 0 || encoder->since_reset >= BT_ZIP_RESET_INTERVAL) {
+        encoder->fill = 0;
+        encoder->since_reset = 0;
+        flags |= BT_ZIP_BLOCK_RESET;
+    }
+    encoder->since_reset++;
+
+    // Input is copied before any output is written, which makes in-place use safe
+    uint16_t fill = encoder->fill;
+    uint16_t end = fill + length;
+    memcpy(scratch.data, encoder->history, fill);
+    memcpy(scratch.data + fill, in, length);
+    memset(scratch.head, 0xFF, sizeof(scratch.head));
+    for (uint16_t pos = 0; pos < fill; pos++) {
+        insert(pos, end);
+    }
+
+    // Only worth sending if it comes out smaller than the stored form
+    bit_writer_t writer = { .out = out + BT_ZIP_HEADER, .size = length - 1 };
+    uint16_t pos = fill;
+    while (pos < end && !writer.overflow) {
+        uint16_t best_length = 0;
+        uint16_t best_distance = 0;
+
+        if (pos + BT_ZIP_MIN_MATCH <= end) {
+            uint16_t limit = end - pos < BT_ZIP_MAX_MATCH ? end - pos : BT_ZIP_MAX_MATCH;
+            uint16_t candidate = scratch.head[hash(&scratch.data[pos])];
+            for (int chain = 0; chain < BT_ZIP_CHAIN_MAX && candidate != NO_POSITION; chain++) {
+                uint16_t distance = pos - candidate;
+                if (distance > BT_ZIP_WINDOW) {
+                    break;
+                }
+                if (scratch.data[candidate + best_length] == scratch.data[pos + best_length]) {
+                    uint16_t match = 0;
+                    while (match < limit && scratch.data[candidate + match] == scratch.data[pos + match]) {
+                        match++;
+                    }
+                    if (match > best_length) {
+                        best_length = match;
+                        best_distance = distance;
+                        if (match == limit) {
+                            break;
+                        }
+                    }
+                }
+                candidate = scratch.prev[candidate];
+            }
+        }
+
+        if (best_length >= BT_ZIP_MIN_MATCH) {
+            put_bits(&writer, 0, 1);
+            put_bits(&writer, best_distance - 1, BT_ZIP_WINDOW_BITS);
+            put_bits(&writer, best_length - BT_ZIP_MIN_MATCH, BT_ZIP_LENGTH_BITS);
+            for (uint16_t i = 0; i < best_length; i++) {
+                insert(pos++, end);
+            }
+        } else {
+            put_bits(&writer, 0x100 | scratch.data[pos], 9);
+            insert(pos++, end);
+        }
+    }
+    flush_bits(&writer);
+
+    uint16_t coded;
+    if (writer.overflow) {
+        coded = length;
+        memcpy(out + BT_ZIP_HEADER, scratch.data + fill, length);
+    } else {
+        coded = writer.pos;
+        flags |= BT_ZIP_BLOCK_LZ;
+    }
+    out[0] = (coded + 1) >> 8;
+    out[1] = coded + 1;
+    out[2] = flags;
+
+    append_history(encoder->history, &encoder->fill, scratch.data + fill, length);
+    encoder->seq = (encoder->seq + 1) & 0x0F;
+    encoder->raw_bytes += length;
+    encoder->coded_bytes += coded + BT_ZIP_HEADER;
+    return coded + BT_ZIP_HEADER;
+}
+
+void bt_zip_decoder_init(bt_zip_decoder_t *decoder) {
+    memset(decoder, 0, sizeof(*decoder));
+}
+
+// Decode one block (flags byte onward, length prefix already removed) into
+// out. Returns the number of bytes produced, or -1 if the block was dropped.
+int bt_zip_decode(bt_zip_decoder_t *decoder, const uint8_t *block, uint16_t length, uint8_t *out, uint16_t out_size) {
+    if (length < 1) {
+        goto fail;
+    }
+
+    uint8_t flags = block[0];
+    uint8_t seq = flags >> BT_ZIP_SEQ_SHIFT;
+    if (flags & BT_ZIP_BLOCK_RESET) {
+        decoder->fill = 0;
+        decoder->synced = true;
+    } else if (!decoder->synced || seq != decoder->seq) {
+        goto fail;
+    }
+    decoder->seq = (seq + 1) & 0x0F;
+
+    const uint8_t *payload = block + 1;
+    uint16_t payload_length = length - 1;
+    uint16_t produced = 0;
+
+    if (!(flags & BT_ZIP_BLOCK_LZ)) {
+        if (payload_length > out_size) {
+            goto fail;
+        }
+        memcpy(out, payload, payload_length);
+        produced = payload_length;
+    } else {
+        // Fewer than 9 bits left can only be padding
+        bit_reader_t reader = { .in = payload, .bits = (uint32_t)payload_length * 8 };
+        while (reader.bits - reader.pos >= 9) {
+            if (get_bits(&reader, 1)) {
+                if (produced >= out_size) {
+                    goto fail;
+                }
+                out[produced++] = get_bits(&reader, 8);
+                continue;
+            }
+            if (reader.bits - reader.pos < BT_ZIP_WINDOW_BITS + BT_ZIP_LENGTH_BITS) {
+                goto fail;
+            }
+            uint16_t distance = get_bits(&reader, BT_ZIP_WINDOW_BITS) + 1;
+            uint16_t match = get_bits(&reader, BT_ZIP_LENGTH_BITS) + BT_ZIP_MIN_MATCH;
+            if (distance > decoder->fill + produced || produced + match > out_size) {
+                goto fail;
+            }
+            // Byte by byte, since a match may overlap its own output
+            for (uint16_t i = 0; i < match; i++, produced++) {
+                uint32_t from = decoder->fill + produced - distance;
+                out[produced] = from < decoder->fill ? decoder->history[from] : out[from - decoder->fill];
+            }
+        }
+    }
+
+    append_history(decoder->history, &decoder->fill, out, produced);
+    return produced;
+
+fail:
+    decoder->synced = false;
+    decoder->errors++;
+    return -1;
+}
+
+// Hello offering (or, in a reply, accepting) this codec's parameters
+void bt_zip_hello(uint8_t *out, bool accept) {
+    out[0] = HELLO_MAGIC0;
+    out[1] = HELLO_MAGIC1;
+    out[2] = BT_ZIP_VERSION;
+    out[3] = accept ? HELLO_PARAMS : 0;
+}
+
+// -1 if the data does not start with a hello, 1 if it is a compatible offer
+// or acceptance, 0 if it declines or asks for other parameters
+int bt_zip_hello_parse(const uint8_t *data, uint16_t length) {
+    if (length < BT_ZIP_HELLO_SIZE || data[0] != HELLO_MAGIC0 || data[1] != HELLO_MAGIC1) {
+        return -1;
+    }
+    return data[2] == BT_ZIP_VERSION && data[3] == HELLO_PARAMS;
+}
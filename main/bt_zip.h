@@ -0,0 +1,56 @@
+#ifndef BT_ZIP_H
+#define BT_ZIP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "bt_config.h"
+
+// Configuration. Both ends must agree on the window and length widths; they
+// are exchanged in the hello.
+#define BT_ZIP_WINDOW_BITS 9  // 512-byte history shared across blocks
+#define BT_ZIP_LENGTH_BITS 4  // Matches of BT_ZIP_MIN_MATCH..BT_ZIP_MIN_MATCH+15 bytes
+#define BT_ZIP_WINDOW (1 << BT_ZIP_WINDOW_BITS)
+#define BT_ZIP_MIN_MATCH 2
+#define BT_ZIP_MAX_MATCH (BT_ZIP_MIN_MATCH + (1 << BT_ZIP_LENGTH_BITS) - 1)
+#define BT_ZIP_BLOCK_MAX MAX_PACKET_SIZE // Largest uncompressed block
+#define BT_ZIP_RESET_INTERVAL 32         // Blocks between history resets, the resync points after a loss
+#define BT_ZIP_CHAIN_MAX 16              // Match candidates examined per position
+
+// Block layout: 16-bit big-endian length of the rest (BT_FRAME_LENGTH_PREFIXED
+// framing), one flags byte, then the LZ bit stream or the stored bytes
+#define BT_ZIP_HEADER 3
+#define BT_ZIP_BLOCK_LZ    0x01 // Else stored uncompressed
+#define BT_ZIP_BLOCK_RESET 0x02 // History cleared before this block
+#define BT_ZIP_SEQ_SHIFT 4      // Block sequence number, modulo 16, in the high nibble
+
+// Hello exchanged at the start of a connection: magic, version and the
+// window/length widths, or 0 there to decline
+#define BT_ZIP_HELLO_SIZE 4
+#define BT_ZIP_VERSION 1
+
+typedef struct {
+    uint8_t history[BT_ZIP_WINDOW]; // Most recent input, oldest first
+    uint16_t fill;
+    uint8_t seq;
+    uint8_t since_reset;
+    uint32_t raw_bytes;   // Input consumed
+    uint32_t coded_bytes; // Blocks produced, headers included
+} bt_zip_encoder_t;
+
+typedef struct {
+    uint8_t history[BT_ZIP_WINDOW];
+    uint16_t fill;
+    uint8_t seq;     // Expected next
+    bool synced;     // False after a gap until the next reset block
+    uint32_t errors; // Blocks dropped as corrupt or out of sequence
+} bt_zip_decoder_t;
+
+// Function declarations
+void bt_zip_encoder_init(bt_zip_encoder_t *encoder);
+uint16_t bt_zip_encode(bt_zip_encoder_t *encoder, const uint8_t *in, uint16_t length, uint8_t *out, uint16_t out_size);
+void bt_zip_decoder_init(bt_zip_decoder_t *decoder);
+int bt_zip_decode(bt_zip_decoder_t *decoder, const uint8_t *block, uint16_t length, uint8_t *out, uint16_t out_size);
+void bt_zip_hello(uint8_t *out, bool accept);
+int bt_zip_hello_parse(const uint8_t *data, uint16_t length);
+
+#endif // BT_ZIP_H